@@ -22,12 +22,15 @@
 #import <ExternalAccessory/ExternalAccessory.h>
 #import "FLScanTool.h"
 
-@interface FLEAScanTool : FLScanTool <EAAccessoryDelegate, NSStreamDelegate> {
+@class FLEASessionTransport;
+
+@interface FLEAScanTool : FLScanTool <NSStreamDelegate> {
 	EAAccessory*		_accessory;
-    EASession*			_session;
+	FLEASessionTransport*	_sessionTransport;
     NSString*			_protocolString;
 	
 	NSMutableData*		_cachedWriteData;
+	NSUInteger			_cachedWriteOffset;
 	BOOL				_spaceAvailable;
 }
 
@@ -36,6 +39,13 @@
 
 - (void) configureScanToolAccessory:(EAAccessory*)accessory 
 						forProtocol:(NSString*)protocol;
+// The streams of the replay or transport, if either is set, or else of
+// the EA session
+- (NSInputStream*) inputStream;
+- (NSOutputStream*) outputStream;
+
+// Open and close the replay or transport, if either is set, or else an EA
+// session with the accessory
 - (BOOL)openSession;
 - (void)closeSession;
 - (void)accessoryDidDisconnect:(EAAccessory *)accessory;
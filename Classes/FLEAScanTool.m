@@ -19,7 +19,9 @@
  */
 
 #import "FLEAScanTool.h"
-#import "FLEAController.h"
+#import "FLEASessionTransport.h"
+#import "FLScanToolCapture.h"
+#import "FLScanToolReplay.h"
 #import "FLLogging.h"
 
 #pragma mark -
@@ -30,9 +32,12 @@
 
 
 - (void) dealloc {
-	[_accessory release];
+	// The session and accessory are released by close, which FLScanTool's
+	// dealloc calls.  That runs after this, so the write cache must not be
+	// left dangling.
 	[_protocolString release];
-	[_cachedWriteData release];	
+	[_cachedWriteData release];
+	_cachedWriteData	= nil;
 	[super dealloc];
 }
 
@@ -49,8 +54,6 @@
 - (void) open {
 	
 	@try {		
-		_accessory	= [[[FLEAController sharedController] accessoryForProtocol:_protocolString] retain];
-		FLDEBUG(@"_protocolString = %@  **_accessory.name = %@", _protocolString, _accessory.name);
 		[self openSession];
 	}
 	@catch (NSException * e) {
@@ -68,74 +71,108 @@
 		FLEXCEPTION(e);
 	}	
 	@finally {
-		_state = STATE_INIT;
+		[_cachedWriteData setLength:0];
+		_cachedWriteOffset	= 0;
+		_state				= STATE_INIT;
 	}
 }
 
+- (FLScanToolTransport*) sessionTransport {
+	FLScanToolTransport* transport	= [self activeTransport];
+	return (transport) ? transport : _sessionTransport;
+}
+
+- (NSInputStream*) inputStream {
+	return [[self sessionTransport] inputStream];
+}
+
+- (NSOutputStream*) outputStream {
+	return [[self sessionTransport] outputStream];
+}
+
 - (BOOL) openSession {
 	
-    [_accessory setDelegate:self];
-    
+	if (![self activeTransport] && !_sessionTransport) {
+		_sessionTransport	= [[FLEASessionTransport alloc] initWithAccessory:_accessory 
+														   protocolString:_protocolString];
+	}
 	
-	if (!_session) {
-		_session		= [[EASession alloc] initWithAccessory:_accessory 
-												   forProtocol:_protocolString];
-	}	
+	FLScanToolTransport* transport	= [self sessionTransport];
+	transport.delegate				= self;
 	
-    if (_session) {
+    if ([transport open]) {
+		
+		if (transport == _sessionTransport) {
+			[_accessory release];
+			_accessory		= [_sessionTransport.accessory retain];
+		}
 		
-        [[_session inputStream] setDelegate:self];
-        [[_session inputStream] scheduleInRunLoop:[NSRunLoop currentRunLoop] 
-										  forMode:NSDefaultRunLoopMode];
+        [[self inputStream] setDelegate:self];
+        [[self inputStream] scheduleInRunLoop:[NSRunLoop currentRunLoop] 
+									  forMode:NSDefaultRunLoopMode];
         
-		[[_session inputStream] open];
+		[[self inputStream] open];
 		
 		
-        [[_session outputStream] setDelegate:self];
-        [[_session outputStream] scheduleInRunLoop:[NSRunLoop currentRunLoop] 
-										   forMode:NSDefaultRunLoopMode];
+        [[self outputStream] setDelegate:self];
+        [[self outputStream] scheduleInRunLoop:[NSRunLoop currentRunLoop] 
+									   forMode:NSDefaultRunLoopMode];
         		
-		[[_session outputStream] open];
+		[[self outputStream] open];
     }
     else     {
-        FLERROR(@"creating session failed", nil)
+        FLERROR(@"Unable to open transport %@", transport)
+		return NO;
     }
 	
-    return (_session != nil);
+    return YES;
 }
 
 - (void) closeSession {
     
-	FLINFO(@"-------------------------------------------->>>> CLOSING EASESSION")
-	
-	
-    [[_session inputStream] removeFromRunLoop:[NSRunLoop currentRunLoop] 
-									  forMode:NSDefaultRunLoopMode];
-    [[_session inputStream] setDelegate:nil];	
-	[[_session inputStream] close];
+    [[self inputStream] removeFromRunLoop:[NSRunLoop currentRunLoop] 
+								  forMode:NSDefaultRunLoopMode];
+    [[self inputStream] setDelegate:nil];	
+	[[self inputStream] close];
     
 	
-    [[_session outputStream] removeFromRunLoop:[NSRunLoop currentRunLoop] 
-									   forMode:NSDefaultRunLoopMode];
-    [[_session outputStream] setDelegate:nil];	 
-	[[_session outputStream] close];
+    [[self outputStream] removeFromRunLoop:[NSRunLoop currentRunLoop] 
+								   forMode:NSDefaultRunLoopMode];
+    [[self outputStream] setDelegate:nil];	 
+	[[self outputStream] close];
+	
+	[[self sessionTransport] close];
+	[self sessionTransport].delegate	= nil;
 	
-    [_session release];
-    _session	= nil;
+    [_sessionTransport release];
+    _sessionTransport	= nil;
 	
-	[_accessory setDelegate:nil];
 	[_accessory release];
 	_accessory	= nil;
 }
 
 - (void) sendCommand:(FLScanToolCommand*)command initCommand:(BOOL)initCommand {
 	FLTRACE_ENTRY
+	if (!command) {
+		// Nothing to send, e.g. no poll is due yet
+		return;
+	}
+	
 	if (!_cachedWriteData) {
         _cachedWriteData = [[NSMutableData alloc] init];
     }
 	
+	if (_cachedWriteOffset > 0 && _cachedWriteOffset >= ([_cachedWriteData length] / 2)) {
+		// Drop the already-written bytes once they make up most of the buffer
+		[_cachedWriteData replaceBytesInRange:NSMakeRange(0, _cachedWriteOffset) 
+									withBytes:NULL 
+									   length:0];
+		_cachedWriteOffset = 0;
+	}
+	
 	FLDEBUG(@"Writing command to cached data", nil)
     [_cachedWriteData appendData:[command data]];
+	[self startDeadlineForCommand:command];
 	[self writeCachedData];
 }
 
@@ -150,7 +187,7 @@
 }
 
 #pragma mark -
-#pragma mark EAAccessoryDelegate Methods
+#pragma mark Disconnection
 
 - (void) accessoryDidDisconnect:(EAAccessory *)accessory {
     FLDEBUG(@"the accessory was disconnected", nil)
@@ -175,7 +212,7 @@
 			break;
 		case NSStreamEventHasSpaceAvailable:
 			FLDEBUG(@"stream %@ event space available", theStream);
-			//[self writeCachedData];
+			[self writeCachedData];
 			break;
 		case NSStreamEventErrorOccurred:
 			FLDEBUG(@"stream %@ event error", theStream);
@@ -196,46 +233,48 @@
     
 	FLTRACE_ENTRY
 	
-	if (_streamOperation.isCancelled) {
+	if (_scanCancelled) {
 		return;
 	}
-
+	
 	if (!_cachedWriteData) {
 		FLERROR(@"No cached data to write (_cachedWriteData == nil)", nil)
 		return;
 	}
 	
-	NSOutputStream* oStream			= [_session outputStream];
-	NSStreamStatus oStreamStatus	= NSStreamStatusError;
+	NSOutputStream* oStream			= [self outputStream];
 	NSInteger bytesWritten			= 0;
 	
-	FLDEBUG(@"[_cachedWriteData length] = %d", [_cachedWriteData length])
+	FLDEBUG(@"Pending write bytes = %d", ([_cachedWriteData length] - _cachedWriteOffset))
 	
-    while ([oStream hasSpaceAvailable] && 
-		   [_cachedWriteData length] > 0) {
-		
-		FLDEBUG(@"_cachedWriteData = %@", [_cachedWriteData description])
+	// Write whatever the stream will take without blocking.  Anything left
+	// over goes out on the next NSStreamEventHasSpaceAvailable.
+    while (_cachedWriteOffset < [_cachedWriteData length] && 
+		   [oStream hasSpaceAvailable]) {
 		
-		bytesWritten = [oStream write:[_cachedWriteData bytes]
-							maxLength:[_cachedWriteData length]];
+		bytesWritten = [oStream write:((const uint8_t*)[_cachedWriteData bytes] + _cachedWriteOffset)
+							maxLength:([_cachedWriteData length] - _cachedWriteOffset)];
 		if (bytesWritten == -1) {
 			FLERROR(@"Write Error", nil)
 			break;
 		}
-		else if(bytesWritten > 0 && [_cachedWriteData length] > 0) {
-			FLDEBUG(@"Wrote %d bytes", bytesWritten)
-			[_cachedWriteData replaceBytesInRange:NSMakeRange(0, bytesWritten) 
-										withBytes:NULL 
-										   length:0];
+		else if (bytesWritten == 0) {
+			break;
 		}
+		
+		FLDEBUG(@"Wrote %d bytes", bytesWritten)
+		[_capture recordBytes:((const uint8_t*)[_cachedWriteData bytes] + _cachedWriteOffset) 
+					   length:bytesWritten 
+					direction:kScanToolCaptureWrite];
+		_cachedWriteOffset += bytesWritten;
 	}
 	
-	oStreamStatus = [oStream streamStatus];
-	FLDEBUG(@"OutputStream status = %X", oStreamStatus)
-	FLINFO(@"Starting write wait")
-	do {		
-		oStreamStatus = [oStream streamStatus];
-	} while (oStreamStatus == NSStreamStatusWriting);
+	if (_cachedWriteOffset == [_cachedWriteData length]) {
+		// Everything has been sent, so rewind the cursor rather than
+		// shifting the buffer contents down
+		[_cachedWriteData setLength:0];
+		_cachedWriteOffset = 0;
+	}
 	
 	FLTRACE_EXIT
 }
@@ -0,0 +1,46 @@
+/*
+ *  FLEASessionTransport.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <ExternalAccessory/ExternalAccessory.h>
+#import "FLScanToolTransport.h"
+
+
+/*
+ An External Accessory session, the transport the EA scan tools use when
+ none has been set.  The accessory speaking protocolString is looked up
+ through FLEAController as the transport is opened, so one that has been
+ reconnected since is picked up; the accessory given is used if there is
+ none.  The delegate is told when the accessory disconnects.
+ */
+@interface FLEASessionTransport : FLScanToolTransport <EAAccessoryDelegate> {
+	EAAccessory*			_accessory;
+	NSString*				_protocolString;
+	EASession*				_session;
+}
+
+@property (nonatomic, readonly) EAAccessory* accessory;
+@property (nonatomic, readonly) NSString* protocolString;
+
++ (FLEASessionTransport*) transportWithAccessory:(EAAccessory*)accessory protocolString:(NSString*)protocolString;
+
+- initWithAccessory:(EAAccessory*)accessory protocolString:(NSString*)protocolString;
+
+@end
@@ -0,0 +1,123 @@
+/*
+ *  FLEASessionTransport.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLEASessionTransport.h"
+#import "FLEAController.h"
+#import "FLLogging.h"
+
+
+#pragma mark -
+@implementation FLEASessionTransport
+
+@synthesize accessory		= _accessory,
+			protocolString	= _protocolString;
+
+
++ (FLEASessionTransport*) transportWithAccessory:(EAAccessory*)accessory protocolString:(NSString*)protocolString {
+	return [[[FLEASessionTransport alloc] initWithAccessory:accessory protocolString:protocolString] autorelease];
+}
+
+
+- initWithAccessory:(EAAccessory*)accessory protocolString:(NSString*)protocolString {
+	
+	if(self = [super init]) {
+		_accessory		= [accessory retain];
+		_protocolString	= [protocolString copy];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self close];
+	[_accessory release];
+	[_protocolString release];
+	[super dealloc];
+}
+
+
+- (NSString*) adapterIdentity {
+	
+	if(!_accessory || [_accessory.serialNumber length] == 0) {
+		return nil;
+	}
+	
+	return [NSString stringWithFormat:@"%@ %@ %@", _accessory.manufacturer, _accessory.modelNumber, _accessory.serialNumber];
+}
+
+
+- (BOOL) open {
+	
+	EAAccessory* accessory	= [[FLEAController sharedController] accessoryForProtocol:_protocolString];
+	
+	if(accessory) {
+		[_accessory release];
+		_accessory			= [accessory retain];
+	}
+	
+	FLDEBUG(@"_protocolString = %@  **_accessory.name = %@", _protocolString, _accessory.name)
+	
+	if(!_session) {
+		_session			= [[EASession alloc] initWithAccessory:_accessory
+												   forProtocol:_protocolString];
+	}
+	
+	if(!_session) {
+		FLERROR(@"creating session failed", nil)
+		return NO;
+	}
+	
+	[_accessory setDelegate:self];
+	
+	[self releaseStreams];
+	_inputStream			= [[_session inputStream] retain];
+	_outputStream			= [[_session outputStream] retain];
+	
+	return [super open];
+}
+
+
+- (void) close {
+	
+	if(!_session) {
+		return;
+	}
+	
+	FLINFO(@"-------------------------------------------->>>> CLOSING EASESSION")
+	
+	[self releaseStreams];
+	
+	[_session release];
+	_session				= nil;
+	
+	[_accessory setDelegate:nil];
+}
+
+
+#pragma mark -
+#pragma mark EAAccessoryDelegate Methods
+
+- (void) accessoryDidDisconnect:(EAAccessory*)accessory {
+	FLDEBUG(@"the accessory was disconnected", nil)
+	[self didDisconnect];
+}
+
+@end
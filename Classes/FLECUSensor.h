@@ -20,6 +20,8 @@
 
 #import <Foundation/Foundation.h>
 #import "FLScanToolResponse.h"
+#import "FLValueHistory.h"
+#import "FLPIDCatalog.h"
 
 
 
@@ -41,6 +43,7 @@
 										 (pid >= 0x2C && pid <= 0x33) || \
 										 (pid >= 0x3C && pid <= 0x3F) || \
 										 (pid >= 0x43 && pid <= 0x4E) || \
+										 (pid >= 0x4F && pid <= 0xFF) || \
 										 (pid >= 0x14 && pid <= 0x1B && sensor == 2) || \
 										 (pid >= 0x24 && pid <= 0x2B && sensor == 2) || \
 										 (pid >= 0x34 && pid <= 0x3B && sensor == 2))
@@ -48,6 +51,10 @@
 	
 
 
+// Default number of samples kept in a sensor's value history
+#define SENSOR_VALUE_HISTORY_DEPTH		32
+
+
 #define DTC_SYSTEM_MASK					0xC0
 #define DTC_DIGIT_0_1_MASK				0x3F
 #define DTC_DIGIT_2_3_MASK				0xFF
@@ -107,18 +114,34 @@ typedef struct trouble_code_t {
 	
 	NSUInteger				_pid;
 	MultiSensorDescriptor*	_sensorDescriptor;
+	MultiSensorDescriptor	_extendedSensorDescriptor;
+	FLPIDCatalog*			_catalog;
+	const FLPIDDefinition*	_definition;
 	FLScanToolResponse*		_currentResponse;
-	NSMutableArray*			_sensorValueHistory;
-	NSUInteger				_valueHistoryHead;
-	NSUInteger				_valueHistoryTail;
+	FLValueHistory*			_valueHistory;
+	NSUInteger				_valueHistoryDepth;
 }
 
 
 @property(nonatomic, retain) FLScanToolResponse* currentResponse;
+
+// Numeric samples of the sensor, read in place.  Alpha value sensors keep
+// no history.
+@property(nonatomic, readonly) FLValueHistory* history;
+
+// Number of samples kept in the history.  Changing it clears the history.
+// Defaults to SENSOR_VALUE_HISTORY_DEPTH.
+@property(nonatomic, assign) NSUInteger valueHistoryDepth;
+
+// The history as an array of dictionaries, one per sample, keyed by
+// measurement1Metric, measurement1Imperial and so on.  Built on each call.
 @property(nonatomic, readonly) NSArray* valueHistory;
 @property(nonatomic, readonly) BOOL isAlphaValue;
 @property(nonatomic, readonly) BOOL isMultiValue;
 @property(nonatomic, readonly) NSUInteger pid;
+
+// Request mode of the PID: $01, or the mode of the catalog definition
+@property(nonatomic, readonly) NSUInteger mode;
 @property(nonatomic, readonly) NSData* data;
 
 @property(nonatomic, readonly) NSString* descriptionStringForMeasurement1;
@@ -137,11 +160,19 @@ typedef struct trouble_code_t {
 @property(nonatomic, readonly) NSInteger minValueForImperialMeasurement2;
 
 
+// Mode $01 PIDs beyond the built in table are looked up in the shared PID
+// catalog, and otherwise report their raw value
 + (FLECUSensor*) sensorForPID:(NSUInteger)pid;
 
+// A sensor for any mode and PID in the shared PID catalog, such as a
+// manufacturer Mode $22 PID.  nil if the PID is neither built in nor in
+// the catalog.
++ (FLECUSensor*) sensorForMode:(NSUInteger)mode pid:(NSUInteger)pid;
+
 + (NSArray*) troubleCodesForResponse:(FLScanToolResponse*)response;
 
 - initWithDescriptor:(MultiSensorDescriptor*)descriptor;
+- initWithDefinition:(const FLPIDDefinition*)definition catalog:(FLPIDCatalog*)catalog;
 
 - (id) valueForMeasurement1:(BOOL)metric;
 - (id) valueForMeasurement2:(BOOL)metric;
@@ -161,6 +192,21 @@ typedef struct trouble_code_t {
 - (NSString*) maxValueStringForMeasurement1:(BOOL)metric;
 - (NSString*) maxValueStringForMeasurement2:(BOOL)metric;
 
+// Decodes measurement 1 or 2 of count payloads of this sensor's PID, such
+// as the data of recorded responses, into metric and (optionally) imperial
+// values.  Payload i starts at payloads + (i * stride) and holds length
+// data bytes.  The common linear formulas are decoded four payloads at a
+// time, as are catalog formulas; other sensors fall back to the
+// calculation function per payload.
+// Returns NO if the measurement has no numeric value.
+- (BOOL) decodeMeasurement:(NSUInteger)measurement 
+				  payloads:(const uint8_t*)payloads 
+					stride:(NSUInteger)stride 
+					length:(NSUInteger)length 
+					 count:(NSUInteger)count 
+			  metricValues:(float*)metricValues 
+			imperialValues:(float*)imperialValues;
+
 
 - (BOOL) isMILActive;
 - (NSInteger) troubleCodeCount;
@@ -187,6 +233,20 @@ static inline float calcTime(const void* data, int len) {
 	return(float)((int)(dataBytes[0] * 256) + dataBytes[1]);
 }
 
+/*!
+ @method calcRawValue
+ */
+static inline float calcRawValue(const void* data, int len) {
+	unsigned char* dataBytes = (unsigned char*)data;
+	unsigned int value = 0;
+	
+	for(int i = 0; i < len && i < 4; i++) {
+		value = (value << 8) | dataBytes[i];
+	}
+	
+	return (float)value;
+}
+
 /*!
  @method calcTimingAdvance
  */
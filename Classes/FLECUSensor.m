@@ -19,6 +19,7 @@
  */
 
 #import "FLECUSensor.h"
+#import "FLScanTool.h"
 #import "FLLogging.h"
 
 //------------------------------------------------------------------------------
@@ -436,6 +437,170 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 	}	
 };
 
+// Mode $01 PIDs beyond the table above have no known scaling, so they are
+// reported as the raw unsigned value of their data bytes
+static const MultiSensorDescriptor g_extendedSensorDescriptor = {
+	0x00,
+	{ "Extended PID", "Ext PID", NULL, 0, INT_MAX, NULL, INT_MAX, INT_MAX, &calcRawValue, NULL },
+	{ NULL, NULL, NULL, INT_MAX, INT_MAX, NULL, INT_MAX, INT_MAX, NULL, NULL }
+};
+
+#define SENSOR_TABLE_SIZE	(sizeof(g_sensorDescriptorTable) / sizeof(g_sensorDescriptorTable[0]))
+
+
+//------------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Batch Decoding Kernels
+
+// Four floats, mapped by the compiler onto NEON or SSE registers where the
+// target has them, and onto plain scalar code where it does not
+typedef float FLFloat4 __attribute__((vector_size(16)));
+
+/*
+ A calculation function which is a PID catalog formula, raw being data
+ byte A, or A * 256 + B.  truncate reproduces the integer division in the
+ scalar formula.
+ */
+typedef struct linear_kernel_t {
+	pfCalculateValueFunc	calcFunction;
+	FLPIDFormula			formula;
+} FLLinearKernel;
+
+static const FLLinearKernel g_linearKernels[] = {
+	/*Calc Function					Offset	Bytes	Signed	Trunc	Divisor		Scale				Offset */
+	{ &calcInt,						{ 0,		1,		NO,		NO,		1,			1,					0 } },
+	{ &calcTime,					{ 0,		2,		NO,		NO,		1,			1,					0 } },
+	{ &calcDistance,				{ 0,		2,		NO,		NO,		1,			1,					0 } },
+	{ &calcTimingAdvance,			{ 0,		1,		NO,		NO,		1,			0.5f,				-64 } },
+	{ &calcPercentage,				{ 0,		1,		NO,		NO,		255,		100,				0 } },
+	{ &calcAbsoluteLoadValue,		{ 0,		2,		NO,		NO,		255,		100,				0 } },
+	{ &calcTemp,					{ 0,		1,		NO,		NO,		1,			1,					-40 } },
+	{ &calcCatalystTemp,			{ 0,		2,		NO,		NO,		10,			1,					-40 } },
+	{ &calcFuelTrimPercentage,		{ 0,		1,		NO,		NO,		1,			0.7812f,			-99.9936f } },
+	{ &calcFuelTrimPercentage2,		{ 1,		1,		NO,		NO,		1,			0.7812f,			-99.9936f } },
+	{ &calcEngineRPM,				{ 0,		2,		NO,		YES,	4,			1,					0 } },
+	{ &calcOxygenSensorVoltage,		{ 0,		1,		NO,		NO,		1,			0.005f,				0 } },
+	{ &calcControlModuleVoltage,	{ 0,		2,		NO,		YES,	1000,		1,					0 } },
+	{ &calcMassAirFlow,				{ 0,		2,		NO,		NO,		100,		1,					0 } },
+	{ &calcPressure,				{ 0,		2,		NO,		NO,		1,			0.079f,				0 } },
+	{ &calcPressureDiesel,			{ 0,		2,		NO,		NO,		1,			10,					0 } },
+	{ &calcVaporPressure,			{ 0,		2,		NO,		NO,		1,			0.25f,				-8192 } },
+	{ &calcEquivalenceRatio,		{ 0,		2,		NO,		NO,		1,			0.0000305f,			0 } },
+	{ &calcEquivalenceVoltage,		{ 2,		2,		NO,		NO,		1,			0.000122f,			0 } },
+	{ &calcEquivalenceCurrent,		{ 2,		2,		NO,		NO,		1,			0.00390625f,		-128 } },
+	{ &calcEGRError,				{ 0,		1,		NO,		NO,		1,			0.78125f,			-100 } }
+};
+
+// A conversion function of the form value * scale + offset
+typedef struct linear_conversion_t {
+	pfConvertFunc			convertFunction;
+	float					scale;
+	float					offset;
+} FLLinearConversion;
+
+static const FLLinearConversion g_linearConversions[] = {
+	{ &convertTemp,			1.8f,				32 },
+	{ &convertPressure,		1.0f / 3.386f,		0 },
+	{ &convertPressure2,	1.0f / 3386.0f,		0 },
+	{ &convertSpeed,		0.62f,				0 },
+	{ &convertAir,			0.132f,				0 },
+	{ &convertDistance,		0.6213f,			0 }
+};
+
+#define NUM_LINEAR_KERNELS		(sizeof(g_linearKernels) / sizeof(g_linearKernels[0]))
+#define NUM_LINEAR_CONVERSIONS	(sizeof(g_linearConversions) / sizeof(g_linearConversions[0]))
+
+
+// Catalog values are shown as integers when the formula cannot produce a
+// fraction
+static inline BOOL isIntegralDefinition(const FLPIDDefinition* definition, BOOL metric) {
+	const FLPIDFormula* formula = &definition->formula;
+	
+	if((formula->divisor != 1 && !formula->truncate) || 
+	   formula->scale != truncf(formula->scale) || 
+	   formula->offset != truncf(formula->offset)) {
+		return NO;
+	}
+	
+	return metric || (definition->imperialScale == truncf(definition->imperialScale) && 
+					  definition->imperialOffset == truncf(definition->imperialOffset));
+}
+
+
+static inline FLFloat4 splatFloat4(float value) {
+	FLFloat4 v = { value, value, value, value };
+	return v;
+}
+
+
+/*
+ Runs a formula over count payloads, four at a time, and the linear
+ conversion to imperial units with it.  Payloads must hold the bytes the
+ formula reads.
+ */
+static void decodeLinear(const FLPIDFormula* formula, 
+						 float imperialScale, 
+						 float imperialOffset, 
+						 const uint8_t* payloads, 
+						 NSUInteger stride, 
+						 NSUInteger count, 
+						 float* metricValues, 
+						 float* imperialValues) {
+	
+	FLFloat4 divisor		= splatFloat4(formula->divisor);
+	FLFloat4 scale			= splatFloat4(formula->scale);
+	FLFloat4 offset			= splatFloat4(formula->offset);
+	FLFloat4 convertScale	= splatFloat4(imperialScale);
+	FLFloat4 convertOffset	= splatFloat4(imperialOffset);
+	NSUInteger i			= 0;
+	
+	for(; (i + 4) <= count; i += 4) {
+		const uint8_t* payload	= &payloads[i * stride];
+		FLFloat4 raw			= { FLPIDFormulaRawValue(formula, payload), 
+									FLPIDFormulaRawValue(formula, (payload + stride)), 
+									FLPIDFormulaRawValue(formula, (payload + (2 * stride))), 
+									FLPIDFormulaRawValue(formula, (payload + (3 * stride))) };
+		
+		FLFloat4 metric;
+		
+		if(formula->truncate) {
+			// The integer conversion truncates toward zero, just as the
+			// scalar integer division does
+			raw					= raw / divisor;
+			FLFloat4 whole		= { (int)raw[0], (int)raw[1], (int)raw[2], (int)raw[3] };
+			metric				= (whole * scale) + offset;
+		}
+		else {
+			// Multiplied before dividing, in the order the calc functions
+			// use, so both give the same float
+			metric				= ((raw * scale) / divisor) + offset;
+		}
+		
+		memcpy(&metricValues[i], &metric, sizeof(metric));
+		
+		if(imperialValues) {
+			FLFloat4 imperial	= (metric * convertScale) + convertOffset;
+			memcpy(&imperialValues[i], &imperial, sizeof(imperial));
+		}
+	}
+	
+	for(; i < count; i++) {
+		float raw				= FLPIDFormulaRawValue(formula, &payloads[i * stride]);
+		
+		if(formula->truncate) {
+			metricValues[i]		= ((float)(int)(raw / formula->divisor) * formula->scale) + formula->offset;
+		}
+		else {
+			metricValues[i]		= ((raw * formula->scale) / formula->divisor) + formula->offset;
+		}
+		
+		if(imperialValues) {
+			imperialValues[i]	= (metricValues[i] * imperialScale) + imperialOffset;
+		}
+	}
+}
+
+
 #pragma mark -
 #pragma mark Private Methods
 @interface FLECUSensor(StringValueMethods)
@@ -448,6 +613,7 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 - (NSString*) calculateSecondaryAirStatus:(NSData*)data;
 
 - (void) addValueHistoryForCurrentResponse;
+- initWithExtendedPID:(NSUInteger)pid;
 @end
 
 
@@ -457,13 +623,36 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 + (FLECUSensor*) sensorForPID:(NSUInteger)pid {
 	FLECUSensor* sensor		= nil;
 	
-	if(pid >= 0x0 && pid <= 0x4E) {
+	if(pid < SENSOR_TABLE_SIZE) {
 		sensor			= [[FLECUSensor alloc] initWithDescriptor:&g_sensorDescriptorTable[pid]];
 	}
+	else if(pid <= 0xFF) {
+		sensor			= [[FLECUSensor sensorForMode:kScanToolModeRequestCurrentPowertrainDiagnosticData pid:pid] retain];
+		
+		if(!sensor) {
+			sensor		= [[FLECUSensor alloc] initWithExtendedPID:pid];
+		}
+	}
 	
 	return [sensor autorelease];
 }
 
++ (FLECUSensor*) sensorForMode:(NSUInteger)mode pid:(NSUInteger)pid {
+	
+	if(mode == kScanToolModeRequestCurrentPowertrainDiagnosticData && pid < SENSOR_TABLE_SIZE) {
+		return [FLECUSensor sensorForPID:pid];
+	}
+	
+	FLPIDCatalog* catalog					= [FLPIDCatalog sharedCatalog];
+	const FLPIDDefinition* definition		= [catalog definitionForMode:mode pid:pid];
+	
+	if(!definition) {
+		return nil;
+	}
+	
+	return [[[FLECUSensor alloc] initWithDefinition:definition catalog:catalog] autorelease];
+}
+
 + (NSArray*) troubleCodesForResponse:(FLScanToolResponse*)response {
 	
 	const char systemCode[4]	= { 'P', 'C', 'B', 'U' };	
@@ -523,7 +712,52 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 - initWithDescriptor:(MultiSensorDescriptor*)descriptor {
 	
 	if(self = [super init]) {
-		_sensorDescriptor = descriptor;
+		_sensorDescriptor	= descriptor;
+		_valueHistoryDepth	= SENSOR_VALUE_HISTORY_DEPTH;
+	}
+	
+	return self;
+}
+
+
+- initWithExtendedPID:(NSUInteger)pid {
+	
+	if(self = [super init]) {
+		_extendedSensorDescriptor		= g_extendedSensorDescriptor;
+		_extendedSensorDescriptor.pid	= pid;
+		_sensorDescriptor				= &_extendedSensorDescriptor;
+		_valueHistoryDepth				= SENSOR_VALUE_HISTORY_DEPTH;
+	}
+	
+	return self;
+}
+
+
+- initWithDefinition:(const FLPIDDefinition*)definition catalog:(FLPIDCatalog*)catalog {
+	
+	if(self = [super init]) {
+		SensorDescriptor* descriptor1	= &_extendedSensorDescriptor.sensorDescriptor1;
+		
+		// The catalog keeps the definition, and the strings it points to,
+		// for as long as it lives
+		_catalog						= [catalog retain];
+		_definition						= definition;
+		_extendedSensorDescriptor		= g_extendedSensorDescriptor;
+		_extendedSensorDescriptor.pid	= definition->pid;
+		
+		descriptor1->description		= definition->description;
+		descriptor1->shortDescription	= definition->shortDescription;
+		descriptor1->metricUnit			= definition->metricUnit;
+		descriptor1->minMetricValue		= definition->minMetricValue;
+		descriptor1->maxMetricValue		= definition->maxMetricValue;
+		descriptor1->imperialUnit		= definition->imperialUnit;
+		descriptor1->minImperialValue	= definition->minImperialValue;
+		descriptor1->maxImperialValue	= definition->maxImperialValue;
+		descriptor1->calcFunction		= NULL;
+		descriptor1->convertFunction	= NULL;
+		
+		_sensorDescriptor				= &_extendedSensorDescriptor;
+		_valueHistoryDepth				= SENSOR_VALUE_HISTORY_DEPTH;
 	}
 	
 	return self;
@@ -531,7 +765,8 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 
 
 - (void)dealloc {
-	[_sensorValueHistory release];
+	[_catalog release];
+	[_valueHistory release];
 	[_currentResponse release];
 	
 	[super dealloc];
@@ -545,7 +780,7 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 - (void) setCurrentResponse:(FLScanToolResponse*)response {
 		
 	if(response) {		
-		if(response.pid == self.pid) {
+		if(response.pid == self.pid && (!_definition || response.mode == _definition->mode)) {
 			[_currentResponse release];
 			_currentResponse = [response retain];
 			[self addValueHistoryForCurrentResponse];
@@ -553,31 +788,71 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 	}	
 }
 
+- (FLValueHistory*) history {
+	return _valueHistory;
+}
+
+
+- (NSUInteger) valueHistoryDepth {
+	return _valueHistoryDepth;
+}
+
+- (void) setValueHistoryDepth:(NSUInteger)depth {
+	
+	if(depth != _valueHistoryDepth) {
+		// Recreated at the new depth with the next sample
+		[_valueHistory release];
+		_valueHistory		= nil;
+		_valueHistoryDepth	= depth;
+	}
+}
+
+
 - (NSArray*) valueHistory {
 	
-	// TODO: Figure out why this doesn't respect the NSRange length value when count > 32
-	//return [_sensorValueHistory objectsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(_valueHistoryHead, (_valueHistoryTail + 1))]];
+	static NSString* const keys[kNumValueHistoryChannels] = {
+		@"measurement1Metric", 
+		@"measurement1Imperial", 
+		@"measurement2Metric", 
+		@"measurement2Imperial"
+	};
 	
-	if([_sensorValueHistory count] > 0) {
-		NSMutableArray* values = [[NSMutableArray arrayWithCapacity:(_valueHistoryTail - _valueHistoryHead - 1)] retain];
+	NSUInteger count	= _valueHistory.count;
+	
+	if(count == 0) {
+		return nil;
+	}
+	
+	NSMutableArray* history	= [NSMutableArray arrayWithCapacity:count];
+	const float* values[kNumValueHistoryChannels];
+	
+	for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+		values[c]	= [_valueHistory valuesForChannel:c];
+	}
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		NSMutableDictionary* sample	= [[NSMutableDictionary alloc] initWithCapacity:kNumValueHistoryChannels];
 		
-		for(NSUInteger idx = _valueHistoryHead; idx <= _valueHistoryTail; idx++) {
-			[values addObject:[_sensorValueHistory objectAtIndex:idx]];
+		for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+			if(!isnan(values[c][i])) {
+				[sample setObject:[NSNumber numberWithFloat:values[c][i]] forKey:keys[c]];
+			}
 		}
 		
-		return [NSArray arrayWithArray:[values autorelease]];
+		[history addObject:sample];
+		[sample release];
 	}
 	
-	return nil;	
+	return history;
 }
 
 
 - (BOOL) isAlphaValue {	
-	return IS_ALPHA_VALUE(self.pid);
+	return !_definition && IS_ALPHA_VALUE(self.pid);
 }
 
 - (BOOL) isMultiValue {
-	return IS_MULTI_VALUE_SENSOR(self.pid);
+	return !_definition && (IS_MULTI_VALUE_SENSOR(self.pid));
 }
 
 
@@ -586,6 +861,11 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 }
 
 
+- (NSUInteger) mode {
+	return (_definition) ? _definition->mode : kScanToolModeRequestCurrentPowertrainDiagnosticData;
+}
+
+
 - (NSData*) data {
 	return _currentResponse.data;
 }
@@ -593,50 +873,128 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 
 - (void) addValueHistoryForCurrentResponse {
 	
-	@try {
+	NSData* data							= _currentResponse.data;
+	const SensorDescriptor* descriptor1		= &_sensorDescriptor->sensorDescriptor1;
+	const SensorDescriptor* descriptor2		= &_sensorDescriptor->sensorDescriptor2;
+	float values[kNumValueHistoryChannels]	= { NAN, NAN, NAN, NAN };
+	
+	if(!data || self.isAlphaValue) {
+		return;
+	}
+	
+	if(_definition) {
+		values[kValueHistoryMeasurement1Metric]		= FLPIDFormulaValue(&_definition->formula, [data bytes], [data length]);
+		values[kValueHistoryMeasurement1Imperial]	= (values[kValueHistoryMeasurement1Metric] * _definition->imperialScale) + 
+														_definition->imperialOffset;
+	}
+	else if(descriptor1->calcFunction) {
+		values[kValueHistoryMeasurement1Metric]		= descriptor1->calcFunction([data bytes], [data length]);
+		values[kValueHistoryMeasurement1Imperial]	= (descriptor1->convertFunction) ? 
+														descriptor1->convertFunction(values[kValueHistoryMeasurement1Metric]) : 
+														values[kValueHistoryMeasurement1Metric];
+	}
+	
+	if(self.isMultiValue && descriptor2->calcFunction) {
+		values[kValueHistoryMeasurement2Metric]		= descriptor2->calcFunction([data bytes], [data length]);
+		values[kValueHistoryMeasurement2Imperial]	= (descriptor2->convertFunction) ? 
+														descriptor2->convertFunction(values[kValueHistoryMeasurement2Metric]) : 
+														values[kValueHistoryMeasurement2Metric];
+	}
+	
+	if(!_valueHistory) {
+		_valueHistory	= [[FLValueHistory alloc] initWithDepth:_valueHistoryDepth];
+	}
+	
+	[_valueHistory addValues:values timestamp:[_currentResponse.timestamp timeIntervalSinceReferenceDate]];
+}
+
+#pragma mark -
+#pragma mark Batch Decoding
+
+- (BOOL) decodeMeasurement:(NSUInteger)measurement 
+				  payloads:(const uint8_t*)payloads 
+					stride:(NSUInteger)stride 
+					length:(NSUInteger)length 
+					 count:(NSUInteger)count 
+			  metricValues:(float*)metricValues 
+			imperialValues:(float*)imperialValues {
+	
+	const SensorDescriptor* descriptor	= (measurement == 2) ? 
+											&_sensorDescriptor->sensorDescriptor2 : 
+											&_sensorDescriptor->sensorDescriptor1;
+	const FLLinearKernel* kernel		= NULL;
+	const FLLinearConversion* conversion	= NULL;
+	
+	if(_definition && measurement != 2 && payloads && metricValues) {
+		const FLPIDFormula* formula		= &_definition->formula;
 		
-		if(!_sensorValueHistory) {
-			_sensorValueHistory = [[NSMutableArray arrayWithCapacity:64] retain];
-			_valueHistoryHead	= 0;
-			_valueHistoryTail	= 0;
+		if(length >= (NSUInteger)(formula->byteOffset + formula->byteCount)) {
+			decodeLinear(formula, 
+						 _definition->imperialScale, 
+						 _definition->imperialOffset, 
+						 payloads, stride, count, metricValues, imperialValues);
 		}
-		
-		if([_sensorValueHistory count] >= 64) {
-			const NSUInteger removalList[] = {
-				0, 1, 2, 3, 4, 5, 6, 7, 8,
-				9, 10, 11, 12, 13, 14, 15,
-				16, 17, 18, 19, 20, 21, 22,
-				23, 24, 25, 26, 27, 28, 29,
-				30, 31
-			};
-			
-			[_sensorValueHistory removeObjectsFromIndices:(NSUInteger*)removalList numIndices:32];
-			//[_sensorValueHistory removeObjectsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 32)]];
-			_valueHistoryHead = 0;
-			_valueHistoryTail = 32;
+		else {
+			for(NSUInteger i = 0; i < count; i++) {
+				metricValues[i]			= NAN;
+				
+				if(imperialValues) {
+					imperialValues[i]	= NAN;
+				}
+			}
 		}
-
-
-			
-		[_sensorValueHistory addObject:[NSDictionary dictionaryWithObjectsAndKeys:
-										   [self valueForMeasurement1:YES], @"measurement1Metric", 
-										   [self valueForMeasurement1:NO], @"measurement1Imperial", 
-										   [self valueForMeasurement2:YES], @"measurement2Metric", 
-										   [self valueForMeasurement2:NO], @"measurement2Imperial", 
-										   nil]];
 		
-		NSUInteger count	= [_sensorValueHistory count];
-		_valueHistoryHead	= (count > 32) ? (count - 32) : 0;
-		_valueHistoryTail	= count - 1;
+		return YES;
 	}
-	@catch (NSException * e) {
-		FLEXCEPTION(e)
+	
+	if(self.isAlphaValue || 
+	   (measurement == 2 && !self.isMultiValue) || 
+	   !descriptor->calcFunction || 
+	   !payloads || 
+	   !metricValues) {
+		return NO;
 	}
-	@finally {
-
+	
+	for(NSUInteger k = 0; k < NUM_LINEAR_KERNELS; k++) {
+		if(g_linearKernels[k].calcFunction == descriptor->calcFunction) {
+			kernel	= &g_linearKernels[k];
+			break;
+		}
 	}
+	
+	for(NSUInteger k = 0; k < NUM_LINEAR_CONVERSIONS && descriptor->convertFunction; k++) {
+		if(g_linearConversions[k].convertFunction == descriptor->convertFunction) {
+			conversion	= &g_linearConversions[k];
+			break;
+		}
+	}
+	
+	// The kernels read a fixed number of bytes, so short payloads and
+	// unknown conversions go through the scalar functions
+	if(kernel && 
+	   length >= (kernel->formula.byteOffset + kernel->formula.byteCount) && 
+	   (conversion || !descriptor->convertFunction)) {
+		decodeLinear(&kernel->formula, 
+					 (conversion) ? conversion->scale : 1, 
+					 (conversion) ? conversion->offset : 0, 
+					 payloads, stride, count, metricValues, imperialValues);
+		return YES;
+	}
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		metricValues[i]			= descriptor->calcFunction(&payloads[i * stride], length);
+		
+		if(imperialValues) {
+			imperialValues[i]	= (descriptor->convertFunction) ? 
+									descriptor->convertFunction(metricValues[i]) : 
+									metricValues[i];
+		}
+	}
+	
+	return YES;
 }
 
+
 - (BOOL) isMILActive {
 	if(self.pid == 0x01) {
 		if(calcMILActive([_currentResponse.data bytes], [_currentResponse.data length])) {
@@ -667,7 +1025,21 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 		return [self calculateStringForData:_currentResponse.data];
 	}
 	
-	if(_sensorDescriptor->sensorDescriptor1.calcFunction) {
+	if(_definition) {
+		
+		float val = FLPIDFormulaValue(&_definition->formula, _currentResponse.data.bytes, _currentResponse.data.length);
+		
+		if(isnan(val)) {
+			return nil;
+		}
+		
+		if(!metric) {
+			val = (val * _definition->imperialScale) + _definition->imperialOffset;
+		}
+		
+		return [NSNumber numberWithFloat:val];
+	}
+	else if(_sensorDescriptor->sensorDescriptor1.calcFunction) {
 		
 		float val = _sensorDescriptor->sensorDescriptor1.calcFunction(_currentResponse.data.bytes, _currentResponse.data.length);
 		
@@ -712,7 +1084,7 @@ static MultiSensorDescriptor g_sensorDescriptorTable[] = {
 	}
 	else {
 		NSNumber* numVal = (NSNumber*)value;
-		if(IS_INT_VALUE(self.pid, 1)) {
+		if((_definition) ? isIntegralDefinition(_definition, metric) : IS_INT_VALUE(self.pid, 1)) {
 			return [NSString stringWithFormat:@"%d", [numVal intValue]];
 		}
 		else {
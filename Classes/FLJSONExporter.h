@@ -0,0 +1,87 @@
+/*
+ *  FLJSONExporter.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanToolResponse.h"
+
+@class FLTripJournalReader;
+
+
+// Size of the output buffer.  Nothing else grows with the export.
+#define JSON_EXPORT_BUFFER_SIZE			16384
+
+// Records read from a journal at a time by -writeJournal:
+#define JSON_EXPORT_JOURNAL_BATCH		64
+
+
+/*
+ Writes responses and records as newline-delimited JSON, one object per
+ line, with the keys of -[FLScanToolResponse proxyForJson].  Each line is
+ formatted straight into a fixed-size buffer, which is written to the
+ output stream as it fills, so no dictionaries or strings are built and a
+ trip of any length is exported in constant memory.
+
+ Records carry no CRC or location, so their lines leave those keys out.
+ Record timestamps are taken to be seconds since the reference date, as
+ FLTripJournalReader returns them.
+
+ The write methods return NO once a write to the stream has failed; the
+ stream's streamError says why.
+ */
+@interface FLJSONExporter : NSObject {
+	NSOutputStream*		_stream;
+	NSString*			_scanToolName;
+	NSData*				_scanToolNameJSON;
+	NSString*			_responseToolName;
+	NSData*				_responseToolNameJSON;
+	char				_buffer[JSON_EXPORT_BUFFER_SIZE];
+	NSUInteger			_length;
+	NSUInteger			_lineCount;
+	BOOL				_failed;
+}
+
+// Name written as the scanTool of records.  Defaults to "ELM327".
+@property (nonatomic, copy) NSString* scanToolName;
+@property (nonatomic, readonly) NSUInteger lineCount;
+@property (nonatomic, readonly) BOOL failed;
+
++ (FLJSONExporter*) exporterWithPath:(NSString*)path;
+
+// Writes to a new file at path, replacing any file there
+- initWithPath:(NSString*)path;
+
+// Writes to stream, such as a socket stream, opening it if it is not open.
+// Writes block until the stream takes the bytes.
+- initWithOutputStream:(NSOutputStream*)stream;
+
+- (BOOL) writeResponse:(FLScanToolResponse*)response;
+- (BOOL) writeResponses:(NSArray*)responses;
+- (BOOL) writeRecords:(const FLScanToolRecord*)records count:(NSUInteger)count;
+
+// Every record in the journal, in order
+- (BOOL) writeJournal:(FLTripJournalReader*)reader;
+
+// Writes out the buffer
+- (BOOL) flush;
+
+// Flushes and closes the stream
+- (void) close;
+
+@end
@@ -0,0 +1,388 @@
+/*
+ *  FLJSONExporter.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLJSONExporter.h"
+#import "FLTripJournalReader.h"
+#import "Base64Extensions.h"
+#import "FLLogging.h"
+
+
+// Longest scan tool name written, in UTF-8 bytes before escaping
+#define JSON_EXPORT_MAX_NAME_LENGTH		128
+
+// Room for everything in a line but the scan tool name and the base64
+// payloads: the keys, eight integers and a double
+#define JSON_EXPORT_FIXED_LINE_LENGTH	512
+
+// Payload bytes base64 encoded into the buffer at a time
+#define JSON_EXPORT_BASE64_CHUNK		3072
+
+
+static inline char* appendLiteral(char* cursor, const char* literal) {
+	while(*literal) {
+		*cursor++ = *literal++;
+	}
+	
+	return cursor;
+}
+
+
+static inline char* appendUnsigned(char* cursor, unsigned long long value) {
+	char digits[20];
+	NSUInteger count = 0;
+	
+	do {
+		digits[count++]	= '0' + (value % 10);
+		value			/= 10;
+	} while(value > 0);
+	
+	while(count > 0) {
+		*cursor++ = digits[--count];
+	}
+	
+	return cursor;
+}
+
+
+// JSON has no NaN or infinity, so those are written as null
+static inline char* appendDouble(char* cursor, double value) {
+	
+	if(isnan(value) || isinf(value)) {
+		return appendLiteral(cursor, "null");
+	}
+	
+	return cursor + snprintf(cursor, 32, "%.15g", value);
+}
+
+
+// A JSON string literal, quotes included, of up to
+// JSON_EXPORT_MAX_NAME_LENGTH bytes of the string
+static NSData* jsonStringData(NSString* string) {
+	
+	static const char hex[] = "0123456789abcdef";
+	const char* utf8		= [string UTF8String];
+	NSUInteger length		= (utf8) ? MIN(strlen(utf8), JSON_EXPORT_MAX_NAME_LENGTH) : 0;
+	NSMutableData* json		= [NSMutableData dataWithCapacity:(length + 2)];
+	
+	[json appendBytes:"\"" length:1];
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		unsigned char c		= (unsigned char)utf8[i];
+		
+		if(c == '"' || c == '\\') {
+			char escaped[2]	= { '\\', c };
+			[json appendBytes:escaped length:2];
+		}
+		else if(c < 0x20) {
+			char escaped[6]	= { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F] };
+			[json appendBytes:escaped length:6];
+		}
+		else {
+			[json appendBytes:&c length:1];
+		}
+	}
+	
+	[json appendBytes:"\"" length:1];
+	
+	return json;
+}
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLJSONExporter (Private)
+- (BOOL) reserve:(NSUInteger)length;
+- (BOOL) appendBase64:(NSData*)data;
+@end
+
+
+#pragma mark -
+@implementation FLJSONExporter
+
+@synthesize scanToolName	= _scanToolName,
+			lineCount		= _lineCount,
+			failed			= _failed;
+
+
++ (FLJSONExporter*) exporterWithPath:(NSString*)path {
+	return [[[FLJSONExporter alloc] initWithPath:path] autorelease];
+}
+
+
+- initWithPath:(NSString*)path {
+	return [self initWithOutputStream:[NSOutputStream outputStreamToFileAtPath:path append:NO]];
+}
+
+
+- initWithOutputStream:(NSOutputStream*)stream {
+	
+	if(self = [super init]) {
+		
+		if(!stream) {
+			[self release];
+			return nil;
+		}
+		
+		_stream				= [stream retain];
+		self.scanToolName	= @"ELM327";
+		
+		if([_stream streamStatus] == NSStreamStatusNotOpen) {
+			[_stream open];
+		}
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self close];
+	[_stream release];
+	[_scanToolName release];
+	[_scanToolNameJSON release];
+	[_responseToolName release];
+	[_responseToolNameJSON release];
+	[super dealloc];
+}
+
+
+- (void) setScanToolName:(NSString*)name {
+	
+	if(name != _scanToolName) {
+		[_scanToolName release];
+		[_scanToolNameJSON release];
+		_scanToolName		= [name copy];
+		_scanToolNameJSON	= [jsonStringData(name) retain];
+	}
+}
+
+
+#pragma mark -
+#pragma mark Output Buffer
+
+- (BOOL) flush {
+	
+	NSUInteger written	= 0;
+	
+	while(!_failed && written < _length) {
+		NSInteger count	= [_stream write:(const uint8_t*)&_buffer[written] maxLength:(_length - written)];
+		
+		if(count <= 0) {
+			FLNSERROR([_stream streamError])
+			_failed		= YES;
+		}
+		else {
+			written		+= count;
+		}
+	}
+	
+	_length				= 0;
+	
+	return !_failed;
+}
+
+
+- (BOOL) reserve:(NSUInteger)length {
+	
+	if((JSON_EXPORT_BUFFER_SIZE - _length) < length) {
+		[self flush];
+	}
+	
+	return !_failed;
+}
+
+
+- (BOOL) appendBase64:(NSData*)data {
+	
+	const uint8_t* bytes	= (const uint8_t*)[data bytes];
+	NSUInteger length		= [data length];
+	
+	for(NSUInteger offset = 0; offset < length; offset += JSON_EXPORT_BASE64_CHUNK) {
+		NSUInteger chunk	= MIN(length - offset, JSON_EXPORT_BASE64_CHUNK);
+		
+		if(![self reserve:FL_BASE64_ENCODED_LENGTH(chunk)]) {
+			return NO;
+		}
+		
+		_length				+= FLBase64Encode(&bytes[offset], chunk, &_buffer[_length]);
+	}
+	
+	return !_failed;
+}
+
+
+- (void) close {
+	
+	if(_stream && [_stream streamStatus] != NSStreamStatusClosed) {
+		[self flush];
+		[_stream close];
+	}
+}
+
+
+#pragma mark -
+#pragma mark Writing
+
+- (BOOL) writeResponse:(FLScanToolResponse*)response {
+	
+	if(response.scanToolName != _responseToolName) {
+		[_responseToolName release];
+		[_responseToolNameJSON release];
+		_responseToolName		= [response.scanToolName retain];
+		_responseToolNameJSON	= [jsonStringData(_responseToolName) retain];
+	}
+	
+	if(![self reserve:(JSON_EXPORT_FIXED_LINE_LENGTH + [_responseToolNameJSON length])]) {
+		return NO;
+	}
+	
+	char* cursor	= &_buffer[_length];
+	
+	cursor			= appendLiteral(cursor, "{\"scanTool\":");
+	memcpy(cursor, [_responseToolNameJSON bytes], [_responseToolNameJSON length]);
+	cursor			+= [_responseToolNameJSON length];
+	cursor			= appendLiteral(cursor, ",\"protocol\":");
+	cursor			= appendUnsigned(cursor, (unsigned int)response.protocol);
+	cursor			= appendLiteral(cursor, ",\"rawPacket\":\"");
+	_length			= cursor - _buffer;
+	
+	if(![self appendBase64:response.rawData] || ![self reserve:JSON_EXPORT_FIXED_LINE_LENGTH]) {
+		return NO;
+	}
+	
+	cursor			= &_buffer[_length];
+	cursor			= appendLiteral(cursor, "\",\"timestamp\":");
+	cursor			= appendDouble(cursor, [response.timestamp timeIntervalSince1970]);
+	cursor			= appendLiteral(cursor, ",\"priority\":");
+	cursor			= appendUnsigned(cursor, response.priority);
+	cursor			= appendLiteral(cursor, ",\"targetAddress\":");
+	cursor			= appendUnsigned(cursor, response.targetAddress);
+	cursor			= appendLiteral(cursor, ",\"ecuAddress\":");
+	cursor			= appendUnsigned(cursor, response.ecuAddress);
+	cursor			= appendLiteral(cursor, ",\"service\":");
+	cursor			= appendUnsigned(cursor, response.mode);
+	cursor			= appendLiteral(cursor, ",\"pid\":");
+	cursor			= appendUnsigned(cursor, response.pid);
+	cursor			= appendLiteral(cursor, ",\"crc\":");
+	cursor			= appendUnsigned(cursor, response.crc);
+	cursor			= appendLiteral(cursor, ",\"data\":\"");
+	_length			= cursor - _buffer;
+	
+	if(![self appendBase64:response.data] || ![self reserve:JSON_EXPORT_FIXED_LINE_LENGTH]) {
+		return NO;
+	}
+	
+	cursor			= &_buffer[_length];
+	cursor			= appendLiteral(cursor, "\",\"latitude\":");
+	cursor			= appendDouble(cursor, response.latitude);
+	cursor			= appendLiteral(cursor, ",\"longitude\":");
+	cursor			= appendDouble(cursor, response.longitude);
+	cursor			= appendLiteral(cursor, ",\"altitude\":");
+	cursor			= appendDouble(cursor, response.altitude);
+	cursor			= appendLiteral(cursor, ",\"horizontalAccuracy\":");
+	cursor			= appendDouble(cursor, response.horizontalAccuracy);
+	cursor			= appendLiteral(cursor, ",\"verticalAccuracy\":");
+	cursor			= appendDouble(cursor, response.verticalAccuracy);
+	cursor			= appendLiteral(cursor, ",\"gpsSpeed\":");
+	cursor			= appendDouble(cursor, response.gpsSpeed);
+	cursor			= appendLiteral(cursor, "}\n");
+	_length			= cursor - _buffer;
+	_lineCount++;
+	
+	return YES;
+}
+
+
+- (BOOL) writeResponses:(NSArray*)responses {
+	
+	for(FLScanToolResponse* response in responses) {
+		if(![self writeResponse:response]) {
+			return NO;
+		}
+	}
+	
+	return YES;
+}
+
+
+- (BOOL) writeRecords:(const FLScanToolRecord*)records count:(NSUInteger)count {
+	
+	NSUInteger nameLength		= [_scanToolNameJSON length];
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		const FLScanToolRecord* record	= &records[i];
+		NSUInteger dataLength			= RECORD_DATA_LENGTH(record);
+		
+		// A record is small enough to format in one piece
+		if(![self reserve:(JSON_EXPORT_FIXED_LINE_LENGTH + nameLength +
+						   FL_BASE64_ENCODED_LENGTH(record->length) + FL_BASE64_ENCODED_LENGTH(dataLength))]) {
+			return NO;
+		}
+		
+		char* cursor	= &_buffer[_length];
+		
+		cursor			= appendLiteral(cursor, "{\"scanTool\":");
+		memcpy(cursor, [_scanToolNameJSON bytes], nameLength);
+		cursor			+= nameLength;
+		cursor			= appendLiteral(cursor, ",\"protocol\":");
+		cursor			= appendUnsigned(cursor, record->protocol);
+		cursor			= appendLiteral(cursor, ",\"rawPacket\":\"");
+		cursor			+= FLBase64Encode(record->bytes, record->length, cursor);
+		cursor			= appendLiteral(cursor, "\",\"timestamp\":");
+		cursor			= appendDouble(cursor, record->timestamp + NSTimeIntervalSince1970);
+		cursor			= appendLiteral(cursor, ",\"priority\":");
+		cursor			= appendUnsigned(cursor, record->priority);
+		cursor			= appendLiteral(cursor, ",\"targetAddress\":");
+		cursor			= appendUnsigned(cursor, record->targetAddress);
+		cursor			= appendLiteral(cursor, ",\"ecuAddress\":");
+		cursor			= appendUnsigned(cursor, record->ecuAddress);
+		cursor			= appendLiteral(cursor, ",\"service\":");
+		cursor			= appendUnsigned(cursor, record->mode);
+		cursor			= appendLiteral(cursor, ",\"pid\":");
+		cursor			= appendUnsigned(cursor, record->pid);
+		cursor			= appendLiteral(cursor, ",\"data\":\"");
+		cursor			+= FLBase64Encode(RECORD_DATA(record), dataLength, cursor);
+		cursor			= appendLiteral(cursor, "\"}\n");
+		_length			= cursor - _buffer;
+		_lineCount++;
+	}
+	
+	return YES;
+}
+
+
+- (BOOL) writeJournal:(FLTripJournalReader*)reader {
+	
+	FLScanToolRecord records[JSON_EXPORT_JOURNAL_BATCH];
+	FLTripJournalCursor cursor;
+	NSUInteger count;
+	
+	memset(&cursor, 0, sizeof(cursor));
+	
+	while((count = [reader readRecords:records maxCount:JSON_EXPORT_JOURNAL_BATCH cursor:&cursor]) > 0) {
+		if(![self writeRecords:records count:count]) {
+			return NO;
+		}
+	}
+	
+	return !_failed;
+}
+
+@end
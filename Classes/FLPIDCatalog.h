@@ -0,0 +1,156 @@
+/*
+ *  FLPIDCatalog.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#include <math.h>
+
+
+// Catalog loaded by +sharedCatalog from the main bundle, if present
+#define PID_CATALOG_FILE				@"FLPIDCatalog.plist"
+
+// Key for a definition in the catalog index
+#define PID_CATALOG_KEY(mode, pid)		((((uint32_t)(mode) & 0xFF) << 16) | ((uint32_t)(pid) & 0xFFFF))
+
+
+/*
+ A formula of the form
+	value = (raw * scale) / divisor + offset
+ where raw is the big-endian value of byteCount (1 to 4) data bytes
+ starting at byteOffset, read as two's complement when isSigned is set.
+ truncate reproduces an integer division in the formula, making it
+	value = trunc(raw / divisor) * scale + offset
+ */
+typedef struct pid_formula_t {
+	uint8_t			byteOffset;
+	uint8_t			byteCount;
+	BOOL			isSigned;
+	BOOL			truncate;
+	float			divisor;
+	float			scale;
+	float			offset;
+} FLPIDFormula;
+
+
+/*
+ A single PID definition.  Imperial values are metric * imperialScale +
+ imperialOffset.  The strings are owned by the catalog.
+ */
+typedef struct pid_definition_t {
+	uint8_t			mode;
+	uint16_t		pid;
+	const char*		description;
+	const char*		shortDescription;
+	const char*		metricUnit;
+	int				minMetricValue;
+	int				maxMetricValue;
+	const char*		imperialUnit;
+	int				minImperialValue;
+	int				maxImperialValue;
+	FLPIDFormula	formula;
+	float			imperialScale;
+	float			imperialOffset;
+} FLPIDDefinition;
+
+
+static inline float FLPIDFormulaRawValue(const FLPIDFormula* formula, const uint8_t* data) {
+	const uint8_t* bytes	= &data[formula->byteOffset];
+	uint32_t raw			= 0;
+	
+	for(NSUInteger i = 0; i < formula->byteCount; i++) {
+		raw					= (raw << 8) | bytes[i];
+	}
+	
+	if(formula->isSigned && formula->byteCount < 4) {
+		uint32_t sign		= 1U << ((formula->byteCount * 8) - 1);
+		return (float)((int32_t)(raw ^ sign) - (int32_t)sign);
+	}
+	
+	return (formula->isSigned) ? (float)(int32_t)raw : (float)raw;
+}
+
+
+// NAN if data is too short for the formula
+static inline float FLPIDFormulaValue(const FLPIDFormula* formula, const uint8_t* data, NSUInteger length) {
+	
+	if(!data || length < (NSUInteger)(formula->byteOffset + formula->byteCount)) {
+		return NAN;
+	}
+	
+	float raw				= FLPIDFormulaRawValue(formula, data);
+	
+	if(formula->truncate) {
+		return (truncf(raw / formula->divisor) * formula->scale) + formula->offset;
+	}
+	
+	return ((raw * formula->scale) / formula->divisor) + formula->offset;
+}
+
+
+/*
+ Sensor definitions loaded from property list files, so that new PIDs,
+ including manufacturer Mode $22 PIDs with 16-bit identifiers, can be
+ added without code changes.  A file holds an array of dictionaries, or a
+ dictionary with such an array under "PIDs", with the keys:
+
+	Mode, PID				Integers.  Required.
+	Name, ShortName			Strings
+	Unit, ImperialUnit		Strings.  ImperialUnit defaults to Unit.
+	Min, Max				Metric range
+	ImperialMin, ImperialMax
+	ByteOffset, ByteCount	Data bytes of the raw value.  Default 0 and 1.
+	Signed, Truncate		Booleans
+	Divisor, Scale, Offset	The formula.  Default 1, 1 and 0.
+	Conversion				"Temperature", "Speed", "Distance", "Pressure"
+							(kPa), "PressurePa" or "Air", the same
+							conversions as the built in sensors, or
+							ImperialScale and ImperialOffset.  A definition
+							with any other Conversion is rejected.
+
+ Definitions are held in flat arrays and indexed by mode and PID in an
+ open-addressed hash table.  Loading a definition for a mode and PID
+ already in the catalog replaces it for sensors created afterwards;
+ definitions are never freed while the catalog lives, so sensors keep
+ pointers to them.
+ */
+@interface FLPIDCatalog : NSObject {
+	FLPIDDefinition**		_blocks;
+	NSUInteger				_blockCount;
+	char**					_strings;
+	NSUInteger				_stringCount;
+	NSUInteger				_stringCapacity;
+	const FLPIDDefinition**	_index;
+	NSUInteger				_indexCapacity;
+	NSUInteger				_count;
+}
+
+@property (nonatomic, readonly) NSUInteger count;
+
+// Loaded from PID_CATALOG_FILE in the main bundle on first use
++ (FLPIDCatalog*) sharedCatalog;
+
+// Returns the number of definitions loaded, or 0 if the file could not be
+// read.  Invalid entries are logged and skipped.
+- (NSUInteger) loadDefinitionsFromFile:(NSString*)path;
+- (NSUInteger) loadDefinitions:(NSArray*)definitions;
+
+// NULL if the catalog has no definition for the mode and PID
+- (const FLPIDDefinition*) definitionForMode:(NSUInteger)mode pid:(NSUInteger)pid;
+
+@end
@@ -0,0 +1,368 @@
+/*
+ *  FLPIDCatalog.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLPIDCatalog.h"
+#import "FLLogging.h"
+
+
+// Smallest index, and the most it is allowed to fill before growing
+#define PID_CATALOG_MIN_INDEX_CAPACITY	16
+#define PID_CATALOG_INDEX_FULL(count, capacity)	(((count) * 2) > (capacity))
+
+
+static FLPIDCatalog* g_sharedCatalog = nil;
+
+
+// Unit conversions which may be named in a definition, matching the
+// conversion functions used by the built in sensors
+typedef struct pid_conversion_t {
+	NSString*		name;
+	float			scale;
+	float			offset;
+} FLPIDConversion;
+
+static const FLPIDConversion g_namedConversions[] = {
+	{ @"Temperature",	1.8f,				32 },
+	{ @"Speed",			0.62f,				0 },
+	{ @"Distance",		0.6213f,			0 },
+	{ @"Pressure",		1.0f / 3.386f,		0 },
+	{ @"PressurePa",	1.0f / 3386.0f,		0 },
+	{ @"Air",			0.132f,				0 }
+};
+
+#define NUM_NAMED_CONVERSIONS	(sizeof(g_namedConversions) / sizeof(g_namedConversions[0]))
+
+
+static inline NSUInteger indexSlotForKey(uint32_t key, NSUInteger capacity) {
+	key ^= key >> 16;
+	key *= 0x45D9F3BU;
+	key ^= key >> 16;
+	return key & (capacity - 1);
+}
+
+
+static double numberForKey(NSDictionary* entry, NSString* key, double defaultValue) {
+	id value = [entry objectForKey:key];
+	return ([value isKindOfClass:[NSNumber class]]) ? [value doubleValue] : defaultValue;
+}
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLPIDCatalog (Private)
+- (const char*) copyString:(id)string;
+- (BOOL) parseDefinition:(NSDictionary*)entry into:(FLPIDDefinition*)definition;
+- (void) insertDefinition:(const FLPIDDefinition*)definition;
+- (BOOL) growIndexForCount:(NSUInteger)count;
+@end
+
+
+#pragma mark -
+@implementation FLPIDCatalog
+
+@synthesize count = _count;
+
+
++ (FLPIDCatalog*) sharedCatalog {
+	@synchronized(self) {
+		if(!g_sharedCatalog) {
+			g_sharedCatalog	= [[FLPIDCatalog alloc] init];
+			NSString* path	= [[NSBundle mainBundle] pathForResource:[PID_CATALOG_FILE stringByDeletingPathExtension]
+															  ofType:[PID_CATALOG_FILE pathExtension]];
+			
+			if(path) {
+				[g_sharedCatalog loadDefinitionsFromFile:path];
+			}
+		}
+	}
+	
+	return g_sharedCatalog;
+}
+
+
+- (void) dealloc {
+	
+	for(NSUInteger i = 0; i < _blockCount; i++) {
+		free(_blocks[i]);
+	}
+	
+	for(NSUInteger i = 0; i < _stringCount; i++) {
+		free(_strings[i]);
+	}
+	
+	free(_blocks);
+	free(_strings);
+	free(_index);
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Loading
+
+- (NSUInteger) loadDefinitionsFromFile:(NSString*)path {
+	
+	id root = [NSArray arrayWithContentsOfFile:path];
+	
+	if(!root) {
+		root = [[NSDictionary dictionaryWithContentsOfFile:path] objectForKey:@"PIDs"];
+	}
+	
+	if(![root isKindOfClass:[NSArray class]]) {
+		FLERROR(@"No PID definitions found in %@", path)
+		return 0;
+	}
+	
+	NSUInteger loaded = [self loadDefinitions:root];
+	FLDEBUG(@"Loaded %d PID definitions from %@", loaded, [path lastPathComponent])
+	
+	return loaded;
+}
+
+
+- (NSUInteger) loadDefinitions:(NSArray*)definitions {
+	
+	NSUInteger count			= [definitions count];
+	NSUInteger loaded			= 0;
+	
+	if(count == 0) {
+		return 0;
+	}
+	
+	@synchronized(self) {
+		FLPIDDefinition* block		= (FLPIDDefinition*)calloc(count, sizeof(FLPIDDefinition));
+		FLPIDDefinition** blocks	= (FLPIDDefinition**)realloc(_blocks, (_blockCount + 1) * sizeof(FLPIDDefinition*));
+		
+		if(blocks) {
+			_blocks					= blocks;
+		}
+		
+		if(!block || !blocks || ![self growIndexForCount:(_count + count)]) {
+			FLERROR(@"Unable to allocate %d PID definitions", count)
+			free(block);
+			return 0;
+		}
+		
+		_blocks[_blockCount++]		= block;
+		
+		for(NSDictionary* entry in definitions) {
+			if([entry isKindOfClass:[NSDictionary class]] &&
+			   [self parseDefinition:entry into:&block[loaded]]) {
+				[self insertDefinition:&block[loaded]];
+				loaded++;
+			}
+			else {
+				FLERROR(@"Skipping invalid PID definition: %@", entry)
+			}
+		}
+	}
+	
+	return loaded;
+}
+
+
+- (const char*) copyString:(id)string {
+	
+	if(![string isKindOfClass:[NSString class]]) {
+		return NULL;
+	}
+	
+	if(_stringCount == _stringCapacity) {
+		NSUInteger capacity	= MAX(_stringCapacity * 2, 32);
+		char** strings		= (char**)realloc(_strings, capacity * sizeof(char*));
+		
+		if(!strings) {
+			return NULL;
+		}
+		
+		_strings			= strings;
+		_stringCapacity		= capacity;
+	}
+	
+	char* copy				= strdup([string UTF8String]);
+	
+	if(copy) {
+		_strings[_stringCount++] = copy;
+	}
+	
+	return copy;
+}
+
+
+- (BOOL) parseDefinition:(NSDictionary*)entry into:(FLPIDDefinition*)definition {
+	
+	double mode						= numberForKey(entry, @"Mode", -1);
+	double pid						= numberForKey(entry, @"PID", -1);
+	FLPIDFormula* formula			= &definition->formula;
+	
+	if(mode < 0 || mode > 0xFF || pid < 0 || pid > 0xFFFF) {
+		return NO;
+	}
+	
+	formula->byteOffset				= (uint8_t)numberForKey(entry, @"ByteOffset", 0);
+	formula->byteCount				= (uint8_t)numberForKey(entry, @"ByteCount", 1);
+	formula->isSigned				= [[entry objectForKey:@"Signed"] boolValue];
+	formula->truncate				= [[entry objectForKey:@"Truncate"] boolValue];
+	formula->divisor				= (float)numberForKey(entry, @"Divisor", 1);
+	formula->scale					= (float)numberForKey(entry, @"Scale", 1);
+	formula->offset					= (float)numberForKey(entry, @"Offset", 0);
+	
+	if(formula->byteCount < 1 || formula->byteCount > 4 || formula->divisor == 0) {
+		return NO;
+	}
+	
+	definition->mode				= (uint8_t)mode;
+	definition->pid					= (uint16_t)pid;
+	definition->imperialScale		= 1;
+	definition->imperialOffset		= 0;
+	
+	id conversion					= [entry objectForKey:@"Conversion"];
+	
+	if(conversion) {
+		NSUInteger index			= 0;
+		
+		while([conversion isKindOfClass:[NSString class]] && index < NUM_NAMED_CONVERSIONS && 
+			  [conversion caseInsensitiveCompare:g_namedConversions[index].name] != NSOrderedSame) {
+			index++;
+		}
+		
+		if(![conversion isKindOfClass:[NSString class]] || index == NUM_NAMED_CONVERSIONS) {
+			// Treating it as metric would show metric values under the
+			// imperial unit
+			FLERROR(@"Unknown conversion for PID %02X %04X: %@", (int)mode, (int)pid, conversion)
+			return NO;
+		}
+		
+		definition->imperialScale	= g_namedConversions[index].scale;
+		definition->imperialOffset	= g_namedConversions[index].offset;
+	}
+	else {
+		definition->imperialScale	= (float)numberForKey(entry, @"ImperialScale", 1);
+		definition->imperialOffset	= (float)numberForKey(entry, @"ImperialOffset", 0);
+	}
+	
+	definition->description			= [self copyString:[entry objectForKey:@"Name"]];
+	definition->shortDescription	= [self copyString:[entry objectForKey:@"ShortName"]];
+	definition->metricUnit			= [self copyString:[entry objectForKey:@"Unit"]];
+	definition->imperialUnit		= [self copyString:[entry objectForKey:@"ImperialUnit"]];
+	
+	if(!definition->imperialUnit) {
+		definition->imperialUnit	= definition->metricUnit;
+	}
+	
+	definition->minMetricValue		= (int)numberForKey(entry, @"Min", 0);
+	definition->maxMetricValue		= (int)numberForKey(entry, @"Max", INT_MAX);
+	definition->minImperialValue	= (int)numberForKey(entry, @"ImperialMin",
+														(definition->minMetricValue * definition->imperialScale) + definition->imperialOffset);
+	definition->maxImperialValue	= (int)numberForKey(entry, @"ImperialMax",
+														(definition->maxMetricValue == INT_MAX) ? INT_MAX :
+														(definition->maxMetricValue * definition->imperialScale) + definition->imperialOffset);
+	
+	return YES;
+}
+
+
+#pragma mark -
+#pragma mark Index
+
+- (BOOL) growIndexForCount:(NSUInteger)count {
+	
+	if(_index && !PID_CATALOG_INDEX_FULL(count, _indexCapacity)) {
+		return YES;
+	}
+	
+	NSUInteger capacity				= MAX(_indexCapacity, PID_CATALOG_MIN_INDEX_CAPACITY);
+	
+	while(PID_CATALOG_INDEX_FULL(count, capacity)) {
+		capacity					*= 2;
+	}
+	
+	const FLPIDDefinition** index	= (const FLPIDDefinition**)calloc(capacity, sizeof(FLPIDDefinition*));
+	
+	if(!index) {
+		FLERROR(@"Unable to allocate PID catalog index of %d entries", capacity)
+		return NO;
+	}
+	
+	for(NSUInteger i = 0; i < _indexCapacity; i++) {
+		const FLPIDDefinition* definition = _index[i];
+		
+		if(definition) {
+			NSUInteger slot			= indexSlotForKey(PID_CATALOG_KEY(definition->mode, definition->pid), capacity);
+			
+			while(index[slot]) {
+				slot				= (slot + 1) & (capacity - 1);
+			}
+			
+			index[slot]				= definition;
+		}
+	}
+	
+	free(_index);
+	_index							= index;
+	_indexCapacity					= capacity;
+	
+	return YES;
+}
+
+
+- (void) insertDefinition:(const FLPIDDefinition*)definition {
+	
+	uint32_t key		= PID_CATALOG_KEY(definition->mode, definition->pid);
+	NSUInteger slot		= indexSlotForKey(key, _indexCapacity);
+	
+	while(_index[slot]) {
+		if(PID_CATALOG_KEY(_index[slot]->mode, _index[slot]->pid) == key) {
+			_index[slot] = definition;
+			return;
+		}
+		
+		slot			= (slot + 1) & (_indexCapacity - 1);
+	}
+	
+	_index[slot]		= definition;
+	_count++;
+}
+
+
+- (const FLPIDDefinition*) definitionForMode:(NSUInteger)mode pid:(NSUInteger)pid {
+	
+	if(mode > 0xFF || pid > 0xFFFF) {
+		return NULL;
+	}
+	
+	uint32_t key = PID_CATALOG_KEY(mode, pid);
+	
+	@synchronized(self) {
+		if(_count == 0) {
+			return NULL;
+		}
+		
+		for(NSUInteger slot = indexSlotForKey(key, _indexCapacity); _index[slot]; slot = (slot + 1) & (_indexCapacity - 1)) {
+			if(PID_CATALOG_KEY(_index[slot]->mode, _index[slot]->pid) == key) {
+				return _index[slot];
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+@end
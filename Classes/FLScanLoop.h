@@ -0,0 +1,68 @@
+/*
+ *  FLScanLoop.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+
+// Loops in the pool unless set otherwise.  One thread can keep up with
+// hundreds of adapters, as each only wakes it for the bytes it sends.
+#define SCAN_LOOP_DEFAULT_POOL_SIZE		1
+
+
+@class FLScanTool;
+
+/*
+ A thread whose run loop drives any number of scan tools.  A scan tool's
+ streams, timers and command deadlines are scheduled on the loop it is
+ given as its scan starts, and its driver runs in their callbacks, so a
+ scan costs its buffers and run loop sources rather than a thread and its
+ stack.
+
+ Loops come from a pool shared by the process.  A new loop is started when
+ every loop has a scan on it, up to poolSize; after that scans go to the
+ least loaded.  Loops run for the life of the process.
+
+ Nothing run on a loop may block, as it would hold up every other scan on
+ the same loop.
+ */
+@interface FLScanLoop : NSObject {
+	NSThread*				_thread;
+	NSCondition*			_startCondition;
+	BOOL					_started;
+	NSUInteger				_scanToolCount;
+}
+
+@property (nonatomic, readonly) NSThread* thread;
+
+// Scans running on the loop
+@property (readonly) NSUInteger scanToolCount;
+
++ (NSUInteger) poolSize;
++ (void) setPoolSize:(NSUInteger)poolSize;
+
+// The loop for the next scan to start.  Its thread is running by the time
+// it is returned.
++ (FLScanLoop*) leastLoadedLoop;
+
+// Counted against the loop from the start of the scan to its end
+- (void) addScanTool:(FLScanTool*)scanTool;
+- (void) removeScanTool:(FLScanTool*)scanTool;
+
+@end
@@ -0,0 +1,189 @@
+/*
+ *  FLScanLoop.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanLoop.h"
+#import "FLScanTool.h"
+#import "FLLogging.h"
+
+
+static NSMutableArray* g_scanLoops	= nil;
+static NSUInteger g_poolSize		= SCAN_LOOP_DEFAULT_POOL_SIZE;
+
+
+#pragma mark -
+@interface FLScanLoop (Private)
+- (void) runLoop;
+- (void) keepAliveTimerDidFire:(NSTimer*)timer;
+@end
+
+
+@implementation FLScanLoop
+
+@synthesize thread			= _thread;
+
+
++ (NSUInteger) poolSize {
+	@synchronized([FLScanLoop class]) {
+		return g_poolSize;
+	}
+}
+
+
++ (void) setPoolSize:(NSUInteger)poolSize {
+	@synchronized([FLScanLoop class]) {
+		// Loops already started keep running, and keep their scans
+		g_poolSize		= MAX(poolSize, 1);
+	}
+}
+
+
++ (FLScanLoop*) leastLoadedLoop {
+	
+	@synchronized([FLScanLoop class]) {
+		FLScanLoop* leastLoaded	= nil;
+		
+		for(FLScanLoop* loop in g_scanLoops) {
+			if(!leastLoaded || loop.scanToolCount < leastLoaded.scanToolCount) {
+				leastLoaded		= loop;
+			}
+		}
+		
+		if(!leastLoaded || (leastLoaded.scanToolCount > 0 && [g_scanLoops count] < g_poolSize)) {
+			if(!g_scanLoops) {
+				g_scanLoops		= [[NSMutableArray alloc] initWithCapacity:g_poolSize];
+			}
+			
+			leastLoaded			= [[[FLScanLoop alloc] init] autorelease];
+			[g_scanLoops addObject:leastLoaded];
+			
+			FLDEBUG(@"Started scan loop %d of %d", [g_scanLoops count], g_poolSize)
+		}
+		
+		return leastLoaded;
+	}
+}
+
+
+- init {
+	
+	if(self = [super init]) {
+		_startCondition		= [[NSCondition alloc] init];
+		_thread				= [[NSThread alloc] initWithTarget:self selector:@selector(runLoop) object:nil];
+		[_thread setName:@"FLScanLoop"];
+		[_thread start];
+		
+		// Selectors performed on the thread before its run loop is running
+		// would never be run
+		[_startCondition lock];
+		
+		while(!_started) {
+			[_startCondition wait];
+		}
+		
+		[_startCondition unlock];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	// Only reached if the pool is torn down; the thread holds the loop
+	// while it runs
+	[_thread cancel];
+	[_thread release];
+	[_startCondition release];
+	[super dealloc];
+}
+
+
+- (NSUInteger) scanToolCount {
+	@synchronized(self) {
+		return _scanToolCount;
+	}
+}
+
+
+- (void) addScanTool:(FLScanTool*)scanTool {
+	@synchronized(self) {
+		_scanToolCount++;
+	}
+}
+
+
+- (void) removeScanTool:(FLScanTool*)scanTool {
+	@synchronized(self) {
+		if(_scanToolCount > 0) {
+			_scanToolCount--;
+		}
+	}
+}
+
+
+- (void) runLoop {
+	NSAutoreleasePool* pool		= [[NSAutoreleasePool alloc] init];
+	NSRunLoop* currentRunLoop	= [NSRunLoop currentRunLoop];
+	NSDate* distantFutureDate	= [NSDate distantFuture];
+	
+	// Keeps the run loop waiting while no scan has anything scheduled on it
+	NSTimer* keepAliveTimer		= [NSTimer timerWithTimeInterval:COMMAND_MAX_TIMEOUT
+														  target:self
+														selector:@selector(keepAliveTimerDidFire:)
+														userInfo:nil
+														 repeats:YES];
+	
+	@try {
+		[currentRunLoop addTimer:keepAliveTimer forMode:NSDefaultRunLoopMode];
+		
+		[_startCondition lock];
+		_started				= YES;
+		[_startCondition signal];
+		[_startCondition unlock];
+		
+		while(![[NSThread currentThread] isCancelled]) {
+			NSAutoreleasePool* loopPool	= [[NSAutoreleasePool alloc] init];
+			
+			// An exception thrown by one scan's callback must not take the
+			// others down with it
+			@try {
+				[currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:distantFutureDate];
+			}
+			@catch (NSException * e) {
+				FLEXCEPTION(e)
+			}
+			
+			[loopPool release];
+		}
+	}
+	@catch (NSException * e) {
+		FLEXCEPTION(e)
+	}
+	@finally {
+		[keepAliveTimer invalidate];
+		[pool release];
+	}
+}
+
+
+- (void) keepAliveTimerDidFire:(NSTimer*)timer {
+	// Nothing to do
+}
+
+@end
@@ -21,6 +21,7 @@
 #import <Foundation/Foundation.h>
 #import "FLScanToolCommand.h"
 #import "FLScanToolResponse.h"
+#import "FLScanToolTransport.h"
 
 typedef enum  {
 	STATE_INIT		=0,
@@ -39,7 +40,7 @@ typedef enum {
 	kScanToolDeviceTypeOBDKey,
 	kScanToolDeviceTypeGoLink,
 	kScanToolDeviceTypeSimulated,
-
+	
 	kNumScanToolDeviceTypes
 } FLScanToolDeviceType;
 
@@ -52,7 +53,11 @@ typedef enum {
 	kScanToolModeRequestOnboardMonitoringTestResultsForSMS,
 	kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodesDetected,
 	kScanToolModeRequestControlOfOnboardSystemTestOrComponent,
-	kScanToolModeRequestVehicleInfo
+	kScanToolModeRequestVehicleInfo,
+	
+	// Manufacturer enhanced data, read by 16-bit identifier (ISO 14229
+	// ReadDataByIdentifier).  Not an OBD-II mode, so outside MODE_IN_RANGE.
+	kScanToolModeRequestDataByIdentifier = 0x22
 } FLScanToolMode;
 
 typedef enum {
@@ -75,6 +80,63 @@ typedef enum {
 #define PENDING_DTC_TIMEOUT	10.0f
 
 
+// Command deadline bounds, in seconds.  Within these, each deadline comes
+// from a running estimate of the response latency for the command's class
+// on the current protocol, computed as for the TCP retransmission timer
+// (RFC 6298).
+#define COMMAND_INITIAL_TIMEOUT		2.0f
+#define COMMAND_MIN_TIMEOUT			0.25f
+#define COMMAND_MAX_TIMEOUT			20.0f
+
+// Number of times a command is resent after its deadline expires before it
+// is skipped
+#define COMMAND_MAX_RETRIES			1
+
+
+typedef enum {
+	kScanToolCommandClassInit			= 0,
+	kScanToolCommandClassSensor,
+	kScanToolCommandClassDiagnostic,
+	kScanToolCommandClassAdapter,
+	
+	kNumScanToolCommandClasses
+} FLScanToolCommandClass;
+
+
+typedef struct latency_estimate_t {
+	NSTimeInterval		srtt;		// Smoothed response time, 0 until sampled
+	NSTimeInterval		rttvar;		// Response time variation
+	NSTimeInterval		rto;		// Current deadline
+} FLLatencyEstimate;
+
+// One estimate per protocol bit in FLScanToolProtocol, plus one for
+// kScanToolProtocolNone (i.e. before the protocol is known)
+#define NUM_LATENCY_PROTOCOLS		11
+
+
+// Default periods, in seconds, of the auxiliary polls made alongside the
+// sensor scan targets.  A period of 0 disables the poll.
+#define VOLTAGE_POLL_PERIOD			10.0f
+#define DTC_COUNT_POLL_PERIOD		0.0f
+
+// ISO 15765-4 allows up to six PIDs in a single Mode $01 request
+#define MAX_PIDS_PER_REQUEST		6
+
+// Poll entry for the battery voltage, which is not a Mode $01 PID
+#define kScanToolPollBatteryVoltage	0x100
+
+
+// A single entry in the polling schedule.  Entries are polled earliest
+// deadline first, and a polled entry's deadline moves forward by its period.
+// Unrated entries (period 0) are always due, but are only polled when no
+// rated entry is.
+typedef struct poll_entry_t {
+	NSUInteger			pid;		// Mode $01 PID or kScanToolPollBatteryVoltage
+	NSTimeInterval		period;		// Seconds between polls, 0 for as often as possible
+	NSTimeInterval		deadline;	// Absolute time (CFAbsoluteTime) the next poll is due
+} FLPollEntry;
+
+
 #define STATE_INIT()		(_state == STATE_INIT)
 #define STATE_IDLE()		(_state == STATE_IDLE)
 #define STATE_WAITING()		(_state == STATE_WAITING)
@@ -92,23 +154,120 @@ typedef enum {
 							 pid != 0xC0 && pid != 0xE0)
 
 
+// Modes $03, $04 and $07 take no PID
+#define MODE_HAS_PID(mode)	(mode != kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes && \
+							 mode != kScanToolModeClearResetEmissionRelatedDiagnosticInfo && \
+							 mode != kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodesDetected)
+
+// Modes whose PIDs are 16-bit identifiers
+#define MODE_HAS_EXTENDED_PID(mode)	(mode == kScanToolModeRequestDataByIdentifier)
+
+
+// Highest Mode $01 PID group, PIDs $E1-$FF
+#define MAX_PID_GROUP		0xE0
+
+// Number of ECUs whose supported PIDs are tracked individually.  ECUs are
+// identified by the order of their replies to the PID search.
+#define MAX_PID_SEARCH_ECUS	8
+
+
+// Set of supported Mode $01 PIDs $01-$FF, one bit per PID.  Word n holds
+// the 4 byte reply to the PID search for group n * 0x20 as is, so the most
+// significant bit of word n is PID (n * 0x20) + 1.
+typedef struct pid_support_set_t {
+	uint32_t			words[8];
+} FLPIDSupportSet;
+
+#define PID_SUPPORT_WORD(pid)		(((pid) - 1) >> 5)
+#define PID_SUPPORT_BIT(pid)		(0x80000000U >> (((pid) - 1) & 0x1F))
+
+
+/*!
+ @method FLPIDSupportSetContains
+ */
+static inline BOOL FLPIDSupportSetContains(const FLPIDSupportSet* set, NSUInteger pid) {
+	return (pid > 0x00 && pid <= 0xFF && 
+			(set->words[PID_SUPPORT_WORD(pid)] & PID_SUPPORT_BIT(pid)) != 0);
+}
+
+/*!
+ @method FLPIDSupportSetNext
+ Returns the lowest PID in the set greater than pid, or 0 if there is none.
+ Start from 0 to iterate over the whole set.
+ */
+static inline NSUInteger FLPIDSupportSetNext(const FLPIDSupportSet* set, NSUInteger pid) {
+	
+	// Bit index of pid + 1
+	NSUInteger index	= pid;
+	
+	while(index < 0xFF) {
+		uint32_t word	= set->words[index >> 5] & (0xFFFFFFFFU >> (index & 0x1F));
+		
+		if(word != 0) {
+			index		= (index & ~0x1F) + __builtin_clz(word);
+			return (index < 0xFF) ? (index + 1) : 0;
+		}
+		
+		index			= (index & ~0x1F) + 0x20;
+	}
+	
+	return 0;
+}
+
+
+#define IS_CAN_PROTOCOL(protocol)	(protocol == kScanToolProtocolCAN11bit250KB || \
+									 protocol == kScanToolProtocolCAN11bit500KB || \
+									 protocol == kScanToolProtocolCAN29bit250KB || \
+									 protocol == kScanToolProtocolCAN29bit500KB)
+
+
 // The time, in seconds, after which a location is considered stale
 #define LOCATION_DECAY_PERIOD				5.0f
 
 
 @protocol FLScanToolDelegate;
+@class FLVehicleProfile;
+@class FLTripJournal;
+@class FLScanToolCapture;
+@class FLScanToolReplay;
+@class FLScanLoop;
 
-@interface FLScanTool : NSObject <CLLocationManagerDelegate> {
-
-	NSMutableArray*				_supportedSensorList;
+@interface FLScanTool : NSObject <CLLocationManagerDelegate, FLScanToolTransportDelegate> {
+	
+	FLPIDSupportSet				_supportedPIDs;
+	FLPIDSupportSet				_ecuSupportedPIDs[MAX_PID_SEARCH_ECUS];
+	NSUInteger					_supportedECUCount;
+	BOOL						_useVehicleProfileCache;
 	
 	NSArray*					_sensorScanTargets;
-	NSInteger					_currentSensorIndex;
+	
+	FLPollEntry*				_pollEntries;
+	NSUInteger					_pollEntryCount;
+	NSTimeInterval				_pollPeriods[256];
+	NSTimeInterval				_batteryVoltagePollPeriod;
+	NSTimeInterval				_dtcCountPollPeriod;
+	NSTimer*					_pollTimer;
 	
 	id<FLScanToolDelegate>		_delegate;
-	NSOperation*				_streamOperation;
-	NSOperationQueue*			_scanOperationQueue;
-
+	NSThread*					_delegateThread;
+	NSUInteger					_delegateBatchSize;
+	NSTimeInterval				_delegateFlushInterval;
+	BOOL						_coalesceRecords;
+	NSMutableData*				_pendingRecords;
+	NSUInteger					_pendingRecordsReceived;
+	NSTimer*					_flushTimer;
+	volatile int32_t			_deliveriesInFlight;
+	FLTripJournal*				_journal;
+	FLScanToolCapture*			_capture;
+	FLScanToolReplay*			_replay;
+	FLScanToolTransport*		_transport;
+	FLScanLoop*					_scanLoop;
+	BOOL						_scanStarted;
+	volatile BOOL				_scanCancelled;
+	BOOL						_scanPaused;
+	BOOL						_scanBeginPending;	// Held by pauseScan
+	BOOL						_scanBegun;			// On the scan loop's thread
+	
 	NSMutableArray*				_priorityCommandQueue;
 	NSMutableArray*				_commandQueue;
 	
@@ -123,6 +282,13 @@ typedef enum {
 	NSTimer*					_pendingCodesTimer;
 	NSTimer*					_deadmanTimer;
 	
+	FLScanToolCommand*			_pendingCommand;
+	FLScanToolCommandClass		_pendingCommandClass;
+	FLScanToolProtocol			_pendingCommandProtocol;
+	NSUInteger					_pendingCommandRetries;
+	NSDate*						_pendingCommandSendDate;
+	FLLatencyEstimate			_latencyEstimates[kNumScanToolCommandClasses][NUM_LATENCY_PROTOCOLS];
+	
 	NSUInteger					_currentPIDGroup;
 	
 	NSString*					_host;
@@ -130,8 +296,47 @@ typedef enum {
 }
 
 @property(readonly) NSArray* supportedSensors;
+@property(readonly) FLPIDSupportSet supportedPIDs;
+@property(readonly) NSUInteger supportedECUCount;
 @property(nonatomic, retain) NSArray* sensorScanTargets;
 @property(assign) id<FLScanToolDelegate> delegate;
+
+// Thread the delegate is called on.  It must be running its run loop.
+// Defaults to the main thread.  Set before the scan is started.
+@property(retain) NSThread* delegateThread;
+
+// Batching of sensor records (see scanTool:didReceiveRecords:count:).
+// Records are held on the stream thread until delegateBatchSize of them
+// have been received, or delegateFlushInterval seconds have passed since
+// the first one, whichever comes first.  With both 0 (the default), each
+// read is delivered as it is parsed.
+@property(nonatomic, assign) NSUInteger delegateBatchSize;
+@property(nonatomic, assign) NSTimeInterval delegateFlushInterval;
+
+// When set, a pending batch keeps only the latest record per mode, PID and
+// ECU, and no new batch is sent while the delegate is still working through
+// the last one, so a slow delegate sees fewer, fresher values.
+@property(nonatomic, assign) BOOL coalesceRecords;
+
+// Journal every sensor record is appended to, on the stream thread, as it
+// is parsed.  Flushed when the scan stops.  Set before the scan is started.
+@property(retain) FLTripJournal* journal;
+
+// Capture every byte read from and written to the adapter is recorded in,
+// on the stream thread.  Flushed when the scan stops.  Set before the scan
+// is started.
+@property(retain) FLScanToolCapture* capture;
+
+// When set, the scan tool talks to the replay of a capture in place of an
+// adapter.  Set before the scan is started.
+@property(nonatomic, retain) FLScanToolReplay* replay;
+
+// When set, the scan tool reaches its adapter over the transport in place
+// of its driver's own (an EA session, or a socket to host and port), e.g.
+// a pipe or an in-memory pair to a stand-in.  A replay takes precedence.
+// Set before the scan is started.
+@property(nonatomic, retain) FLScanToolTransport* transport;
+
 @property(nonatomic, readonly) BOOL scanning;
 @property(nonatomic, assign) BOOL useLocation;
 @property(nonatomic, retain, readonly) CLLocation* currentLocation;
@@ -144,8 +349,23 @@ typedef enum {
 @property (nonatomic, copy) NSString* host;		//For WiFi ScanTool
 @property (nonatomic, assign) NSInteger port;	//For WiFi ScanTool
 
+// Periods, in seconds, of the battery voltage (ELM327 only) and DTC count
+// (Mode $01 PID $01) polls.  These run on their own schedule, independent
+// of how long a pass through the scan targets takes.  0 disables the poll.
+@property (nonatomic, assign) NSTimeInterval batteryVoltagePollPeriod;
+@property (nonatomic, assign) NSTimeInterval dtcCountPollPeriod;
+
+// When enabled, the protocol and supported PIDs found during init are cached
+// per adapter, and drivers which support it skip protocol detection and the
+// PID search on the next connect to the same vehicle.  Defaults to YES.
+@property (nonatomic, assign) BOOL useVehicleProfileCache;
+
 
 + (FLScanTool*) scanToolForDeviceType:(FLScanToolDeviceType) deviceType;
+
+// A scan tool of the device type the replay's capture was made with, set up
+// to talk to the replay
++ (FLScanTool*) scanToolForReplay:(FLScanToolReplay*)replay;
 + (NSString*) stringForProtocol:(FLScanToolProtocol)protocol;
 
 //
@@ -156,6 +376,11 @@ typedef enum {
 //
 - (FLScanToolCommand*) commandForPing;
 - (FLScanToolCommand*) commandForGenericOBD:(FLScanToolMode)mode pid:(unsigned char)pid data:(NSData*)data;
+- (FLScanToolCommand*) commandForGenericOBD:(FLScanToolMode)mode pids:(NSArray*)pids;
+
+// A Mode $22 read of a manufacturer PID, such as one defined in the PID
+// catalog.  nil for scan tools which cannot send one.
+- (FLScanToolCommand*) commandForEnhancedPID:(NSUInteger)pid;
 - (FLScanToolCommand*) commandForReadSerialNumber;
 - (FLScanToolCommand*) commandForReadVersionNumber;
 - (FLScanToolCommand*) commandForReadProtocol;
@@ -167,6 +392,16 @@ typedef enum {
 - (FLScanToolCommand*) commandForGetBatteryVoltage;
 
 
+// The number of Mode $01 PIDs the scan tool can pack into a single request
+// for the current protocol.  Defaults to 1 (no request batching).
+- (NSUInteger) maxPIDsPerRequest;
+
+// Target poll rate, in Hz, for a scan target PID.  PIDs without a rate are
+// polled as often as the bus allows, sharing whatever time the rated PIDs
+// leave free.
+- (void) setPollRate:(double)rate forPID:(NSUInteger)pid;
+- (double) pollRateForPID:(NSUInteger)pid;
+
 - (void) enqueueCommand:(FLScanToolCommand*)command;
 - (FLScanToolCommand*) dequeueCommand;
 - (void) clearCommandQueue;
@@ -174,21 +409,60 @@ typedef enum {
 - (void) sendCommand:(FLScanToolCommand*)command initCommand:(BOOL)initCommand;
 - (void) getResponse;
 
+// Drivers arm a deadline as each command is written, and stop it once the
+// complete response has been read.  If the deadline expires first, the
+// command is resent up to COMMAND_MAX_RETRIES times, after which it is
+// skipped and the delegate receives scanTool:didTimeoutOnCommand:.
+- (void) startDeadlineForCommand:(FLScanToolCommand*)command;
+- (void) stopDeadline;
+- (NSTimeInterval) timeoutForCommandClass:(FLScanToolCommandClass)commandClass;
+
+// Called when a deadline expires, so the driver can drop any partial
+// response before the command is resent or skipped
+- (void) discardPendingResponse;
+
+// The replay or transport drivers open in place of their own, if either is
+// set
+- (FLScanToolTransport*) activeTransport;
+
 - (void) open;
 - (void) close;
 - (void) initScanTool;
+// Scans run on a thread shared with other scan tools' scans (see
+// FLScanLoop), so drivers must not block.  A paused scan is held back from
+// its loop until it is resumed; one already running is unaffected.
 - (void) startScan;
 - (void) pauseScan;
 - (void) resumeScanFromPause;
 - (void) cancelScan;
+
+// Called on the scan loop's thread once the scan starts, and once it has
+// been cancelled.  beginScan opens the driver and starts its init sequence;
+// endScan closes it and tells the delegate.  Drivers which do not talk to
+// an adapter, e.g. the simulated one, override both.
+- (void) beginScan;
+- (void) endScan;
 - (void) dispatchDelegate:(SEL)selector withObject:(id)obj;
+
+// Delivers parsed records to the delegate on the delegate thread, either as
+// records or, for delegates which only take responses, as FLScanToolResponse
+// objects built on that thread.  Unless records are being batched, a count
+// of 0 delivers a nil response.  Called on the stream thread.
+- (void) dispatchRecords:(const FLScanToolRecord*)records count:(NSUInteger)count;
+- (void) flushPendingRecords;
 - (void) updateSafetyCheckState;
-- (BOOL) buildSupportedSensorList:(NSData*)data forPidGroup:(NSUInteger)pidGroup;
+- (BOOL) buildSupportedSensorList:(NSData*)data forPidGroup:(NSUInteger)pidGroup ecuIndex:(NSUInteger)ecuIndex;
 - (BOOL) isService01PIDSupported:(NSUInteger)pid;
+- (BOOL) isService01PIDSupported:(NSUInteger)pid ecuIndex:(NSUInteger)ecuIndex;
+- (void) addSupportedPID:(NSUInteger)pid;
+- (void) resetSupportedPIDs;
+- (FLVehicleProfile*) vehicleProfileWithIdentifier:(NSString*)identifier;
+- (void) applyVehicleProfile:(FLVehicleProfile*)profile;
 - (void) getTroubleCodes;
 - (void) getPendingTroubleCodes;
 - (void) clearTroubleCodes;
 - (void) getBatteryVoltage;
+- (void) getEnhancedPID:(NSUInteger)pid;
 - (void) stream:(NSStream*)stream handleEvent:(NSStreamEvent)eventCode;
 - (void) writeCachedData;
 
@@ -208,6 +482,10 @@ typedef enum {
 - (void)scanToolDidFailToInitialize:(FLScanTool*)scanTool;
 - (void)scanTool:(FLScanTool*)scanTool didSendCommand:(FLScanToolCommand*)command;
 - (void)scanTool:(FLScanTool*)scanTool didReceiveResponse:(NSArray*)responses;
+
+// Sent instead of scanTool:didReceiveResponse: for sensor responses, when
+// implemented.  The records are only valid for the duration of the call.
+- (void)scanTool:(FLScanTool*)scanTool didReceiveRecords:(const FLScanToolRecord*)records count:(NSUInteger)count;
 - (void)scanTool:(FLScanTool*)scanTool didReceiveVoltage:(NSString*)voltage;
 - (void)scanTool:(FLScanTool*)scanTool didTimeoutOnCommand:(FLScanToolCommand*)command;
 - (void)scanTool:(FLScanTool*)scanTool didReceiveError:(NSError*)error;
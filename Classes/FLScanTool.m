@@ -19,30 +19,80 @@
  */
 
 #import <CoreFoundation/CoreFoundation.h>
+#import <libkern/OSAtomic.h>
 
 #import "FLScanTool.h"
 #import "FLLogging.h"
+#import "FLScanToolResponseParser.h"
+#import "FLVehicleProfile.h"
+#import "FLTripJournal.h"
+#import "FLScanToolCapture.h"
+#import "FLScanToolReplay.h"
+#import "FLScanLoop.h"
 #import "ELM327.h"
 #import "GoLink.h"
 #import "FLSimScanTool.h"
 
+
+// Whether entry is polled ahead of other.  Due entries come first, then
+// rated entries ahead of unrated ones, so unrated PIDs only get the time
+// the rated PIDs leave free, then the earliest deadline.
+static inline BOOL pollEntryPrecedes(const FLPollEntry* entry, const FLPollEntry* other, NSTimeInterval now) {
+	
+	BOOL entryDue		= (entry->deadline <= now);
+	BOOL otherDue		= (other->deadline <= now);
+	
+	if(entryDue != otherDue) {
+		return entryDue;
+	}
+	
+	if(entryDue && (entry->period > 0) != (other->period > 0)) {
+		return (entry->period > 0);
+	}
+	
+	return (entry->deadline < other->deadline);
+}
+
+
 @interface FLScanTool (Private)
-- (unsigned char) nextSensor;
 - (FLScanToolCommand*) commandForNextSensor;
+- (void) rebuildPollEntries;
+- (void) pollTimerDidFire:(NSTimer*)timer;
+- (FLLatencyEstimate*) latencyEstimateForCommandClass:(FLScanToolCommandClass)commandClass protocol:(FLScanToolProtocol)protocol;
+- (void) resetLatencyEstimates;
+- (void) clearPendingCommand;
+- (void) deadlineDidExpire:(NSTimer*)timer;
+- (void) deliverRecords:(NSData*)recordData;
+- (void) deliverRecords:(const FLScanToolRecord*)records count:(NSUInteger)count;
+- (void) flushTimerDidFire:(NSTimer*)timer;
+- (void) sendPendingRecords;
+- (void) restartPolling;
 @end
 
 
 #pragma mark -
 @implementation FLScanTool
 
-@synthesize supportedSensors	= _supportedSensorList, 
+@synthesize supportedPIDs		= _supportedPIDs,
+			supportedECUCount	= _supportedECUCount,
 			delegate			= _delegate,
+			delegateThread		= _delegateThread,
+			delegateBatchSize	= _delegateBatchSize,
+			delegateFlushInterval	= _delegateFlushInterval,
+			coalesceRecords		= _coalesceRecords,
+			journal				= _journal,
+			capture				= _capture,
+			replay				= _replay,
+			transport			= _transport,
 			scanToolState		= _state,
 			scanToolProtocol	= _protocol,
 			scanToolDeviceType	= _deviceType,
 			host				= _host,
 			port				= _port,
-			useLocation			= _useLocation;
+			useLocation			= _useLocation,
+			batteryVoltagePollPeriod	= _batteryVoltagePollPeriod,
+			dtcCountPollPeriod			= _dtcCountPollPeriod,
+			useVehicleProfileCache		= _useVehicleProfileCache;
 
 
 + (FLScanTool*) scanToolForDeviceType:(FLScanToolDeviceType) deviceType {
@@ -67,6 +117,15 @@
 	return [scanTool autorelease];
 }
 
++ (FLScanTool*) scanToolForReplay:(FLScanToolReplay*)replay {
+	
+	FLScanTool* scanTool	= [FLScanTool scanToolForDeviceType:replay.deviceType];
+	
+	scanTool.replay			= replay;
+	
+	return scanTool;
+}
+
 + (NSString*) stringForProtocol:(FLScanToolProtocol)protocol {
 	NSString* protocolString	= nil;
 	
@@ -122,17 +181,37 @@
 }
 
 
+- (id) init {
+	if (self = [super init]) {
+		_batteryVoltagePollPeriod	= VOLTAGE_POLL_PERIOD;
+		_dtcCountPollPeriod			= DTC_COUNT_POLL_PERIOD;
+		_useVehicleProfileCache		= YES;
+	}
+	
+	return self;
+}
+
+
 - (void) dealloc {
 	
 	[self close];
 	
+	free(_pollEntries);
+	
 	[_priorityCommandQueue release];
 	[_commandQueue release];
-	[_supportedSensorList release];
 	[_sensorScanTargets release];	
 	[_locationManager release];
-	[_scanOperationQueue release];
-	[_streamOperation release];
+	[_scanLoop release];
+	[_pendingCommand release];
+	[_pendingCommandSendDate release];
+	[_delegateThread release];
+	[_pendingRecords release];
+	[_journal release];
+	[_capture release];
+	_replay.scanTool	= nil;
+	[_replay release];
+	[_transport release];
 	[super dealloc];
 }
 
@@ -150,6 +229,20 @@
 	return ([self isKindOfClass:[FLEAScanTool class]]);
 }
 
+- (void) setReplay:(FLScanToolReplay*)replay {
+	
+	if(replay != _replay) {
+		_replay.scanTool	= nil;
+		[_replay release];
+		_replay				= [replay retain];
+		_replay.scanTool	= self;
+	}
+}
+
+- (FLScanToolTransport*) activeTransport {
+	return (_replay) ? _replay : _transport;
+}
+
 - (void) open {	
 	// Abstract method
 	[self doesNotRecognizeSelector:_cmd];
@@ -166,26 +259,36 @@
 }
 
 - (void) setSensorScanTargets:(NSArray *)targets {
-	[_sensorScanTargets release];	
-	_sensorScanTargets	= [[NSArray arrayWithArray:targets] retain];
+	@synchronized(self) {
+		[_sensorScanTargets release];	
+		_sensorScanTargets	= [[NSArray arrayWithArray:targets] retain];
+		[self rebuildPollEntries];
+	}
 	
-	if (![self isKindOfClass:[GoLink class]] && targets != nil) {
+	if (![self isKindOfClass:[GoLink class]] && targets != nil && _scanLoop && self.scanning) {
 		// The GoLink (GL1) has a heartbeat, so doesn't need an extra push
-		// to start scanning once targets have changed
+		// to start scanning once targets have changed.  The push is made
+		// on the scan loop, which owns the streams and the command state.
 		
-		[self sendCommand:[self dequeueCommand] initCommand:NO];
-		[self writeCachedData];
+		[self performSelector:@selector(restartPolling) onThread:_scanLoop.thread withObject:nil waitUntilDone:NO];
 	}
 }
 
-- (BOOL) scanning {
+
+- (void) restartPolling {
 	
-	if(!_streamOperation) {
-		return NO;
-	}
-	else {
-		return !(_streamOperation.isCancelled);
+	// With a command in flight, the new targets are picked up when it
+	// completes; sending another now would put two on the wire
+	if(!_scanBegun || _scanCancelled || !STATE_IDLE() || _pendingCommand) {
+		return;
 	}
+	
+	[self sendCommand:[self dequeueCommand] initCommand:NO];
+	[self writeCachedData];
+}
+
+- (BOOL) scanning {
+	return (_scanStarted && !_scanCancelled);
 }
 
 
@@ -200,7 +303,7 @@
 				[_locationManager stopUpdatingLocation];
 				[_locationManager startUpdatingLocation];
 			}
-
+			
 			return lastKnownLocation;
 		}
 	}
@@ -208,6 +311,10 @@
 	return nil;
 }
 
+- (NSUInteger) maxPIDsPerRequest {
+	return 1;
+}
+
 - (void) enqueueCommand:(FLScanToolCommand*)command {
 	[_priorityCommandQueue addObject:command];
 }
@@ -218,6 +325,163 @@
 	[self doesNotRecognizeSelector:_cmd];
 }
 
+#pragma mark -
+#pragma mark Command Deadlines
+
+- (FLLatencyEstimate*) latencyEstimateForCommandClass:(FLScanToolCommandClass)commandClass protocol:(FLScanToolProtocol)protocol {
+	
+	// kScanToolProtocolNone maps to 0, and each protocol bit to its
+	// position + 1
+	NSUInteger protocolIndex	= 0;
+	for(; protocol != 0 && protocolIndex < (NUM_LATENCY_PROTOCOLS - 1); protocol >>= 1) {
+		protocolIndex++;
+	}
+	
+	return &_latencyEstimates[commandClass][protocolIndex];
+}
+
+
+- (void) resetLatencyEstimates {
+	
+	for(NSUInteger i = 0; i < kNumScanToolCommandClasses; i++) {
+		for(NSUInteger j = 0; j < NUM_LATENCY_PROTOCOLS; j++) {
+			_latencyEstimates[i][j].srtt	= 0;
+			_latencyEstimates[i][j].rttvar	= 0;
+			_latencyEstimates[i][j].rto		= (i == kScanToolCommandClassInit) ? INIT_TIMEOUT : COMMAND_INITIAL_TIMEOUT;
+		}
+	}
+}
+
+
+- (NSTimeInterval) timeoutForCommandClass:(FLScanToolCommandClass)commandClass {
+	
+	FLLatencyEstimate* estimate	= [self latencyEstimateForCommandClass:commandClass protocol:_protocol];
+	
+	// Init includes protocol detection, which can take several seconds on
+	// the first request, so its deadline never shrinks below INIT_TIMEOUT
+	NSTimeInterval minTimeout	= (commandClass == kScanToolCommandClassInit) ? INIT_TIMEOUT : COMMAND_MIN_TIMEOUT;
+	
+	return MIN(MAX(estimate->rto, minTimeout), COMMAND_MAX_TIMEOUT);
+}
+
+
+- (void) startDeadlineForCommand:(FLScanToolCommand*)command {
+	
+	if(!command || !_deadmanTimer) {
+		return;
+	}
+	
+	if(command != _pendingCommand) {
+		[_pendingCommand release];
+		_pendingCommand			= [command retain];
+		_pendingCommandRetries	= 0;
+	}
+	
+	if(STATE_INIT()) {
+		_pendingCommandClass	= kScanToolCommandClassInit;
+	}
+	else if(_waitingForVoltageCommand) {
+		_pendingCommandClass	= kScanToolCommandClassAdapter;
+	}
+	else if(command.mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
+		_pendingCommandClass	= kScanToolCommandClassSensor;
+	}
+	else {
+		_pendingCommandClass	= kScanToolCommandClassDiagnostic;
+	}
+	
+	_pendingCommandProtocol		= _protocol;
+	
+	[_pendingCommandSendDate release];
+	_pendingCommandSendDate		= [[NSDate alloc] init];
+	
+	[_deadmanTimer setFireDate:[NSDate dateWithTimeIntervalSinceNow:[self timeoutForCommandClass:_pendingCommandClass]]];
+}
+
+
+- (void) stopDeadline {
+	
+	if(!_pendingCommand) {
+		return;
+	}
+	
+	// Only sample commands which were sent once (Karn's algorithm), since
+	// we cannot tell which transmission a response belongs to
+	if(_pendingCommandRetries == 0 && _pendingCommandSendDate) {
+		NSTimeInterval sample		= -[_pendingCommandSendDate timeIntervalSinceNow];
+		FLLatencyEstimate* estimate	= [self latencyEstimateForCommandClass:_pendingCommandClass 
+																 protocol:_pendingCommandProtocol];
+		
+		if(estimate->srtt == 0) {
+			estimate->srtt			= sample;
+			estimate->rttvar		= sample / 2;
+		}
+		else {
+			estimate->rttvar		= (0.75 * estimate->rttvar) + (0.25 * fabs(estimate->srtt - sample));
+			estimate->srtt			= (0.875 * estimate->srtt) + (0.125 * sample);
+		}
+		
+		estimate->rto				= estimate->srtt + MAX(COMMAND_MIN_TIMEOUT, (4 * estimate->rttvar));
+	}
+	
+	[self clearPendingCommand];
+}
+
+
+- (void) clearPendingCommand {
+	[_deadmanTimer setFireDate:[NSDate distantFuture]];
+	
+	[_pendingCommand release];
+	_pendingCommand				= nil;
+	
+	[_pendingCommandSendDate release];
+	_pendingCommandSendDate		= nil;
+}
+
+
+- (void) discardPendingResponse {
+	// Drivers with a read buffer override this to drop a partial response
+}
+
+
+- (void) deadlineDidExpire:(NSTimer*)timer {
+	
+	if(!_pendingCommand || _scanCancelled) {
+		return;
+	}
+	
+	FLScanToolCommand* cmd		= [[_pendingCommand retain] autorelease];
+	FLLatencyEstimate* estimate	= [self latencyEstimateForCommandClass:_pendingCommandClass 
+															 protocol:_pendingCommandProtocol];
+	
+	// Back off, as for an expired TCP retransmission timer
+	estimate->rto				= MIN((estimate->rto * 2), COMMAND_MAX_TIMEOUT);
+	
+	[self discardPendingResponse];
+	
+	if(_pendingCommandRetries < COMMAND_MAX_RETRIES) {
+		_pendingCommandRetries++;
+		FLERROR(@"Command timed out, resending (retry %d)", _pendingCommandRetries)
+		[self sendCommand:cmd initCommand:STATE_INIT()];
+	}
+	else {
+		FLERROR(@"Command timed out, skipping", nil)
+		[self clearPendingCommand];
+		[self dispatchDelegate:@selector(scanTool:didTimeoutOnCommand:) withObject:cmd];
+		
+		if(STATE_INIT()) {
+			// An init step cannot be skipped, so start over
+			[self initScanTool];
+		}
+		else {
+			_state						= STATE_IDLE;
+			_waitingForVoltageCommand	= NO;
+			[self sendCommand:[self dequeueCommand] initCommand:NO];
+		}
+	}
+}
+
+
 - (void) clearCommandQueue {
 	[_priorityCommandQueue removeAllObjects];
 }
@@ -248,115 +512,306 @@
 #pragma mark -
 #pragma mark Sensor Support Methods
 
-- (BOOL) buildSupportedSensorList:(NSData*)data forPidGroup:(NSUInteger)pidGroup {
+- (BOOL) buildSupportedSensorList:(NSData*)data forPidGroup:(NSUInteger)pidGroup ecuIndex:(NSUInteger)ecuIndex {
 	
 	uint8_t* bytes		= (uint8_t*)[data bytes];
 	uint32_t bytesLen	= [data length];
 	
-	if(bytesLen != 4) {
+	if(bytesLen != 4 || (pidGroup & 0x1F) != 0 || pidGroup > MAX_PID_GROUP) {
 		return NO;
 	}
 	
-	if(!_supportedSensorList) {
-		_supportedSensorList = [[NSMutableArray alloc] initWithCapacity:16];
-	}
-	
-/*	if(pidGroup == 0x00) {
-		// If we are re-issuing the PID search command, reset any
-		// previously received PIDs		
-		[_supportedSensorList removeAllObjects];
-		[_sensorScanTargets release];
-		_sensorScanTargets = nil;
-		FLDEBUG(@"Resetting sensor list: %d", [_supportedSensorList count])
-	}
-*/	
+	// The last bit of each group is the next search PID, which is not
+	// itself a sensor
+	NSUInteger word		= pidGroup >> 5;
+	uint32_t pids		= ((uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | 
+						   (uint32_t)bytes[2] << 8 | (uint32_t)bytes[3]) & ~0x01U;
 	
-	int pid				= pidGroup + 1;
-	BOOL supported		= NO;
+	_supportedPIDs.words[word]	|= pids;
 	
-	for (int i=0; i < 4; i++)
-	{
-		for (int leftShift=7; leftShift >= 0; leftShift--, pid++)
-		{
-			supported   = (((1 << leftShift) & bytes[i]) != 0);
-			
-			if(supported) {
-				NSNumber* pidNum = [NSNumber numberWithInt:pid];
-				if(NOT_SEARCH_PID(pid) && pid <= 0x4E && ![_supportedSensorList containsObject:pidNum]) {
-					[_supportedSensorList addObject:pidNum];
-				}			
-			}
-		}
+	if(ecuIndex < MAX_PID_SEARCH_ECUS) {
+		_ecuSupportedPIDs[ecuIndex].words[word]	|= pids;
+		_supportedECUCount	= MAX(_supportedECUCount, ecuIndex + 1);
 	}
 	
-	FLDEBUG(@"Supported Sensors: %@", [_supportedSensorList description])
+	FLDEBUG(@"Supported PIDs $%02X-$%02X (ECU %d): %08X", pidGroup + 1, pidGroup + 0x20, ecuIndex, pids)
 	FLDEBUG(@"More PIDs: %d", MORE_PIDS_SUPPORTED(bytes))
 	
 	return MORE_PIDS_SUPPORTED(bytes);
 }
 
+
 - (BOOL) isService01PIDSupported:(NSUInteger)pid {
+	return FLPIDSupportSetContains(&_supportedPIDs, pid);
+}
+
+
+- (BOOL) isService01PIDSupported:(NSUInteger)pid ecuIndex:(NSUInteger)ecuIndex {
 	
-	BOOL supported = NO;
+	if(ecuIndex >= _supportedECUCount) {
+		return NO;
+	}
 	
-	for (NSNumber* supportedPID in _supportedSensorList) {
-		if ([supportedPID unsignedIntegerValue] == pid) {
-			supported = YES;
-			break;
+	return FLPIDSupportSetContains(&_ecuSupportedPIDs[ecuIndex], pid);
+}
+
+
+- (void) addSupportedPID:(NSUInteger)pid {
+	
+	if(pid > 0x00 && pid <= 0xFF && NOT_SEARCH_PID(pid)) {
+		_supportedPIDs.words[PID_SUPPORT_WORD(pid)]	|= PID_SUPPORT_BIT(pid);
+	}
+}
+
+
+- (void) resetSupportedPIDs {
+	memset(&_supportedPIDs, 0x00, sizeof(_supportedPIDs));
+	memset(_ecuSupportedPIDs, 0x00, sizeof(_ecuSupportedPIDs));
+	_supportedECUCount	= 0;
+}
+
+
+- (FLVehicleProfile*) vehicleProfileWithIdentifier:(NSString*)identifier {
+	
+	FLVehicleProfile* profile	= [[FLVehicleProfile alloc] initWithIdentifier:identifier];
+	profile.protocol			= _protocol;
+	
+	for(NSUInteger i = 0; i < _supportedECUCount; i++) {
+		[profile setSupportedPIDs:&_ecuSupportedPIDs[i] forECU:i];
+	}
+	
+	return [profile autorelease];
+}
+
+
+- (void) applyVehicleProfile:(FLVehicleProfile*)profile {
+	
+	[self resetSupportedPIDs];
+	
+	_protocol					= profile.protocol;
+	
+	for(NSUInteger i = 0; i < profile.ecuCount && i < MAX_PID_SEARCH_ECUS; i++) {
+		const FLPIDSupportSet* pids	= [profile supportedPIDsForECU:i];
+		
+		for(NSUInteger w = 0; w < 8; w++) {
+			_ecuSupportedPIDs[i].words[w]	= pids->words[w];
+			_supportedPIDs.words[w]			|= pids->words[w];
 		}
 	}
 	
-	return supported;
+	_supportedECUCount			= MIN(profile.ecuCount, MAX_PID_SEARCH_ECUS);
 }
 
 
-- (unsigned char) nextSensor {
-	if(!_sensorScanTargets) {
-		return 0xFF;
+- (NSArray*) supportedSensors {
+	
+	NSMutableArray* sensors	= [NSMutableArray arrayWithCapacity:16];
+	
+	for(NSUInteger pid = FLPIDSupportSetNext(&_supportedPIDs, 0); pid != 0; pid = FLPIDSupportSetNext(&_supportedPIDs, pid)) {
+		[sensors addObject:[NSNumber numberWithUnsignedInteger:pid]];
 	}
-	else {
-		NSNumber* number = [_sensorScanTargets objectAtIndex:_currentSensorIndex];
-		_currentSensorIndex++;		
+	
+	return sensors;
+}
+
+
+#pragma mark -
+#pragma mark Poll Scheduling
+
+- (void) setPollRate:(double)rate forPID:(NSUInteger)pid {
+	
+	if(pid >= (sizeof(_pollPeriods) / sizeof(_pollPeriods[0]))) {
+		return;
+	}
+	
+	@synchronized(self) {
+		_pollPeriods[pid]	= (rate > 0) ? (1.0 / rate) : 0;
 		
-		if(number) {
-			return [number unsignedCharValue];
-		}
-		else {
-			return 0xFF;
+		for(NSUInteger i = 0; i < _pollEntryCount; i++) {
+			if(_pollEntries[i].pid == pid) {
+				_pollEntries[i].period	= _pollPeriods[pid];
+			}
 		}
 	}
 }
 
 
+- (double) pollRateForPID:(NSUInteger)pid {
+	
+	if(pid >= (sizeof(_pollPeriods) / sizeof(_pollPeriods[0])) || _pollPeriods[pid] == 0) {
+		return 0;
+	}
+	
+	return 1.0 / _pollPeriods[pid];
+}
+
+
+- (void) setBatteryVoltagePollPeriod:(NSTimeInterval)period {
+	@synchronized(self) {
+		_batteryVoltagePollPeriod	= period;
+		[self rebuildPollEntries];
+	}
+}
 
-- (FLScanToolCommand*) commandForNextSensor {
+
+- (void) setDtcCountPollPeriod:(NSTimeInterval)period {
+	@synchronized(self) {
+		_dtcCountPollPeriod			= period;
+		[self rebuildPollEntries];
+	}
+}
+
+
+- (void) rebuildPollEntries {
+	
+	free(_pollEntries);
+	_pollEntries			= NULL;
+	_pollEntryCount			= 0;
 	
 	if(!_sensorScanTargets) {
-		return nil;
+		return;
 	}
 	
-	if(_currentSensorIndex >= [_sensorScanTargets count]) {
-		_currentSensorIndex		= 0;		
+	NSTimeInterval now		= CFAbsoluteTimeGetCurrent();
+	BOOL pollingDTCCount	= NO;
+	
+	// Room for every target plus the two auxiliary polls
+	_pollEntries			= (FLPollEntry*)malloc(([_sensorScanTargets count] + 2) * sizeof(FLPollEntry));
+	
+	for(NSNumber* target in _sensorScanTargets) {
+		NSUInteger pid		= [target unsignedIntegerValue];
 		
-		// Put a pending DTC request in the priority queue, to be executed
-		// after the battery voltage reading
-		//[self getPendingTroubleCodes];
+		if(pid > 0xFF || !NOT_SEARCH_PID(pid)) {
+			continue;
+		}
 		
-		if ([self isKindOfClass:[ELM327 class]]) {
-			_waitingForVoltageCommand= YES;
-			return [self commandForGetBatteryVoltage];
-		}		
+		pollingDTCCount		|= (pid == 0x01);
+		
+		// New targets are due immediately
+		_pollEntries[_pollEntryCount].pid		= pid;
+		_pollEntries[_pollEntryCount].period	= _pollPeriods[pid];
+		_pollEntries[_pollEntryCount].deadline	= 0;
+		_pollEntryCount++;
 	}
 	
-	unsigned char next = [self nextSensor];
+	if(_dtcCountPollPeriod > 0 && !pollingDTCCount) {
+		_pollEntries[_pollEntryCount].pid		= 0x01;
+		_pollEntries[_pollEntryCount].period	= _dtcCountPollPeriod;
+		_pollEntries[_pollEntryCount].deadline	= now;
+		_pollEntryCount++;
+	}
 	
-	if(next <= 0x4E) {
-		return [self commandForGenericOBD:kScanToolModeRequestCurrentPowertrainDiagnosticData 
-									  pid:next 
-									 data:nil];
+	if(_batteryVoltagePollPeriod > 0 && [self isKindOfClass:[ELM327 class]]) {
+		_pollEntries[_pollEntryCount].pid		= kScanToolPollBatteryVoltage;
+		_pollEntries[_pollEntryCount].period	= _batteryVoltagePollPeriod;
+		_pollEntries[_pollEntryCount].deadline	= now;
+		_pollEntryCount++;
 	}
-	else {
-		return nil;
+}
+
+
+- (FLScanToolCommand*) commandForNextSensor {
+	
+	NSUInteger maxPIDs				= [self maxPIDsPerRequest];
+	NSUInteger picked[MAX_PIDS_PER_REQUEST];
+	NSUInteger pickedCount			= 0;
+	
+	if(maxPIDs > MAX_PIDS_PER_REQUEST) {
+		maxPIDs						= MAX_PIDS_PER_REQUEST;
+	}
+	
+	@synchronized(self) {
+		
+		if(_pollEntryCount == 0) {
+			return nil;
+		}
+		
+		NSTimeInterval now			= CFAbsoluteTimeGetCurrent();
+		FLPollEntry* earliest		= &_pollEntries[0];
+		
+		for(NSUInteger i = 1; i < _pollEntryCount; i++) {
+			if(pollEntryPrecedes(&_pollEntries[i], earliest, now)) {
+				earliest			= &_pollEntries[i];
+			}
+		}
+		
+		if(earliest->deadline > now) {
+			// Nothing is due yet, so leave the bus idle until something is
+			[_pollTimer setFireDate:[NSDate dateWithTimeIntervalSinceReferenceDate:earliest->deadline]];
+			return nil;
+		}
+		
+		if(earliest->pid == kScanToolPollBatteryVoltage) {
+			earliest->deadline		= MAX((earliest->deadline + earliest->period), now);
+			_waitingForVoltageCommand	= YES;
+			return [self commandForGetBatteryVoltage];
+		}
+		
+		// Earliest deadline first: pack as many of the due PIDs as the scan
+		// tool allows into a single request, rated PIDs ahead of unrated.  A reply
+		// can only be split up when the length of each PID is known.
+		picked[pickedCount++]		= (earliest - _pollEntries);
+		
+		if([FLScanToolResponseParser dataLengthForService01PID:earliest->pid] < 0) {
+			maxPIDs					= 1;
+		}
+		
+		while(pickedCount < maxPIDs) {
+			FLPollEntry* next		= NULL;
+			
+			for(NSUInteger i = 0; i < _pollEntryCount; i++) {
+				FLPollEntry* entry	= &_pollEntries[i];
+				BOOL alreadyPicked	= NO;
+				
+				if(entry->pid == kScanToolPollBatteryVoltage || entry->deadline > now || 
+				   [FLScanToolResponseParser dataLengthForService01PID:entry->pid] < 0) {
+					continue;
+				}
+				
+				for(NSUInteger j = 0; j < pickedCount && !alreadyPicked; j++) {
+					alreadyPicked	= (picked[j] == i);
+				}
+				
+				if(!alreadyPicked && (!next || pollEntryPrecedes(entry, next, now))) {
+					next			= entry;
+				}
+			}
+			
+			if(!next) {
+				break;
+			}
+			
+			picked[pickedCount++]	= (next - _pollEntries);
+		}
+		
+		// A PID which has fallen behind is rescheduled from now, rather
+		// than polled repeatedly to catch up
+		NSMutableArray* pids		= [NSMutableArray arrayWithCapacity:pickedCount];
+		
+		for(NSUInteger j = 0; j < pickedCount; j++) {
+			FLPollEntry* entry		= &_pollEntries[picked[j]];
+			entry->deadline			= MAX((entry->deadline + entry->period), now);
+			[pids addObject:[NSNumber numberWithUnsignedInteger:entry->pid]];
+		}
+		
+		if([pids count] > 1) {
+			return [self commandForGenericOBD:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+										 pids:pids];
+		}
+		else {
+			return [self commandForGenericOBD:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+										  pid:[[pids objectAtIndex:0] unsignedCharValue] 
+										 data:nil];
+		}
+	}
+}
+
+
+- (void) pollTimerDidFire:(NSTimer*)timer {
+	
+	// Restart polling if the bus went idle waiting for a deadline
+	if(!_scanCancelled && STATE_IDLE() && !_pendingCommand) {
+		[self sendCommand:[self dequeueCommand] initCommand:NO];
 	}
 }
 
@@ -380,11 +835,174 @@
 			
 			[invocation retainArguments];
 			
-			[invocation performSelectorOnMainThread:@selector(invoke) withObject:nil waitUntilDone:NO];
+			// Keep the delegate's view in order with any batched records
+			[self flushPendingRecords];
+			
+			[invocation performSelector:@selector(invoke) 
+							   onThread:(_delegateThread) ? _delegateThread : [NSThread mainThread] 
+							 withObject:nil 
+						  waitUntilDone:NO];
 		}	
 	}
 }
 
+- (void) dispatchRecords:(const FLScanToolRecord*)records count:(NSUInteger)count {
+	
+	[_journal appendRecords:records count:count];
+	
+	if(!_delegate) {
+		return;
+	}
+	
+	if(![_delegate respondsToSelector:@selector(scanTool:didReceiveRecords:count:)] && 
+	   ![_delegate respondsToSelector:@selector(scanTool:didReceiveResponse:)]) {
+		return;
+	}
+	
+	if(_delegateBatchSize == 0 && _delegateFlushInterval <= 0 && !_coalesceRecords) {
+		// The parser reuses its record array on the next read, so the
+		// records are copied once for the trip to the delegate thread
+		NSData* recordData	= [[NSData alloc] initWithBytes:records length:(count * sizeof(FLScanToolRecord))];
+		
+		OSAtomicIncrement32Barrier(&_deliveriesInFlight);
+		[self performSelector:@selector(deliverRecords:) 
+					 onThread:(_delegateThread) ? _delegateThread : [NSThread mainThread] 
+				   withObject:recordData 
+				waitUntilDone:NO];
+		[recordData release];
+		return;
+	}
+	
+	if(!_pendingRecords) {
+		_pendingRecords		= [[NSMutableData alloc] initWithCapacity:(MAX(_delegateBatchSize, 16) * sizeof(FLScanToolRecord))];
+	}
+	
+	BOOL wasEmpty			= ([_pendingRecords length] == 0);
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		const FLScanToolRecord* record	= &records[i];
+		BOOL replaced					= NO;
+		
+		if(_coalesceRecords) {
+			FLScanToolRecord* pending	= (FLScanToolRecord*)[_pendingRecords mutableBytes];
+			NSUInteger pendingCount		= [_pendingRecords length] / sizeof(FLScanToolRecord);
+			
+			for(NSUInteger j = 0; j < pendingCount; j++) {
+				if(pending[j].mode == record->mode && 
+				   pending[j].pid == record->pid && 
+				   pending[j].ecuAddress == record->ecuAddress) {
+					pending[j]			= *record;
+					replaced			= YES;
+					break;
+				}
+			}
+		}
+		
+		if(!replaced) {
+			[_pendingRecords appendBytes:record length:sizeof(FLScanToolRecord)];
+		}
+	}
+	
+	// Batch size counts records received rather than pending, since with
+	// coalescing the pending batch may never grow that large
+	_pendingRecordsReceived	+= count;
+	
+	if(_delegateBatchSize > 0 ? (_pendingRecordsReceived >= _delegateBatchSize) : (_delegateFlushInterval <= 0)) {
+		[self flushPendingRecords];
+	}
+	else if(wasEmpty && _delegateFlushInterval > 0 && [_pendingRecords length] > 0) {
+		[_flushTimer setFireDate:[NSDate dateWithTimeIntervalSinceNow:_delegateFlushInterval]];
+	}
+}
+
+
+- (void) flushPendingRecords {
+	
+	if([_pendingRecords length] == 0) {
+		return;
+	}
+	
+	if(_coalesceRecords && _deliveriesInFlight > 0) {
+		// The delegate is behind.  Keep coalescing into the pending batch,
+		// and try again on the next record or flush interval.
+		if(_delegateFlushInterval > 0) {
+			[_flushTimer setFireDate:[NSDate dateWithTimeIntervalSinceNow:_delegateFlushInterval]];
+		}
+		return;
+	}
+	
+	[self sendPendingRecords];
+}
+
+
+- (void) sendPendingRecords {
+	
+	if([_pendingRecords length] == 0) {
+		return;
+	}
+	
+	NSData* recordData		= [_pendingRecords copy];
+	
+	[_pendingRecords setLength:0];
+	_pendingRecordsReceived	= 0;
+	[_flushTimer setFireDate:[NSDate distantFuture]];
+	
+	OSAtomicIncrement32Barrier(&_deliveriesInFlight);
+	[self performSelector:@selector(deliverRecords:) 
+				 onThread:(_delegateThread) ? _delegateThread : [NSThread mainThread] 
+			   withObject:recordData 
+			waitUntilDone:NO];
+	[recordData release];
+}
+
+
+- (void) flushTimerDidFire:(NSTimer*)timer {
+	[self flushPendingRecords];
+}
+
+
+- (void) deliverRecords:(NSData*)recordData {
+	
+	// Counted as delivered once the delegate returns
+	[self deliverRecords:(const FLScanToolRecord*)[recordData bytes] 
+				   count:([recordData length] / sizeof(FLScanToolRecord))];
+	OSAtomicDecrement32Barrier(&_deliveriesInFlight);
+}
+
+
+- (void) deliverRecords:(const FLScanToolRecord*)records count:(NSUInteger)count {
+	
+	if([_delegate respondsToSelector:@selector(scanTool:didReceiveRecords:count:)]) {
+		if(count > 0) {
+			[_delegate scanTool:self didReceiveRecords:records count:count];
+		}
+	}
+	else if([_delegate respondsToSelector:@selector(scanTool:didReceiveResponse:)]) {
+		NSMutableArray* responses	= nil;
+		
+		if(count > 0) {
+			NSString* name			= self.scanToolName;
+			CLLocation* location	= (self.useLocation) ? self.currentLocation : nil;
+			
+			responses				= [NSMutableArray arrayWithCapacity:count];
+			
+			for(NSUInteger i = 0; i < count; i++) {
+				FLScanToolResponse* resp	= [[FLScanToolResponse alloc] initWithRecord:&records[i] scanToolName:name];
+				
+				if(location) {
+					[resp updateLocation:location];
+				}
+				
+				[responses addObject:resp];
+				[resp release];
+			}
+		}
+		
+		[_delegate scanTool:self didReceiveResponse:responses];
+	}
+}
+
+
 #pragma mark -
 #pragma mark Scanning Operation
 
@@ -397,6 +1015,11 @@
 
 - (void) startScan {
 	
+	if(self.scanning) {
+		FLERROR(@"Scan already running on %@", self)
+		return;
+	}
+	
 	[_priorityCommandQueue release];
 	[_commandQueue release];
 	
@@ -404,10 +1027,12 @@
 	_commandQueue			= [[NSMutableArray alloc] initWithCapacity:16];
 	_state					= STATE_INIT;
 	
-	[_supportedSensorList removeAllObjects];
-	if (_sensorScanTargets) {
+	[self resetLatencyEstimates];
+	[self resetSupportedPIDs];
+	@synchronized(self) {
 		[_sensorScanTargets release];
 		_sensorScanTargets = nil;
+		[self rebuildPollEntries];
 	}
 	
 	if(!_locationManager) {
@@ -421,43 +1046,62 @@
 		[_locationManager startUpdatingLocation];
 	}	
 	
+	// A scan tool stays on the loop it was first given, so the end of one
+	// scan is always run before the start of the next
+	if(!_scanLoop) {
+		_scanLoop			= [[FLScanLoop leastLoadedLoop] retain];
+	}
 	
-	[_scanOperationQueue release];
+	[_scanLoop addScanTool:self];
 	
-	_streamOperation		= [[NSInvocationOperation alloc] initWithTarget:self 
-															 selector:@selector(runStreams) 
-															   object:nil];
-
-	_scanOperationQueue		= [[NSOperationQueue alloc] init];
-	[_scanOperationQueue addOperation:_streamOperation];
-	[_scanOperationQueue setSuspended:NO];
+	_scanStarted			= YES;
+	_scanCancelled			= NO;
+	
+	if(_scanPaused) {
+		_scanBeginPending	= YES;
+	}
+	else {
+		[self performSelector:@selector(beginScan) onThread:_scanLoop.thread withObject:nil waitUntilDone:NO];
+	}
 }
 
 
 - (void) pauseScan {
 	FLTRACE_ENTRY
-	[_scanOperationQueue setSuspended:YES];
+	_scanPaused			= YES;
 }
 
 
 - (void) resumeScanFromPause {
 	FLTRACE_ENTRY
-	[_scanOperationQueue setSuspended:NO];
+	_scanPaused			= NO;
+	
+	if(_scanBeginPending) {
+		_scanBeginPending	= NO;
+		[self performSelector:@selector(beginScan) onThread:_scanLoop.thread withObject:nil waitUntilDone:NO];
+	}
 }
 
 
 - (void) cancelScan {
 	FLINFO("ATTEMPTING SCAN CANCELLATION")
-	[_scanOperationQueue cancelAllOperations];	
-	[_streamOperation cancel];
+	
+	BOOL running		= self.scanning;
+	_scanCancelled		= YES;
+	_scanBeginPending	= NO;
+	
 	if(_locationManager && _locationManager.locationServicesEnabled) {
 		[_locationManager stopUpdatingLocation];
 		_locationManager.delegate	= nil;
 	}
 	
-	[_supportedSensorList removeAllObjects];
+	[self resetSupportedPIDs];
+	
+	if(running) {
+		[self performSelector:@selector(endScan) onThread:_scanLoop.thread withObject:nil waitUntilDone:NO];
+	}
 	
-	FLDEBUG(@"_streamOperation.isCancelled = %d", _streamOperation.isCancelled)
+	FLDEBUG(@"_scanCancelled = %d", _scanCancelled)
 }
 
 
@@ -466,44 +1110,101 @@
 }
 
 
-- (void) runStreams {
-	NSAutoreleasePool * pool	= [[NSAutoreleasePool alloc] init];
-	NSRunLoop* currentRunLoop	= [NSRunLoop currentRunLoop];
-	NSDate* distantFutureDate	= [NSDate distantFuture];
+- (void) beginScan {
+	
+	if(_scanCancelled) {
+		// Cancelled before it reached the loop; endScan follows
+		return;
+	}
+	
+	_scanBegun					= YES;
 	
 	@try {
+		NSRunLoop* currentRunLoop	= [NSRunLoop currentRunLoop];
+		
+		// Command deadlines fire on the scan loop.  The timer stays
+		// scheduled for the life of the scan, and is armed by moving its
+		// fire date.
+		_deadmanTimer				= [[NSTimer alloc] initWithFireDate:[NSDate distantFuture] 
+															  interval:COMMAND_MAX_TIMEOUT 
+																target:self 
+															  selector:@selector(deadlineDidExpire:) 
+															  userInfo:nil 
+															   repeats:YES];
+		[currentRunLoop addTimer:_deadmanTimer forMode:NSDefaultRunLoopMode];
+		
+		// Likewise for restarting polling once the next poll comes due
+		_pollTimer					= [[NSTimer alloc] initWithFireDate:[NSDate distantFuture] 
+															  interval:COMMAND_MAX_TIMEOUT 
+																target:self 
+															  selector:@selector(pollTimerDidFire:) 
+															  userInfo:nil 
+															   repeats:YES];
+		[currentRunLoop addTimer:_pollTimer forMode:NSDefaultRunLoopMode];
+		
+		// And for sending a batch of records once the flush interval is up
+		_flushTimer					= [[NSTimer alloc] initWithFireDate:[NSDate distantFuture] 
+															  interval:COMMAND_MAX_TIMEOUT 
+																target:self 
+															  selector:@selector(flushTimerDidFire:) 
+															  userInfo:nil 
+															   repeats:YES];
+		[currentRunLoop addTimer:_flushTimer forMode:NSDefaultRunLoopMode];
+		
 		[self open];
 		
 		[self dispatchDelegate:@selector(scanDidStart:) withObject:nil];	
 		[self initScanTool];
+	}
+	@catch (NSException * e) {
+		FLEXCEPTION(e)
+	}
+}
+
+
+- (void) endScan {
+	
+	if(!_scanBegun) {
+		[_scanLoop removeScanTool:self];
+		return;
+	}
+	
+	_scanBegun			= NO;
+	
+	FLINFO(@"*** STREAMS CANCELLED ***")
+	
+	@try {
+		[_deadmanTimer invalidate];
+		[_deadmanTimer release];
+		_deadmanTimer	= nil;
 		
-		if ([self isEAScanTool]) {
-			while (!_streamOperation.isCancelled && [currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:distantFutureDate]) {
-				;;
-			}
-		}
-		else if([self isWifiScanTool]) {
-			while (!_streamOperation.isCancelled && [currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:distantFutureDate]) {
-				;;
-			}
-		}
+		[_pollTimer invalidate];
+		[_pollTimer release];
+		_pollTimer		= nil;
+		[self clearPendingCommand];
 		
+		// Whatever is left of the last batch goes out ahead of scanDidCancel:
+		[_flushTimer invalidate];
+		[_flushTimer release];
+		_flushTimer		= nil;
+		[self sendPendingRecords];
+		[_journal flush];
+		[_capture flush];
 		
-		FLINFO(@"*** STREAMS CANCELLED ***")
+		[self close];
 	}
 	@catch (NSException * e) {
 		FLEXCEPTION(e)
 	}
 	@finally {
-		[pool release];
-		[self close];
 		[self dispatchDelegate:@selector(scanDidCancel:) withObject:nil];
-	}	
+		[_scanLoop removeScanTool:self];
+	}
 }
 
 
 - (void) getTroubleCodes {
-
+	
 	if(!_priorityCommandQueue) {
 		_priorityCommandQueue = [NSMutableArray arrayWithCapacity:8];
 		[_priorityCommandQueue retain];
@@ -552,6 +1253,22 @@
 	[self enqueueCommand:[self commandForGetBatteryVoltage]];
 }
 
+- (void) getEnhancedPID:(NSUInteger)pid {
+	FLScanToolCommand* command = [self commandForEnhancedPID:pid];
+	
+	if(!command) {
+		FLERROR(@"%@ cannot read enhanced PID %04X", self.scanToolName, pid)
+		return;
+	}
+	
+	if(!_priorityCommandQueue) {
+		_priorityCommandQueue = [NSMutableArray arrayWithCapacity:8];
+		[_priorityCommandQueue retain];
+	}
+	
+	[self enqueueCommand:command];
+}
+
 - (void) writeCachedData {
 	// Abstract method
 	[self doesNotRecognizeSelector:_cmd];
@@ -573,6 +1290,23 @@
 	return nil;
 }
 
+- (FLScanToolCommand*) commandForGenericOBD:(FLScanToolMode)mode pids:(NSArray*)pids {
+	// Scan tools that do not support multi-PID requests fall back to the
+	// first PID in the list
+	if(!pids || [pids count] == 0) {
+		return nil;
+	}
+	
+	return [self commandForGenericOBD:mode 
+								  pid:[[pids objectAtIndex:0] unsignedCharValue] 
+								 data:nil];
+}
+
+- (FLScanToolCommand*) commandForEnhancedPID:(NSUInteger)pid {
+	// Scan tools only support Mode $22 where they override this
+	return nil;
+}
+
 - (FLScanToolCommand*) commandForReadSerialNumber {
 	// Abstract method
 	[self doesNotRecognizeSelector:_cmd];
@@ -641,6 +1375,15 @@
 }
 
 
+#pragma mark -
+#pragma mark FLScanToolTransportDelegate Methods
+
+- (void) transportDidDisconnect:(FLScanToolTransport*)transport {
+	FLDEBUG(@"Transport %@ disconnected", transport)
+	[self dispatchDelegate:@selector(scanToolDidDisconnect:) withObject:nil];
+}
+
+
 #pragma mark -
 #pragma mark CLLocationManagerDelegate Methods
 
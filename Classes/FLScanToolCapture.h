@@ -0,0 +1,104 @@
+/*
+ *  FLScanToolCapture.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanTool.h"
+
+
+//------------------------------------------------------------------------------
+// Capture Format
+//
+// A capture is a single file:
+//
+//	FLScanToolCaptureHeader
+//	chunks, each an FLScanToolCaptureChunk followed by its bytes, one per
+//	read from or write to the adapter, in the order they were made
+//
+// A chunk cut short at the end of the file (e.g. the app was killed) is
+// ignored.  All values are in host byte order.
+
+#define SCAN_TOOL_CAPTURE_MAGIC			0x43534C46		// "FLSC"
+#define SCAN_TOOL_CAPTURE_VERSION		1
+
+#define SCAN_TOOL_CAPTURE_EXTENSION		@"flsc"
+
+// Chunks are held in memory until this many bytes are pending
+#define SCAN_TOOL_CAPTURE_BUFFER_SIZE	16384
+
+// Chunks are padded so that each chunk header is 8-byte aligned
+#define SCAN_TOOL_CAPTURE_CHUNK_SIZE(length)	((sizeof(FLScanToolCaptureChunk) + (length) + 7) & ~(size_t)7)
+
+
+typedef enum {
+	kScanToolCaptureRead				= 0,	// Bytes read from the adapter
+	kScanToolCaptureWrite				= 1		// Bytes written to the adapter
+} FLScanToolCaptureDirection;
+
+
+typedef struct scan_tool_capture_header_t {
+	uint32_t		magic;
+	uint16_t		version;
+	uint16_t		headerLength;
+	uint32_t		deviceType;			// FLScanToolDeviceType of the scan tool captured
+	uint32_t		reserved;
+	double			monotonicTime;		// FLMonotonicTime() when the capture was created
+	double			referenceTime;		// Seconds since the reference date at the same moment
+} FLScanToolCaptureHeader;
+
+
+typedef struct scan_tool_capture_chunk_t {
+	double			timestamp;			// FLMonotonicTime() of the read or write
+	uint32_t		length;
+	uint8_t			direction;			// FLScanToolCaptureDirection
+	uint8_t			reserved[3];
+	// length bytes follow
+} FLScanToolCaptureChunk;
+
+
+/*
+ Records every byte a scan tool reads from and writes to its adapter, with
+ the time of each read and write, for playing back later with
+ FLScanToolReplay.  Set as the capture of a scan tool, it is written to on
+ the stream thread.  Chunks are buffered, so adding one costs a copy, and
+ the buffer is written out as it fills and when the scan stops.
+ */
+@interface FLScanToolCapture : NSObject {
+	NSString*				_path;
+	NSOutputStream*			_stream;
+	NSMutableData*			_buffer;
+	NSUInteger				_chunkCount;
+}
+
+@property (nonatomic, readonly) NSString* path;
+@property (nonatomic, readonly) NSUInteger chunkCount;
+
++ (FLScanToolCapture*) captureWithPath:(NSString*)path deviceType:(FLScanToolDeviceType)deviceType;
+
+// Creates a new capture file at path, replacing any file there
+- initWithPath:(NSString*)path deviceType:(FLScanToolDeviceType)deviceType;
+
+- (void) recordBytes:(const uint8_t*)bytes
+			  length:(NSUInteger)length
+		   direction:(FLScanToolCaptureDirection)direction;
+
+- (void) flush;
+- (void) close;
+
+@end
@@ -0,0 +1,139 @@
+/*
+ *  FLScanToolCapture.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolCapture.h"
+#import "FLLogging.h"
+
+
+#pragma mark -
+@implementation FLScanToolCapture
+
+@synthesize path		= _path,
+			chunkCount	= _chunkCount;
+
+
++ (FLScanToolCapture*) captureWithPath:(NSString*)path deviceType:(FLScanToolDeviceType)deviceType {
+	return [[[FLScanToolCapture alloc] initWithPath:path deviceType:deviceType] autorelease];
+}
+
+
+- initWithPath:(NSString*)path deviceType:(FLScanToolDeviceType)deviceType {
+	
+	if(self = [super init]) {
+		FLScanToolCaptureHeader header;
+		
+		_stream					= [[NSOutputStream alloc] initToFileAtPath:path append:NO];
+		[_stream open];
+		
+		if([_stream streamStatus] != NSStreamStatusOpen) {
+			FLNSERROR([_stream streamError])
+			[self release];
+			return nil;
+		}
+		
+		_path					= [path copy];
+		_buffer					= [[NSMutableData alloc] initWithCapacity:(SCAN_TOOL_CAPTURE_BUFFER_SIZE + 512)];
+		
+		memset(&header, 0, sizeof(header));
+		header.magic			= SCAN_TOOL_CAPTURE_MAGIC;
+		header.version			= SCAN_TOOL_CAPTURE_VERSION;
+		header.headerLength		= sizeof(header);
+		header.deviceType		= deviceType;
+		header.monotonicTime	= FLMonotonicTime();
+		header.referenceTime	= [NSDate timeIntervalSinceReferenceDate];
+		
+		[_buffer appendBytes:&header length:sizeof(header)];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self close];
+	[_buffer release];
+	[_path release];
+	[super dealloc];
+}
+
+
+- (void) recordBytes:(const uint8_t*)bytes
+			  length:(NSUInteger)length
+		   direction:(FLScanToolCaptureDirection)direction {
+	
+	static const uint8_t padding[8]	= { 0 };
+	FLScanToolCaptureChunk chunk;
+	
+	if(!_stream || length == 0) {
+		return;
+	}
+	
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.timestamp		= FLMonotonicTime();
+	chunk.length		= length;
+	chunk.direction		= direction;
+	
+	[_buffer appendBytes:&chunk length:sizeof(chunk)];
+	[_buffer appendBytes:bytes length:length];
+	[_buffer appendBytes:padding length:(SCAN_TOOL_CAPTURE_CHUNK_SIZE(length) - sizeof(chunk) - length)];
+	_chunkCount++;
+	
+	if([_buffer length] >= SCAN_TOOL_CAPTURE_BUFFER_SIZE) {
+		[self flush];
+	}
+}
+
+
+- (void) flush {
+	
+	const uint8_t* bytes	= (const uint8_t*)[_buffer bytes];
+	NSUInteger written		= 0;
+	
+	while(_stream && written < [_buffer length]) {
+		NSInteger count		= [_stream write:&bytes[written] maxLength:([_buffer length] - written)];
+		
+		if(count <= 0) {
+			// The capture is cut short here, but what was written is
+			// still readable
+			FLNSERROR([_stream streamError])
+			[_stream close];
+			[_stream release];
+			_stream			= nil;
+		}
+		else {
+			written			+= count;
+		}
+	}
+	
+	[_buffer setLength:0];
+}
+
+
+- (void) close {
+	
+	if(_stream) {
+		[self flush];
+		[_stream close];
+		[_stream release];
+		_stream		= nil;
+	}
+}
+
+@end
@@ -0,0 +1,106 @@
+/*
+ *  FLScanToolReplay.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanToolCapture.h"
+#import "FLScanToolTransport.h"
+
+
+// Speed at which each captured read is handed over as soon as the write
+// before it has been made
+#define SCAN_TOOL_REPLAY_AS_FAST_AS_POSSIBLE	0.0
+
+
+/*
+ Plays a capture back to a scan tool in place of its adapter.  The replay
+ stands in as the scan tool's transport, so its driver's state machine and
+ parser run exactly as they would against the adapter, and see its bytes
+ split across reads as they were.
+
+ Writes are taken in place of the captured ones.  Each captured read is
+ handed over once as much time has passed since the write before it as in
+ the capture, divided by speed: 1 for the original pace, 10 for ten times
+ it, or SCAN_TOOL_REPLAY_AS_FAST_AS_POSSIBLE.  A write that differs from
+ the capture (e.g. a poll came due at a different point) is counted in
+ mismatchCount, but the replay carries on.
+
+ When the last captured read has been taken the scan is cancelled, so
+ scanDidCancel: marks the end of a replay.  See +[FLScanTool
+ scanToolForReplay:].
+ */
+@interface FLScanToolReplay : FLScanToolTransport {
+	NSString*				_path;
+	NSData*					_capture;
+	size_t*					_chunkOffsets;
+	NSUInteger				_chunkCount;
+	FLScanToolDeviceType	_deviceType;
+	double					_speed;
+	FLScanTool*				_scanTool;			// Not retained
+	
+	NSTimer*				_readTimer;
+	
+	NSUInteger				_readChunk;			// Next captured read to hand over
+	NSUInteger				_readOffset;
+	NSUInteger				_writeChunk;		// Next captured write to match
+	NSUInteger				_writeOffset;
+	BOOL					_writeMismatched;
+	double					_anchorTime;		// Of the last write matched
+	double					_anchorCaptureTime;	// Of the captured write it matched
+	
+	double					_startTime;
+	double					_endTime;
+	double					_lastReadTime;
+	NSUInteger				_bytesRead;
+	NSUInteger				_bytesWritten;
+	NSUInteger				_mismatchCount;
+	NSUInteger				_turnaroundCount;
+	double					_turnaroundTotal;
+	double					_turnaroundMax;
+}
+
+@property (nonatomic, readonly) NSString* path;
+@property (nonatomic, readonly) FLScanToolDeviceType deviceType;
+@property (nonatomic, readonly) double speed;
+@property (nonatomic, readonly) NSUInteger chunkCount;
+
+// Set by the scan tool the replay is given to
+@property (nonatomic, assign) FLScanTool* scanTool;
+
+// Seconds from the streams being opened to the last captured read being
+// taken, or until now while the replay is running
+@property (nonatomic, readonly) NSTimeInterval elapsed;
+@property (nonatomic, readonly) BOOL finished;
+@property (nonatomic, readonly) NSUInteger bytesRead;
+@property (nonatomic, readonly) NSUInteger bytesWritten;
+@property (nonatomic, readonly) NSUInteger mismatchCount;
+
+// Time from the scan tool taking a read to its next write, i.e. parsing,
+// dispatching to the delegate and building the next command, plus any wait
+// for a poll to come due
+@property (nonatomic, readonly) NSUInteger turnaroundCount;
+@property (nonatomic, readonly) NSTimeInterval meanTurnaround;
+@property (nonatomic, readonly) NSTimeInterval maxTurnaround;
+
++ (FLScanToolReplay*) replayWithPath:(NSString*)path speed:(double)speed;
+
+// nil if path is not a capture
+- initWithPath:(NSString*)path speed:(double)speed;
+
+@end
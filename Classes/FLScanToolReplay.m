@@ -0,0 +1,344 @@
+/*
+ *  FLScanToolReplay.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolReplay.h"
+#import "FLLogging.h"
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLScanToolReplay (Private)
+- (const FLScanToolCaptureChunk*) chunkAtIndex:(NSUInteger)index;
+- (NSUInteger) nextChunkFrom:(NSUInteger)index direction:(FLScanToolCaptureDirection)direction;
+- (BOOL) readIsDue;
+- (void) scheduleRead;
+- (void) readTimerDidFire:(NSTimer*)timer;
+@end
+
+
+#pragma mark -
+@implementation FLScanToolReplay
+
+@synthesize path			= _path,
+			deviceType		= _deviceType,
+			speed			= _speed,
+			chunkCount		= _chunkCount,
+			scanTool		= _scanTool,
+			bytesRead		= _bytesRead,
+			bytesWritten	= _bytesWritten,
+			mismatchCount	= _mismatchCount,
+			turnaroundCount	= _turnaroundCount,
+			maxTurnaround	= _turnaroundMax;
+
+
++ (FLScanToolReplay*) replayWithPath:(NSString*)path speed:(double)speed {
+	return [[[FLScanToolReplay alloc] initWithPath:path speed:speed] autorelease];
+}
+
+
+- initWithPath:(NSString*)path speed:(double)speed {
+	
+	if(self = [super init]) {
+		_capture		= [[NSData alloc] initWithContentsOfMappedFile:path];
+		
+		const uint8_t* bytes					= (const uint8_t*)[_capture bytes];
+		size_t length							= [_capture length];
+		const FLScanToolCaptureHeader* header	= (const FLScanToolCaptureHeader*)bytes;
+		
+		if(length < sizeof(FLScanToolCaptureHeader) ||
+		   header->magic != SCAN_TOOL_CAPTURE_MAGIC ||
+		   header->version != SCAN_TOOL_CAPTURE_VERSION) {
+			FLERROR(@"Not a scan tool capture: %@", path)
+			[self release];
+			return nil;
+		}
+		
+		// Count the complete chunks, then note where each one starts
+		for(NSUInteger pass = 0; pass < 2; pass++) {
+			size_t offset		= header->headerLength;
+			NSUInteger count	= 0;
+			
+			while((offset + sizeof(FLScanToolCaptureChunk)) <= length) {
+				const FLScanToolCaptureChunk* chunk	= (const FLScanToolCaptureChunk*)&bytes[offset];
+				
+				if((offset + sizeof(FLScanToolCaptureChunk) + chunk->length) > length ||
+				   chunk->direction > kScanToolCaptureWrite) {
+					break;
+				}
+				
+				if(_chunkOffsets) {
+					_chunkOffsets[count]	= offset;
+				}
+				
+				count++;
+				offset			+= SCAN_TOOL_CAPTURE_CHUNK_SIZE(chunk->length);
+			}
+			
+			if(!_chunkOffsets) {
+				_chunkCount		= count;
+				_chunkOffsets	= (size_t*)malloc(MAX(count, 1) * sizeof(size_t));
+			}
+		}
+		
+		_path			= [path copy];
+		_deviceType		= header->deviceType;
+		_speed			= speed;
+		_readChunk		= [self nextChunkFrom:0 direction:kScanToolCaptureRead];
+		_writeChunk		= [self nextChunkFrom:0 direction:kScanToolCaptureWrite];
+		
+		[self createStreams];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[_readTimer invalidate];
+	[_readTimer release];
+	free(_chunkOffsets);
+	[_capture release];
+	[_path release];
+	[super dealloc];
+}
+
+
+- (NSTimeInterval) elapsed {
+	
+	if(_startTime == 0) {
+		return 0;
+	}
+	
+	return ((_endTime > 0) ? _endTime : FLMonotonicTime()) - _startTime;
+}
+
+
+- (BOOL) finished {
+	return (_endTime > 0);
+}
+
+
+- (NSTimeInterval) meanTurnaround {
+	return (_turnaroundCount > 0) ? (_turnaroundTotal / _turnaroundCount) : 0;
+}
+
+
+#pragma mark -
+#pragma mark Capture
+
+- (const FLScanToolCaptureChunk*) chunkAtIndex:(NSUInteger)index {
+	return (const FLScanToolCaptureChunk*)((const uint8_t*)[_capture bytes] + _chunkOffsets[index]);
+}
+
+
+- (NSUInteger) nextChunkFrom:(NSUInteger)index direction:(FLScanToolCaptureDirection)direction {
+	
+	while(index < _chunkCount && [self chunkAtIndex:index]->direction != direction) {
+		index++;
+	}
+	
+	return index;
+}
+
+
+// Whether the next captured read may be handed over: every write made
+// before it in the capture has been matched, and its time has come
+- (BOOL) readIsDue {
+	
+	if(_readChunk >= _chunkCount || _writeChunk < _readChunk) {
+		return NO;
+	}
+	
+	if(_speed <= SCAN_TOOL_REPLAY_AS_FAST_AS_POSSIBLE) {
+		return YES;
+	}
+	
+	return (FLMonotonicTime() >= _anchorTime + ([self chunkAtIndex:_readChunk]->timestamp - _anchorCaptureTime) / _speed);
+}
+
+
+- (void) scheduleRead {
+	
+	if(_readOffset > 0 || [self readIsDue]) {
+		[self signalEvent:NSStreamEventHasBytesAvailable forStream:_inputStream];
+	}
+	else if(_readChunk < _chunkCount && _writeChunk > _readChunk) {
+		NSTimeInterval due	= _anchorTime + ([self chunkAtIndex:_readChunk]->timestamp - _anchorCaptureTime) / _speed;
+		
+		[_readTimer setFireDate:[NSDate dateWithTimeIntervalSinceNow:(due - FLMonotonicTime())]];
+	}
+}
+
+
+- (void) readTimerDidFire:(NSTimer*)timer {
+	[self scheduleRead];
+}
+
+
+#pragma mark -
+#pragma mark Stream Events
+
+- (void) deliverEvents {
+	
+	BOOL finished	= (_inputEvents & NSStreamEventEndEncountered) != 0;
+	
+	[super deliverEvents];
+	
+	if(finished) {
+		FLINFO(@"*** REPLAY FINISHED ***")
+		[_scanTool cancelScan];
+	}
+}
+
+
+- (void) streamDidOpen:(NSStream*)stream {
+	
+	if(_startTime == 0) {
+		// Captured reads before the first write are timed from here
+		_startTime				= FLMonotonicTime();
+		_anchorTime				= _startTime;
+		_anchorCaptureTime		= (_chunkCount > 0) ? [self chunkAtIndex:0]->timestamp : 0;
+	}
+	
+	if(stream == _outputStream) {
+		[self signalEvent:(NSStreamEventOpenCompleted | NSStreamEventHasSpaceAvailable) forStream:stream];
+	}
+	else if(_readChunk >= _chunkCount) {
+		// Nothing was read in the capture
+		_endTime				= _startTime;
+		[self signalEvent:(NSStreamEventOpenCompleted | NSStreamEventEndEncountered) forStream:stream];
+	}
+	else {
+		[self signalEvent:NSStreamEventOpenCompleted forStream:stream];
+		[self scheduleRead];
+	}
+}
+
+
+- (void) didScheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	
+	// Armed by moving its fire date, as the scan tool's own timers are
+	_readTimer			= [[NSTimer alloc] initWithFireDate:[NSDate distantFuture]
+												  interval:COMMAND_MAX_TIMEOUT
+													target:self
+												  selector:@selector(readTimerDidFire:)
+												  userInfo:nil
+												   repeats:YES];
+	[runLoop addTimer:_readTimer forMode:mode];
+}
+
+
+- (void) didRemoveFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	
+	// The timer retains the replay, so it goes now rather than in dealloc
+	[_readTimer invalidate];
+	[_readTimer release];
+	_readTimer			= nil;
+}
+
+
+#pragma mark -
+#pragma mark Reading and Writing
+
+- (BOOL) hasBytesAvailable {
+	return (_readOffset > 0 || [self readIsDue]);
+}
+
+
+- (NSInteger) readBytes:(uint8_t*)buffer maxLength:(NSUInteger)maxLength {
+	
+	if(![self hasBytesAvailable]) {
+		return 0;
+	}
+	
+	const FLScanToolCaptureChunk* chunk	= [self chunkAtIndex:_readChunk];
+	NSUInteger length					= MIN(maxLength, chunk->length - _readOffset);
+	
+	// One read never runs past the end of a captured one, so the driver
+	// sees the bytes split as the adapter sent them
+	memcpy(buffer, (const uint8_t*)&chunk[1] + _readOffset, length);
+	_readOffset							+= length;
+	_bytesRead							+= length;
+	_lastReadTime						= FLMonotonicTime();
+	
+	if(_readOffset == chunk->length) {
+		_readOffset						= 0;
+		_readChunk						= [self nextChunkFrom:(_readChunk + 1) direction:kScanToolCaptureRead];
+		
+		if(_readChunk >= _chunkCount) {
+			_endTime					= _lastReadTime;
+			[self signalEvent:NSStreamEventEndEncountered forStream:_inputStream];
+		}
+		else {
+			[self scheduleRead];
+		}
+	}
+	
+	return length;
+}
+
+
+- (NSInteger) writeBytes:(const uint8_t*)buffer length:(NSUInteger)length {
+	
+	double now			= FLMonotonicTime();
+	NSUInteger offset	= 0;
+	
+	if(_lastReadTime > 0 && _writeOffset == 0) {
+		double turnaround	= now - _lastReadTime;
+		
+		_turnaroundTotal	+= turnaround;
+		_turnaroundMax		= MAX(_turnaroundMax, turnaround);
+		_turnaroundCount++;
+		_lastReadTime		= 0;
+	}
+	
+	// Written bytes are matched against the captured writes by count, so a
+	// command written in pieces still matches
+	while(offset < length && _writeChunk < _chunkCount) {
+		const FLScanToolCaptureChunk* chunk	= [self chunkAtIndex:_writeChunk];
+		NSUInteger count					= MIN(length - offset, chunk->length - _writeOffset);
+		
+		if(!_writeMismatched && memcmp(&buffer[offset], (const uint8_t*)&chunk[1] + _writeOffset, count) != 0) {
+			FLDEBUG(@"Write differs from capture chunk %u", _writeChunk)
+			_writeMismatched				= YES;
+			_mismatchCount++;
+		}
+		
+		offset								+= count;
+		_writeOffset						+= count;
+		
+		if(_writeOffset == chunk->length) {
+			// The reads that followed this write are timed from now
+			_anchorTime						= now;
+			_anchorCaptureTime				= chunk->timestamp;
+			_writeOffset					= 0;
+			_writeMismatched				= NO;
+			_writeChunk						= [self nextChunkFrom:(_writeChunk + 1) direction:kScanToolCaptureWrite];
+		}
+	}
+	
+	_bytesWritten		+= length;
+	
+	[self scheduleRead];
+	
+	return length;
+}
+
+@end
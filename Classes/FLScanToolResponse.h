@@ -20,6 +20,7 @@
 
 #import <Foundation/Foundation.h>
 #import <CoreLocation/CoreLocation.h>
+#include <mach/mach_time.h>
 
 typedef struct pid_support_map_t {
 
@@ -70,6 +71,51 @@ typedef struct pid_support_map_t {
 //#define MORE_PIDS_SUPPORTED(pSupportMap)			(pSupportMap->pid1F != 0)
 
 
+// Longest response, in bytes including the mode and PID (or, for GoLink, the
+// frame header), held by a scan tool record.  Longer replies, such as long
+// trouble code lists, are only delivered as FLScanToolResponse objects.
+#define SCAN_TOOL_RECORD_MAX_LENGTH					64
+
+
+// Compact form of a single response, used on the sensor sampling path so
+// that no objects are allocated per sample.  Records are parsed into an
+// array owned by the parser and delivered to the delegate in batches; an
+// FLScanToolResponse is only created from a record when one is asked for.
+typedef struct scan_tool_record_t {
+	double				timestamp;		// FLMonotonicTime() when parsed
+	uint32_t			ecuAddress;
+	uint16_t			protocol;		// FLScanToolProtocol
+	uint16_t			pid;			// 16 bits for Mode $22 identifiers
+	uint8_t				mode;			// Request mode, e.g. 0x01 for a 0x41 reply
+	uint8_t				priority;
+	uint8_t				targetAddress;
+	uint8_t				dataOffset;		// Index of the first data byte in bytes
+	uint8_t				length;			// Length of the whole response in bytes
+	uint8_t				bytes[SCAN_TOOL_RECORD_MAX_LENGTH];
+} FLScanToolRecord;
+
+#define RECORD_DATA(record)				(&(record)->bytes[(record)->dataOffset])
+#define RECORD_DATA_LENGTH(record)		((record)->length - (record)->dataOffset)
+
+
+/*!
+ @method FLMonotonicTime
+ Seconds since an arbitrary point, from a clock which is not affected by
+ changes to the wall clock
+ */
+static inline double FLMonotonicTime(void) {
+	static double scale = 0;
+	
+	if(scale == 0) {
+		mach_timebase_info_data_t info;
+		mach_timebase_info(&info);
+		scale = ((double)info.numer / (double)info.denom) / 1.0e9;
+	}
+	
+	return (double)mach_absolute_time() * scale;
+}
+
+
 @interface FLScanToolResponse : NSObject<NSCoding> {
 	
 	NSString*				_scanToolName;
@@ -118,6 +164,10 @@ typedef struct pid_support_map_t {
 @property (nonatomic, assign) double gpsSpeed;
 
 
++ (FLScanToolResponse*) responseWithRecord:(const FLScanToolRecord*)record scanToolName:(NSString*)scanToolName;
+
+- initWithRecord:(const FLScanToolRecord*)record scanToolName:(NSString*)scanToolName;
+
 - (void) updateLocation:(CLLocation*)location;
 - (id) proxyForJson;
 
@@ -68,6 +68,38 @@
 }
 
 
++ (FLScanToolResponse*) responseWithRecord:(const FLScanToolRecord*)record scanToolName:(NSString*)scanToolName {
+	return [[[FLScanToolResponse alloc] initWithRecord:record scanToolName:scanToolName] autorelease];
+}
+
+
+- initWithRecord:(const FLScanToolRecord*)record scanToolName:(NSString*)scanToolName {
+	
+	if(self = [self init]) {
+		
+		// Records are stamped on the monotonic clock, so carry the age of
+		// the record over to the wall clock
+		[_timestamp release];
+		_timestamp					= [[NSDate dateWithTimeIntervalSinceNow:(record->timestamp - FLMonotonicTime())] retain];
+		
+		_scanToolName				= [scanToolName retain];
+		_protocol					= record->protocol;
+		_priority					= record->priority;
+		_targetAddress				= record->targetAddress;
+		_ecuAddress					= record->ecuAddress;
+		_mode						= record->mode;
+		_pid						= record->pid;
+		_responseData				= [[NSData alloc] initWithBytes:record->bytes length:record->length];
+		
+		if(RECORD_DATA_LENGTH(record) > 0) {
+			_data					= [[NSData alloc] initWithBytes:RECORD_DATA(record) length:RECORD_DATA_LENGTH(record)];
+		}
+	}
+	
+	return self;
+}
+
+
 - (NSData*) rawData {
 	return _responseData;
 }
@@ -57,16 +57,45 @@ typedef struct can_29bit_response_t {
 	BOOL					resolveLocation;
 	uint8_t*				_bytes;
 	NSInteger				_length;
+	
+	FLScanToolRecord*		_records;
+	NSUInteger				_recordCount;
+	NSUInteger				_recordCapacity;
+	BOOL					_recordOverflow;
 }
 
 @property (nonatomic, assign, readonly) BOOL resolveLocation;
 
+// Records from the last call to parseRecords:.  They belong to the parser,
+// and are only valid until the next parse.
+@property (nonatomic, readonly) const FLScanToolRecord* records;
+@property (nonatomic, readonly) NSUInteger recordCount;
+
 - initWithBytes:(uint8_t*)bytes length:(NSUInteger)length;
 
 - (void) setBytes:(uint8_t*)bytes length:(NSInteger)length;
 
 - (NSArray*) parseResponse:(FLScanToolProtocol)protocol;
 
+// Parses the response into records rather than FLScanToolResponse objects.
+// Returns NO if any response was too long to fit in a record, or if the
+// parser does not support records, in which case the response must be
+// parsed with parseResponse: instead.
+- (BOOL) parseRecords:(FLScanToolProtocol)protocol;
+
+// For subclasses: appends a record holding length bytes of response, with
+// the data starting at dataOffset.  Returns NULL, and makes parseRecords:
+// fail, if the response is too long for a record.
+- (FLScanToolRecord*) addRecordForBytes:(const uint8_t*)bytes 
+								 length:(NSUInteger)length 
+							 dataOffset:(NSUInteger)dataOffset 
+							   protocol:(FLScanToolProtocol)protocol;
+- (void) resetRecords;
+
+// Returns the number of data bytes an ECU returns for the given Mode $01 PID,
+// or -1 if the length is not known.  Used to split multi-PID replies.
++ (NSInteger) dataLengthForService01PID:(NSUInteger)pid;
+
 @end
 
 
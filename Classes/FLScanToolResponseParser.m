@@ -21,8 +21,22 @@
 #import "FLScanToolResponseParser.h"
 
 
+// Number of data bytes returned for each Mode $01 PID, per SAE J1979.
+// A value of 0 means the length is not known.
+static const uint8_t g_service01PIDLengthTable[] = {
+	/* 0x00 */	4, 4, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1,
+	/* 0x10 */	2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2,
+	/* 0x20 */	4, 2, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1, 1,
+	/* 0x30 */	1, 2, 2, 1, 4, 4, 4, 4, 4, 4, 4, 4, 2, 2, 2, 2,
+	/* 0x40 */	4, 4, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2
+};
+
+
 @implementation FLScanToolResponseParser
 
+@synthesize records		= _records,
+			recordCount	= _recordCount;
+
 
 - initWithBytes:(uint8_t*)bytes length:(NSUInteger)length {
 	
@@ -35,6 +49,12 @@
 }
 
 
+- (void) dealloc {
+	free(_records);
+	[super dealloc];
+}
+
+
 - (NSArray*) parseResponse:(FLScanToolProtocol)protocol {
 	// Abstract method
 	[self doesNotRecognizeSelector:_cmd];
@@ -42,6 +62,73 @@
 }
 
 
++ (NSInteger) dataLengthForService01PID:(NSUInteger)pid {
+	
+	// Every PID search group replies with a 4 byte support bitmap
+	if(pid <= MAX_PID_GROUP && !NOT_SEARCH_PID(pid)) {
+		return 4;
+	}
+	
+	if(pid >= (sizeof(g_service01PIDLengthTable) / sizeof(g_service01PIDLengthTable[0])) ||
+	   g_service01PIDLengthTable[pid] == 0) {
+		return -1;
+	}
+	
+	return g_service01PIDLengthTable[pid];
+}
+
+
+- (BOOL) parseRecords:(FLScanToolProtocol)protocol {
+	// Parsers which do not produce records fall back to parseResponse:
+	return NO;
+}
+
+
+- (FLScanToolRecord*) addRecordForBytes:(const uint8_t*)bytes 
+								 length:(NSUInteger)length 
+							 dataOffset:(NSUInteger)dataOffset 
+							   protocol:(FLScanToolProtocol)protocol {
+	
+	if(length > SCAN_TOOL_RECORD_MAX_LENGTH || dataOffset > length) {
+		_recordOverflow				= YES;
+		return NULL;
+	}
+	
+	if(_recordCount == _recordCapacity) {
+		// The array is kept between parses, so this only happens until
+		// it has grown to fit the largest reply seen
+		NSUInteger capacity			= (_recordCapacity > 0) ? (_recordCapacity * 2) : 8;
+		FLScanToolRecord* records	= (FLScanToolRecord*)realloc(_records, capacity * sizeof(FLScanToolRecord));
+		
+		if(!records) {
+			_recordOverflow			= YES;
+			return NULL;
+		}
+		
+		_records					= records;
+		_recordCapacity				= capacity;
+	}
+	
+	FLScanToolRecord* record		= &_records[_recordCount++];
+	
+	memset(record, 0x00, offsetof(FLScanToolRecord, bytes));
+	memcpy(record->bytes, bytes, length);
+	
+	record->timestamp				= FLMonotonicTime();
+	record->protocol				= (uint16_t)protocol;
+	record->dataOffset				= (uint8_t)dataOffset;
+	record->length					= (uint8_t)length;
+	
+	return record;
+}
+
+
+- (void) resetRecords {
+	_recordCount	= 0;
+	_recordOverflow	= NO;
+}
+
+
 - (void) setBytes:(uint8_t*)bytes length:(NSInteger)length {
 	if(bytes) {
 		_bytes = bytes;
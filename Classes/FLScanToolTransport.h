@@ -0,0 +1,210 @@
+/*
+ *  FLScanToolTransport.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
+
+
+@class FLScanToolTransport;
+
+@protocol FLScanToolTransportDelegate <NSObject>
+// The far end has gone away for good, e.g. the accessory was unplugged
+- (void) transportDidDisconnect:(FLScanToolTransport*)transport;
+@end
+
+
+/*
+ The byte channel between a scan tool and its adapter.  A driver reads
+ and writes the transport's streams exactly as it would the adapter's, so
+ the same driver runs over an EA session, a socket, a pipe or pty, or an
+ in-memory pair with a stand-in on the other end:
+
+	FLMemoryTransport* transport;
+	FLMemoryTransport* peer;
+	
+	[FLMemoryTransport getTransport:&transport peer:&peer];
+	[goLinkEmulator startWithTransport:peer];
+	
+	scanTool			= [FLScanTool scanToolForDeviceType:kScanToolDeviceTypeGoLink];
+	scanTool.transport	= transport;
+
+ A scan tool without a transport uses its driver's own: an EA session for
+ the EA drivers, a socket to host and port for the WiFi ones.
+
+ Subclasses either hand over streams made elsewhere (a socket's, an EA
+ session's), or call createStreams for a pair whose reads, writes and
+ scheduling come back to the methods at the end of this interface.  The
+ events of those streams are delivered from a run loop source of the
+ transport's, on the thread they are scheduled on, and may be signalled
+ from any thread.
+ */
+@interface FLScanToolTransport : NSObject {
+	id<FLScanToolTransportDelegate>	_delegate;			// Not retained
+	
+	NSInputStream*			_inputStream;
+	NSOutputStream*			_outputStream;
+	NSError*				_error;
+	NSStreamEvent			_inputEvents;		// Waiting to be delivered
+	NSStreamEvent			_outputEvents;
+	CFRunLoopRef			_runLoop;
+	CFRunLoopSourceRef		_source;
+	NSUInteger				_scheduleCount;
+}
+
+@property (nonatomic, assign) id<FLScanToolTransportDelegate> delegate;
+
+// Valid from open until close
+@property (nonatomic, readonly) NSInputStream* inputStream;
+@property (nonatomic, readonly) NSOutputStream* outputStream;
+
+// Set once the transport has failed
+@property (nonatomic, readonly) NSError* error;
+
+// Names the adapter at the far end the same way from one connection to
+// the next, e.g. its device path or accessory serial number, so settings
+// can be cached for it.  nil if the transport cannot tell adapters apart.
+@property (nonatomic, readonly) NSString* adapterIdentity;
+
+// Makes the streams, which the scan tool then schedules and opens.
+// Returns NO if the far end cannot be reached.
+- (BOOL) open;
+
+// Called once the scan tool has closed the streams
+- (void) close;
+
+// For subclasses
+
+- (void) createStreams;
+- (void) releaseStreams;
+- (void) signalEvent:(NSStreamEvent)event forStream:(NSStream*)stream;
+- (void) deliverEvents;
+- (void) failWithError:(NSError*)error;
+- (void) didDisconnect;
+
+// Called as the streams made by createStreams are opened, closed and
+// scheduled.  The run loop calls are made for the first stream scheduled
+// and the last removed.
+- (void) streamDidOpen:(NSStream*)stream;
+- (void) streamDidClose:(NSStream*)stream;
+- (void) didScheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode;
+- (void) didRemoveFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode;
+- (BOOL) hasBytesAvailable;
+- (NSInteger) readBytes:(uint8_t*)buffer maxLength:(NSUInteger)maxLength;
+- (BOOL) hasSpaceAvailable;
+- (NSInteger) writeBytes:(const uint8_t*)buffer length:(NSUInteger)length;
+
+@end
+
+
+/*
+ A TCP connection to host and port, or a socket already connected, e.g.
+ one end of a socketpair.  A socket given to the transport is closed with
+ it, and so may be opened only once.
+ */
+@interface FLSocketTransport : FLScanToolTransport {
+	NSString*				_host;
+	NSInteger				_port;
+	int						_socket;
+}
+
+@property (nonatomic, readonly) NSString* host;
+@property (nonatomic, readonly) NSInteger port;
+
++ (FLSocketTransport*) transportWithHost:(NSString*)host port:(NSInteger)port;
++ (FLSocketTransport*) transportWithSocket:(int)socket;
+
+// Two transports joined by a local socketpair.  Returns NO if the pair
+// could not be made.
++ (BOOL) getTransport:(FLSocketTransport**)transport peer:(FLSocketTransport**)peer;
+
+- initWithHost:(NSString*)host port:(NSInteger)port;
+- initWithSocket:(int)socket;
+
+@end
+
+
+/*
+ Non-blocking reads and writes on file descriptors: a device or FIFO
+ opened by path, a pty, or a pair of pipes.  Readiness comes from the run
+ loop the streams are scheduled on.  A terminal is put in raw mode, with
+ its speed left as it was; see configureDescriptor: for changing that.
+ Descriptors given to the transport are closed with it only if asked.
+ */
+@interface FLFileDescriptorTransport : FLScanToolTransport {
+	NSString*				_path;
+	int						_readDescriptor;
+	int						_writeDescriptor;
+	BOOL					_closesDescriptors;
+	
+	CFFileDescriptorRef		_readSource;
+	CFFileDescriptorRef		_writeSource;		// NULL when both are one descriptor
+	CFRunLoopSourceRef		_readRunLoopSource;
+	CFRunLoopSourceRef		_writeRunLoopSource;
+	BOOL					_atEnd;
+}
+
+// The path opened, or nil for descriptors that were given
+@property (nonatomic, readonly) NSString* path;
+@property (nonatomic, readonly) int readDescriptor;
+@property (nonatomic, readonly) int writeDescriptor;
+
++ (FLFileDescriptorTransport*) transportWithPath:(NSString*)path;
++ (FLFileDescriptorTransport*) transportWithReadDescriptor:(int)readDescriptor
+										   writeDescriptor:(int)writeDescriptor
+										 closesDescriptors:(BOOL)closesDescriptors;
+
+// The master side of a new pty.  The path of its slave, for the adapter or
+// stand-in on the other side to open, is returned in slavePath.  nil if no
+// pty could be had.
++ (FLFileDescriptorTransport*) ptyTransportWithSlavePath:(NSString**)slavePath;
+
+// Two transports joined by a pipe in each direction.  Returns NO if the
+// pipes could not be made.
++ (BOOL) getPipeTransport:(FLFileDescriptorTransport**)transport peer:(FLFileDescriptorTransport**)peer;
+
+- initWithPath:(NSString*)path;
+- initWithReadDescriptor:(int)readDescriptor writeDescriptor:(int)writeDescriptor closesDescriptors:(BOOL)closesDescriptors;
+
+// Called on each descriptor as the transport is opened, after it has been
+// made non-blocking.  Puts a terminal in raw mode.  Returns NO, with errno
+// set, if the descriptor cannot be used.
+- (BOOL) configureDescriptor:(int)descriptor;
+
+@end
+
+
+/*
+ One end of a pair joined in memory, for a stand-in run in the same
+ process.  Bytes written to one end are read from the other, on whichever
+ threads the two are scheduled.  Writes are never refused while the peer
+ is open; closing one end ends the other's input.
+ */
+@interface FLMemoryTransport : FLScanToolTransport {
+	id						_lock;				// Shared by both ends
+	FLMemoryTransport*		_peer;				// Not retained
+	NSMutableData*			_buffer;			// Written by the peer, not yet read
+	NSUInteger				_bufferOffset;
+	BOOL					_peerClosed;
+	BOOL					_closed;
+}
+
++ (void) getTransport:(FLMemoryTransport**)transport peer:(FLMemoryTransport**)peer;
+
+@end
@@ -0,0 +1,1164 @@
+/*
+ *  FLScanToolTransport.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolTransport.h"
+#import "NSStreamAdditions.h"
+#import "FLLogging.h"
+#import <sys/socket.h>
+#import <fcntl.h>
+#import <poll.h>
+#import <termios.h>
+#import <unistd.h>
+#import <stdlib.h>
+#import <errno.h>
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLScanToolTransport (Private)
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode;
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode;
+@end
+
+
+//------------------------------------------------------------------------------
+// The streams made by createStreams.  Both pass everything on to their
+// transport, which delivers their events from a run loop source of its own.
+// A stream outliving its transport (e.g. still retained by a scan tool)
+// is detached from it, and acts as a closed stream.
+
+@interface FLTransportInputStream : NSInputStream {
+	FLScanToolTransport*	_transport;		// Not retained
+	id						_delegate;
+	NSStreamStatus			_status;
+}
+- initWithTransport:(FLScanToolTransport*)transport;
+- (void) detach;
+@end
+
+
+@interface FLTransportOutputStream : NSOutputStream {
+	FLScanToolTransport*	_transport;		// Not retained
+	id						_delegate;
+	NSStreamStatus			_status;
+}
+- initWithTransport:(FLScanToolTransport*)transport;
+- (void) detach;
+@end
+
+
+@implementation FLTransportInputStream
+
+- initWithTransport:(FLScanToolTransport*)transport {
+	
+	if(self = [super init]) {
+		_transport	= transport;
+		_delegate	= self;
+		_status		= NSStreamStatusNotOpen;
+	}
+	
+	return self;
+}
+
+- (void) detach {
+	_transport	= nil;
+	_status		= NSStreamStatusClosed;
+}
+
+- (id) delegate {
+	return _delegate;
+}
+
+- (void) setDelegate:(id)delegate {
+	_delegate	= (delegate) ? delegate : self;
+}
+
+- (void) open {
+	
+	if(_transport && _status == NSStreamStatusNotOpen) {
+		_status		= NSStreamStatusOpen;
+		[_transport streamDidOpen:self];
+	}
+}
+
+- (void) close {
+	
+	if(_status != NSStreamStatusClosed) {
+		_status		= NSStreamStatusClosed;
+		[_transport streamDidClose:self];
+	}
+}
+
+- (NSStreamStatus) streamStatus {
+	return (_status == NSStreamStatusOpen && _transport.error) ? NSStreamStatusError : _status;
+}
+
+- (NSError*) streamError {
+	return _transport.error;
+}
+
+- (id) propertyForKey:(NSString*)key {
+	return nil;
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+	return NO;
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	[_transport scheduleInRunLoop:runLoop forMode:mode];
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	[_transport removeFromRunLoop:runLoop forMode:mode];
+}
+
+- (BOOL) hasBytesAvailable {
+	return ([self streamStatus] == NSStreamStatusOpen && [_transport hasBytesAvailable]);
+}
+
+- (NSInteger) read:(uint8_t*)buffer maxLength:(NSUInteger)length {
+	return ([self streamStatus] == NSStreamStatusOpen) ? [_transport readBytes:buffer maxLength:length] : -1;
+}
+
+- (BOOL) getBuffer:(uint8_t**)buffer length:(NSUInteger*)length {
+	return NO;
+}
+
+@end
+
+
+@implementation FLTransportOutputStream
+
+- initWithTransport:(FLScanToolTransport*)transport {
+	
+	if(self = [super init]) {
+		_transport	= transport;
+		_delegate	= self;
+		_status		= NSStreamStatusNotOpen;
+	}
+	
+	return self;
+}
+
+- (void) detach {
+	_transport	= nil;
+	_status		= NSStreamStatusClosed;
+}
+
+- (id) delegate {
+	return _delegate;
+}
+
+- (void) setDelegate:(id)delegate {
+	_delegate	= (delegate) ? delegate : self;
+}
+
+- (void) open {
+	
+	if(_transport && _status == NSStreamStatusNotOpen) {
+		_status		= NSStreamStatusOpen;
+		[_transport streamDidOpen:self];
+	}
+}
+
+- (void) close {
+	
+	if(_status != NSStreamStatusClosed) {
+		_status		= NSStreamStatusClosed;
+		[_transport streamDidClose:self];
+	}
+}
+
+- (NSStreamStatus) streamStatus {
+	return (_status == NSStreamStatusOpen && _transport.error) ? NSStreamStatusError : _status;
+}
+
+- (NSError*) streamError {
+	return _transport.error;
+}
+
+- (id) propertyForKey:(NSString*)key {
+	return nil;
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+	return NO;
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	[_transport scheduleInRunLoop:runLoop forMode:mode];
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	[_transport removeFromRunLoop:runLoop forMode:mode];
+}
+
+- (BOOL) hasSpaceAvailable {
+	return ([self streamStatus] == NSStreamStatusOpen && [_transport hasSpaceAvailable]);
+}
+
+- (NSInteger) write:(const uint8_t*)buffer maxLength:(NSUInteger)length {
+	return ([self streamStatus] == NSStreamStatusOpen) ? [_transport writeBytes:buffer length:length] : -1;
+}
+
+@end
+
+
+static void transportSourcePerform(void* info) {
+	[(FLScanToolTransport*)info deliverEvents];
+}
+
+
+#pragma mark -
+@implementation FLScanToolTransport
+
+@synthesize delegate		= _delegate,
+			inputStream		= _inputStream,
+			outputStream	= _outputStream,
+			error			= _error;
+
+
+- (void) dealloc {
+	
+	if(_source) {
+		CFRunLoopSourceInvalidate(_source);
+		CFRelease(_source);
+	}
+	
+	[self releaseStreams];
+	[_error release];
+	[super dealloc];
+}
+
+
+- (BOOL) open {
+	return (_inputStream != nil && _outputStream != nil);
+}
+
+
+- (void) close {
+}
+
+
+- (NSString*) adapterIdentity {
+	return nil;
+}
+
+
+#pragma mark -
+#pragma mark Streams
+
+- (void) createStreams {
+	
+	[self releaseStreams];
+	
+	@synchronized(self) {
+		_inputStream		= [[FLTransportInputStream alloc] initWithTransport:self];
+		_outputStream		= [[FLTransportOutputStream alloc] initWithTransport:self];
+		_inputEvents		= 0;
+		_outputEvents		= 0;
+		
+		[_error release];
+		_error				= nil;
+	}
+}
+
+
+- (void) releaseStreams {
+	
+	@synchronized(self) {
+		if([_inputStream isKindOfClass:[FLTransportInputStream class]]) {
+			[(FLTransportInputStream*)_inputStream detach];
+		}
+		
+		if([_outputStream isKindOfClass:[FLTransportOutputStream class]]) {
+			[(FLTransportOutputStream*)_outputStream detach];
+		}
+		
+		[_inputStream release];
+		_inputStream		= nil;
+		[_outputStream release];
+		_outputStream		= nil;
+	}
+}
+
+
+- (void) failWithError:(NSError*)error {
+	
+	@synchronized(self) {
+		if(_error) {
+			return;
+		}
+		
+		_error			= [error retain];
+		
+		[self signalEvent:NSStreamEventErrorOccurred forStream:_inputStream];
+		[self signalEvent:NSStreamEventErrorOccurred forStream:_outputStream];
+	}
+	
+	FLNSERROR(error)
+}
+
+
+- (void) didDisconnect {
+	[_delegate transportDidDisconnect:self];
+}
+
+
+#pragma mark -
+#pragma mark Stream Events
+
+- (void) signalEvent:(NSStreamEvent)event forStream:(NSStream*)stream {
+	
+	@synchronized(self) {
+		if(stream == _inputStream) {
+			_inputEvents	|= event;
+		}
+		else {
+			_outputEvents	|= event;
+		}
+		
+		if(_source) {
+			CFRunLoopSourceSignal(_source);
+			CFRunLoopWakeUp(_runLoop);
+		}
+	}
+}
+
+
+- (void) deliverEvents {
+	
+	NSInputStream* inputStream		= nil;
+	NSOutputStream* outputStream	= nil;
+	NSStreamEvent inputEvents		= 0;
+	NSStreamEvent outputEvents		= 0;
+	NSStreamEvent order[]			= { NSStreamEventOpenCompleted, NSStreamEventHasSpaceAvailable,
+										NSStreamEventHasBytesAvailable, NSStreamEventErrorOccurred,
+										NSStreamEventEndEncountered };
+	
+	@synchronized(self) {
+		// A delegate may close the transport, and release the streams,
+		// while they are being delivered to
+		inputStream					= [[_inputStream retain] autorelease];
+		outputStream				= [[_outputStream retain] autorelease];
+		inputEvents					= _inputEvents;
+		outputEvents				= _outputEvents;
+		_inputEvents				= 0;
+		_outputEvents				= 0;
+	}
+	
+	// Anything a delegate does in response is signalled afresh, and
+	// delivered on the next pass through the run loop
+	for(NSUInteger i = 0; i < (sizeof(order) / sizeof(order[0])); i++) {
+		
+		if((outputEvents & order[i]) && [outputStream streamStatus] != NSStreamStatusClosed) {
+			[[outputStream delegate] stream:outputStream handleEvent:order[i]];
+		}
+		
+		if((inputEvents & order[i]) && [inputStream streamStatus] != NSStreamStatusClosed) {
+			if(order[i] != NSStreamEventHasBytesAvailable || [inputStream hasBytesAvailable]) {
+				[[inputStream delegate] stream:inputStream handleEvent:order[i]];
+			}
+		}
+	}
+}
+
+
+- (void) streamDidOpen:(NSStream*)stream {
+	
+	if(stream == _outputStream) {
+		[self signalEvent:(NSStreamEventOpenCompleted | NSStreamEventHasSpaceAvailable) forStream:stream];
+	}
+	else {
+		[self signalEvent:(([self hasBytesAvailable]) ? (NSStreamEventOpenCompleted | NSStreamEventHasBytesAvailable) :
+																						NSStreamEventOpenCompleted)
+				forStream:stream];
+	}
+}
+
+
+- (void) streamDidClose:(NSStream*)stream {
+}
+
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	
+	@synchronized(self) {
+		if(_scheduleCount++ > 0) {
+			return;
+		}
+		
+		CFRunLoopSourceContext context;
+		
+		memset(&context, 0, sizeof(context));
+		context.info		= self;
+		context.perform		= transportSourcePerform;
+		
+		_runLoop			= [runLoop getCFRunLoop];
+		_source				= CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+		CFRunLoopAddSource(_runLoop, _source, (CFStringRef)mode);
+		
+		// Events signalled before there was a run loop to deliver them on
+		if(_inputEvents || _outputEvents) {
+			CFRunLoopSourceSignal(_source);
+		}
+	}
+	
+	[self didScheduleInRunLoop:runLoop forMode:mode];
+}
+
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	
+	@synchronized(self) {
+		if(_scheduleCount == 0 || --_scheduleCount > 0) {
+			return;
+		}
+		
+		CFRunLoopSourceInvalidate(_source);
+		CFRelease(_source);
+		_source				= NULL;
+		_runLoop			= NULL;
+	}
+	
+	[self didRemoveFromRunLoop:runLoop forMode:mode];
+}
+
+
+- (void) didScheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+
+- (void) didRemoveFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+
+#pragma mark -
+#pragma mark Reading and Writing
+
+- (BOOL) hasBytesAvailable {
+	return NO;
+}
+
+
+- (NSInteger) readBytes:(uint8_t*)buffer maxLength:(NSUInteger)maxLength {
+	// Abstract method
+	[self doesNotRecognizeSelector:_cmd];
+	return -1;
+}
+
+
+- (BOOL) hasSpaceAvailable {
+	return YES;
+}
+
+
+- (NSInteger) writeBytes:(const uint8_t*)buffer length:(NSUInteger)length {
+	// Abstract method
+	[self doesNotRecognizeSelector:_cmd];
+	return -1;
+}
+
+@end
+
+
+#pragma mark -
+@implementation FLSocketTransport
+
+@synthesize host	= _host,
+			port	= _port;
+
+
++ (FLSocketTransport*) transportWithHost:(NSString*)host port:(NSInteger)port {
+	return [[[FLSocketTransport alloc] initWithHost:host port:port] autorelease];
+}
+
+
++ (FLSocketTransport*) transportWithSocket:(int)socket {
+	return [[[FLSocketTransport alloc] initWithSocket:socket] autorelease];
+}
+
+
++ (BOOL) getTransport:(FLSocketTransport**)transport peer:(FLSocketTransport**)peer {
+	
+	int sockets[2];
+	
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+		FLERROR(@"Unable to create socket pair (errno=%d)", errno)
+		return NO;
+	}
+	
+	*transport	= [FLSocketTransport transportWithSocket:sockets[0]];
+	*peer		= [FLSocketTransport transportWithSocket:sockets[1]];
+	
+	return YES;
+}
+
+
+- initWithHost:(NSString*)host port:(NSInteger)port {
+	
+	if(self = [super init]) {
+		_host		= [host copy];
+		_port		= port;
+		_socket		= -1;
+	}
+	
+	return self;
+}
+
+
+- initWithSocket:(int)socket {
+	
+	if(self = [super init]) {
+		_socket		= socket;
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	if(_socket >= 0) {
+		close(_socket);
+	}
+	
+	[_host release];
+	[super dealloc];
+}
+
+
+- (BOOL) open {
+	
+	[self releaseStreams];
+	
+	if(_socket >= 0) {
+		CFReadStreamRef readStream		= NULL;
+		CFWriteStreamRef writeStream	= NULL;
+		
+		CFStreamCreatePairWithSocket(kCFAllocatorDefault, _socket, &readStream, &writeStream);
+		
+		if(!readStream || !writeStream) {
+			FLERROR(@"Unable to create streams for socket %d", _socket)
+			
+			if(readStream) {
+				CFRelease(readStream);
+			}
+			
+			if(writeStream) {
+				CFRelease(writeStream);
+			}
+			
+			return NO;
+		}
+		
+		// The socket is the streams' from here on
+		CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+		CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+		
+		_inputStream					= (NSInputStream*)readStream;
+		_outputStream					= (NSOutputStream*)writeStream;
+		_socket							= -1;
+	}
+	else if(_host) {
+		[NSStream getIOStreamsToHostNamed:_host
+									 port:_port
+							  inputStream:&_inputStream
+							 outputStream:&_outputStream];
+		
+		[_inputStream retain];
+		[_outputStream retain];
+	}
+	else {
+		FLERROR(@"Socket transport %@ has already been used", self)
+	}
+	
+	return [super open];
+}
+
+
+- (void) close {
+	[self releaseStreams];
+}
+
+
+- (NSString*) adapterIdentity {
+	// A socket given to the transport could lead anywhere
+	return (_host) ? [NSString stringWithFormat:@"%@:%d", _host, _port] : nil;
+}
+
+@end
+
+
+#pragma mark -
+@interface FLFileDescriptorTransport (Private)
+- (void) descriptorDidBecomeReady:(CFOptionFlags)callBackTypes;
+- (void) invalidateSources;
+- (void) closeDescriptors;
+@end
+
+
+static void descriptorCallBack(CFFileDescriptorRef descriptor, CFOptionFlags callBackTypes, void* info) {
+	[(FLFileDescriptorTransport*)info descriptorDidBecomeReady:callBackTypes];
+}
+
+
+@implementation FLFileDescriptorTransport
+
+@synthesize path				= _path,
+			readDescriptor		= _readDescriptor,
+			writeDescriptor		= _writeDescriptor;
+
+
++ (FLFileDescriptorTransport*) transportWithPath:(NSString*)path {
+	return [[[self alloc] initWithPath:path] autorelease];
+}
+
+
++ (FLFileDescriptorTransport*) transportWithReadDescriptor:(int)readDescriptor
+										   writeDescriptor:(int)writeDescriptor
+										 closesDescriptors:(BOOL)closesDescriptors {
+	return [[[self alloc] initWithReadDescriptor:readDescriptor
+								 writeDescriptor:writeDescriptor
+							   closesDescriptors:closesDescriptors] autorelease];
+}
+
+
++ (FLFileDescriptorTransport*) ptyTransportWithSlavePath:(NSString**)slavePath {
+	
+	int master			= posix_openpt(O_RDWR | O_NOCTTY);
+	const char* name	= NULL;
+	
+	if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || !(name = ptsname(master))) {
+		FLERROR(@"Unable to create pty (errno=%d)", errno)
+		
+		if(master >= 0) {
+			close(master);
+		}
+		
+		return nil;
+	}
+	
+	if(slavePath) {
+		*slavePath		= [NSString stringWithUTF8String:name];
+	}
+	
+	return [self transportWithReadDescriptor:master writeDescriptor:master closesDescriptors:YES];
+}
+
+
++ (BOOL) getPipeTransport:(FLFileDescriptorTransport**)transport peer:(FLFileDescriptorTransport**)peer {
+	
+	int toPeer[2];
+	int fromPeer[2];
+	
+	if(pipe(toPeer) != 0) {
+		FLERROR(@"Unable to create pipe (errno=%d)", errno)
+		return NO;
+	}
+	
+	if(pipe(fromPeer) != 0) {
+		FLERROR(@"Unable to create pipe (errno=%d)", errno)
+		close(toPeer[0]);
+		close(toPeer[1]);
+		return NO;
+	}
+	
+	*transport	= [self transportWithReadDescriptor:fromPeer[0] writeDescriptor:toPeer[1] closesDescriptors:YES];
+	*peer		= [self transportWithReadDescriptor:toPeer[0] writeDescriptor:fromPeer[1] closesDescriptors:YES];
+	
+	return YES;
+}
+
+
+- initWithPath:(NSString*)path {
+	
+	if(self = [super init]) {
+		_path				= [path copy];
+		_readDescriptor		= -1;
+		_writeDescriptor	= -1;
+		_closesDescriptors	= YES;
+	}
+	
+	return self;
+}
+
+
+- initWithReadDescriptor:(int)readDescriptor writeDescriptor:(int)writeDescriptor closesDescriptors:(BOOL)closesDescriptors {
+	
+	if(self = [super init]) {
+		_readDescriptor		= readDescriptor;
+		_writeDescriptor	= writeDescriptor;
+		_closesDescriptors	= closesDescriptors;
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self invalidateSources];
+	[self closeDescriptors];
+	[_path release];
+	[super dealloc];
+}
+
+
+- (NSString*) description {
+	return (_path) ? [NSString stringWithFormat:@"<%@ %@>", [self class], _path] :
+					 [NSString stringWithFormat:@"<%@ %d/%d>", [self class], _readDescriptor, _writeDescriptor];
+}
+
+
+- (NSString*) adapterIdentity {
+	return _path;
+}
+
+
+- (BOOL) open {
+	
+	[self releaseStreams];
+	
+	if(_path && _readDescriptor < 0) {
+		int descriptor		= open([_path fileSystemRepresentation], O_RDWR | O_NOCTTY | O_NONBLOCK);
+		
+		if(descriptor < 0) {
+			FLERROR(@"Unable to open %@ (errno=%d)", _path, errno)
+			return NO;
+		}
+		
+		_readDescriptor		= descriptor;
+		_writeDescriptor	= descriptor;
+	}
+	
+	if(_readDescriptor < 0 || _writeDescriptor < 0) {
+		FLERROR(@"%@ has no descriptors to open", self)
+		return NO;
+	}
+	
+	int descriptors[]		= { _readDescriptor, _writeDescriptor };
+	
+	for(NSUInteger i = 0; i < ((_readDescriptor == _writeDescriptor) ? 1 : 2); i++) {
+		int flags			= fcntl(descriptors[i], F_GETFL);
+		
+		if(flags < 0 ||
+		   fcntl(descriptors[i], F_SETFL, flags | O_NONBLOCK) != 0 ||
+		   ![self configureDescriptor:descriptors[i]]) {
+			FLERROR(@"Unable to configure %@ (errno=%d)", self, errno)
+			
+			if(_path) {
+				[self closeDescriptors];
+			}
+			
+			return NO;
+		}
+	}
+	
+	_atEnd					= NO;
+	[self createStreams];
+	
+	return [super open];
+}
+
+
+- (void) close {
+	
+	[self releaseStreams];
+	[self invalidateSources];
+	
+	// Descriptors opened from a path are opened afresh each time
+	if(_path || _closesDescriptors) {
+		[self closeDescriptors];
+	}
+}
+
+
+- (BOOL) configureDescriptor:(int)descriptor {
+	
+	if(!isatty(descriptor)) {
+		return YES;
+	}
+	
+	struct termios settings;
+	
+	if(tcgetattr(descriptor, &settings) != 0) {
+		return NO;
+	}
+	
+	// Bytes are passed through untouched, and a read returns whatever has
+	// arrived
+	cfmakeraw(&settings);
+	settings.c_cflag		|= (CLOCAL | CREAD);
+	settings.c_cc[VMIN]		= 1;
+	settings.c_cc[VTIME]	= 0;
+	
+	return (tcsetattr(descriptor, TCSANOW, &settings) == 0);
+}
+
+
+#pragma mark -
+#pragma mark Readiness
+
+- (void) didScheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	
+	CFFileDescriptorContext context	= { 0, self, NULL, NULL, NULL };
+	
+	if(_readDescriptor < 0) {
+		return;
+	}
+	
+	_readSource						= CFFileDescriptorCreate(kCFAllocatorDefault, _readDescriptor, false, descriptorCallBack, &context);
+	_readRunLoopSource				= CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, _readSource, 0);
+	CFRunLoopAddSource([runLoop getCFRunLoop], _readRunLoopSource, (CFStringRef)mode);
+	
+	if(_writeDescriptor != _readDescriptor) {
+		_writeSource				= CFFileDescriptorCreate(kCFAllocatorDefault, _writeDescriptor, false, descriptorCallBack, &context);
+		_writeRunLoopSource			= CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, _writeSource, 0);
+		CFRunLoopAddSource([runLoop getCFRunLoop], _writeRunLoopSource, (CFStringRef)mode);
+	}
+	
+	// Write readiness is only watched for after a write falls short
+	CFFileDescriptorEnableCallBacks(_readSource, kCFFileDescriptorReadCallBack);
+}
+
+
+- (void) didRemoveFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+	[self invalidateSources];
+}
+
+
+- (void) invalidateSources {
+	
+	if(_readSource) {
+		CFFileDescriptorInvalidate(_readSource);
+		CFRelease(_readRunLoopSource);
+		CFRelease(_readSource);
+		_readSource				= NULL;
+		_readRunLoopSource		= NULL;
+	}
+	
+	if(_writeSource) {
+		CFFileDescriptorInvalidate(_writeSource);
+		CFRelease(_writeRunLoopSource);
+		CFRelease(_writeSource);
+		_writeSource			= NULL;
+		_writeRunLoopSource		= NULL;
+	}
+}
+
+
+- (void) closeDescriptors {
+	
+	if(_writeDescriptor >= 0 && _writeDescriptor != _readDescriptor) {
+		close(_writeDescriptor);
+	}
+	
+	if(_readDescriptor >= 0) {
+		close(_readDescriptor);
+	}
+	
+	_readDescriptor			= -1;
+	_writeDescriptor		= -1;
+}
+
+
+- (void) descriptorDidBecomeReady:(CFOptionFlags)callBackTypes {
+	
+	if(callBackTypes & kCFFileDescriptorReadCallBack) {
+		[self signalEvent:NSStreamEventHasBytesAvailable forStream:_inputStream];
+	}
+	
+	if(callBackTypes & kCFFileDescriptorWriteCallBack) {
+		[self signalEvent:NSStreamEventHasSpaceAvailable forStream:_outputStream];
+	}
+}
+
+
+- (void) deliverEvents {
+	
+	[super deliverEvents];
+	
+	// Descriptor callbacks are one-shot.  Re-armed once the delegate has had
+	// its chance to read, the callback comes straight back if it left
+	// anything unread.
+	if(_readSource && !_atEnd) {
+		CFFileDescriptorEnableCallBacks(_readSource, kCFFileDescriptorReadCallBack);
+	}
+}
+
+
+#pragma mark -
+#pragma mark Reading and Writing
+
+- (BOOL) hasBytesAvailable {
+	
+	if(_atEnd || _readDescriptor < 0) {
+		return NO;
+	}
+	
+	// A hang up counts, so the read that follows finds the end
+	struct pollfd poller	= { _readDescriptor, POLLIN, 0 };
+	
+	return (poll(&poller, 1, 0) > 0 && (poller.revents & (POLLIN | POLLHUP)) != 0);
+}
+
+
+- (NSInteger) readBytes:(uint8_t*)buffer maxLength:(NSUInteger)maxLength {
+	
+	if(_atEnd) {
+		return 0;
+	}
+	
+	ssize_t count	= read(_readDescriptor, buffer, maxLength);
+	
+	if(count > 0) {
+		return count;
+	}
+	
+	// A pty master reads EIO once its slave has been closed
+	if(count == 0 || errno == EIO) {
+		_atEnd		= YES;
+		[self signalEvent:NSStreamEventEndEncountered forStream:_inputStream];
+		return 0;
+	}
+	
+	if(errno == EAGAIN || errno == EINTR) {
+		return 0;
+	}
+	
+	[self failWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]];
+	return -1;
+}
+
+
+- (BOOL) hasSpaceAvailable {
+	
+	if(_writeDescriptor < 0) {
+		return NO;
+	}
+	
+	struct pollfd poller	= { _writeDescriptor, POLLOUT, 0 };
+	
+	return (poll(&poller, 1, 0) > 0 && (poller.revents & POLLOUT) != 0);
+}
+
+
+- (NSInteger) writeBytes:(const uint8_t*)buffer length:(NSUInteger)length {
+	
+	// Writing to a pipe whose reader has gone raises SIGPIPE, as ever, so a
+	// process using pipe transports should ignore it
+	ssize_t count	= write(_writeDescriptor, buffer, length);
+	
+	if(count < 0) {
+		if(errno != EAGAIN && errno != EINTR) {
+			[self failWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]];
+			return -1;
+		}
+		
+		count		= 0;
+	}
+	
+	if((NSUInteger)count < length) {
+		CFFileDescriptorRef source	= (_writeSource) ? _writeSource : _readSource;
+		
+		if(source) {
+			CFFileDescriptorEnableCallBacks(source, kCFFileDescriptorWriteCallBack);
+		}
+	}
+	
+	return count;
+}
+
+@end
+
+
+#pragma mark -
+@interface FLMemoryTransport (Private)
+- (void) appendBytes:(const uint8_t*)bytes length:(NSUInteger)length;
+- (void) peerDidSignal:(NSStreamEvent)event;
+@end
+
+
+@implementation FLMemoryTransport
+
++ (void) getTransport:(FLMemoryTransport**)transport peer:(FLMemoryTransport**)peer {
+	
+	FLMemoryTransport* first	= [[[FLMemoryTransport alloc] init] autorelease];
+	FLMemoryTransport* second	= [[[FLMemoryTransport alloc] init] autorelease];
+	id lock						= [[NSObject alloc] init];
+	
+	first->_lock				= lock;
+	first->_peer				= second;
+	second->_lock				= [lock retain];
+	second->_peer				= first;
+	
+	*transport					= first;
+	*peer						= second;
+}
+
+
+- init {
+	
+	if(self = [super init]) {
+		_buffer		= [[NSMutableData alloc] init];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	@synchronized(_lock) {
+		if(_peer) {
+			_peer->_peer		= nil;
+			_peer->_peerClosed	= YES;
+			[_peer peerDidSignal:NSStreamEventEndEncountered];
+		}
+	}
+	
+	[_buffer release];
+	[_lock release];
+	[super dealloc];
+}
+
+
+- (BOOL) open {
+	
+	@synchronized(_lock) {
+		if(_closed) {
+			FLERROR(@"%@ has been closed", self)
+			return NO;
+		}
+	}
+	
+	[self createStreams];
+	
+	return [super open];
+}
+
+
+- (void) close {
+	
+	@synchronized(_lock) {
+		_closed		= YES;
+		
+		if(_peer) {
+			_peer->_peerClosed	= YES;
+			[_peer peerDidSignal:NSStreamEventEndEncountered];
+		}
+	}
+	
+	[self releaseStreams];
+}
+
+
+- (void) streamDidOpen:(NSStream*)stream {
+	
+	[super streamDidOpen:stream];
+	
+	@synchronized(_lock) {
+		if(stream == _inputStream && _peerClosed) {
+			[self signalEvent:NSStreamEventEndEncountered forStream:stream];
+		}
+	}
+}
+
+
+// Called with the lock held, from the peer's thread
+- (void) appendBytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	if(_bufferOffset > 0 && _bufferOffset >= ([_buffer length] / 2)) {
+		// Drop the already-read bytes once they make up most of the buffer
+		[_buffer replaceBytesInRange:NSMakeRange(0, _bufferOffset) withBytes:NULL length:0];
+		_bufferOffset	= 0;
+	}
+	
+	[_buffer appendBytes:bytes length:length];
+	[self peerDidSignal:NSStreamEventHasBytesAvailable];
+}
+
+
+- (void) peerDidSignal:(NSStreamEvent)event {
+	
+	@synchronized(self) {
+		[self signalEvent:event forStream:_inputStream];
+	}
+}
+
+
+#pragma mark -
+#pragma mark Reading and Writing
+
+- (BOOL) hasBytesAvailable {
+	
+	@synchronized(_lock) {
+		return (_bufferOffset < [_buffer length]);
+	}
+	
+	return NO;
+}
+
+
+- (NSInteger) readBytes:(uint8_t*)buffer maxLength:(NSUInteger)maxLength {
+	
+	@synchronized(_lock) {
+		NSUInteger count	= MIN(maxLength, [_buffer length] - _bufferOffset);
+		
+		memcpy(buffer, (const uint8_t*)[_buffer bytes] + _bufferOffset, count);
+		_bufferOffset		+= count;
+		
+		if(_bufferOffset == [_buffer length]) {
+			[_buffer setLength:0];
+			_bufferOffset	= 0;
+		}
+		
+		return count;
+	}
+	
+	return 0;
+}
+
+
+- (BOOL) hasSpaceAvailable {
+	
+	@synchronized(_lock) {
+		return (_peer != nil && !_peerClosed && !_closed);
+	}
+	
+	return NO;
+}
+
+
+- (NSInteger) writeBytes:(const uint8_t*)buffer length:(NSUInteger)length {
+	
+	@synchronized(_lock) {
+		if(_peer && !_peerClosed && !_closed) {
+			[_peer appendBytes:buffer length:length];
+			return length;
+		}
+	}
+	
+	[self failWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:EPIPE userInfo:nil]];
+	return -1;
+}
+
+@end
@@ -0,0 +1,83 @@
+/*
+ *  FLSerialTransport.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanToolTransport.h"
+
+
+// Rate an ELM327 starts at with its baud rate pin high, and the rate ports
+// are opened at unless told otherwise
+#define SERIAL_TRANSPORT_DEFAULT_BAUD_RATE		38400
+
+// Highest rate negotiated by default.  Every ELM327 which accepts AT BRD
+// reaches it, as do the USB serial bridges in common adapters.
+#define SERIAL_TRANSPORT_DEFAULT_MAX_BAUD_RATE	115200
+
+
+/*
+ A serial port, e.g. /dev/cu.usbserial for a USB adapter, run at 8N1
+ with no flow control.  The rate may be changed while the port is open;
+ an ELM327 scan tool does so during its init sequence, moving from
+ baudRate up to at most maxBaudRate if the adapter accepts AT BRD:
+
+	transport				= [FLSerialTransport transportWithPath:@"/dev/cu.usbserial" baudRate:38400];
+	transport.maxBaudRate	= 500000;
+	
+	scanTool				= [FLScanTool scanToolForDeviceType:kScanToolDeviceTypeELM327];
+	scanTool.transport		= transport;
+
+ Descriptors which are not terminals, e.g. a pipe, are used as they are,
+ and take any rate.  A pty takes any rate it is given, so the negotiation
+ can be run against a stand-in on the slave side.
+ */
+@interface FLSerialTransport : FLFileDescriptorTransport {
+	NSUInteger				_baudRate;
+	NSUInteger				_maxBaudRate;
+}
+
+// Rate the port is at, or will be opened at
+@property (nonatomic, readonly) NSUInteger baudRate;
+
+// Highest rate a scan tool may move the port to.  Defaults to
+// SERIAL_TRANSPORT_DEFAULT_MAX_BAUD_RATE.
+@property (nonatomic, assign) NSUInteger maxBaudRate;
+
++ (FLSerialTransport*) transportWithPath:(NSString*)path baudRate:(NSUInteger)baudRate;
+
+// Whether the system can set a port to baudRate.  Whether the port's own
+// hardware can run at it is only found out by trying.
++ (BOOL) supportsBaudRate:(NSUInteger)baudRate;
+
+- initWithPath:(NSString*)path baudRate:(NSUInteger)baudRate;
+
+// Moves the port to baudRate, at once if it is open.  It does not wait for
+// bytes already written to be sent, as that would hold up every scan tool
+// on the same scan loop, so any still queued go out at the new rate.  Call
+// it once the other end has answered what was written, as the ELM327 does
+// before switching.  Returns NO, leaving the rate as it was, if the rate
+// cannot be set.
+- (BOOL) switchToBaudRate:(NSUInteger)baudRate;
+
+// Whether bytes written to the port have yet to leave it.  A caller which
+// needs them sent at the current rate polls this from a timer before
+// switching.
+- (BOOL) hasPendingOutput;
+
+@end
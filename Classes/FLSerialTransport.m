@@ -0,0 +1,202 @@
+/*
+ *  FLSerialTransport.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLSerialTransport.h"
+#import "FLLogging.h"
+#import <termios.h>
+#import <unistd.h>
+#import <sys/ioctl.h>
+#import <errno.h>
+
+
+// The termios speed for baudRate, or 0 if there is none.  Darwin's speeds
+// are the rates themselves, so it is handed any rate, which the driver may
+// refuse.
+static speed_t speedForBaudRate(NSUInteger baudRate) {
+	
+	switch(baudRate) {
+		case 9600:		return B9600;
+		case 19200:		return B19200;
+		case 38400:		return B38400;
+		case 57600:		return B57600;
+		case 115200:	return B115200;
+		case 230400:	return B230400;
+#ifdef B500000
+		case 500000:	return B500000;
+#endif
+		default:		break;
+	}
+	
+#if defined(__APPLE__)
+	return (speed_t)baudRate;
+#else
+	return 0;
+#endif
+}
+
+
+#pragma mark -
+@interface FLSerialTransport (Private)
+- (BOOL) setBaudRate:(NSUInteger)baudRate ofDescriptor:(int)descriptor when:(int)action;
+@end
+
+
+@implementation FLSerialTransport
+
+@synthesize baudRate		= _baudRate,
+			maxBaudRate		= _maxBaudRate;
+
+
++ (FLSerialTransport*) transportWithPath:(NSString*)path baudRate:(NSUInteger)baudRate {
+	return [[[self alloc] initWithPath:path baudRate:baudRate] autorelease];
+}
+
+
++ (BOOL) supportsBaudRate:(NSUInteger)baudRate {
+	return (baudRate > 0 && speedForBaudRate(baudRate) != 0);
+}
+
+
+- initWithPath:(NSString*)path baudRate:(NSUInteger)baudRate {
+	
+	if(self = [super initWithPath:path]) {
+		_baudRate			= baudRate;
+		_maxBaudRate		= SERIAL_TRANSPORT_DEFAULT_MAX_BAUD_RATE;
+	}
+	
+	return self;
+}
+
+
+- initWithPath:(NSString*)path {
+	return [self initWithPath:path baudRate:SERIAL_TRANSPORT_DEFAULT_BAUD_RATE];
+}
+
+
+- initWithReadDescriptor:(int)readDescriptor writeDescriptor:(int)writeDescriptor closesDescriptors:(BOOL)closesDescriptors {
+	
+	if(self = [super initWithReadDescriptor:readDescriptor writeDescriptor:writeDescriptor closesDescriptors:closesDescriptors]) {
+		_baudRate			= SERIAL_TRANSPORT_DEFAULT_BAUD_RATE;
+		_maxBaudRate		= SERIAL_TRANSPORT_DEFAULT_MAX_BAUD_RATE;
+	}
+	
+	return self;
+}
+
+
+- (NSString*) description {
+	return [NSString stringWithFormat:@"%@ at %d baud", [super description], _baudRate];
+}
+
+
+- (BOOL) configureDescriptor:(int)descriptor {
+	
+	if(![super configureDescriptor:descriptor]) {
+		return NO;
+	}
+	
+	return (!isatty(descriptor) || [self setBaudRate:_baudRate ofDescriptor:descriptor when:TCSANOW]);
+}
+
+
+- (BOOL) switchToBaudRate:(NSUInteger)baudRate {
+	
+	if(![FLSerialTransport supportsBaudRate:baudRate]) {
+		FLERROR(@"Unsupported baud rate %d", baudRate)
+		return NO;
+	}
+	
+	if(baudRate == _baudRate) {
+		return YES;
+	}
+	
+	// Not open; the rate is set as the port is opened
+	if(!self.inputStream) {
+		_baudRate			= baudRate;
+		return YES;
+	}
+	
+	int descriptors[]		= { _readDescriptor, _writeDescriptor };
+	NSUInteger count		= (_readDescriptor == _writeDescriptor) ? 1 : 2;
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		if(isatty(descriptors[i]) && ![self setBaudRate:baudRate ofDescriptor:descriptors[i] when:TCSANOW]) {
+			FLERROR(@"Unable to set %@ to %d baud (errno=%d)", self, baudRate, errno)
+			
+			// Put back any descriptor already changed
+			for(NSUInteger j = 0; j < i; j++) {
+				if(isatty(descriptors[j])) {
+					[self setBaudRate:_baudRate ofDescriptor:descriptors[j] when:TCSANOW];
+				}
+			}
+			
+			return NO;
+		}
+	}
+	
+	FLDEBUG(@"%@ switched to %d baud", self, baudRate)
+	_baudRate				= baudRate;
+	
+	return YES;
+}
+
+
+- (BOOL) hasPendingOutput {
+	
+	if(!self.outputStream || !isatty(_writeDescriptor)) {
+		return NO;
+	}
+	
+	int queued				= 0;
+	
+	if(ioctl(_writeDescriptor, TIOCOUTQ, &queued) != 0) {
+		return NO;
+	}
+	
+	return (queued > 0);
+}
+
+
+- (BOOL) setBaudRate:(NSUInteger)baudRate ofDescriptor:(int)descriptor when:(int)action {
+	
+	speed_t speed			= speedForBaudRate(baudRate);
+	struct termios settings;
+	
+	if(speed == 0 || tcgetattr(descriptor, &settings) != 0) {
+		return NO;
+	}
+	
+	// 8N1, with no hardware or software flow control, which the ELM327
+	// does not use
+	settings.c_cflag		&= ~(CSIZE | PARENB | CSTOPB);
+	settings.c_cflag		|= (CS8 | CLOCAL | CREAD);
+#ifdef CRTSCTS
+	settings.c_cflag		&= ~CRTSCTS;
+#endif
+	settings.c_iflag		&= ~(IXON | IXOFF | IXANY);
+	
+	if(cfsetispeed(&settings, speed) != 0 || cfsetospeed(&settings, speed) != 0) {
+		return NO;
+	}
+	
+	return (tcsetattr(descriptor, action, &settings) == 0);
+}
+
+@end
@@ -0,0 +1,168 @@
+/*
+ *  FLTripJournal.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanToolResponse.h"
+
+
+//------------------------------------------------------------------------------
+// Journal Format
+//
+// A journal is a directory of segment files, each written once from start
+// to end and never modified after.  A segment is:
+//
+//	FLTripJournalHeader
+//	blocks, each an FLTripJournalBlock followed by its frames
+//	the index, one FLTripJournalIndexEntry per block	} written when the
+//	FLTripJournalTrailer								} segment is closed
+//
+// A segment without a trailer (e.g. the writer was killed) is read by
+// walking the block headers.  All values are in host byte order, which is
+// little endian on every supported device.
+
+#define TRIP_JOURNAL_MAGIC				0x4A544C46		// "FLTJ"
+#define TRIP_JOURNAL_BLOCK_MAGIC		0x424A4C46		// "FLJB"
+#define TRIP_JOURNAL_INDEX_MAGIC		0x494A4C46		// "FLJI"
+#define TRIP_JOURNAL_VERSION			1
+
+#define TRIP_JOURNAL_SEGMENT_EXTENSION	@"fltj"
+
+// Frames are written into blocks of this size in memory, and each block is
+// one write to the segment file
+#define TRIP_JOURNAL_BLOCK_SIZE			16384
+
+#define TRIP_JOURNAL_DEFAULT_SEGMENT_SIZE	(8 * 1024 * 1024)
+#define TRIP_JOURNAL_DEFAULT_BLOCKS_PER_SYNC	4
+
+// Frames are padded so that each frame header is 8-byte aligned
+#define TRIP_JOURNAL_FRAME_SIZE(length)	((sizeof(FLTripJournalFrame) + (length) + 7) & ~(size_t)7)
+
+// Bit of a block's PID set for a PID.  PIDs sharing a bit only cost a
+// reader a walk through a block it could have skipped.
+#define TRIP_JOURNAL_PID_BIT(pid)		(((pid) ^ ((pid) >> 8)) & 0xFF)
+#define TRIP_JOURNAL_HAS_PID(set, pid)	(((set)[TRIP_JOURNAL_PID_BIT(pid) >> 5] & (1U << (TRIP_JOURNAL_PID_BIT(pid) & 0x1F))) != 0)
+
+
+typedef struct trip_journal_header_t {
+	uint32_t		magic;
+	uint16_t		version;
+	uint16_t		headerLength;
+	uint32_t		segment;
+	uint32_t		reserved;
+	double			monotonicTime;		// FLMonotonicTime() when the segment was opened
+	double			referenceTime;		// Seconds since the reference date at the same moment
+} FLTripJournalHeader;
+
+
+typedef struct trip_journal_block_t {
+	uint32_t		magic;
+	uint32_t		length;				// Bytes in the block, including this header
+	uint32_t		frameCount;
+	uint32_t		reserved;
+	double			minTime;			// Frame timestamps, FLMonotonicTime()
+	double			maxTime;
+	uint32_t		pidSet[8];			// TRIP_JOURNAL_PID_BIT of each frame
+} FLTripJournalBlock;
+
+
+// A scan tool record, less the unused part of its bytes
+typedef struct trip_journal_frame_t {
+	double			timestamp;
+	uint32_t		ecuAddress;
+	uint16_t		protocol;
+	uint16_t		pid;
+	uint8_t			mode;
+	uint8_t			priority;
+	uint8_t			targetAddress;
+	uint8_t			dataOffset;
+	uint8_t			length;
+	uint8_t			reserved[3];
+	// length bytes follow
+} FLTripJournalFrame;
+
+
+typedef struct trip_journal_index_entry_t {
+	uint64_t		offset;				// Of the block in the segment
+	double			minTime;
+	double			maxTime;
+	uint32_t		frameCount;
+	uint32_t		reserved;
+	uint32_t		pidSet[8];
+} FLTripJournalIndexEntry;
+
+
+typedef struct trip_journal_trailer_t {
+	uint32_t		magic;
+	uint32_t		blockCount;
+	uint64_t		indexOffset;
+} FLTripJournalTrailer;
+
+
+/*
+ Appends scan tool records to a journal.  Records are copied into an
+ in-memory block on the calling thread, which is all the scan thread pays
+ for a sample; full blocks are written, and synced in groups of
+ blocksPerSync, on a queue of their own.  New segments are started once a
+ segment reaches segmentSize, and each time a journal is opened, so an
+ existing journal is only ever appended to.
+
+ -appendRecords:count: and -flush must be called from one thread at a
+ time.  Set as the journal of a scan tool, they are called on its stream
+ thread.  See FLTripJournalReader for reading a journal back.
+ */
+@interface FLTripJournal : NSObject {
+	NSString*				_path;
+	NSOperationQueue*		_writeQueue;
+	
+	// Filled on the appending thread
+	NSMutableData*			_block;
+	NSUInteger				_blockLength;
+	
+	// Used on the write queue
+	int						_fd;
+	NSUInteger				_segment;
+	uint64_t				_segmentLength;
+	NSMutableData*			_index;
+	NSUInteger				_blocksSinceSync;
+	NSUInteger				_segmentSize;
+	NSUInteger				_blocksPerSync;
+}
+
+@property (nonatomic, readonly) NSString* path;
+
+// Set before the first records are appended
+@property (nonatomic, assign) NSUInteger segmentSize;
+@property (nonatomic, assign) NSUInteger blocksPerSync;
+
+// Creates the directory at path if there is none
++ (FLTripJournal*) journalWithPath:(NSString*)path;
+- initWithPath:(NSString*)path;
+
+- (void) appendRecords:(const FLScanToolRecord*)records count:(NSUInteger)count;
+
+// Queues the partly filled block and a sync of the segment.  Returns
+// without waiting for either.
+- (void) flush;
+
+// Flushes, finishes the current segment and waits for the writes.  Called
+// on dealloc if not before.
+- (void) close;
+
+@end
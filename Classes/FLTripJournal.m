@@ -0,0 +1,363 @@
+/*
+ *  FLTripJournal.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLTripJournal.h"
+#import "FLLogging.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+static BOOL writeFully(int fd, const void* bytes, size_t length) {
+	
+	const uint8_t* cursor = (const uint8_t*)bytes;
+	
+	while(length > 0) {
+		ssize_t written = write(fd, cursor, length);
+		
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			return NO;
+		}
+		
+		cursor	+= written;
+		length	-= written;
+	}
+	
+	return YES;
+}
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLTripJournal (Private)
+- (NSUInteger) lastSegmentNumber;
+- (BOOL) sealBlock;
+- (void) finishBlock;
+- (void) writeBlock:(NSData*)block;
+- (void) syncSegment;
+- (BOOL) openSegment;
+- (void) closeSegment;
+@end
+
+
+#pragma mark -
+@implementation FLTripJournal
+
+@synthesize path			= _path,
+			segmentSize		= _segmentSize,
+			blocksPerSync	= _blocksPerSync;
+
+
++ (FLTripJournal*) journalWithPath:(NSString*)path {
+	return [[[FLTripJournal alloc] initWithPath:path] autorelease];
+}
+
+
+- initWithPath:(NSString*)path {
+	
+	if(self = [super init]) {
+		NSError* error	= nil;
+		
+		if(![[NSFileManager defaultManager] createDirectoryAtPath:path
+									  withIntermediateDirectories:YES
+													   attributes:nil
+															error:&error]) {
+			FLNSERROR(error)
+			[self release];
+			return nil;
+		}
+		
+		_path			= [path copy];
+		_fd				= -1;
+		_segment		= [self lastSegmentNumber] + 1;
+		_segmentSize	= TRIP_JOURNAL_DEFAULT_SEGMENT_SIZE;
+		_blocksPerSync	= TRIP_JOURNAL_DEFAULT_BLOCKS_PER_SYNC;
+		_index			= [[NSMutableData alloc] initWithCapacity:(64 * sizeof(FLTripJournalIndexEntry))];
+		
+		// One block at a time, in order
+		_writeQueue		= [[NSOperationQueue alloc] init];
+		[_writeQueue setMaxConcurrentOperationCount:1];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	// Queued writes retain the journal, so none are left by now, and the
+	// last block and the index are written here directly
+	if([self sealBlock]) {
+		[self writeBlock:_block];
+	}
+	
+	[self closeSegment];
+	
+	[_writeQueue release];
+	[_block release];
+	[_index release];
+	[_path release];
+	[super dealloc];
+}
+
+
+- (NSUInteger) lastSegmentNumber {
+	
+	NSUInteger last		= 0;
+	
+	for(NSString* file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_path error:NULL]) {
+		if([[file pathExtension] isEqualToString:TRIP_JOURNAL_SEGMENT_EXTENSION]) {
+			last		= MAX(last, (NSUInteger)[[file stringByDeletingPathExtension] integerValue]);
+		}
+	}
+	
+	return last;
+}
+
+
+#pragma mark -
+#pragma mark Appending
+
+- (void) appendRecords:(const FLScanToolRecord*)records count:(NSUInteger)count {
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		const FLScanToolRecord* record	= &records[i];
+		size_t frameSize				= TRIP_JOURNAL_FRAME_SIZE(record->length);
+		
+		if(_block && (_blockLength + frameSize) > TRIP_JOURNAL_BLOCK_SIZE) {
+			[self finishBlock];
+		}
+		
+		if(!_block) {
+			_block						= [[NSMutableData alloc] initWithLength:TRIP_JOURNAL_BLOCK_SIZE];
+			_blockLength				= sizeof(FLTripJournalBlock);
+		}
+		
+		uint8_t* bytes					= (uint8_t*)[_block mutableBytes];
+		FLTripJournalBlock* block		= (FLTripJournalBlock*)bytes;
+		FLTripJournalFrame* frame		= (FLTripJournalFrame*)&bytes[_blockLength];
+		
+		frame->timestamp				= record->timestamp;
+		frame->ecuAddress				= record->ecuAddress;
+		frame->protocol					= record->protocol;
+		frame->pid						= record->pid;
+		frame->mode						= record->mode;
+		frame->priority					= record->priority;
+		frame->targetAddress			= record->targetAddress;
+		frame->dataOffset				= record->dataOffset;
+		frame->length					= record->length;
+		memcpy(&frame[1], record->bytes, record->length);
+		
+		if(block->frameCount == 0 || record->timestamp < block->minTime) {
+			block->minTime				= record->timestamp;
+		}
+		
+		if(block->frameCount == 0 || record->timestamp > block->maxTime) {
+			block->maxTime				= record->timestamp;
+		}
+		
+		block->pidSet[TRIP_JOURNAL_PID_BIT(record->pid) >> 5]	|= 1U << (TRIP_JOURNAL_PID_BIT(record->pid) & 0x1F);
+		block->frameCount++;
+		_blockLength					+= frameSize;
+	}
+}
+
+
+- (BOOL) sealBlock {
+	
+	if(!_block) {
+		return NO;
+	}
+	
+	FLTripJournalBlock* block	= (FLTripJournalBlock*)[_block mutableBytes];
+	
+	block->magic				= TRIP_JOURNAL_BLOCK_MAGIC;
+	block->length				= _blockLength;
+	[_block setLength:_blockLength];
+	
+	return YES;
+}
+
+
+- (void) finishBlock {
+	
+	if(![self sealBlock]) {
+		return;
+	}
+	
+	NSInvocationOperation* op	= [[NSInvocationOperation alloc] initWithTarget:self
+																	selector:@selector(writeBlock:)
+																	  object:_block];
+	[_writeQueue addOperation:op];
+	[op release];
+	
+	[_block release];
+	_block						= nil;
+	_blockLength				= 0;
+}
+
+
+- (void) flush {
+	
+	[self finishBlock];
+	
+	NSInvocationOperation* op	= [[NSInvocationOperation alloc] initWithTarget:self
+																	selector:@selector(syncSegment)
+																	  object:nil];
+	[_writeQueue addOperation:op];
+	[op release];
+}
+
+
+- (void) close {
+	
+	[self finishBlock];
+	
+	NSInvocationOperation* op	= [[NSInvocationOperation alloc] initWithTarget:self
+																	selector:@selector(closeSegment)
+																	  object:nil];
+	[_writeQueue addOperation:op];
+	[op release];
+	
+	[_writeQueue waitUntilAllOperationsAreFinished];
+}
+
+
+#pragma mark -
+#pragma mark Write Queue
+
+- (void) writeBlock:(NSData*)data {
+	
+	if(_fd < 0 && ![self openSegment]) {
+		return;
+	}
+	
+	const FLTripJournalBlock* block		= (const FLTripJournalBlock*)[data bytes];
+	FLTripJournalIndexEntry entry;
+	
+	memset(&entry, 0, sizeof(entry));
+	entry.offset			= _segmentLength;
+	entry.minTime			= block->minTime;
+	entry.maxTime			= block->maxTime;
+	entry.frameCount		= block->frameCount;
+	memcpy(entry.pidSet, block->pidSet, sizeof(entry.pidSet));
+	
+	if(!writeFully(_fd, [data bytes], [data length])) {
+		// The block is lost, but the segment is still readable up to it
+		FLERROR(@"Failed to write journal block (%d)", errno)
+		[self closeSegment];
+		return;
+	}
+	
+	[_index appendBytes:&entry length:sizeof(entry)];
+	_segmentLength			+= [data length];
+	
+	if(++_blocksSinceSync >= _blocksPerSync) {
+		[self syncSegment];
+	}
+	
+	if(_segmentLength >= _segmentSize) {
+		[self closeSegment];
+	}
+}
+
+
+- (void) syncSegment {
+	
+	if(_fd >= 0 && _blocksSinceSync > 0) {
+		if(fsync(_fd) != 0) {
+			FLERROR(@"Failed to sync journal segment (%d)", errno)
+		}
+		
+		_blocksSinceSync	= 0;
+	}
+}
+
+
+- (BOOL) openSegment {
+	
+	NSString* file				= [_path stringByAppendingPathComponent:
+								   [NSString stringWithFormat:@"%06u.%@", _segment, TRIP_JOURNAL_SEGMENT_EXTENSION]];
+	FLTripJournalHeader header;
+	
+	_fd							= open([file fileSystemRepresentation], O_WRONLY | O_CREAT | O_EXCL, 0644);
+	
+	if(_fd < 0) {
+		FLERROR(@"Failed to create journal segment %@ (%d)", file, errno)
+		_segment++;
+		return NO;
+	}
+	
+	memset(&header, 0, sizeof(header));
+	header.magic				= TRIP_JOURNAL_MAGIC;
+	header.version				= TRIP_JOURNAL_VERSION;
+	header.headerLength			= sizeof(header);
+	header.segment				= _segment;
+	header.monotonicTime		= FLMonotonicTime();
+	header.referenceTime		= [NSDate timeIntervalSinceReferenceDate];
+	
+	if(!writeFully(_fd, &header, sizeof(header))) {
+		FLERROR(@"Failed to write journal segment header (%d)", errno)
+		close(_fd);
+		_fd						= -1;
+		_segment++;
+		return NO;
+	}
+	
+	_segmentLength				= sizeof(header);
+	_blocksSinceSync			= 0;
+	[_index setLength:0];
+	
+	return YES;
+}
+
+
+- (void) closeSegment {
+	
+	if(_fd < 0) {
+		return;
+	}
+	
+	FLTripJournalTrailer trailer;
+	
+	trailer.magic			= TRIP_JOURNAL_INDEX_MAGIC;
+	trailer.blockCount		= [_index length] / sizeof(FLTripJournalIndexEntry);
+	trailer.indexOffset		= _segmentLength;
+	
+	if(!writeFully(_fd, [_index bytes], [_index length]) ||
+	   !writeFully(_fd, &trailer, sizeof(trailer))) {
+		FLERROR(@"Failed to write journal segment index (%d)", errno)
+	}
+	
+	if(fsync(_fd) != 0) {
+		FLERROR(@"Failed to sync journal segment (%d)", errno)
+	}
+	
+	close(_fd);
+	_fd						= -1;
+	_segment++;
+	[_index setLength:0];
+}
+
+@end
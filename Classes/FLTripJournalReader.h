@@ -0,0 +1,89 @@
+/*
+ *  FLTripJournalReader.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLTripJournal.h"
+
+
+// A memory-mapped journal segment and its block index
+typedef struct trip_journal_segment_t {
+	const uint8_t*					bytes;
+	size_t							length;
+	const FLTripJournalHeader*		header;
+	const FLTripJournalIndexEntry*	index;
+	FLTripJournalIndexEntry*		builtIndex;		// For segments without a trailer
+	NSUInteger						blockCount;
+	double							minTime;
+	double							maxTime;
+} FLTripJournalSegment;
+
+
+// Position of a sequential read through a journal.  Zero it to start from
+// the first record.
+typedef struct trip_journal_cursor_t {
+	NSUInteger						segment;
+	NSUInteger						block;
+	NSUInteger						frame;
+	size_t							offset;			// Of the frame in its block
+} FLTripJournalCursor;
+
+
+/*
+ Reads records back from a journal written by FLTripJournal.  Segments
+ are memory-mapped, and a query only touches the blocks whose time range
+ and PID set match it, so pulling one PID over a few minutes of a long
+ trip reads a handful of pages.  A segment still being written is read up
+ to its last complete block when the reader is created.
+
+ Times are seconds since the reference date, as NSDate uses, both in
+ queries and in the timestamp of the records returned.
+ */
+@interface FLTripJournalReader : NSObject {
+	NSString*				_path;
+	FLTripJournalSegment*	_segments;
+	NSUInteger				_segmentCount;
+}
+
+@property (nonatomic, readonly) NSString* path;
+@property (nonatomic, readonly) NSUInteger segmentCount;
+
+// Time of the first and last records in the journal, NAN if it is empty
+@property (nonatomic, readonly) NSTimeInterval startTime;
+@property (nonatomic, readonly) NSTimeInterval endTime;
+
++ (FLTripJournalReader*) readerWithPath:(NSString*)path;
+- initWithPath:(NSString*)path;
+
+// FLScanToolRecords for the mode and PID with timestamps from start to end
+// inclusive, in journal order
+- (NSData*) recordsForMode:(NSUInteger)mode
+					   pid:(NSUInteger)pid
+				 startTime:(NSTimeInterval)start
+				   endTime:(NSTimeInterval)end;
+
+// Copies up to maxCount records, in journal order, from cursor on and
+// advances the cursor past them.  Returns the number copied, 0 once the
+// whole journal has been read.  Reads in bounded memory however long the
+// journal is.
+- (NSUInteger) readRecords:(FLScanToolRecord*)records 
+				  maxCount:(NSUInteger)maxCount 
+					cursor:(FLTripJournalCursor*)cursor;
+
+@end
@@ -0,0 +1,369 @@
+/*
+ *  FLTripJournalReader.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLTripJournalReader.h"
+#import "FLLogging.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Seconds since the reference date of a timestamp in the segment
+#define SEGMENT_REFERENCE_TIME(segment, time)	((time) - (segment)->header->monotonicTime + (segment)->header->referenceTime)
+#define SEGMENT_MONOTONIC_TIME(segment, time)	((time) - (segment)->header->referenceTime + (segment)->header->monotonicTime)
+
+
+static BOOL readTrailer(FLTripJournalSegment* segment) {
+	
+	if(segment->length < (segment->header->headerLength + sizeof(FLTripJournalTrailer))) {
+		return NO;
+	}
+	
+	const FLTripJournalTrailer* trailer	= (const FLTripJournalTrailer*)&segment->bytes[segment->length - sizeof(FLTripJournalTrailer)];
+	
+	if(trailer->magic != TRIP_JOURNAL_INDEX_MAGIC ||
+	   (trailer->indexOffset + (trailer->blockCount * sizeof(FLTripJournalIndexEntry)) + sizeof(FLTripJournalTrailer)) != segment->length) {
+		return NO;
+	}
+	
+	segment->index						= (const FLTripJournalIndexEntry*)&segment->bytes[trailer->indexOffset];
+	segment->blockCount					= trailer->blockCount;
+	
+	return YES;
+}
+
+
+// Rebuilds the index of a segment which was not closed, from its blocks
+static void buildIndex(FLTripJournalSegment* segment) {
+	
+	NSUInteger capacity					= 0;
+	size_t offset						= segment->header->headerLength;
+	
+	while((offset + sizeof(FLTripJournalBlock)) <= segment->length) {
+		const FLTripJournalBlock* block	= (const FLTripJournalBlock*)&segment->bytes[offset];
+		
+		if(block->magic != TRIP_JOURNAL_BLOCK_MAGIC ||
+		   block->length < sizeof(FLTripJournalBlock) ||
+		   (offset + block->length) > segment->length) {
+			break;
+		}
+		
+		if(segment->blockCount == capacity) {
+			capacity					= MAX(capacity * 2, 64);
+			FLTripJournalIndexEntry* index	= (FLTripJournalIndexEntry*)realloc(segment->builtIndex, capacity * sizeof(FLTripJournalIndexEntry));
+			
+			if(!index) {
+				break;
+			}
+			
+			segment->builtIndex			= index;
+		}
+		
+		FLTripJournalIndexEntry* entry	= &segment->builtIndex[segment->blockCount++];
+		
+		memset(entry, 0, sizeof(*entry));
+		entry->offset					= offset;
+		entry->minTime					= block->minTime;
+		entry->maxTime					= block->maxTime;
+		entry->frameCount				= block->frameCount;
+		memcpy(entry->pidSet, block->pidSet, sizeof(entry->pidSet));
+		
+		offset							+= block->length;
+	}
+	
+	segment->index						= segment->builtIndex;
+}
+
+
+// The block an index entry points to, or NULL if it is not in the segment
+static const FLTripJournalBlock* blockForEntry(const FLTripJournalSegment* segment, const FLTripJournalIndexEntry* entry) {
+	
+	const FLTripJournalBlock* block		= (const FLTripJournalBlock*)&segment->bytes[entry->offset];
+	
+	if((entry->offset + sizeof(FLTripJournalBlock)) > segment->length || 
+	   (entry->offset + block->length) > segment->length) {
+		FLERROR(@"Journal index of segment %u points past its end", segment->header->segment)
+		return NULL;
+	}
+	
+	return block;
+}
+
+
+// The frame at offset in the block, or NULL if it runs past the block
+static const FLTripJournalFrame* frameAtOffset(const FLTripJournalBlock* block, size_t offset) {
+	
+	const FLTripJournalFrame* frame		= (const FLTripJournalFrame*)((const uint8_t*)block + offset);
+	
+	if((offset + sizeof(FLTripJournalFrame)) > block->length ||
+	   (offset + TRIP_JOURNAL_FRAME_SIZE(frame->length)) > block->length ||
+	   frame->length > SCAN_TOOL_RECORD_MAX_LENGTH) {
+		FLERROR(@"Journal block with %u frames is damaged", block->frameCount)
+		return NULL;
+	}
+	
+	return frame;
+}
+
+
+static void copyFrameToRecord(const FLTripJournalSegment* segment, const FLTripJournalFrame* frame, FLScanToolRecord* record) {
+	record->timestamp		= SEGMENT_REFERENCE_TIME(segment, frame->timestamp);
+	record->ecuAddress		= frame->ecuAddress;
+	record->protocol		= frame->protocol;
+	record->pid				= frame->pid;
+	record->mode			= frame->mode;
+	record->priority		= frame->priority;
+	record->targetAddress	= frame->targetAddress;
+	record->dataOffset		= frame->dataOffset;
+	record->length			= frame->length;
+	memcpy(record->bytes, &frame[1], frame->length);
+}
+
+
+static BOOL mapSegment(NSString* file, FLTripJournalSegment* segment) {
+	
+	struct stat info;
+	int fd						= open([file fileSystemRepresentation], O_RDONLY);
+	
+	memset(segment, 0, sizeof(*segment));
+	
+	if(fd < 0) {
+		FLERROR(@"Failed to open journal segment %@ (%d)", file, errno)
+		return NO;
+	}
+	
+	if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(FLTripJournalHeader)) {
+		close(fd);
+		return NO;
+	}
+	
+	void* bytes					= mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if(bytes == MAP_FAILED) {
+		FLERROR(@"Failed to map journal segment %@ (%d)", file, errno)
+		return NO;
+	}
+	
+	segment->bytes				= (const uint8_t*)bytes;
+	segment->length				= (size_t)info.st_size;
+	segment->header				= (const FLTripJournalHeader*)bytes;
+	
+	if(segment->header->magic != TRIP_JOURNAL_MAGIC ||
+	   segment->header->version != TRIP_JOURNAL_VERSION ||
+	   segment->header->headerLength < sizeof(FLTripJournalHeader)) {
+		FLERROR(@"%@ is not a journal segment", file)
+		munmap(bytes, segment->length);
+		return NO;
+	}
+	
+	if(!readTrailer(segment)) {
+		buildIndex(segment);
+	}
+	
+	for(NSUInteger i = 0; i < segment->blockCount; i++) {
+		if(i == 0 || segment->index[i].minTime < segment->minTime) {
+			segment->minTime	= segment->index[i].minTime;
+		}
+		
+		if(i == 0 || segment->index[i].maxTime > segment->maxTime) {
+			segment->maxTime	= segment->index[i].maxTime;
+		}
+	}
+	
+	return YES;
+}
+
+
+#pragma mark -
+@implementation FLTripJournalReader
+
+@synthesize path			= _path,
+			segmentCount	= _segmentCount;
+
+
++ (FLTripJournalReader*) readerWithPath:(NSString*)path {
+	return [[[FLTripJournalReader alloc] initWithPath:path] autorelease];
+}
+
+
+- initWithPath:(NSString*)path {
+	
+	if(self = [super init]) {
+		NSError* error		= nil;
+		NSArray* files		= [[NSFileManager defaultManager] contentsOfDirectoryAtPath:path error:&error];
+		
+		if(!files) {
+			FLNSERROR(error)
+			[self release];
+			return nil;
+		}
+		
+		_path				= [path copy];
+		_segments			= (FLTripJournalSegment*)calloc(MAX([files count], 1), sizeof(FLTripJournalSegment));
+		
+		// Segment names are zero-padded sequence numbers
+		for(NSString* file in [files sortedArrayUsingSelector:@selector(compare:)]) {
+			if([[file pathExtension] isEqualToString:TRIP_JOURNAL_SEGMENT_EXTENSION] &&
+			   mapSegment([path stringByAppendingPathComponent:file], &_segments[_segmentCount])) {
+				_segmentCount++;
+			}
+		}
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	for(NSUInteger i = 0; i < _segmentCount; i++) {
+		munmap((void*)_segments[i].bytes, _segments[i].length);
+		free(_segments[i].builtIndex);
+	}
+	
+	free(_segments);
+	[_path release];
+	[super dealloc];
+}
+
+
+- (NSTimeInterval) startTime {
+	
+	for(NSUInteger i = 0; i < _segmentCount; i++) {
+		if(_segments[i].blockCount > 0) {
+			return SEGMENT_REFERENCE_TIME(&_segments[i], _segments[i].minTime);
+		}
+	}
+	
+	return NAN;
+}
+
+
+- (NSTimeInterval) endTime {
+	
+	for(NSUInteger i = _segmentCount; i > 0; i--) {
+		if(_segments[i - 1].blockCount > 0) {
+			return SEGMENT_REFERENCE_TIME(&_segments[i - 1], _segments[i - 1].maxTime);
+		}
+	}
+	
+	return NAN;
+}
+
+
+- (NSData*) recordsForMode:(NSUInteger)mode
+					   pid:(NSUInteger)pid
+				 startTime:(NSTimeInterval)start
+				   endTime:(NSTimeInterval)end {
+	
+	NSMutableData* records		= [NSMutableData data];
+	FLScanToolRecord record;
+	
+	for(NSUInteger s = 0; s < _segmentCount; s++) {
+		const FLTripJournalSegment* segment	= &_segments[s];
+		double segmentStart		= SEGMENT_MONOTONIC_TIME(segment, start);
+		double segmentEnd		= SEGMENT_MONOTONIC_TIME(segment, end);
+		
+		if(segment->blockCount == 0 || segment->maxTime < segmentStart || segment->minTime > segmentEnd) {
+			continue;
+		}
+		
+		for(NSUInteger b = 0; b < segment->blockCount; b++) {
+			const FLTripJournalIndexEntry* entry	= &segment->index[b];
+			
+			if(entry->maxTime < segmentStart ||
+			   entry->minTime > segmentEnd ||
+			   !TRIP_JOURNAL_HAS_PID(entry->pidSet, pid)) {
+				continue;
+			}
+			
+			const FLTripJournalBlock* block	= blockForEntry(segment, entry);
+			size_t offset					= sizeof(FLTripJournalBlock);
+			
+			for(NSUInteger f = 0; block && f < entry->frameCount; f++) {
+				const FLTripJournalFrame* frame	= frameAtOffset(block, offset);
+				
+				if(!frame) {
+					break;
+				}
+				
+				offset						+= TRIP_JOURNAL_FRAME_SIZE(frame->length);
+				
+				if(frame->pid != pid ||
+				   frame->mode != mode ||
+				   frame->timestamp < segmentStart ||
+				   frame->timestamp > segmentEnd) {
+					continue;
+				}
+				
+				copyFrameToRecord(segment, frame, &record);
+				[records appendBytes:&record length:sizeof(record)];
+			}
+		}
+	}
+	
+	return records;
+}
+
+
+- (NSUInteger) readRecords:(FLScanToolRecord*)records 
+				  maxCount:(NSUInteger)maxCount 
+					cursor:(FLTripJournalCursor*)cursor {
+	
+	NSUInteger count							= 0;
+	
+	while(count < maxCount && cursor->segment < _segmentCount) {
+		const FLTripJournalSegment* segment		= &_segments[cursor->segment];
+		
+		if(cursor->block >= segment->blockCount) {
+			cursor->segment++;
+			cursor->block						= 0;
+			cursor->frame						= 0;
+			continue;
+		}
+		
+		const FLTripJournalIndexEntry* entry	= &segment->index[cursor->block];
+		const FLTripJournalBlock* block			= blockForEntry(segment, entry);
+		
+		if(cursor->frame == 0) {
+			cursor->offset						= sizeof(FLTripJournalBlock);
+		}
+		
+		const FLTripJournalFrame* frame			= (block && cursor->frame < entry->frameCount) ? 
+													frameAtOffset(block, cursor->offset) : NULL;
+		
+		if(!frame) {
+			cursor->block++;
+			cursor->frame						= 0;
+			continue;
+		}
+		
+		copyFrameToRecord(segment, frame, &records[count++]);
+		cursor->offset							+= TRIP_JOURNAL_FRAME_SIZE(frame->length);
+		cursor->frame++;
+	}
+	
+	return count;
+}
+
+@end
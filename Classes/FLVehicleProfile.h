@@ -0,0 +1,71 @@
+/*
+ *  FLVehicleProfile.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanTool.h"
+
+
+// Name of the profile cache file in the application's Caches directory
+#define VEHICLE_PROFILE_CACHE_FILE		@"FLVehicleProfiles.plist"
+
+
+//------------------------------------------------------------------------------
+// What a scan tool learned about the adapter and the vehicle it was plugged
+// into during its last init: the protocol, and the supported PIDs of each
+// ECU.  Profiles are kept in a persistent cache keyed by an identifier for
+// the adapter, so the next connect through the same adapter can set the
+// protocol directly and skip the PID search, once a single probe confirms
+// the adapter is still plugged into the same vehicle.
+
+@interface FLVehicleProfile : NSObject<NSCoding> {
+	NSString*				_identifier;
+	NSString*				_adapterVersion;
+	FLScanToolProtocol		_protocol;
+	NSUInteger				_protocolNumber;
+	FLPIDSupportSet			_ecuSupportedPIDs[MAX_PID_SEARCH_ECUS];
+	NSUInteger				_ecuCount;
+	NSDate*					_lastConnected;
+}
+
+@property (nonatomic, copy) NSString* identifier;
+@property (nonatomic, copy) NSString* adapterVersion;
+@property (nonatomic, assign) FLScanToolProtocol protocol;
+
+// Device specific protocol number, e.g. the ELM327 protocol number
+@property (nonatomic, assign) NSUInteger protocolNumber;
+@property (nonatomic, readonly) NSUInteger ecuCount;
+@property (nonatomic, retain) NSDate* lastConnected;
+
+
++ (FLVehicleProfile*) profileForIdentifier:(NSString*)identifier;
++ (void) storeProfile:(FLVehicleProfile*)profile;
++ (void) removeProfileForIdentifier:(NSString*)identifier;
++ (void) removeAllProfiles;
+
+- initWithIdentifier:(NSString*)identifier;
+
+- (void) setSupportedPIDs:(const FLPIDSupportSet*)pids forECU:(NSUInteger)ecuIndex;
+- (const FLPIDSupportSet*) supportedPIDsForECU:(NSUInteger)ecuIndex;
+
+// YES if one of the profile's ECUs gave the same reply to the PID search for
+// pidGroup, ignoring the bit for the next search PID
+- (BOOL) hasECUWithSupportedPIDs:(NSData*)data forPidGroup:(NSUInteger)pidGroup;
+
+@end
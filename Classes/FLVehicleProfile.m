@@ -0,0 +1,264 @@
+/*
+ *  FLVehicleProfile.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLVehicleProfile.h"
+#import "FLLogging.h"
+
+
+// Cached profiles, keyed by identifier.  Loaded from disk on first use.
+static NSMutableDictionary* g_profileCache = nil;
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLVehicleProfile (Private)
++ (NSString*) cachePath;
++ (NSMutableDictionary*) profileCache;
++ (void) writeProfileCache;
+@end
+
+
+#pragma mark -
+@implementation FLVehicleProfile
+
+@synthesize identifier		= _identifier,
+			adapterVersion	= _adapterVersion,
+			protocol		= _protocol,
+			protocolNumber	= _protocolNumber,
+			ecuCount		= _ecuCount,
+			lastConnected	= _lastConnected;
+
+
+#pragma mark -
+#pragma mark Profile Cache
+
++ (FLVehicleProfile*) profileForIdentifier:(NSString*)identifier {
+	
+	if(!identifier) {
+		return nil;
+	}
+	
+	@synchronized(self) {
+		return [[[[self profileCache] objectForKey:identifier] retain] autorelease];
+	}
+}
+
+
++ (void) storeProfile:(FLVehicleProfile*)profile {
+	
+	if(!profile.identifier) {
+		return;
+	}
+	
+	@synchronized(self) {
+		[[self profileCache] setObject:profile forKey:profile.identifier];
+		[self writeProfileCache];
+	}
+}
+
+
++ (void) removeProfileForIdentifier:(NSString*)identifier {
+	
+	if(!identifier) {
+		return;
+	}
+	
+	@synchronized(self) {
+		[[self profileCache] removeObjectForKey:identifier];
+		[self writeProfileCache];
+	}
+}
+
+
++ (void) removeAllProfiles {
+	@synchronized(self) {
+		[[self profileCache] removeAllObjects];
+		[self writeProfileCache];
+	}
+}
+
+
++ (NSString*) cachePath {
+	NSArray* paths	= NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+	
+	if([paths count] == 0) {
+		return nil;
+	}
+	
+	return [[paths objectAtIndex:0] stringByAppendingPathComponent:VEHICLE_PROFILE_CACHE_FILE];
+}
+
+
++ (NSMutableDictionary*) profileCache {
+	
+	if(!g_profileCache) {
+		NSDictionary* profiles	= nil;
+		
+		@try {
+			NSString* path		= [self cachePath];
+			
+			if(path && [[NSFileManager defaultManager] fileExistsAtPath:path]) {
+				profiles		= [NSKeyedUnarchiver unarchiveObjectWithFile:path];
+			}
+		}
+		@catch (NSException * e) {
+			// A corrupt cache only costs a full init on the next connect
+			FLEXCEPTION(e)
+			profiles			= nil;
+		}
+		
+		if([profiles isKindOfClass:[NSDictionary class]]) {
+			g_profileCache		= [[NSMutableDictionary alloc] initWithDictionary:profiles];
+		}
+		else {
+			g_profileCache		= [[NSMutableDictionary alloc] initWithCapacity:1];
+		}
+	}
+	
+	return g_profileCache;
+}
+
+
++ (void) writeProfileCache {
+	
+	NSString* path	= [self cachePath];
+	
+	if(path && ![NSKeyedArchiver archiveRootObject:g_profileCache toFile:path]) {
+		FLERROR(@"Failed to write vehicle profile cache to %@", path)
+	}
+}
+
+
+#pragma mark -
+#pragma mark Object Lifecycle
+
+- initWithIdentifier:(NSString*)identifier {
+	
+	if(self = [super init]) {
+		self.identifier		= identifier;
+		self.lastConnected	= [NSDate date];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[_identifier release];
+	[_adapterVersion release];
+	[_lastConnected release];
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Supported PIDs
+
+- (void) setSupportedPIDs:(const FLPIDSupportSet*)pids forECU:(NSUInteger)ecuIndex {
+	
+	if(ecuIndex >= MAX_PID_SEARCH_ECUS) {
+		return;
+	}
+	
+	_ecuSupportedPIDs[ecuIndex]	= *pids;
+	_ecuCount					= MAX(_ecuCount, ecuIndex + 1);
+}
+
+
+- (const FLPIDSupportSet*) supportedPIDsForECU:(NSUInteger)ecuIndex {
+	
+	if(ecuIndex >= _ecuCount) {
+		return NULL;
+	}
+	
+	return &_ecuSupportedPIDs[ecuIndex];
+}
+
+
+- (BOOL) hasECUWithSupportedPIDs:(NSData*)data forPidGroup:(NSUInteger)pidGroup {
+	
+	const uint8_t* bytes	= (const uint8_t*)[data bytes];
+	
+	if([data length] != 4 || (pidGroup & 0x1F) != 0 || pidGroup > MAX_PID_GROUP) {
+		return NO;
+	}
+	
+	uint32_t pids			= ((uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 |
+							   (uint32_t)bytes[2] << 8 | (uint32_t)bytes[3]) & ~0x01U;
+	
+	for(NSUInteger i = 0; i < _ecuCount; i++) {
+		if(_ecuSupportedPIDs[i].words[pidGroup >> 5] == pids) {
+			return YES;
+		}
+	}
+	
+	return NO;
+}
+
+
+#pragma mark -
+#pragma mark NSCoding Methods
+
+- (void)encodeWithCoder:(NSCoder *)encoder {
+	
+	// Supported PID words are stored big-endian
+	uint32_t words[MAX_PID_SEARCH_ECUS * 8];
+	
+	for(NSUInteger i = 0; i < _ecuCount; i++) {
+		for(NSUInteger w = 0; w < 8; w++) {
+			words[(i * 8) + w]	= CFSwapInt32HostToBig(_ecuSupportedPIDs[i].words[w]);
+		}
+	}
+	
+	[encoder encodeObject:_identifier forKey:@"Identifier"];
+	[encoder encodeObject:_adapterVersion forKey:@"AdapterVersion"];
+	[encoder encodeInt32:_protocol forKey:@"ScanToolProtocol"];
+	[encoder encodeInt32:_protocolNumber forKey:@"ProtocolNumber"];
+	[encoder encodeObject:[NSData dataWithBytes:words length:(_ecuCount * sizeof(FLPIDSupportSet))] forKey:@"SupportedPIDs"];
+	[encoder encodeDouble:[_lastConnected timeIntervalSince1970] forKey:@"LastConnected"];
+}
+
+
+- (id)initWithCoder:(NSCoder*)decoder {
+	
+	if(self = [super init]) {
+		self.identifier			= [decoder decodeObjectForKey:@"Identifier"];
+		self.adapterVersion		= [decoder decodeObjectForKey:@"AdapterVersion"];
+		self.protocol			= [decoder decodeInt32ForKey:@"ScanToolProtocol"];
+		self.protocolNumber		= [decoder decodeInt32ForKey:@"ProtocolNumber"];
+		self.lastConnected		= [NSDate dateWithTimeIntervalSince1970:[decoder decodeDoubleForKey:@"LastConnected"]];
+		
+		NSData* pidData			= [decoder decodeObjectForKey:@"SupportedPIDs"];
+		const uint32_t* words	= (const uint32_t*)[pidData bytes];
+		NSUInteger count		= MIN([pidData length] / sizeof(FLPIDSupportSet), MAX_PID_SEARCH_ECUS);
+		
+		for(NSUInteger i = 0; i < count; i++) {
+			for(NSUInteger w = 0; w < 8; w++) {
+				_ecuSupportedPIDs[i].words[w]	= CFSwapInt32BigToHost(words[(i * 8) + w]);
+			}
+		}
+		
+		_ecuCount				= count;
+	}
+	
+	return self;
+}
+
+@end
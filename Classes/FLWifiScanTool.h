@@ -25,6 +25,7 @@
 	NSInputStream*			_inputStream;
 	NSOutputStream*			_outputStream;
 	NSMutableData*			_cachedWriteData;
+	NSUInteger				_cachedWriteOffset;
 	BOOL					_spaceAvailable;
 }
 
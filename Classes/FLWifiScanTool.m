@@ -20,6 +20,8 @@
 
 #import "FLWifiScanTool.h"
 #import "NSStreamAdditions.h"
+#import "FLScanToolCapture.h"
+#import "FLScanToolReplay.h"
 #import "FLLogging.h"
 
 
@@ -28,20 +30,36 @@
 
 
 - (void) dealloc {
-	[_inputStream release];		
-	[_outputStream release];
+	// The streams are released by close, which FLScanTool's dealloc calls.
+	// That runs after this, so the write cache must not be left dangling.
 	[_host release];
 	[_cachedWriteData release];
+	_cachedWriteData	= nil;
 	[super dealloc];
 }
 
 - (void) open {
 	
 	@try {
-		[NSStream getIOStreamsToHostNamed:_host 
-									 port:_port 
-							  inputStream:&_inputStream 
-							 outputStream:&_outputStream];
+		FLScanToolTransport* transport	= [self activeTransport];
+		
+		if(transport) {
+			transport.delegate	= self;
+			
+			if(![transport open]) {
+				FLERROR(@"Unable to open transport %@", transport)
+				return;
+			}
+			
+			_inputStream	= [transport inputStream];
+			_outputStream	= [transport outputStream];
+		}
+		else {
+			[NSStream getIOStreamsToHostNamed:_host 
+										 port:_port 
+								  inputStream:&_inputStream 
+								 outputStream:&_outputStream];
+		}
 		
 		[_inputStream retain];
 		[_outputStream retain];
@@ -74,23 +92,46 @@
 		[_outputStream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
 		[_outputStream setDelegate:nil];
 		[_outputStream close];		
+		
+		[[self activeTransport] close];
+		[self activeTransport].delegate	= nil;
 	}
 	@catch (NSException * e) {
 		FLEXCEPTION(e);
 	}	
 	@finally {
-		_state = STATE_INIT;
+		[_inputStream release];
+		_inputStream		= nil;
+		[_outputStream release];
+		_outputStream		= nil;
+		[_cachedWriteData setLength:0];
+		_cachedWriteOffset	= 0;
+		_state				= STATE_INIT;
 	}
 }
 
 - (void) sendCommand:(FLScanToolCommand*)command initCommand:(BOOL)initCommand {
 	FLTRACE_ENTRY
+	if (!command) {
+		// Nothing to send, e.g. no poll is due yet
+		return;
+	}
+	
 	if (!_cachedWriteData) {
         _cachedWriteData = [[NSMutableData alloc] init];
     }
 	
+	if (_cachedWriteOffset > 0 && _cachedWriteOffset >= ([_cachedWriteData length] / 2)) {
+		// Drop the already-written bytes once they make up most of the buffer
+		[_cachedWriteData replaceBytesInRange:NSMakeRange(0, _cachedWriteOffset) 
+									withBytes:NULL 
+									   length:0];
+		_cachedWriteOffset = 0;
+	}
+	
 	FLDEBUG(@"Writing command to cached data", nil)
     [_cachedWriteData appendData:[command data]];
+	[self startDeadlineForCommand:command];
 	[self writeCachedData];
 }
 
@@ -115,7 +156,7 @@
     
 	FLTRACE_ENTRY
 	
-	if (_streamOperation.isCancelled) {
+	if (_scanCancelled) {
 		return;
 	}
 	
@@ -125,36 +166,38 @@
 	}
 	
 	NSOutputStream* oStream			= _outputStream;
-	NSStreamStatus oStreamStatus	= NSStreamStatusError;
 	NSInteger bytesWritten			= 0;
 	
-	FLDEBUG(@"[_cachedWriteData length] = %d", [_cachedWriteData length])
+	FLDEBUG(@"Pending write bytes = %d", ([_cachedWriteData length] - _cachedWriteOffset))
 	
-    while ([oStream hasSpaceAvailable] && 
-		   [_cachedWriteData length] > 0) {
-		
-		FLDEBUG(@"_cachedWriteData = %@", [_cachedWriteData description])
+	// Write whatever the stream will take without blocking.  Anything left
+	// over goes out on the next NSStreamEventHasSpaceAvailable.
+    while (_cachedWriteOffset < [_cachedWriteData length] && 
+		   [oStream hasSpaceAvailable]) {
 		
-		bytesWritten = [oStream write:[_cachedWriteData bytes]
-							maxLength:[_cachedWriteData length]];
+		bytesWritten = [oStream write:((const uint8_t*)[_cachedWriteData bytes] + _cachedWriteOffset)
+							maxLength:([_cachedWriteData length] - _cachedWriteOffset)];
 		if (bytesWritten == -1) {
 			FLERROR(@"Write Error", nil)
 			break;
 		}
-		else if(bytesWritten > 0 && [_cachedWriteData length] > 0) {
-			FLDEBUG(@"Wrote %d bytes", bytesWritten)
-			[_cachedWriteData replaceBytesInRange:NSMakeRange(0, bytesWritten) 
-										withBytes:NULL 
-										   length:0];
+		else if (bytesWritten == 0) {
+			break;
 		}
+		
+		FLDEBUG(@"Wrote %d bytes", bytesWritten)
+		[_capture recordBytes:((const uint8_t*)[_cachedWriteData bytes] + _cachedWriteOffset) 
+					   length:bytesWritten 
+					direction:kScanToolCaptureWrite];
+		_cachedWriteOffset += bytesWritten;
 	}
 	
-	oStreamStatus = [oStream streamStatus];
-	FLDEBUG(@"OutputStream status = %X", oStreamStatus)
-	FLINFO(@"Starting write wait")
-	do {		
-		oStreamStatus = [oStream streamStatus];
-	} while (oStreamStatus == NSStreamStatusWriting);
+	if (_cachedWriteOffset == [_cachedWriteData length]) {
+		// Everything has been sent, so rewind the cursor rather than
+		// shifting the buffer contents down
+		[_cachedWriteData setLength:0];
+		_cachedWriteOffset = 0;
+	}
 	
 	FLTRACE_EXIT
 }
@@ -26,6 +26,29 @@
 #import <Foundation/NSData.h>
 #import <Foundation/NSString.h>
 
+// Characters FLBase64Encode writes for length bytes
+#define FL_BASE64_ENCODED_LENGTH(length)	((((length) + 2) / 3) * 4)
+
+// Bytes FLBase64Decode writes at most for length characters
+#define FL_BASE64_DECODED_LENGTH(length)	((((length) + 3) / 4) * 3)
+
+// Encodes length bytes into out, which must have room for
+// FL_BASE64_ENCODED_LENGTH(length) characters, with padding but no line
+// breaks or terminating NUL.  Returns the number of characters written.
+// Uses AVX2 or SSSE3 when the target has them.
+size_t FLBase64Encode(const uint8_t* bytes, size_t length, char* out);
+
+// Decodes length characters into out, which must have room for
+// FL_BASE64_DECODED_LENGTH(length) bytes.  Characters outside the
+// alphabet, such as line breaks, are skipped, and decoding stops at the
+// first '='.  Returns the number of bytes written.
+size_t FLBase64Decode(const char* string, size_t length, uint8_t* out);
+
+// FLBase64Encode and FLBase64Decode without the vector paths, for checking
+// and measuring them against the table-driven loop
+size_t FLBase64EncodeScalar(const uint8_t* bytes, size_t length, char* out);
+size_t FLBase64DecodeScalar(const char* string, size_t length, uint8_t* out);
+
 @interface NSData (NSDataExtensions)
 
 + (NSData *)base64DataFromString: (NSString *)string;
@@ -36,6 +36,12 @@
 
 #import "Base64Extensions.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 /* Base64 Encoding Table */
 static char base64EncodingTable [64] = {
 	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
@@ -44,121 +50,50 @@ static char base64EncodingTable [64] = {
 	'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
+#define BASE64_SKIP	0xFF
+#define BASE64_PAD	0xFE
+
+/* Base64 Decoding Table, BASE64_PAD for '=' and BASE64_SKIP outside the alphabet */
+static const uint8_t base64DecodingTable [256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF,
+	0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
 @implementation NSData (NSDataExtensions)
 
 + (NSData *)base64DataFromString: (NSString *)string
 {
-	unsigned long ixtext, lentext;
-	unsigned char ch, inbuf[3], outbuf[4];
-	short i, ixinbuf;
-	Boolean flignore, flendtext = false;
-	const unsigned char *tempcstring;
+	const char *tempcstring;
 	NSMutableData *theData;
+	size_t lentext;
 	
 	if (string == nil)
 	{
 		return [NSData data];
 	}
 	
-	ixtext = 0;
-	
-	tempcstring = (const unsigned char *)[string UTF8String];
+	tempcstring = [string UTF8String];
 	
-	lentext = [string length];
+	lentext = strlen(tempcstring);
 	
-	theData = [NSMutableData dataWithCapacity: lentext];
+	theData = [NSMutableData dataWithLength: FL_BASE64_DECODED_LENGTH(lentext)];
 	
-	ixinbuf = 0;
- 
-	while (true)
-	{
-		if (ixtext >= lentext)
-		{
-			break;
-		}
-		
-		ch = tempcstring [ixtext++];
-			
-		flignore = false;
+	[theData setLength: FLBase64Decode(tempcstring, lentext, [theData mutableBytes])];
 	
-		if ((ch >= 'A') && (ch <= 'Z'))
-		{
-			ch = ch - 'A';
-		}
-		else if ((ch >= 'a') && (ch <= 'z'))
-		{
-			ch = ch - 'a' + 26;
-		}
-		else if ((ch >= '0') && (ch <= '9'))
-		{
-			ch = ch - '0' + 52;
-		}
-		else if (ch == '+')
-		{
-			ch = 62;
-		}
-		else if (ch == '=')
-		{
-			flendtext = true;
-		}
-		else if (ch == '/')
-		{
-			ch = 63;
-		}
-		else
-		{
-			flignore = true; 
-		}
-		
-		if (!flignore)
-		{
-			short ctcharsinbuf = 3;
-			Boolean flbreak = false;
-			 
-			if (flendtext)
-			{
-				if (ixinbuf == 0)
-				{
-					break;
-				}
-				
-				if ((ixinbuf == 1) || (ixinbuf == 2))
-				{
-					ctcharsinbuf = 1;
-				}
-				else
-				{
-					ctcharsinbuf = 2;
-				}
-				
-				ixinbuf = 3;
-			
-				flbreak = true;
-			}
-		
-			inbuf [ixinbuf++] = ch;
-		
-			if (ixinbuf == 4)
-			{
-				ixinbuf = 0;
-			
-				outbuf[0] = (inbuf[0] << 2) | ((inbuf[1] & 0x30) >> 4);
-				outbuf[1] = ((inbuf[1] & 0x0F) << 4) | ((inbuf[2] & 0x3C) >> 2);
-				outbuf[2] = ((inbuf[2] & 0x03) << 6) | (inbuf[3] & 0x3F);
-	
-				for (i = 0; i < ctcharsinbuf; i++)
-				{
-					[theData appendBytes: &outbuf[i] length: 1];
-				}
-			}
-		
-			if (flbreak)
-			{
-				break;
-			}
-		}
-	}
- 
 	return theData;
 }
 
@@ -170,92 +105,311 @@ static char base64EncodingTable [64] = {
 
 + (NSString *)base64StringFromData: (NSData *)data length: (int)length
 {
-	unsigned long ixtext, lentext;
-	long ctremaining;
-	unsigned char inbuf [3], outbuf [4];
-	short i, charsonline = 0, ctcopy;
+	size_t ixtext, lentext, linebytes, ctline;
 	const unsigned char *raw;
-	NSMutableString *theString;
-    
+	char *buffer, *cursor;
+	
 	lentext = [data length];
-
+	
 	if (lentext < 1)
 	{
 		return @"";
 	}
-		
- 	theString = [NSMutableString stringWithCapacity: lentext];
- 	
- 	raw = [data bytes];
-
-	ixtext = 0; 
- 	
-	while (true) {
-		ctremaining = lentext - ixtext;
 	
-		if (ctremaining <= 0)
+	raw = [data bytes];
+	
+	// A line break follows every length characters, rounded up to whole
+	// groups of 4, so every line but a short last one ends in one
+	linebytes = (length > 0) ? (((size_t)length + 3) / 4) * 3 : lentext;
+	
+	buffer = malloc(FL_BASE64_ENCODED_LENGTH(lentext) + (lentext / linebytes));
+	
+	cursor = buffer;
+	
+	for (ixtext = 0; ixtext < lentext; ixtext += ctline)
+	{
+		ctline = MIN(linebytes, lentext - ixtext);
+		
+		cursor += FLBase64Encode(&raw [ixtext], ctline, cursor);
+		
+		if (length > 0 && ctline == linebytes)
 		{
-			break;
+			*cursor++ = '\n';
 		}
-				
-		for (i = 0; i < 3; i++)
-		{ 
-			unsigned long ix = ixtext + i;
+	}
+	
+	return [[[NSString alloc] initWithBytesNoCopy: buffer
+										   length: (cursor - buffer)
+										 encoding: NSASCIIStringEncoding
+									 freeWhenDone: YES] autorelease];
+}
+
+@end
+
+#pragma mark -
+
+#if defined(__SSSE3__)
+
+//
+//  The vector paths follow Wojciech Mula's SSE base64 algorithms.
+//  Encoding moves each 3 bytes into a 32-bit lane, shifts the four
+//  6-bit indices into place with multiplies, and turns indices into
+//  characters by adding an offset picked per range with pshufb.
+//  Decoding classifies 16 characters at once by their nibbles and
+//  leaves a block holding anything but alphabet characters, such as
+//  '=' or a line break, to the scalar loop.
+//
+
+static inline __m128i base64EncodeBlock (__m128i input)
+{
+	__m128i in, indices, range;
+	
+	in = _mm_shuffle_epi8(input, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	
+	indices = _mm_or_si128(_mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040)),
+						   _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010)));
+	
+	// 0-25 to 13, 26-51 to 0, 52-61 to 1-10, 62 to 11 and 63 to 12
+	range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+																'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+																'/' - 63, 'A', 0, 0), range));
+}
+
+// Decodes 16 characters into 12 bytes, storing 16; NO if any character is
+// outside the alphabet
+static inline BOOL base64DecodeBlock (const char *string, uint8_t *out)
+{
+	__m128i in, hinibbles, invalid, values;
+	
+	in = _mm_loadu_si128((const __m128i *)string);
+	
+	hinibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0F));
+	
+	invalid = _mm_and_si128(_mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+														   0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A),
+											 _mm_and_si128(in, _mm_set1_epi8(0x0F))),
+							_mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+														   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10),
+											 hinibbles));
+	
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(invalid, _mm_setzero_si128())))
+	{
+		return NO;
+	}
+	
+	// Offset from each character to its value, by high nibble, with '/'
+	// moved down to its own entry
+	values = _mm_add_epi8(in, _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+											   _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hinibbles)));
+	
+	values = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+	
+	_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(values, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)));
+	
+	return YES;
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+// The 128-bit constant in both lanes
+#define BASE64_LANES(...)	_mm256_broadcastsi128_si256(_mm_setr_epi8(__VA_ARGS__))
+
+static inline __m256i base64EncodeBlock256 (__m256i input)
+{
+	__m256i in, indices, range;
+	
+	in = _mm256_shuffle_epi8(input, BASE64_LANES(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	
+	indices = _mm256_or_si256(_mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040)),
+							  _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010)));
+	
+	range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+	
+	return _mm256_add_epi8(indices, _mm256_shuffle_epi8(BASE64_LANES('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+																	  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+																	  '/' - 63, 'A', 0, 0), range));
+}
+
+// Decodes 32 characters into 24 bytes, storing 32
+static inline BOOL base64DecodeBlock256 (const char *string, uint8_t *out)
+{
+	__m256i in, hinibbles, invalid, values;
+	
+	in = _mm256_loadu_si256((const __m256i *)string);
+	
+	hinibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0F));
+	
+	invalid = _mm256_and_si256(_mm256_shuffle_epi8(BASE64_LANES(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+																0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A),
+												   _mm256_and_si256(in, _mm256_set1_epi8(0x0F))),
+							   _mm256_shuffle_epi8(BASE64_LANES(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+																0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10),
+												   hinibbles));
+	
+	if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(invalid, _mm256_setzero_si256())))
+	{
+		return NO;
+	}
+	
+	values = _mm256_add_epi8(in, _mm256_shuffle_epi8(BASE64_LANES(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+													 _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')), hinibbles)));
+	
+	values = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+	
+	values = _mm256_shuffle_epi8(values, BASE64_LANES(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	
+	// The 12 bytes of each lane together
+	_mm256_storeu_si256((__m256i *)out, _mm256_permutevar8x32_epi32(values, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7)));
+	
+	return YES;
+}
+
+#endif
+
+// The vector paths are left out when vector is NO; it is a constant in
+// each caller, so the test is compiled away
+static inline size_t base64Encode(const uint8_t* bytes, size_t length, char* out, BOOL vector)
+{
+	char* cursor = out;
+	size_t i = 0;
+	
+#if defined(__AVX2__)
+	// 24 bytes at a time, reading 28
+	for (; vector && (i + 28) <= length; i += 24)
+	{
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&bytes[i])),
+											 _mm_loadu_si128((const __m128i *)&bytes[i + 12]), 1);
+		
+		_mm256_storeu_si256((__m256i *)cursor, base64EncodeBlock256(in));
+		cursor += 32;
+	}
+#endif
+	
+#if defined(__SSSE3__)
+	// 12 bytes at a time, reading 16
+	for (; vector && (i + 16) <= length; i += 12)
+	{
+		_mm_storeu_si128((__m128i *)cursor, base64EncodeBlock(_mm_loadu_si128((const __m128i *)&bytes[i])));
+		cursor += 16;
+	}
+#endif
+	
+	for (; (i + 3) <= length; i += 3)
+	{
+		uint32_t triple = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
 		
-			if (ix < lentext)
+		*cursor++ = base64EncodingTable [(triple >> 18) & 0x3F];
+		*cursor++ = base64EncodingTable [(triple >> 12) & 0x3F];
+		*cursor++ = base64EncodingTable [(triple >> 6) & 0x3F];
+		*cursor++ = base64EncodingTable [triple & 0x3F];
+	}
+	
+	if (i < length)
+	{
+		uint32_t triple = (bytes[i] << 16) | (((i + 1) < length) ? (bytes[i + 1] << 8) : 0);
+		
+		*cursor++ = base64EncodingTable [(triple >> 18) & 0x3F];
+		*cursor++ = base64EncodingTable [(triple >> 12) & 0x3F];
+		*cursor++ = ((i + 1) < length) ? base64EncodingTable [(triple >> 6) & 0x3F] : '=';
+		*cursor++ = '=';
+	}
+	
+	return cursor - out;
+}
+
+static inline size_t base64Decode(const char* string, size_t length, uint8_t* out, BOOL vector)
+{
+	uint8_t* cursor = out;
+	uint32_t quad = 0;
+	size_t i = 0;
+	short count = 0;
+	
+	while (i < length)
+	{
+		// Whole blocks go to the vector paths between groups of 4.  Each
+		// leaves enough characters unread that its 16 or 32 byte store
+		// stays inside FL_BASE64_DECODED_LENGTH(length).
+		if (vector && count == 0)
+		{
+#if defined(__AVX2__)
+			while ((i + 44) <= length && base64DecodeBlock256(&string[i], cursor))
 			{
-				inbuf [i] = raw [ix];
+				i += 32;
+				cursor += 24;
 			}
-			else
+#endif
+#if defined(__SSSE3__)
+			while ((i + 24) <= length && base64DecodeBlock(&string[i], cursor))
 			{
-				inbuf [i] = 0;
+				i += 16;
+				cursor += 12;
 			}
+#endif
 		}
 		
-		outbuf[0] = (inbuf[0] & 0xFC) >> 2;
-		outbuf[1] = ((inbuf[0] & 0x03) << 4) | ((inbuf[1] & 0xF0) >> 4);
-		outbuf[2] = ((inbuf[1] & 0x0F) << 2) | ((inbuf[2] & 0xC0) >> 6);
-		outbuf[3] = inbuf[2] & 0x3F;
-	
-		ctcopy = 4;
-	
-		switch (ctremaining)
+		uint8_t value = base64DecodingTable [(uint8_t)string[i++]];
+		
+		if (value == BASE64_PAD)
 		{
-			case 1: 
-				ctcopy = 2; 
-				break;
-			case 2: 
-				ctcopy = 3; 
-				break;
+			break;
 		}
- 
-		for (i = 0; i < ctcopy; i++)
+		
+		if (value == BASE64_SKIP)
 		{
-			NSString *s = [[NSString alloc] initWithFormat:@"%c", base64EncodingTable [outbuf[i]]];
-			[theString appendString:s];
-			[s release];
+			continue;
 		}
-
-		for (i = ctcopy; i < 4; i++)
+		
+		quad = (quad << 6) | value;
+		
+		if (++count == 4)
 		{
-			[theString appendString: @"="];
+			*cursor++ = quad >> 16;
+			*cursor++ = quad >> 8;
+			*cursor++ = quad;
+			
+			quad = 0;
+			count = 0;
 		}
-		
-		ixtext += 3;
-		charsonline += 4;
+	}
 	
-		if (length > 0)
+	// 2 or 3 characters left over, padded or not, hold 1 or 2 bytes
+	if (count >= 2)
+	{
+		quad <<= 6 * (4 - count);
+		
+		*cursor++ = quad >> 16;
+		
+		if (count == 3)
 		{
-			if (charsonline >= length)
-			{
-				charsonline = 0;
-				
-				[theString appendString: @"\n"];
-			}
+			*cursor++ = quad >> 8;
 		}
 	}
- 
-	return theString;
+	
+	return cursor - out;
+}
+
+size_t FLBase64Encode(const uint8_t* bytes, size_t length, char* out)
+{
+	return base64Encode(bytes, length, out, YES);
+}
+
+size_t FLBase64EncodeScalar(const uint8_t* bytes, size_t length, char* out)
+{
+	return base64Encode(bytes, length, out, NO);
 }
 
-@end
\ No newline at end of file
+size_t FLBase64Decode(const char* string, size_t length, uint8_t* out)
+{
+	return base64Decode(string, length, out, YES);
+}
+
+size_t FLBase64DecodeScalar(const char* string, size_t length, uint8_t* out)
+{
+	return base64Decode(string, length, out, NO);
+}
@@ -19,7 +19,11 @@
  */
 
 
+// Benchmarks and unit tests define FL_NO_VERBOSE_DEBUG so logging does not
+// dominate what they measure.
+#ifndef FL_NO_VERBOSE_DEBUG
 #define VERBOSE_DEBUG			1
+#endif
 //#undef VERBOSE_DEBUG
 
 #define CONCAT(s1, s2) s1 s2
@@ -0,0 +1,66 @@
+/*
+ *  FLResponseBuffer.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+
+// Size of the pooled storage blocks.  Buffers asked for with a larger
+// capacity get storage of their own, which is freed rather than pooled.
+#define FL_RESPONSE_BUFFER_BLOCK_SIZE		1024
+
+// Most free blocks kept in the pool
+#define FL_RESPONSE_BUFFER_POOL_SIZE		8
+
+
+/*
+ A fixed-capacity byte buffer holding the response bytes of a single read.
+ The parsers copy each read into one buffer and hand out slices of it as
+ the rawData and data of the responses, instead of copying every frame into
+ NSData objects of its own.  Each slice retains the buffer, and the storage
+ goes back to a shared pool when the last slice is released.
+
+ Storage is never moved once bytes are appended, so the buffer does not
+ grow; appends which do not fit return NULL.
+ */
+@interface FLResponseBuffer : NSObject {
+	uint8_t*		_bytes;
+	NSUInteger		_length;
+	NSUInteger		_capacity;
+}
+
+@property (nonatomic, readonly) NSUInteger length;
+@property (nonatomic, readonly) NSUInteger capacity;
+
++ (FLResponseBuffer*) bufferWithCapacity:(NSUInteger)capacity;
+
+- initWithCapacity:(NSUInteger)capacity;
+
+// Copies bytes onto the end of the buffer, returning where they were put,
+// or NULL if there is no room for them
+- (const uint8_t*) appendBytes:(const void*)bytes length:(NSUInteger)length;
+
+// Returns an NSData over length bytes of the buffer starting at bytes,
+// without copying them.  bytes must point into the buffer.
+- (NSData*) sliceWithBytes:(const uint8_t*)bytes length:(NSUInteger)length;
+
+// Releases the free storage blocks held in the pool
++ (void) drainPool;
+
+@end
@@ -0,0 +1,173 @@
+/*
+ *  FLResponseBuffer.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLResponseBuffer.h"
+#import "FLLogging.h"
+
+
+// Free storage blocks.  Buffers are filled on the stream thread and
+// usually released on the main thread, so the pool is locked.
+static uint8_t* g_freeBlocks[FL_RESPONSE_BUFFER_POOL_SIZE];
+static NSUInteger g_freeBlockCount = 0;
+
+
+/*
+ An immutable NSData over part of a response buffer.  Only the primitive
+ methods of the class cluster are overridden; NSData builds everything
+ else on top of them.
+ */
+@interface FLResponseBufferSlice : NSData {
+	FLResponseBuffer*	_buffer;
+	const uint8_t*		_sliceBytes;
+	NSUInteger			_sliceLength;
+}
+
+- initWithBuffer:(FLResponseBuffer*)buffer bytes:(const uint8_t*)bytes length:(NSUInteger)length;
+
+@end
+
+
+#pragma mark -
+@implementation FLResponseBufferSlice
+
+- initWithBuffer:(FLResponseBuffer*)buffer bytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	if(self = [super init]) {
+		_buffer			= [buffer retain];
+		_sliceBytes		= bytes;
+		_sliceLength	= length;
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[_buffer release];
+	[super dealloc];
+}
+
+
+- (NSUInteger) length {
+	return _sliceLength;
+}
+
+
+- (const void*) bytes {
+	return _sliceBytes;
+}
+
+@end
+
+
+#pragma mark -
+@implementation FLResponseBuffer
+
+@synthesize length		= _length,
+			capacity	= _capacity;
+
+
++ (FLResponseBuffer*) bufferWithCapacity:(NSUInteger)capacity {
+	return [[[FLResponseBuffer alloc] initWithCapacity:capacity] autorelease];
+}
+
+
++ (void) drainPool {
+	@synchronized(self) {
+		while(g_freeBlockCount > 0) {
+			free(g_freeBlocks[--g_freeBlockCount]);
+		}
+	}
+}
+
+
+- initWithCapacity:(NSUInteger)capacity {
+	
+	if(self = [super init]) {
+		
+		if(capacity <= FL_RESPONSE_BUFFER_BLOCK_SIZE) {
+			_capacity		= FL_RESPONSE_BUFFER_BLOCK_SIZE;
+			
+			@synchronized([FLResponseBuffer class]) {
+				if(g_freeBlockCount > 0) {
+					_bytes	= g_freeBlocks[--g_freeBlockCount];
+				}
+			}
+		}
+		else {
+			_capacity		= capacity;
+		}
+		
+		if(!_bytes) {
+			_bytes			= (uint8_t*)malloc(_capacity);
+		}
+		
+		if(!_bytes) {
+			FLERROR(@"Unable to allocate %d byte response buffer", _capacity)
+			_capacity		= 0;
+		}
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	if(_bytes && _capacity == FL_RESPONSE_BUFFER_BLOCK_SIZE) {
+		@synchronized([FLResponseBuffer class]) {
+			if(g_freeBlockCount < FL_RESPONSE_BUFFER_POOL_SIZE) {
+				g_freeBlocks[g_freeBlockCount++]	= _bytes;
+				_bytes								= NULL;
+			}
+		}
+	}
+	
+	free(_bytes);
+	[super dealloc];
+}
+
+
+- (const uint8_t*) appendBytes:(const void*)bytes length:(NSUInteger)length {
+	
+	if(length > (_capacity - _length)) {
+		return NULL;
+	}
+	
+	uint8_t* dest	= &_bytes[_length];
+	
+	memcpy(dest, bytes, length);
+	_length			+= length;
+	
+	return dest;
+}
+
+
+- (NSData*) sliceWithBytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	if(bytes < _bytes || (bytes + length) > (_bytes + _length)) {
+		FLERROR(@"Slice of %d bytes is outside the response buffer", length)
+		return nil;
+	}
+	
+	return [[[FLResponseBufferSlice alloc] initWithBuffer:self bytes:bytes length:length] autorelease];
+}
+
+@end
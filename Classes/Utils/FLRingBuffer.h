@@ -0,0 +1,71 @@
+/*
+ *  FLRingBuffer.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+@class FLScanToolCapture;
+
+
+// Upper bound on how far a read buffer may grow before we give up on the
+// data it holds (e.g. an adapter streaming garbage without a terminator)
+#define FL_RING_BUFFER_MAX_CAPACITY		65536
+
+
+/*
+ A growable byte ring buffer used by the device drivers to accumulate
+ incoming stream data.  Bytes are appended at the tail and consumed from
+ the head once a driver has processed a complete response, so a single read
+ may yield several responses and a single response may span several reads.
+ */
+@interface FLRingBuffer : NSObject {
+	uint8_t*		_buffer;
+	NSUInteger		_capacity;
+	NSUInteger		_head;
+	NSUInteger		_length;
+}
+
+@property (nonatomic, readonly) NSUInteger length;
+@property (nonatomic, readonly) NSUInteger capacity;
+
+- initWithCapacity:(NSUInteger)capacity;
+
+// Reads everything the stream has available into the buffer, growing it as
+// needed.  Returns the number of bytes read, or -1 on a stream error.
+- (NSInteger) readFromStream:(NSInputStream*)stream;
+
+// As above, also recording each read in capture, if not nil
+- (NSInteger) readFromStream:(NSInputStream*)stream capture:(FLScanToolCapture*)capture;
+
+- (BOOL) appendBytes:(const uint8_t*)bytes length:(NSUInteger)length;
+
+- (uint8_t) byteAtIndex:(NSUInteger)index;
+
+// Returns the offset of the first occurrence of byte from the head of the
+// buffer, or -1 if it is not present
+- (NSInteger) indexOfByte:(uint8_t)byte;
+
+// Returns a pointer to the unread bytes.  The contents are moved so they are
+// contiguous only when they currently wrap around the end of the buffer.
+- (uint8_t*) contiguousBytes;
+
+- (void) consumeBytes:(NSUInteger)length;
+- (void) reset;
+
+@end
@@ -0,0 +1,237 @@
+/*
+ *  FLRingBuffer.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLRingBuffer.h"
+#import "FLScanToolCapture.h"
+#import "FLLogging.h"
+
+// Minimum free space we want on hand before issuing a stream read
+#define MIN_READ_SPACE		64
+
+
+@interface FLRingBuffer (Private)
+- (BOOL) ensureFreeSpace:(NSUInteger)space;
+- (void) resizeToCapacity:(NSUInteger)capacity;
+@end
+
+
+#pragma mark -
+@implementation FLRingBuffer
+
+@synthesize length		= _length,
+			capacity	= _capacity;
+
+
+- initWithCapacity:(NSUInteger)capacity {
+	
+	if(self = [super init]) {
+		_capacity	= (capacity > 0) ? capacity : MIN_READ_SPACE;
+		_buffer		= (uint8_t*)malloc(_capacity);
+		_head		= 0;
+		_length		= 0;
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	free(_buffer);
+	[super dealloc];
+}
+
+
+- (NSInteger) readFromStream:(NSInputStream*)stream {
+	return [self readFromStream:stream capture:nil];
+}
+
+
+- (NSInteger) readFromStream:(NSInputStream*)stream capture:(FLScanToolCapture*)capture {
+	
+	NSInteger totalRead	= 0;
+	
+	while([stream hasBytesAvailable]) {
+		
+		if(![self ensureFreeSpace:MIN_READ_SPACE]) {
+			break;
+		}
+		
+		// Read into the contiguous free region following the tail
+		NSUInteger tail			= (_head + _length) % _capacity;
+		NSUInteger freeSpace	= (tail >= _head) ? (_capacity - tail) : (_head - tail);
+		
+		if(_length == _capacity) {
+			break;
+		}
+		
+		NSInteger readLength	= [stream read:&_buffer[tail] maxLength:freeSpace];
+		
+		if(readLength < 0) {
+			FLERROR(@"Stream read error (%d)", readLength)
+			return -1;
+		}
+		else if(readLength == 0) {
+			break;
+		}
+		
+		[capture recordBytes:&_buffer[tail] length:readLength direction:kScanToolCaptureRead];
+		
+		_length					+= readLength;
+		totalRead				+= readLength;
+	}
+	
+	return totalRead;
+}
+
+
+- (BOOL) appendBytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	if(![self ensureFreeSpace:length]) {
+		return NO;
+	}
+	
+	NSUInteger tail		= (_head + _length) % _capacity;
+	NSUInteger firstRun	= MIN(length, (_capacity - tail));
+	
+	memcpy(&_buffer[tail], bytes, firstRun);
+	if(firstRun < length) {
+		memcpy(_buffer, &bytes[firstRun], (length - firstRun));
+	}
+	
+	_length				+= length;
+	
+	return YES;
+}
+
+
+- (uint8_t) byteAtIndex:(NSUInteger)index {
+	
+	if(index >= _length) {
+		return 0x00;
+	}
+	
+	return _buffer[(_head + index) % _capacity];
+}
+
+
+- (NSInteger) indexOfByte:(uint8_t)byte {
+	
+	if(_length == 0) {
+		return -1;
+	}
+	
+	NSUInteger firstRun	= MIN(_length, (_capacity - _head));
+	uint8_t* match		= (uint8_t*)memchr(&_buffer[_head], byte, firstRun);
+	
+	if(match) {
+		return (match - &_buffer[_head]);
+	}
+	
+	if(firstRun < _length) {
+		match			= (uint8_t*)memchr(_buffer, byte, (_length - firstRun));
+		
+		if(match) {
+			return firstRun + (match - _buffer);
+		}
+	}
+	
+	return -1;
+}
+
+
+- (uint8_t*) contiguousBytes {
+	
+	if((_head + _length) > _capacity) {
+		// The unread bytes wrap, so move them to the start of a new buffer
+		[self resizeToCapacity:_capacity];
+	}
+	
+	return &_buffer[_head];
+}
+
+
+- (void) consumeBytes:(NSUInteger)length {
+	
+	if(length >= _length) {
+		[self reset];
+		return;
+	}
+	
+	_head	= (_head + length) % _capacity;
+	_length	-= length;
+}
+
+
+- (void) reset {
+	_head	= 0;
+	_length	= 0;
+}
+
+
+#pragma mark -
+#pragma mark Private Methods
+
+- (BOOL) ensureFreeSpace:(NSUInteger)space {
+	
+	if(_length == 0) {
+		// Nothing pending, so restart at the beginning of the buffer to
+		// keep reads contiguous
+		_head = 0;
+	}
+	
+	if((_capacity - _length) >= space) {
+		return YES;
+	}
+	
+	NSUInteger newCapacity	= _capacity;
+	while((newCapacity - _length) < space) {
+		newCapacity			*= 2;
+	}
+	
+	if(newCapacity > FL_RING_BUFFER_MAX_CAPACITY) {
+		FLERROR(@"Read buffer overflow, discarding %d bytes", _length)
+		[self reset];
+		return ((_capacity - _length) >= space);
+	}
+	
+	[self resizeToCapacity:newCapacity];
+	
+	return YES;
+}
+
+
+- (void) resizeToCapacity:(NSUInteger)capacity {
+	
+	uint8_t* newBuffer	= (uint8_t*)malloc(capacity);
+	NSUInteger firstRun	= MIN(_length, (_capacity - _head));
+	
+	memcpy(newBuffer, &_buffer[_head], firstRun);
+	if(firstRun < _length) {
+		memcpy(&newBuffer[firstRun], _buffer, (_length - firstRun));
+	}
+	
+	free(_buffer);
+	
+	_buffer		= newBuffer;
+	_capacity	= capacity;
+	_head		= 0;
+}
+
+@end
@@ -0,0 +1,88 @@
+/*
+ *  FLValueHistory.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#include <math.h>
+
+
+typedef enum {
+	kValueHistoryMeasurement1Metric		= 0,
+	kValueHistoryMeasurement1Imperial,
+	kValueHistoryMeasurement2Metric,
+	kValueHistoryMeasurement2Imperial,
+	kNumValueHistoryChannels
+} FLValueHistoryChannel;
+
+
+// Running minimum and maximum of a channel, kept as monotonic queues of
+// sample sequence numbers, and the running sum for the mean
+typedef struct value_history_stats_t {
+	NSUInteger*		minQueue;
+	NSUInteger		minHead;
+	NSUInteger		minCount;
+	NSUInteger*		maxQueue;
+	NSUInteger		maxHead;
+	NSUInteger		maxCount;
+	double			sum;
+	NSUInteger		validCount;
+} FLValueHistoryStats;
+
+
+/*
+ A fixed-depth history of sensor samples: a timestamp and one float per
+ channel for each sample, with the oldest sample dropped once the history
+ is full.  Channels without a value for a sample hold NAN.
+
+ Each sample is written twice, depth apart, into storage of twice the
+ depth, so the last count samples are always contiguous and can be read
+ in place, oldest first, without copying.  The min, max and mean of each
+ channel over the samples held are updated as samples come and go, in
+ amortized constant time per sample.
+ */
+@interface FLValueHistory : NSObject {
+	NSUInteger				_depth;
+	NSUInteger				_count;
+	NSUInteger				_sequence;
+	double*					_timestamps;
+	float*					_values[kNumValueHistoryChannels];
+	FLValueHistoryStats		_stats[kNumValueHistoryChannels];
+}
+
+@property (nonatomic, readonly) NSUInteger depth;
+@property (nonatomic, readonly) NSUInteger count;
+
+- initWithDepth:(NSUInteger)depth;
+
+// values holds one value per channel, NAN for none.  timestamp is in
+// seconds since the reference date.
+- (void) addValues:(const float*)values timestamp:(double)timestamp;
+- (void) reset;
+
+// The last count timestamps and values, oldest first.  Valid until the
+// next sample is added.
+- (const double*) timestamps;
+- (const float*) valuesForChannel:(FLValueHistoryChannel)channel;
+
+// NAN if the channel has no values in the history
+- (float) minValueForChannel:(FLValueHistoryChannel)channel;
+- (float) maxValueForChannel:(FLValueHistoryChannel)channel;
+- (float) meanValueForChannel:(FLValueHistoryChannel)channel;
+
+@end
@@ -0,0 +1,208 @@
+/*
+ *  FLValueHistory.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLValueHistory.h"
+
+
+// Value of the sample with the given sequence number, which must still be
+// in the history
+#define SAMPLE_VALUE(channel, seq)		(_values[channel][(seq) % _depth])
+
+
+#pragma mark -
+@implementation FLValueHistory
+
+@synthesize depth	= _depth,
+			count	= _count;
+
+
+- initWithDepth:(NSUInteger)depth {
+	
+	if(self = [super init]) {
+		_depth			= MAX(depth, 1);
+		_timestamps		= (double*)calloc(2 * _depth, sizeof(double));
+		
+		for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+			_values[c]				= (float*)calloc(2 * _depth, sizeof(float));
+			_stats[c].minQueue		= (NSUInteger*)calloc(_depth, sizeof(NSUInteger));
+			_stats[c].maxQueue		= (NSUInteger*)calloc(_depth, sizeof(NSUInteger));
+		}
+		
+		[self reset];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	
+	free(_timestamps);
+	
+	for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+		free(_values[c]);
+		free(_stats[c].minQueue);
+		free(_stats[c].maxQueue);
+	}
+	
+	[super dealloc];
+}
+
+
+- (void) reset {
+	
+	_count		= 0;
+	_sequence	= 0;
+	
+	for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+		_stats[c].minHead		= 0;
+		_stats[c].minCount		= 0;
+		_stats[c].maxHead		= 0;
+		_stats[c].maxCount		= 0;
+		_stats[c].sum			= 0;
+		_stats[c].validCount	= 0;
+	}
+}
+
+
+- (void) addValues:(const float*)values timestamp:(double)timestamp {
+	
+	NSUInteger seq		= _sequence++;
+	NSUInteger slot		= seq % _depth;
+	BOOL full			= (_count == _depth);
+	
+	_timestamps[slot]			= timestamp;
+	_timestamps[slot + _depth]	= timestamp;
+	
+	for(NSUInteger c = 0; c < kNumValueHistoryChannels; c++) {
+		FLValueHistoryStats* stats	= &_stats[c];
+		float value					= values[c];
+		
+		// The slot being written holds the sample falling out of the history
+		if(full && !isnan(_values[c][slot])) {
+			stats->sum				-= _values[c][slot];
+			stats->validCount--;
+		}
+		
+		_values[c][slot]			= value;
+		_values[c][slot + _depth]	= value;
+		
+		// Drop queued samples which are no longer in the history
+		while(stats->minCount > 0 && (stats->minQueue[stats->minHead] + _depth) <= seq) {
+			stats->minHead			= (stats->minHead + 1) % _depth;
+			stats->minCount--;
+		}
+		
+		while(stats->maxCount > 0 && (stats->maxQueue[stats->maxHead] + _depth) <= seq) {
+			stats->maxHead			= (stats->maxHead + 1) % _depth;
+			stats->maxCount--;
+		}
+		
+		if(isnan(value)) {
+			continue;
+		}
+		
+		stats->sum					+= value;
+		stats->validCount++;
+		
+		// A sample can never again be the minimum once a later sample is
+		// at or below it, and likewise for the maximum
+		while(stats->minCount > 0 &&
+			  SAMPLE_VALUE(c, stats->minQueue[(stats->minHead + stats->minCount - 1) % _depth]) >= value) {
+			stats->minCount--;
+		}
+		
+		stats->minQueue[(stats->minHead + stats->minCount) % _depth]	= seq;
+		stats->minCount++;
+		
+		while(stats->maxCount > 0 &&
+			  SAMPLE_VALUE(c, stats->maxQueue[(stats->maxHead + stats->maxCount - 1) % _depth]) <= value) {
+			stats->maxCount--;
+		}
+		
+		stats->maxQueue[(stats->maxHead + stats->maxCount) % _depth]	= seq;
+		stats->maxCount++;
+		
+		// Resum once per pass through the storage, so rounding error in
+		// the running sum cannot build up
+		if(full && slot == (_depth - 1)) {
+			double sum				= 0;
+			
+			for(NSUInteger i = 0; i < _depth; i++) {
+				if(!isnan(_values[c][i])) {
+					sum				+= _values[c][i];
+				}
+			}
+			
+			stats->sum				= sum;
+		}
+	}
+	
+	if(!full) {
+		_count++;
+	}
+}
+
+
+- (const double*) timestamps {
+	return &_timestamps[(_sequence - _count) % _depth];
+}
+
+
+- (const float*) valuesForChannel:(FLValueHistoryChannel)channel {
+	
+	if(channel >= kNumValueHistoryChannels) {
+		return NULL;
+	}
+	
+	return &_values[channel][(_sequence - _count) % _depth];
+}
+
+
+- (float) minValueForChannel:(FLValueHistoryChannel)channel {
+	
+	if(channel >= kNumValueHistoryChannels || _stats[channel].minCount == 0) {
+		return NAN;
+	}
+	
+	return SAMPLE_VALUE(channel, _stats[channel].minQueue[_stats[channel].minHead]);
+}
+
+
+- (float) maxValueForChannel:(FLValueHistoryChannel)channel {
+	
+	if(channel >= kNumValueHistoryChannels || _stats[channel].maxCount == 0) {
+		return NAN;
+	}
+	
+	return SAMPLE_VALUE(channel, _stats[channel].maxQueue[_stats[channel].maxHead]);
+}
+
+
+- (float) meanValueForChannel:(FLValueHistoryChannel)channel {
+	
+	if(channel >= kNumValueHistoryChannels || _stats[channel].validCount == 0) {
+		return NAN;
+	}
+	
+	return (float)(_stats[channel].sum / _stats[channel].validCount);
+}
+
+@end
@@ -0,0 +1,164 @@
+/*
+ *  FLELM327Emulator.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
+#import "ELM327.h"
+#import "FLScanToolTransport.h"
+#import "FLSimECU.h"
+
+
+#define ELM327_EMULATOR_HOST				@"127.0.0.1"
+#define ELM327_EMULATOR_VERSION				@"ELM327 v1.5"
+#define ELM327_EMULATOR_DESCRIPTION			@"OBDII to RS232 Interpreter"
+
+// Longest command line accepted; longer lines are answered with '?'
+#define ELM327_EMULATOR_LINE_LENGTH			64
+
+// Default AT ST value, in 4 msec units (200 msec)
+#define ELM327_EMULATOR_DEFAULT_TIMEOUT		0x32
+
+// Seconds to wait for the CR confirming an AT BRD rate (the AT BRT default)
+#define ELM327_EMULATOR_BAUD_RATE_TIMEOUT	0.075
+
+// Seconds between checks that the OK for an AT BRD has left the port
+#define ELM327_EMULATOR_DRAIN_INTERVAL		0.002
+
+
+/*
+ A stand-in for an ELM327 and the vehicle behind it, listening on a
+ loopback TCP port.  An ELM327 scan tool given the emulator's host and
+ port connects to it as it would to a WiFi adapter, so its init sequence,
+ polling, writes and parser all run against the emulator:
+
+	emulator.ecus		= [NSArray arrayWithObjects:[FLSimECU engineECU], [FLSimECU transmissionECU], nil];
+	emulator.protocol	= kISO15765CAN11Bit500;
+	[emulator startOnPort:0];
+	
+	scanTool			= [FLScanTool scanToolForDeviceType:kScanToolDeviceTypeELM327];
+	scanTool.host		= emulator.host;
+	scanTool.port		= emulator.port;
+
+ The emulator answers the AT commands the driver sends (and the common
+ others) and OBD requests, from each ECU in the order given.  Echo, spaces,
+ linefeeds and headers (AT H1) are honored, with CAN replies split into
+ ISO 15765-2 frames and other replies carrying their 3 byte header and
+ checksum.  The first request after a reset or AT SP on an automatic
+ protocol prints SEARCHING... and connects to protocol, or prints UNABLE
+ TO CONNECT if there are no ECUs.  Requests no ECU answers print NO DATA.
+ A byte received while a reply is pending stops it, as on the ELM327.
+
+ The emulator can instead serve a single scan tool over a transport.  AT
+ BRD is answered as the ELM327 does, and over an FLSerialTransport the
+ emulator's end changes rate with it.  The scan tool only negotiates a
+ rate over an FLSerialTransport, so across a pty it takes the slave:
+
+	[emulator startWithTransport:[FLFileDescriptorTransport ptyTransportWithSlavePath:&slavePath]];
+	
+	transport				= [FLSerialTransport transportWithPath:slavePath baudRate:38400];
+	transport.maxBaudRate	= 115200;
+	scanTool.transport		= transport;
+
+ Each connection has its own ELM327 settings, so several scan tools may
+ be connected at once.  The emulator runs on its own thread; its settings
+ and ECUs may only be changed while it is stopped.
+ */
+@interface FLELM327Emulator : NSObject {
+	NSArray*				_ecus;
+	ELM327Protocol			_protocol;
+	NSTimeInterval			_responseDelay;
+	NSTimeInterval			_searchDelay;
+	BOOL					_waitsForResponseTimeout;
+	BOOL					_refusesBaudRateChange;
+	BOOL					_failsBaudRateChange;
+	NSString*				_versionString;
+	double					_voltage;
+	
+	NSInteger				_port;
+	CFSocketRef				_socket;
+	FLScanToolTransport*	_transport;
+	NSOperationQueue*		_operationQueue;
+	NSInvocationOperation*	_operation;
+	CFRunLoopRef			_runLoop;
+	NSMutableArray*			_connections;
+	NSUInteger				_connectionCount;
+	NSUInteger				_requestCount;
+}
+
+// ECUs on the vehicle bus, each a FLSimECU.  Defaults to the engine ECU.
+@property (nonatomic, retain) NSArray* ecus;
+
+// Protocol the vehicle speaks.  Defaults to kISO15765CAN11Bit500.
+@property (nonatomic, assign) ELM327Protocol protocol;
+
+// Seconds from an OBD request to its reply, to which the slowest replying
+// ECU's responseDelay is added.  AT commands are answered at once.
+@property (nonatomic, assign) NSTimeInterval responseDelay;
+
+// Seconds added to the first request on an automatic protocol
+@property (nonatomic, assign) NSTimeInterval searchDelay;
+
+// When enabled, replies are held for the AT ST timeout after the last ECU
+// has replied, as the ELM327 listens for more ECUs, unless the request's
+// response count hint has been met.  NO DATA then also takes the timeout.
+// Defaults to NO, so requests are answered as fast as possible.
+@property (nonatomic, assign) BOOL waitsForResponseTimeout;
+
+// When enabled, AT BRD is answered with '?', as by adapters older than
+// v1.2 and many clones
+@property (nonatomic, assign) BOOL refusesBaudRateChange;
+
+// When enabled, AT BRD is answered with OK and the rate changes, but the
+// ID string is not sent at the new rate, as when the host's port cannot
+// run at it.  The emulator goes back to the old rate once the AT BRT time
+// is up.
+@property (nonatomic, assign) BOOL failsBaudRateChange;
+
+// Reply to ATZ, ATWS and ATI
+@property (nonatomic, copy) NSString* versionString;
+
+// Reply to AT RV, in volts
+@property (nonatomic, assign) double voltage;
+
+@property (nonatomic, readonly) NSString* host;
+
+// Port listened on, which is chosen by the system if startOnPort: is given 0
+@property (nonatomic, readonly) NSInteger port;
+@property (nonatomic, readonly) BOOL running;
+
+// Totals since the emulator was created
+@property (nonatomic, readonly) NSUInteger connectionCount;
+@property (nonatomic, readonly) NSUInteger requestCount;
+
++ (FLELM327Emulator*) emulator;
+
+// Listens on port, or a free port if 0, on the loopback interface.  Returns
+// NO if the port could not be listened on.
+- (BOOL) startOnPort:(NSInteger)port;
+
+// Serves the scan tool on the other end of transport instead of listening.
+// Returns NO if the transport could not be opened.
+- (BOOL) startWithTransport:(FLScanToolTransport*)transport;
+
+// Closes every connection, and stops listening or closes the transport,
+// once the emulator's thread has finished
+- (void) stop;
+
+@end
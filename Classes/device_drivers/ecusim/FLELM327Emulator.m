@@ -0,0 +1,1338 @@
+/*
+ *  FLELM327Emulator.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLELM327Emulator.h"
+#import "ELM327Command.h"
+#import "FLSerialTransport.h"
+#import "FLLogging.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <unistd.h>
+#import <errno.h>
+
+
+#define EMULATOR_READ_SIZE				1024
+
+// Longest line printed: a 29-bit CAN header and an 8 byte frame
+#define EMULATOR_MAX_LINE_LENGTH		64
+
+// Value CAN frames are padded out to 8 bytes with
+#define EMULATOR_CAN_PADDING			0x00
+
+#define EMULATOR_CAN_PROTOCOL(p)		((p) >= kISO15765CAN11Bit500)
+#define EMULATOR_CAN_29BIT(p)			((p) == kISO15765CAN29Bit500 || (p) == kISO15765CAN29Bit250 || (p) == kSAEJ1939CAN29Bit250)
+
+// Functional (broadcast) request headers
+#define EMULATOR_CAN_11BIT_FUNCTIONAL	0x7DF
+#define EMULATOR_CAN_29BIT_FUNCTIONAL	0xDB33F1
+
+
+static const char g_hexDigits[] = "0123456789ABCDEF";
+
+// Standard rates, which AT BRD divisors are matched to before a serial
+// transport is switched
+static const NSUInteger g_baudRates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 500000 };
+
+static const char* g_protocolDescriptions[] = {
+	"AUTO",
+	"SAE J1850 PWM",
+	"SAE J1850 VPW",
+	"ISO 9141-2",
+	"ISO 14230-4 (KWP 5BAUD)",
+	"ISO 14230-4 (KWP FAST)",
+	"ISO 15765-4 (CAN 11/500)",
+	"ISO 15765-4 (CAN 29/500)",
+	"ISO 15765-4 (CAN 11/250)",
+	"ISO 15765-4 (CAN 29/250)",
+	"SAE J1939 (CAN 29/250)",
+	"USER1 (CAN 11/125)",
+	"USER2 (CAN 11/50)"
+};
+
+
+static inline NSInteger hexValue(char c) {
+	
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	else if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	
+	return -1;
+}
+
+
+// Parses a command argument of exactly digits hex digits, or returns -1
+static NSInteger parseHex(const char* str, NSUInteger digits) {
+	
+	NSInteger value		= 0;
+	
+	if(strlen(str) != digits) {
+		return -1;
+	}
+	
+	for(NSUInteger i = 0; i < digits; i++) {
+		NSInteger digit	= hexValue(str[i]);
+		
+		if(digit < 0) {
+			return -1;
+		}
+		
+		value			= (value << 4) | digit;
+	}
+	
+	return value;
+}
+
+
+static inline NSUInteger appendHexByte(char* line, NSUInteger offset, uint8_t byte, BOOL spaces) {
+	
+	if(spaces && offset > 0) {
+		line[offset++]	= ' ';
+	}
+	
+	line[offset++]		= g_hexDigits[byte >> 4];
+	line[offset++]		= g_hexDigits[byte & 0x0F];
+	
+	return offset;
+}
+
+
+// The standard rate whose AT BRD divisor is divisor, or else the rate the
+// ELM327 clock gives
+static NSUInteger baudRateForDivisor(NSUInteger divisor) {
+	
+	for(NSUInteger i = 0; i < sizeof(g_baudRates) / sizeof(g_baudRates[0]); i++) {
+		if((ELM327_BAUD_RATE_CLOCK + (g_baudRates[i] / 2)) / g_baudRates[i] == divisor) {
+			return g_baudRates[i];
+		}
+	}
+	
+	return ELM327_BAUD_RATE_CLOCK / divisor;
+}
+
+
+// SAE J1850 CRC-8
+static uint8_t j1850CRC(const uint8_t* bytes, NSUInteger length) {
+	
+	uint8_t crc			= 0xFF;
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		crc				^= bytes[i];
+		
+		for(NSUInteger bit = 0; bit < 8; bit++) {
+			crc			= (crc & 0x80) ? ((crc << 1) ^ 0x1D) : (crc << 1);
+		}
+	}
+	
+	return ~crc;
+}
+
+
+@class FLELM327EmulatorConnection;
+
+@interface FLELM327Emulator (Private)
+- (void) runEmulator;
+- (void) acceptConnection:(CFSocketNativeHandle)nativeSocket;
+- (void) addConnection:(FLELM327EmulatorConnection*)connection;
+- (void) connectionDidClose:(FLELM327EmulatorConnection*)connection;
+- (void) countRequest;
+@end
+
+
+static void emulatorAcceptCallback(CFSocketRef socket,
+								   CFSocketCallBackType type,
+								   CFDataRef address,
+								   const void* data,
+								   void* info) {
+	
+	if(type == kCFSocketAcceptCallBack && data) {
+		[(FLELM327Emulator*)info acceptConnection:*(const CFSocketNativeHandle*)data];
+	}
+}
+
+
+#pragma mark -
+/*
+ One scan tool's connection to the emulator, holding the ELM327 settings
+ it has made.  Lives on the emulator's thread.
+ */
+@interface FLELM327EmulatorConnection : NSObject <NSStreamDelegate> {
+	FLELM327Emulator*		_emulator;			// Not retained
+	FLScanToolTransport*	_transport;			// nil for a socket
+	NSInputStream*			_inputStream;
+	NSOutputStream*			_outputStream;
+	NSMutableData*			_output;
+	NSUInteger				_outputOffset;
+	NSMutableData*			_reply;				// Held until its delay is up
+	BOOL					_replyPending;
+	
+	char					_line[ELM327_EMULATOR_LINE_LENGTH + 1];
+	NSUInteger				_lineLength;
+	BOOL					_lineOverflow;
+	char					_lastLine[ELM327_EMULATOR_LINE_LENGTH + 1];
+	
+	BOOL					_echo;
+	BOOL					_linefeeds;
+	BOOL					_spaces;
+	BOOL					_headers;
+	NSUInteger				_selectedProtocol;	// AT SP
+	BOOL					_automatic;
+	NSUInteger				_connectedProtocol;	// 0 until a request connects
+	NSUInteger				_timeout;			// AT ST, in 4 msec units
+	NSUInteger				_requestHeader;		// AT SH, 0 for the default
+	NSUInteger				_receiveAddress;	// AT CRA, 0 for any
+	BOOL					_baudRatePending;	// AT BRD, waiting for the CR
+	NSUInteger				_pendingBaudRate;	// AT BRD, waiting for the OK to go
+	NSUInteger				_previousBaudRate;
+}
+
+- initWithEmulator:(FLELM327Emulator*)emulator nativeSocket:(CFSocketNativeHandle)nativeSocket;
+- initWithEmulator:(FLELM327Emulator*)emulator transport:(FLScanToolTransport*)transport;
+- (void) close;
+
+@end
+
+
+@interface FLELM327EmulatorConnection (Private)
+- (void) openWithInputStream:(NSInputStream*)inputStream outputStream:(NSOutputStream*)outputStream;
+- (void) receiveBytes:(const uint8_t*)bytes length:(NSUInteger)length;
+- (void) handleLine;
+- (void) handleATCommand:(const char*)command;
+- (void) handleRequest:(const char*)request;
+- (BOOL) ecuReceivesRequest:(FLSimECU*)ecu;
+- (NSUInteger) responseIDForECU:(FLSimECU*)ecu;
+- (void) appendCANMessage:(NSData*)message fromECU:(FLSimECU*)ecu;
+- (void) appendMessage:(NSData*)message fromECU:(FLSimECU*)ecu;
+- (NSUInteger) appendCANHeaderForECU:(FLSimECU*)ecu toLine:(char*)line;
+- (void) appendLine:(const char*)line length:(NSUInteger)length;
+- (void) appendString:(const char*)string;
+- (void) finishReplyAfterDelay:(NSTimeInterval)delay;
+- (void) replyDelayDidExpire;
+- (void) stopReply;
+- (void) switchToBaudRateDivisor:(NSUInteger)divisor;
+- (void) switchBaudRateOnceSent;
+- (void) confirmBaudRate;
+- (void) baudRateDidTimeout;
+- (void) resetSettings;
+- (void) writeOutput;
+@end
+
+
+@implementation FLELM327EmulatorConnection
+
+
+- initWithEmulator:(FLELM327Emulator*)emulator nativeSocket:(CFSocketNativeHandle)nativeSocket {
+	
+	if(self = [super init]) {
+		CFReadStreamRef readStream		= NULL;
+		CFWriteStreamRef writeStream	= NULL;
+		int noDelay						= 1;
+		
+		// Replies are written a line at a time, so send each as it is made
+		setsockopt(nativeSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		
+		CFStreamCreatePairWithSocket(kCFAllocatorDefault, nativeSocket, &readStream, &writeStream);
+		
+		if(!readStream || !writeStream) {
+			FLERROR(@"Unable to create streams for socket %d", nativeSocket)
+			
+			if(readStream) {
+				CFRelease(readStream);
+			}
+			
+			if(writeStream) {
+				CFRelease(writeStream);
+			}
+			
+			close(nativeSocket);
+			[self release];
+			return nil;
+		}
+		
+		CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+		CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+		
+		_emulator		= emulator;
+		[self openWithInputStream:(NSInputStream*)readStream outputStream:(NSOutputStream*)writeStream];
+		
+		CFRelease(readStream);
+		CFRelease(writeStream);
+	}
+	
+	return self;
+}
+
+
+- initWithEmulator:(FLELM327Emulator*)emulator transport:(FLScanToolTransport*)transport {
+	
+	if(self = [super init]) {
+		// The transport has been opened by the emulator
+		_emulator		= emulator;
+		_transport		= [transport retain];
+		[self openWithInputStream:transport.inputStream outputStream:transport.outputStream];
+	}
+	
+	return self;
+}
+
+
+- (void) openWithInputStream:(NSInputStream*)inputStream outputStream:(NSOutputStream*)outputStream {
+	
+	_inputStream	= [inputStream retain];
+	_outputStream	= [outputStream retain];
+	_output			= [[NSMutableData alloc] initWithCapacity:EMULATOR_READ_SIZE];
+	_reply			= [[NSMutableData alloc] initWithCapacity:EMULATOR_READ_SIZE];
+	_automatic		= YES;
+	
+	[self resetSettings];
+	
+	[_inputStream setDelegate:self];
+	[_inputStream scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[_inputStream open];
+	
+	[_outputStream setDelegate:self];
+	[_outputStream scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[_outputStream open];
+}
+
+
+- (void) dealloc {
+	[self close];
+	[_inputStream release];
+	[_outputStream release];
+	[_transport release];
+	[_output release];
+	[_reply release];
+	[super dealloc];
+}
+
+
+- (void) close {
+	
+	if(_replyPending) {
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(replyDelayDidExpire) object:nil];
+		_replyPending	= NO;
+	}
+	
+	if(_baudRatePending) {
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(baudRateDidTimeout) object:nil];
+		_baudRatePending	= NO;
+	}
+	
+	if(_pendingBaudRate != 0) {
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(switchBaudRateOnceSent) object:nil];
+		_pendingBaudRate	= 0;
+	}
+	
+	[_inputStream setDelegate:nil];
+	[_inputStream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[_inputStream close];
+	
+	[_outputStream setDelegate:nil];
+	[_outputStream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[_outputStream close];
+	
+	[_transport close];
+}
+
+
+#pragma mark -
+#pragma mark NSStream Delegate Methods
+
+- (void)stream:(NSStream*)stream handleEvent:(NSStreamEvent)eventCode {
+	
+	uint8_t buffer[EMULATOR_READ_SIZE];
+	
+	switch(eventCode) {
+		case NSStreamEventHasBytesAvailable:
+			while([_inputStream hasBytesAvailable]) {
+				NSInteger count	= [_inputStream read:buffer maxLength:sizeof(buffer)];
+				
+				if(count <= 0) {
+					break;
+				}
+				
+				[self receiveBytes:buffer length:count];
+			}
+			
+			[self writeOutput];
+			break;
+		
+		case NSStreamEventHasSpaceAvailable:
+			[self writeOutput];
+			break;
+		
+		case NSStreamEventErrorOccurred:
+			FLNSERROR([stream streamError])
+			// Fall through
+		
+		case NSStreamEventEndEncountered:
+			[self close];
+			[_emulator connectionDidClose:self];
+			break;
+		
+		default:
+			break;
+	}
+}
+
+
+#pragma mark -
+#pragma mark Command Handling
+
+- (void) receiveBytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		char c	= (char)bytes[i];
+		
+		if(_baudRatePending) {
+			// Only the CR confirming the new rate is looked for
+			if(c == '\r') {
+				[self confirmBaudRate];
+			}
+			
+			continue;
+		}
+		
+		if(_replyPending) {
+			// Any byte stops the reply in progress, and is itself dropped
+			[self stopReply];
+			continue;
+		}
+		
+		if(_echo) {
+			[_output appendBytes:&c length:1];
+		}
+		
+		if(c == '\r') {
+			[self handleLine];
+			_lineLength		= 0;
+			_lineOverflow	= NO;
+		}
+		else if(c <= ' ') {
+			// Spaces, linefeeds and other control characters are ignored
+			continue;
+		}
+		else if(_lineLength < ELM327_EMULATOR_LINE_LENGTH) {
+			_line[_lineLength++]	= toupper(c);
+		}
+		else {
+			_lineOverflow	= YES;
+		}
+	}
+}
+
+
+- (void) handleLine {
+	
+	_line[_lineLength]	= 0x00;
+	
+	if(_lineOverflow) {
+		[self appendString:"?"];
+		[self finishReplyAfterDelay:0];
+		return;
+	}
+	
+	if(_lineLength == 0) {
+		// A bare CR repeats the last command
+		strcpy(_line, _lastLine);
+	}
+	else {
+		strcpy(_lastLine, _line);
+	}
+	
+	if(_line[0] == 0x00) {
+		[self finishReplyAfterDelay:0];
+	}
+	else if(_line[0] == 'A' && _line[1] == 'T') {
+		[self handleATCommand:&_line[2]];
+	}
+	else {
+		[self handleRequest:_line];
+	}
+}
+
+
+- (void) handleATCommand:(const char*)command {
+	
+	char line[EMULATOR_MAX_LINE_LENGTH];
+	NSInteger value;
+	BOOL ok		= YES;
+	
+	if(!strcmp(command, "Z") || !strcmp(command, "WS")) {
+		[self resetSettings];
+		[self appendString:[_emulator.versionString UTF8String]];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "D")) {
+		[self resetSettings];
+	}
+	else if(!strcmp(command, "I")) {
+		[self appendString:[_emulator.versionString UTF8String]];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "@1")) {
+		[self appendString:[ELM327_EMULATOR_DESCRIPTION UTF8String]];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "RV")) {
+		snprintf(line, sizeof(line), "%.1fV", _emulator.voltage);
+		[self appendString:line];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "IGN")) {
+		[self appendString:"ON"];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "DP")) {
+		NSUInteger protocol	= (_connectedProtocol) ? _connectedProtocol : _selectedProtocol;
+		
+		if(_automatic && protocol != kELMAutomatic) {
+			snprintf(line, sizeof(line), "AUTO, %s", g_protocolDescriptions[protocol]);
+		}
+		else {
+			snprintf(line, sizeof(line), "%s", g_protocolDescriptions[protocol]);
+		}
+		
+		[self appendString:line];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "DPN")) {
+		NSUInteger protocol	= (_connectedProtocol) ? _connectedProtocol : _selectedProtocol;
+		snprintf(line, sizeof(line), (_automatic) ? "A%X" : "%X", protocol);
+		[self appendString:line];
+		ok		= NO;
+	}
+	else if(!strcmp(command, "E0") || !strcmp(command, "E1")) {
+		_echo		= (command[1] == '1');
+	}
+	else if(!strcmp(command, "L0") || !strcmp(command, "L1")) {
+		_linefeeds	= (command[1] == '1');
+	}
+	else if(!strcmp(command, "S0") || !strcmp(command, "S1")) {
+		_spaces		= (command[1] == '1');
+	}
+	else if(!strcmp(command, "H0") || !strcmp(command, "H1")) {
+		_headers	= (command[1] == '1');
+	}
+	else if(!strncmp(command, "SP", 2) || !strncmp(command, "TP", 2)) {
+		const char* argument	= &command[2];
+		BOOL automatic			= (*argument == 'A');
+		
+		if(automatic) {
+			argument++;
+		}
+		
+		value					= parseHex(argument, 1);
+		
+		if(value < 0 || value > kUser2CAN11Bit50) {
+			ok					= NO;
+			[self appendString:"?"];
+		}
+		else {
+			_selectedProtocol	= value;
+			_automatic			= (automatic || value == kELMAutomatic);
+			_connectedProtocol	= 0;
+		}
+	}
+	else if(!strncmp(command, "ST", 2)) {
+		value		= parseHex(&command[2], 2);
+		
+		if(value < 0) {
+			ok		= NO;
+			[self appendString:"?"];
+		}
+		else {
+			_timeout	= (value == 0) ? ELM327_EMULATOR_DEFAULT_TIMEOUT : value;
+		}
+	}
+	else if(!strncmp(command, "SH", 2)) {
+		value		= parseHex(&command[2], 3);
+		
+		if(value < 0) {
+			value	= parseHex(&command[2], 6);
+		}
+		
+		if(value < 0) {
+			ok		= NO;
+			[self appendString:"?"];
+		}
+		else {
+			_requestHeader	= value;
+		}
+	}
+	else if(!strncmp(command, "CRA", 3)) {
+		value		= (command[3] == 0x00) ? 0 : parseHex(&command[3], 3);
+		
+		if(value < 0) {
+			value	= parseHex(&command[3], 8);
+		}
+		
+		if(value < 0) {
+			ok		= NO;
+			[self appendString:"?"];
+		}
+		else {
+			_receiveAddress	= value;
+		}
+	}
+	else if(!strcmp(command, "AR")) {
+		_receiveAddress	= 0;
+	}
+	else if(!strncmp(command, "BRD", 3)) {
+		value		= parseHex(&command[3], 2);
+		
+		if(value < ELM327_MIN_BAUD_RATE_DIVISOR || _emulator.refusesBaudRateChange) {
+			ok		= NO;
+			[self appendString:"?"];
+		}
+		else {
+			// Answered in steps of its own, not with OK and the prompt
+			[self switchToBaudRateDivisor:value];
+			return;
+		}
+	}
+	else if(!strcmp(command, "AT0") || !strcmp(command, "AT1") || !strcmp(command, "AT2") ||
+			!strcmp(command, "M0") || !strcmp(command, "M1") ||
+			!strcmp(command, "CAF0") || !strcmp(command, "CAF1") ||
+			!strcmp(command, "D0") || !strcmp(command, "D1") ||
+			!strcmp(command, "R0") || !strcmp(command, "R1") ||
+			!strcmp(command, "PC") || !strncmp(command, "@3", 2)) {
+		// Accepted, but without effect on the emulator
+	}
+	else {
+		ok		= NO;
+		[self appendString:"?"];
+	}
+	
+	if(ok) {
+		[self appendString:"OK"];
+	}
+	
+	[self finishReplyAfterDelay:0];
+}
+
+
+- (void) handleRequest:(const char*)request {
+	
+	uint8_t bytes[SIM_ECU_MAX_MESSAGE_LENGTH];
+	NSUInteger length			= strlen(request);
+	NSUInteger responseHint		= 0;
+	NSTimeInterval delay		= _emulator.responseDelay;
+	NSTimeInterval ecuDelay		= 0;
+	NSUInteger responseCount	= 0;
+	ELM327Protocol protocol		= _emulator.protocol;
+	NSArray* ecus				= _emulator.ecus;
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		if(hexValue(request[i]) < 0) {
+			[self appendString:"?"];
+			[self finishReplyAfterDelay:0];
+			return;
+		}
+	}
+	
+	if(length % 2) {
+		// A trailing digit is the number of responses to wait for
+		responseHint			= hexValue(request[--length]);
+	}
+	
+	if(length == 0 || (length / 2) > sizeof(bytes)) {
+		[self appendString:"?"];
+		[self finishReplyAfterDelay:0];
+		return;
+	}
+	
+	length						/= 2;
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		bytes[i]				= (hexValue(request[i * 2]) << 4) | hexValue(request[(i * 2) + 1]);
+	}
+	
+	[_emulator countRequest];
+	
+	if(!_connectedProtocol) {
+		BOOL available			= (protocol != kELMAutomatic && protocol <= kUser2CAN11Bit50 && [ecus count] > 0);
+		
+		if(_automatic) {
+			// SP A6 tries 6 first, and only searches if that fails
+			if(_selectedProtocol == kELMAutomatic || _selectedProtocol != protocol) {
+				[self appendString:"SEARCHING..."];
+				delay			+= _emulator.searchDelay;
+			}
+		}
+		else if(_selectedProtocol != protocol) {
+			available			= NO;
+		}
+		
+		if(!available) {
+			[self appendString:"UNABLE TO CONNECT"];
+			[self finishReplyAfterDelay:delay];
+			return;
+		}
+		
+		_connectedProtocol		= protocol;
+	}
+	
+	BOOL canProtocol			= EMULATOR_CAN_PROTOCOL(_connectedProtocol);
+	NSMutableArray* messages	= [[NSMutableArray alloc] initWithCapacity:4];
+	
+	for(FLSimECU* ecu in ecus) {
+		if(![self ecuReceivesRequest:ecu]) {
+			continue;
+		}
+		
+		[messages removeAllObjects];
+		
+		if([ecu addRepliesToRequest:bytes length:length canProtocol:canProtocol toArray:messages] == 0) {
+			continue;
+		}
+		
+		for(NSData* message in messages) {
+			if(canProtocol) {
+				[self appendCANMessage:message fromECU:ecu];
+			}
+			else {
+				[self appendMessage:message fromECU:ecu];
+			}
+		}
+		
+		ecuDelay				= MAX(ecuDelay, ecu.responseDelay);
+		responseCount++;
+	}
+	
+	[messages release];
+	
+	if(_emulator.waitsForResponseTimeout && (responseHint == 0 || responseCount < responseHint)) {
+		delay					+= (_timeout * 0.004);
+	}
+	
+	if(responseCount == 0) {
+		[self appendString:"NO DATA"];
+	}
+	
+	[self finishReplyAfterDelay:(delay + ecuDelay)];
+}
+
+
+- (BOOL) ecuReceivesRequest:(FLSimECU*)ecu {
+	
+	if(!EMULATOR_CAN_PROTOCOL(_connectedProtocol)) {
+		return YES;
+	}
+	
+	if(_receiveAddress != 0 && _receiveAddress != [self responseIDForECU:ecu]) {
+		return NO;
+	}
+	
+	if(_requestHeader == 0 ||
+	   _requestHeader == EMULATOR_CAN_11BIT_FUNCTIONAL ||
+	   _requestHeader == EMULATOR_CAN_29BIT_FUNCTIONAL) {
+		return YES;
+	}
+	
+	if(EMULATOR_CAN_29BIT(_connectedProtocol)) {
+		// DA xx F1 is a physical request to ECU xx from the tester
+		return ((_requestHeader & 0xFF00FF) == 0xDA00F1 && ((_requestHeader >> 8) & 0xFF) == ecu.address);
+	}
+	
+	return (_requestHeader + 8 == ecu.canID);
+}
+
+
+- (NSUInteger) responseIDForECU:(FLSimECU*)ecu {
+	return (EMULATOR_CAN_29BIT(_connectedProtocol)) ? (0x18DAF100 | (ecu.address & 0xFF)) : ecu.canID;
+}
+
+
+#pragma mark -
+#pragma mark Reply Formatting
+
+- (NSUInteger) appendCANHeaderForECU:(FLSimECU*)ecu toLine:(char*)line {
+	
+	NSUInteger responseID	= [self responseIDForECU:ecu];
+	NSUInteger offset		= 0;
+	
+	if(EMULATOR_CAN_29BIT(_connectedProtocol)) {
+		for(NSInteger shift = 24; shift >= 0; shift -= 8) {
+			offset			= appendHexByte(line, offset, ((responseID >> shift) & 0xFF), _spaces);
+		}
+	}
+	else {
+		line[offset++]		= g_hexDigits[(responseID >> 8) & 0x07];
+		line[offset++]		= g_hexDigits[(responseID >> 4) & 0x0F];
+		line[offset++]		= g_hexDigits[responseID & 0x0F];
+	}
+	
+	return offset;
+}
+
+
+- (void) appendCANMessage:(NSData*)message fromECU:(FLSimECU*)ecu {
+	
+	const uint8_t* data		= (const uint8_t*)[message bytes];
+	NSUInteger length		= [message length];
+	char line[EMULATOR_MAX_LINE_LENGTH];
+	NSUInteger offset		= 0;
+	NSUInteger dataIndex	= 0;
+	
+	if(length <= 7) {
+		// Single frame.  Without headers, only the data is shown.
+		if(_headers) {
+			offset			= [self appendCANHeaderForECU:ecu toLine:line];
+			offset			= appendHexByte(line, offset, length, _spaces);
+		}
+		
+		for(NSUInteger i = 0; i < length; i++) {
+			offset			= appendHexByte(line, offset, data[i], _spaces);
+		}
+		
+		for(NSUInteger i = length; _headers && i < 7; i++) {
+			offset			= appendHexByte(line, offset, EMULATOR_CAN_PADDING, _spaces);
+		}
+		
+		[self appendLine:line length:offset];
+		return;
+	}
+	
+	// First frame, then consecutive frames numbered from 1, wrapping at 15.
+	// Without headers the ELM327 prints the total length on its own line,
+	// and numbers each frame from 0.
+	if(!_headers) {
+		offset				= snprintf(line, sizeof(line), "%03X", length);
+		[self appendLine:line length:offset];
+	}
+	
+	for(NSUInteger frame = 0; dataIndex < length; frame++) {
+		NSUInteger frameLength	= (frame == 0) ? 6 : 7;
+		
+		if(_headers) {
+			offset			= [self appendCANHeaderForECU:ecu toLine:line];
+			
+			if(frame == 0) {
+				offset		= appendHexByte(line, offset, (0x10 | ((length >> 8) & 0x0F)), _spaces);
+				offset		= appendHexByte(line, offset, (length & 0xFF), _spaces);
+			}
+			else {
+				offset		= appendHexByte(line, offset, (0x20 | (frame & 0x0F)), _spaces);
+			}
+		}
+		else {
+			line[0]			= g_hexDigits[frame & 0x0F];
+			line[1]			= ':';
+			offset			= 2;
+		}
+		
+		for(NSUInteger i = 0; i < frameLength; i++, dataIndex++) {
+			offset			= appendHexByte(line, offset,
+											((dataIndex < length) ? data[dataIndex] : EMULATOR_CAN_PADDING),
+											_spaces);
+		}
+		
+		[self appendLine:line length:offset];
+	}
+}
+
+
+- (void) appendMessage:(NSData*)message fromECU:(FLSimECU*)ecu {
+	
+	uint8_t frame[3 + SIM_ECU_MAX_MESSAGE_LENGTH + 1];
+	NSUInteger length		= MIN([message length], SIM_ECU_MAX_MESSAGE_LENGTH);
+	NSUInteger frameLength	= 0;
+	char line[EMULATOR_MAX_LINE_LENGTH];
+	NSUInteger offset		= 0;
+	
+	if(_headers) {
+		// Priority/format, target (the tester) and source bytes
+		switch(_connectedProtocol) {
+			case kSAEJ1850PWM:
+				frame[frameLength++]	= 0x41;
+				frame[frameLength++]	= 0x6B;
+				break;
+			
+			case kISO14230KWP:
+			case kISO14230KWPFastInit:
+				frame[frameLength++]	= 0x80 | length;
+				frame[frameLength++]	= 0xF1;
+				break;
+			
+			default:
+				frame[frameLength++]	= 0x48;
+				frame[frameLength++]	= 0x6B;
+				break;
+		}
+		
+		frame[frameLength++]	= ecu.address & 0xFF;
+	}
+	
+	memcpy(&frame[frameLength], [message bytes], length);
+	frameLength				+= length;
+	
+	if(_headers) {
+		if(_connectedProtocol == kSAEJ1850PWM || _connectedProtocol == kSAEJ1850VPW) {
+			frame[frameLength]	= j1850CRC(frame, frameLength);
+		}
+		else {
+			uint8_t sum			= 0;
+			
+			for(NSUInteger i = 0; i < frameLength; i++) {
+				sum				+= frame[i];
+			}
+			
+			frame[frameLength]	= sum;
+		}
+		
+		frameLength++;
+	}
+	
+	for(NSUInteger i = 0; i < frameLength; i++) {
+		offset				= appendHexByte(line, offset, frame[i], _spaces);
+	}
+	
+	[self appendLine:line length:offset];
+}
+
+
+- (void) appendLine:(const char*)line length:(NSUInteger)length {
+	
+	[_reply appendBytes:line length:length];
+	[_reply appendBytes:"\r\n" length:(_linefeeds) ? 2 : 1];
+}
+
+
+- (void) appendString:(const char*)string {
+	
+	if(string) {
+		[self appendLine:string length:strlen(string)];
+	}
+}
+
+
+- (void) finishReplyAfterDelay:(NSTimeInterval)delay {
+	
+	// A blank line, then the prompt
+	[_reply appendBytes:"\r\n" length:(_linefeeds) ? 2 : 1];
+	[_reply appendBytes:">" length:1];
+	
+	if(delay > 0) {
+		_replyPending	= YES;
+		[self performSelector:@selector(replyDelayDidExpire) withObject:nil afterDelay:delay];
+	}
+	else {
+		[_output appendData:_reply];
+		[_reply setLength:0];
+	}
+}
+
+
+- (void) replyDelayDidExpire {
+	
+	_replyPending	= NO;
+	[_output appendData:_reply];
+	[_reply setLength:0];
+	[self writeOutput];
+}
+
+
+- (void) stopReply {
+	
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(replyDelayDidExpire) object:nil];
+	_replyPending	= NO;
+	[_reply setLength:0];
+	
+	[self appendString:"STOPPED"];
+	[self finishReplyAfterDelay:0];
+}
+
+
+- (void) switchToBaudRateDivisor:(NSUInteger)divisor {
+	
+	FLSerialTransport* serial	= ([_transport isKindOfClass:[FLSerialTransport class]]) ? (FLSerialTransport*)_transport : nil;
+	NSUInteger baudRate			= baudRateForDivisor(divisor);
+	
+	if(serial && ![FLSerialTransport supportsBaudRate:baudRate]) {
+		[self appendString:"?"];
+		[self finishReplyAfterDelay:0];
+		return;
+	}
+	
+	// OK at the old rate, with no prompt after it
+	[self appendString:"OK"];
+	[_output appendData:_reply];
+	[_reply setLength:0];
+	[self writeOutput];
+	
+	_pendingBaudRate			= baudRate;
+	[self switchBaudRateOnceSent];
+}
+
+
+- (void) switchBaudRateOnceSent {
+	
+	FLSerialTransport* serial	= ([_transport isKindOfClass:[FLSerialTransport class]]) ? (FLSerialTransport*)_transport : nil;
+	
+	// The OK has to leave the port before the rate changes.  Waiting on the
+	// port would hold up the whole run loop, so check back shortly instead.
+	if(serial && ([_output length] > 0 || [serial hasPendingOutput])) {
+		[self writeOutput];
+		[self performSelector:@selector(switchBaudRateOnceSent) withObject:nil afterDelay:ELM327_EMULATOR_DRAIN_INTERVAL];
+		return;
+	}
+	
+	// Then the ID at the new rate, and a wait for the CR
+	_previousBaudRate			= serial.baudRate;
+	[serial switchToBaudRate:_pendingBaudRate];
+	_pendingBaudRate			= 0;
+	
+	if(!_emulator.failsBaudRateChange) {
+		[self appendString:[_emulator.versionString UTF8String]];
+		[_output appendData:_reply];
+		[_reply setLength:0];
+	}
+	
+	_baudRatePending			= YES;
+	[self performSelector:@selector(baudRateDidTimeout) withObject:nil afterDelay:ELM327_EMULATOR_BAUD_RATE_TIMEOUT];
+}
+
+
+- (void) confirmBaudRate {
+	
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(baudRateDidTimeout) object:nil];
+	_baudRatePending			= NO;
+	[self finishReplyAfterDelay:0];
+}
+
+
+- (void) baudRateDidTimeout {
+	
+	FLSerialTransport* serial	= ([_transport isKindOfClass:[FLSerialTransport class]]) ? (FLSerialTransport*)_transport : nil;
+	
+	// No CR came, so go back and print the prompt at the old rate
+	_baudRatePending			= NO;
+	
+	if(serial) {
+		[serial switchToBaudRate:_previousBaudRate];
+	}
+	
+	[self finishReplyAfterDelay:0];
+	[self writeOutput];
+}
+
+
+- (void) resetSettings {
+	
+	_echo				= YES;
+	_linefeeds			= NO;
+	_spaces				= YES;
+	_headers			= NO;
+	_connectedProtocol	= 0;
+	_timeout			= ELM327_EMULATOR_DEFAULT_TIMEOUT;
+	_requestHeader		= 0;
+	_receiveAddress		= 0;
+}
+
+
+- (void) writeOutput {
+	
+	const uint8_t* bytes	= (const uint8_t*)[_output bytes];
+	NSUInteger length		= [_output length];
+	
+	while(_outputOffset < length && [_outputStream hasSpaceAvailable]) {
+		NSInteger count		= [_outputStream write:&bytes[_outputOffset] maxLength:(length - _outputOffset)];
+		
+		if(count <= 0) {
+			FLNSERROR([_outputStream streamError])
+			break;
+		}
+		
+		_outputOffset		+= count;
+	}
+	
+	if(_outputOffset >= length) {
+		[_output setLength:0];
+		_outputOffset		= 0;
+	}
+}
+
+@end
+
+
+#pragma mark -
+@implementation FLELM327Emulator
+
+@synthesize ecus					= _ecus,
+			protocol				= _protocol,
+			responseDelay			= _responseDelay,
+			searchDelay				= _searchDelay,
+			waitsForResponseTimeout	= _waitsForResponseTimeout,
+			refusesBaudRateChange	= _refusesBaudRateChange,
+			failsBaudRateChange		= _failsBaudRateChange,
+			versionString			= _versionString,
+			voltage					= _voltage,
+			port					= _port,
+			connectionCount			= _connectionCount,
+			requestCount			= _requestCount;
+
+
++ (FLELM327Emulator*) emulator {
+	return [[[FLELM327Emulator alloc] init] autorelease];
+}
+
+
+- init {
+	
+	if(self = [super init]) {
+		_ecus			= [[NSArray alloc] initWithObjects:[FLSimECU engineECU], nil];
+		_protocol		= kISO15765CAN11Bit500;
+		_versionString	= [ELM327_EMULATOR_VERSION copy];
+		_voltage		= 12.6;
+		_connections	= [[NSMutableArray alloc] init];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self stop];
+	[_ecus release];
+	[_versionString release];
+	[_connections release];
+	[super dealloc];
+}
+
+
+- (NSString*) host {
+	return ELM327_EMULATOR_HOST;
+}
+
+
+- (BOOL) running {
+	return (_operation != nil);
+}
+
+
+- (BOOL) startOnPort:(NSInteger)port {
+	
+	CFSocketContext context			= { 0, self, NULL, NULL, NULL };
+	struct sockaddr_in address;
+	socklen_t addressLength			= sizeof(address);
+	int reuse						= 1;
+	
+	if(_operation) {
+		FLERROR(@"Emulator already running on port %d", _port)
+		return NO;
+	}
+	
+	_socket							= CFSocketCreate(kCFAllocatorDefault,
+													 PF_INET,
+													 SOCK_STREAM,
+													 IPPROTO_TCP,
+													 kCFSocketAcceptCallBack,
+													 emulatorAcceptCallback,
+													 &context);
+	
+	if(!_socket) {
+		FLERROR(@"Unable to create emulator socket (errno=%d)", errno)
+		return NO;
+	}
+	
+	setsockopt(CFSocketGetNative(_socket), SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	
+	memset(&address, 0, sizeof(address));
+	address.sin_len					= sizeof(address);
+	address.sin_family				= AF_INET;
+	address.sin_port				= htons(port);
+	address.sin_addr.s_addr			= htonl(INADDR_LOOPBACK);
+	
+	CFDataRef addressData			= CFDataCreate(kCFAllocatorDefault, (const UInt8*)&address, sizeof(address));
+	CFSocketError error				= CFSocketSetAddress(_socket, addressData);
+	CFRelease(addressData);
+	
+	if(error != kCFSocketSuccess ||
+	   getsockname(CFSocketGetNative(_socket), (struct sockaddr*)&address, &addressLength) != 0) {
+		FLERROR(@"Unable to listen on port %d (errno=%d)", port, errno)
+		CFSocketInvalidate(_socket);
+		CFRelease(_socket);
+		_socket						= NULL;
+		return NO;
+	}
+	
+	_port							= ntohs(address.sin_port);
+	
+	_operation						= [[NSInvocationOperation alloc] initWithTarget:self
+																		  selector:@selector(runEmulator)
+																			object:nil];
+	_operationQueue					= [[NSOperationQueue alloc] init];
+	[_operationQueue addOperation:_operation];
+	
+	FLDEBUG(@"ELM327 emulator listening on port %d", _port)
+	
+	return YES;
+}
+
+
+- (BOOL) startWithTransport:(FLScanToolTransport*)transport {
+	
+	if(_operation) {
+		FLERROR(@"Emulator already running", nil)
+		return NO;
+	}
+	
+	if(![transport open]) {
+		FLERROR(@"Unable to open transport %@", transport)
+		return NO;
+	}
+	
+	_transport						= [transport retain];
+	
+	_operation						= [[NSInvocationOperation alloc] initWithTarget:self
+																		  selector:@selector(runEmulator)
+																			object:nil];
+	_operationQueue					= [[NSOperationQueue alloc] init];
+	[_operationQueue addOperation:_operation];
+	
+	FLDEBUG(@"ELM327 emulator serving %@", transport)
+	
+	return YES;
+}
+
+
+- (void) stop {
+	
+	if(!_operation) {
+		return;
+	}
+	
+	[_operation cancel];
+	
+	@synchronized(self) {
+		// If the run loop is not yet running, it returns as soon as it is run
+		if(_runLoop) {
+			CFRunLoopStop(_runLoop);
+		}
+	}
+	
+	[_operationQueue waitUntilAllOperationsAreFinished];
+	
+	[_operation release];
+	_operation			= nil;
+	[_operationQueue release];
+	_operationQueue		= nil;
+	
+	if(_socket) {
+		CFSocketInvalidate(_socket);
+		CFRelease(_socket);
+		_socket			= NULL;
+		_port			= 0;
+	}
+	
+	[_transport release];
+	_transport			= nil;
+}
+
+
+- (void) runEmulator {
+	NSAutoreleasePool* pool		= [[NSAutoreleasePool alloc] init];
+	NSRunLoop* currentRunLoop	= [NSRunLoop currentRunLoop];
+	NSDate* distantFutureDate	= [NSDate distantFuture];
+	CFRunLoopSourceRef source	= (_socket) ? CFSocketCreateRunLoopSource(kCFAllocatorDefault, _socket, 0) : NULL;
+	
+	@try {
+		if(source) {
+			CFRunLoopAddSource([currentRunLoop getCFRunLoop], source, kCFRunLoopDefaultMode);
+		}
+		
+		if(_transport) {
+			FLELM327EmulatorConnection* connection	= [[FLELM327EmulatorConnection alloc] initWithEmulator:self transport:_transport];
+			[self addConnection:connection];
+			[connection release];
+		}
+		
+		@synchronized(self) {
+			_runLoop			= (CFRunLoopRef)CFRetain([currentRunLoop getCFRunLoop]);
+		}
+		
+		while(!_operation.isCancelled) {
+			NSAutoreleasePool* loopPool	= [[NSAutoreleasePool alloc] init];
+			[currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:distantFutureDate];
+			[loopPool release];
+		}
+	}
+	@catch (NSException * e) {
+		FLEXCEPTION(e)
+	}
+	@finally {
+		[_connections makeObjectsPerformSelector:@selector(close)];
+		[_connections removeAllObjects];
+		
+		if(source) {
+			CFRunLoopRemoveSource([currentRunLoop getCFRunLoop], source, kCFRunLoopDefaultMode);
+			CFRelease(source);
+		}
+		
+		@synchronized(self) {
+			if(_runLoop) {
+				CFRelease(_runLoop);
+				_runLoop		= NULL;
+			}
+		}
+		
+		[pool release];
+	}
+}
+
+
+- (void) acceptConnection:(CFSocketNativeHandle)nativeSocket {
+	
+	FLELM327EmulatorConnection* connection	= [[FLELM327EmulatorConnection alloc] initWithEmulator:self nativeSocket:nativeSocket];
+	
+	if(connection) {
+		[self addConnection:connection];
+		[connection release];
+	}
+}
+
+
+- (void) addConnection:(FLELM327EmulatorConnection*)connection {
+	
+	[_connections addObject:connection];
+	_connectionCount++;
+	
+	FLDEBUG(@"ELM327 emulator accepted connection %d", _connectionCount)
+}
+
+
+- (void) connectionDidClose:(FLELM327EmulatorConnection*)connection {
+	// The connection is called from its own stream, so outlives this run
+	// loop pass
+	[[connection retain] autorelease];
+	[_connections removeObject:connection];
+}
+
+
+- (void) countRequest {
+	_requestCount++;
+}
+
+@end
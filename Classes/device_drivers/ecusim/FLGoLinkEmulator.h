@@ -0,0 +1,97 @@
+/*
+ *  FLGoLinkEmulator.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
+#import "GoLink.h"
+#import "FLScanToolTransport.h"
+#import "FLSimECU.h"
+
+
+// Address the GoLink sends OBD requests to
+#define GOLINK_EMULATOR_FUNCTIONAL_ADDRESS	0xDF
+
+#define GOLINK_EMULATOR_READ_SIZE			1024
+
+
+/*
+ A stand-in for a GoLink and the vehicle behind it, speaking the GoLink's
+ binary frames over any transport.  With one end of a pair given to the
+ emulator and the other set as a GoLink scan tool's transport, the
+ driver's init, polling, framing and parser all run against it:
+
+	[FLMemoryTransport getTransport:&transport peer:&peer];
+	
+	emulator.ecus		= [NSArray arrayWithObjects:[FLSimECU engineECU], [FLSimECU transmissionECU], nil];
+	[emulator startWithTransport:peer];
+	
+	scanTool			= [FLScanTool scanToolForDeviceType:kScanToolDeviceTypeGoLink];
+	scanTool.transport	= transport;
+
+ The bus type request is answered with a system frame for protocol, and an
+ OBD request with a data frame for each message each ECU replies with, all
+ in a single write, so the driver splits several frames out of one read as
+ it would on the accessory.  A request no ECU answers gets a timeout error
+ frame.  Replies go out as soon as the request is read, so the scan runs as
+ fast as the driver can take them; a pipe, pty or socket pair in place of
+ the in-memory pair puts the kernel back in the path.
+
+ The emulator runs on its own thread; its settings and ECUs may only be
+ changed while it is stopped.
+ */
+@interface FLGoLinkEmulator : NSObject <NSStreamDelegate> {
+	NSArray*				_ecus;
+	GoLinkProtocol			_protocol;
+	
+	FLScanToolTransport*	_transport;
+	NSOperationQueue*		_operationQueue;
+	NSInvocationOperation*	_operation;
+	CFRunLoopRef			_runLoop;
+	NSMutableData*			_input;
+	NSMutableData*			_output;
+	NSUInteger				_outputOffset;
+	NSMutableArray*			_replies;
+	NSUInteger				_requestCount;
+	NSUInteger				_frameCount;
+}
+
+// ECUs on the vehicle bus, each a FLSimECU.  Defaults to the engine ECU.
+@property (nonatomic, retain) NSArray* ecus;
+
+// Protocol reported to the bus type request.  Defaults to
+// kGLProtocolISO15765CAN11Bit500.
+@property (nonatomic, assign) GoLinkProtocol protocol;
+
+@property (nonatomic, readonly) BOOL running;
+
+// Totals since the emulator was created
+@property (nonatomic, readonly) NSUInteger requestCount;
+@property (nonatomic, readonly) NSUInteger frameCount;
+
++ (FLGoLinkEmulator*) emulator;
+
+// Opens transport and answers the requests read from it until stopped.
+// Returns NO if the transport could not be opened.
+- (BOOL) startWithTransport:(FLScanToolTransport*)transport;
+
+// Closes the transport, once the emulator's thread has finished
+- (void) stop;
+
+@end
@@ -0,0 +1,387 @@
+/*
+ *  FLGoLinkEmulator.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLGoLinkEmulator.h"
+#import "FLLogging.h"
+
+
+// Largest payload a frame's length byte can announce
+#define EMULATOR_MAX_FRAME_DATA			0xFF
+
+#define EMULATOR_CAN_PROTOCOL(p)		((p) <= kGLProtocolISO15765CAN29Bit250)
+
+
+#pragma mark -
+#pragma mark Private Methods
+@interface FLGoLinkEmulator (Private)
+- (void) runEmulator;
+- (void) closeStreams;
+- (void) receiveFrames;
+- (void) handleFrame:(const GoLinkFrameHeader*)header;
+- (void) appendFrameOfType:(GoLinkFrameType)type address:(uint8_t)address bytes:(const uint8_t*)bytes length:(NSUInteger)length;
+- (void) writeOutput;
+- (void) keepAliveTimerDidFire:(NSTimer*)timer;
+@end
+
+
+#pragma mark -
+@implementation FLGoLinkEmulator
+
+@synthesize ecus			= _ecus,
+			protocol		= _protocol,
+			requestCount	= _requestCount,
+			frameCount		= _frameCount;
+
+
++ (FLGoLinkEmulator*) emulator {
+	return [[[FLGoLinkEmulator alloc] init] autorelease];
+}
+
+
+- init {
+	
+	if(self = [super init]) {
+		_ecus			= [[NSArray alloc] initWithObjects:[FLSimECU engineECU], nil];
+		_protocol		= kGLProtocolISO15765CAN11Bit500;
+		_input			= [[NSMutableData alloc] initWithCapacity:GOLINK_EMULATOR_READ_SIZE];
+		_output			= [[NSMutableData alloc] initWithCapacity:GOLINK_EMULATOR_READ_SIZE];
+		_replies		= [[NSMutableArray alloc] init];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[self stop];
+	[_ecus release];
+	[_input release];
+	[_output release];
+	[_replies release];
+	[super dealloc];
+}
+
+
+- (BOOL) running {
+	return (_operation != nil);
+}
+
+
+- (BOOL) startWithTransport:(FLScanToolTransport*)transport {
+	
+	if(_operation) {
+		FLERROR(@"Emulator already running on %@", _transport)
+		return NO;
+	}
+	
+	if(![transport open]) {
+		FLERROR(@"Unable to open transport %@", transport)
+		return NO;
+	}
+	
+	_transport			= [transport retain];
+	[_input setLength:0];
+	[_output setLength:0];
+	_outputOffset		= 0;
+	
+	_operation			= [[NSInvocationOperation alloc] initWithTarget:self
+															   selector:@selector(runEmulator)
+																 object:nil];
+	_operationQueue		= [[NSOperationQueue alloc] init];
+	[_operationQueue addOperation:_operation];
+	
+	return YES;
+}
+
+
+- (void) stop {
+	
+	if(!_operation) {
+		return;
+	}
+	
+	[_operation cancel];
+	
+	@synchronized(self) {
+		// If the run loop is not yet running, it returns as soon as it is run
+		if(_runLoop) {
+			CFRunLoopStop(_runLoop);
+		}
+	}
+	
+	[_operationQueue waitUntilAllOperationsAreFinished];
+	
+	[_operation release];
+	_operation			= nil;
+	[_operationQueue release];
+	_operationQueue		= nil;
+	
+	[_transport close];
+	[_transport release];
+	_transport			= nil;
+}
+
+
+- (void) runEmulator {
+	NSAutoreleasePool* pool		= [[NSAutoreleasePool alloc] init];
+	NSRunLoop* currentRunLoop	= [NSRunLoop currentRunLoop];
+	NSDate* distantFutureDate	= [NSDate distantFuture];
+	
+	// Keeps the run loop waiting once the transport's end has been reached
+	NSTimer* keepAliveTimer		= [NSTimer timerWithTimeInterval:COMMAND_MAX_TIMEOUT
+														  target:self
+														selector:@selector(keepAliveTimerDidFire:)
+														userInfo:nil
+														 repeats:YES];
+	
+	@try {
+		[currentRunLoop addTimer:keepAliveTimer forMode:NSDefaultRunLoopMode];
+		
+		[[_transport inputStream] setDelegate:self];
+		[[_transport inputStream] scheduleInRunLoop:currentRunLoop forMode:NSDefaultRunLoopMode];
+		[[_transport inputStream] open];
+		
+		[[_transport outputStream] setDelegate:self];
+		[[_transport outputStream] scheduleInRunLoop:currentRunLoop forMode:NSDefaultRunLoopMode];
+		[[_transport outputStream] open];
+		
+		@synchronized(self) {
+			_runLoop			= (CFRunLoopRef)CFRetain([currentRunLoop getCFRunLoop]);
+		}
+		
+		while(!_operation.isCancelled) {
+			NSAutoreleasePool* loopPool	= [[NSAutoreleasePool alloc] init];
+			[currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:distantFutureDate];
+			[loopPool release];
+		}
+	}
+	@catch (NSException * e) {
+		FLEXCEPTION(e)
+	}
+	@finally {
+		[self closeStreams];
+		[keepAliveTimer invalidate];
+		
+		@synchronized(self) {
+			if(_runLoop) {
+				CFRelease(_runLoop);
+				_runLoop		= NULL;
+			}
+		}
+		
+		[pool release];
+	}
+}
+
+
+- (void) closeStreams {
+	
+	NSInputStream* inputStream		= [_transport inputStream];
+	NSOutputStream* outputStream	= [_transport outputStream];
+	
+	[inputStream setDelegate:nil];
+	[inputStream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[inputStream close];
+	
+	[outputStream setDelegate:nil];
+	[outputStream removeFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+	[outputStream close];
+}
+
+
+- (void) keepAliveTimerDidFire:(NSTimer*)timer {
+}
+
+
+#pragma mark -
+#pragma mark NSStream Delegate Methods
+
+- (void)stream:(NSStream*)stream handleEvent:(NSStreamEvent)eventCode {
+	
+	NSInputStream* inputStream	= [_transport inputStream];
+	uint8_t buffer[GOLINK_EMULATOR_READ_SIZE];
+	
+	switch(eventCode) {
+		case NSStreamEventHasBytesAvailable:
+			while([inputStream hasBytesAvailable]) {
+				NSInteger count	= [inputStream read:buffer maxLength:sizeof(buffer)];
+				
+				if(count <= 0) {
+					break;
+				}
+				
+				[_input appendBytes:buffer length:count];
+			}
+			
+			[self receiveFrames];
+			[self writeOutput];
+			break;
+		
+		case NSStreamEventHasSpaceAvailable:
+			[self writeOutput];
+			break;
+		
+		case NSStreamEventErrorOccurred:
+			FLNSERROR([stream streamError])
+			// Fall through
+		
+		case NSStreamEventEndEncountered:
+			[self closeStreams];
+			break;
+		
+		default:
+			break;
+	}
+}
+
+
+#pragma mark -
+#pragma mark Frame Handling
+
+- (void) receiveFrames {
+	
+	const uint8_t* bytes	= (const uint8_t*)[_input bytes];
+	NSUInteger length		= [_input length];
+	NSUInteger offset		= 0;
+	
+	while((length - offset) >= sizeof(GoLinkFrameHeader)) {
+		const GoLinkFrameHeader* header	= (const GoLinkFrameHeader*)&bytes[offset];
+		NSUInteger frameLength			= sizeof(GoLinkFrameHeader) + header->length;
+		
+		if(frameLength > (length - offset)) {
+			break;
+		}
+		
+		[self handleFrame:header];
+		offset							+= frameLength;
+	}
+	
+	// Keep any partial frame for the next read
+	[_input replaceBytesInRange:NSMakeRange(0, offset) withBytes:NULL length:0];
+}
+
+
+- (void) handleFrame:(const GoLinkFrameHeader*)header {
+	
+	const uint8_t* request	= (const uint8_t*)&header[1];
+	NSUInteger frameCount	= _frameCount;
+	
+	_requestCount++;
+	
+	if(header->fid != kGLFrameTypeSystem || header->length == 0) {
+		FLERROR(@"Unexpected GoLink request frame $%02X", header->fid)
+		return;
+	}
+	
+	if(header->address == 0x00) {
+		if(request[0] == kGLSystemMessageProtocol) {
+			// The ISO 9141-2 keywords tell the two ISO 9141 protocols apart
+			uint8_t keyword		= (_protocol == kGLProtocolISO9141Keywords0808) ? 0x08 :
+								  (_protocol == kGLProtocolISO9141Keywords9494) ? 0x94 : 0x00;
+			uint8_t reply[]		= { kGLSystemMessageProtocol, _protocol, keyword, keyword };
+			
+			[self appendFrameOfType:kGLFrameTypeSystem address:0x00 bytes:reply length:sizeof(reply)];
+		}
+		else {
+			FLERROR(@"Unknown GoLink system request $%02X", request[0])
+		}
+		
+		return;
+	}
+	
+	if(header->address != GOLINK_EMULATOR_FUNCTIONAL_ADDRESS) {
+		FLERROR(@"GoLink request to unknown address $%02X", header->address)
+		return;
+	}
+	
+	BOOL canProtocol		= EMULATOR_CAN_PROTOCOL(_protocol);
+	
+	for(FLSimECU* ecu in _ecus) {
+		[_replies removeAllObjects];
+		
+		if([ecu addRepliesToRequest:request length:header->length canProtocol:canProtocol toArray:_replies] == 0) {
+			continue;
+		}
+		
+		uint8_t address		= (canProtocol) ? (ecu.canID & 0xFF) : ecu.address;
+		
+		for(NSData* reply in _replies) {
+			if([reply length] > EMULATOR_MAX_FRAME_DATA) {
+				FLERROR(@"Dropping %d byte reply, too long for a GoLink frame", [reply length])
+				continue;
+			}
+			
+			[self appendFrameOfType:kGLFrameTypeData
+							address:address
+							  bytes:(const uint8_t*)[reply bytes]
+							 length:[reply length]];
+		}
+	}
+	
+	if(_frameCount == frameCount) {
+		GoLinkErrorFrame frame;
+		
+		frame.status		= kGLErrorMessageTimeout;
+		frame.requestHeader	= *header;
+		frame.requestMode	= request[0];
+		frame.requestPid	= (header->length > 1) ? request[1] : 0x00;
+		
+		[self appendFrameOfType:kGLFrameTypeError
+						address:0x00
+						  bytes:&frame.status
+						 length:(sizeof(frame) - sizeof(GoLinkFrameHeader))];
+	}
+}
+
+
+- (void) appendFrameOfType:(GoLinkFrameType)type address:(uint8_t)address bytes:(const uint8_t*)bytes length:(NSUInteger)length {
+	
+	GoLinkFrameHeader header	= { type, address, length };
+	
+	[_output appendBytes:&header length:sizeof(header)];
+	[_output appendBytes:bytes length:length];
+	_frameCount++;
+}
+
+
+- (void) writeOutput {
+	
+	NSOutputStream* outputStream	= [_transport outputStream];
+	const uint8_t* bytes			= (const uint8_t*)[_output bytes];
+	NSUInteger length				= [_output length];
+	
+	while(_outputOffset < length && [outputStream hasSpaceAvailable]) {
+		NSInteger count				= [outputStream write:&bytes[_outputOffset] maxLength:(length - _outputOffset)];
+		
+		if(count <= 0) {
+			FLNSERROR([outputStream streamError])
+			break;
+		}
+		
+		_outputOffset				+= count;
+	}
+	
+	if(_outputOffset >= length) {
+		[_output setLength:0];
+		_outputOffset				= 0;
+	}
+}
+
+@end
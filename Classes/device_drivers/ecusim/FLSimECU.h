@@ -0,0 +1,107 @@
+/*
+ *  FLSimECU.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "FLScanTool.h"
+
+
+// Longest reply an ECU will build, which is the most an ISO 15765-2 first
+// frame can announce
+#define SIM_ECU_MAX_REPLY_LENGTH		4095
+
+// Data bytes in a single J1850 or ISO 9141/14230 message, after the header
+#define SIM_ECU_MAX_MESSAGE_LENGTH		7
+
+
+/*
+ A simulated vehicle ECU, answering OBD requests from the values it has
+ been given.  Used by FLELM327Emulator, which turns the replies into the
+ lines an ELM327 would print for them.
+
+ Values are set per mode and PID as the bytes an ECU sends after the mode
+ and PID, e.g. 1A F8 for Mode $01 PID $0C.  Support PIDs for Modes $01 and
+ $09 (i.e. $00, $20, ...) are answered from the PIDs which have values, and
+ Modes $03, $04 and $07 from the trouble codes.  Requests for anything else
+ go unanswered, as they would on the vehicle.
+
+ Values may only be changed while the emulator the ECU is given to is
+ stopped.
+ */
+@interface FLSimECU : NSObject {
+	NSUInteger				_address;
+	NSUInteger				_canID;
+	NSTimeInterval			_responseDelay;
+	
+	NSMutableDictionary*	_values;
+	FLPIDSupportSet			_service01PIDs;
+	FLPIDSupportSet			_service09PIDs;
+	NSMutableArray*			_troubleCodes;
+	NSMutableArray*			_pendingTroubleCodes;
+}
+
+// Physical address, used as the source of J1850 and ISO 9141/14230 headers
+// and in the 29-bit CAN ID (18 DA F1 xx), e.g. $10 for the engine
+@property (nonatomic, assign) NSUInteger address;
+
+// 11-bit CAN ID the ECU replies with, e.g. $7E8 for the engine.  Requests
+// sent to canID - 8 (AT SH) reach this ECU alone.
+@property (nonatomic, assign) NSUInteger canID;
+
+// Seconds the ECU takes to reply, on top of the emulator's responseDelay
+@property (nonatomic, assign) NSTimeInterval responseDelay;
+
+@property (nonatomic, readonly) NSArray* troubleCodes;
+@property (nonatomic, readonly) NSArray* pendingTroubleCodes;
+
++ (FLSimECU*) ecuWithAddress:(NSUInteger)address canID:(NSUInteger)canID;
+
+// An engine ECU ($10, $7E8) with the common Mode $01 PIDs, including some
+// beyond group $40, and a VIN
++ (FLSimECU*) engineECU;
+
+// A transmission ECU ($18, $7E9) with a handful of Mode $01 PIDs
++ (FLSimECU*) transmissionECU;
+
+- initWithAddress:(NSUInteger)address canID:(NSUInteger)canID;
+
+- (void) setData:(NSData*)data forMode:(FLScanToolMode)mode pid:(NSUInteger)pid;
+- (void) setBytes:(const uint8_t*)bytes length:(NSUInteger)length forMode:(FLScanToolMode)mode pid:(NSUInteger)pid;
+- (NSData*) dataForMode:(FLScanToolMode)mode pid:(NSUInteger)pid;
+
+// Sets Mode $09 PID $02
+- (void) setVIN:(NSString*)vin;
+
+// Trouble codes are given as their two encoded bytes, e.g. 0x0133 for P0133
+- (void) addTroubleCode:(NSUInteger)code;
+- (void) addPendingTroubleCode:(NSUInteger)code;
+- (void) clearTroubleCodes;
+
+// Adds the ECU's reply to request, as NSData holding the mode byte onwards,
+// to replies.  On CAN the reply is a single message of any length, which is
+// split into frames by the caller.  On the other protocols it is split here
+// into messages of at most SIM_ECU_MAX_MESSAGE_LENGTH bytes, as the ECU
+// would send them.  Returns the number of messages added, or 0 if the ECU
+// does not reply.
+- (NSUInteger) addRepliesToRequest:(const uint8_t*)request
+							length:(NSUInteger)length
+					   canProtocol:(BOOL)canProtocol
+						   toArray:(NSMutableArray*)replies;
+
+@end
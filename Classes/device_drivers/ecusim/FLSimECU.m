@@ -0,0 +1,445 @@
+/*
+ *  FLSimECU.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLSimECU.h"
+#import "FLLogging.h"
+
+
+#define SIM_ECU_VALUE_KEY(mode, pid)	[NSNumber numberWithUnsignedInteger:((((NSUInteger)(mode)) << 16) | (pid))]
+
+// Trouble codes per J1850 or ISO 9141/14230 message
+#define SIM_ECU_CODES_PER_MESSAGE		3
+
+
+typedef struct sim_ecu_value_t {
+	uint8_t			pid;
+	uint8_t			length;
+	uint8_t			bytes[4];
+} FLSimECUValue;
+
+
+static const FLSimECUValue g_engineValues[] = {
+	{ 0x01, 4, { 0x00, 0x07, 0xE5, 0x00 } },	// Monitor status, MIL off
+	{ 0x04, 1, { 0x50 } },						// Load 31%
+	{ 0x05, 1, { 0x7B } },						// Coolant 83C
+	{ 0x0B, 1, { 0x21 } },						// MAP 33 kPa
+	{ 0x0C, 2, { 0x1A, 0xF8 } },				// 1726 RPM
+	{ 0x0D, 1, { 0x3C } },						// 60 km/h
+	{ 0x0F, 1, { 0x46 } },						// Intake air 30C
+	{ 0x10, 2, { 0x01, 0xF4 } },				// MAF 5 g/s
+	{ 0x11, 1, { 0x33 } },						// Throttle 20%
+	{ 0x1C, 1, { 0x01 } },						// OBD-II (CARB)
+	{ 0x1F, 2, { 0x00, 0x8C } },				// 140 sec since start
+	{ 0x21, 2, { 0x00, 0x00 } },				// Distance with MIL on
+	{ 0x2F, 1, { 0x99 } },						// Fuel level 60%
+	{ 0x33, 1, { 0x65 } },						// Barometric 101 kPa
+	{ 0x42, 2, { 0x31, 0x2A } },				// Control module 12.6V
+	{ 0x46, 1, { 0x3C } }						// Ambient 20C
+};
+
+static const FLSimECUValue g_transmissionValues[] = {
+	{ 0x01, 4, { 0x00, 0x04, 0x00, 0x00 } },
+	{ 0x0D, 1, { 0x3C } },
+	{ 0x1C, 1, { 0x01 } }
+};
+
+
+@interface FLSimECU (Private)
+- (void) setValues:(const FLSimECUValue*)values count:(NSUInteger)count;
+- (FLPIDSupportSet*) supportSetForMode:(FLScanToolMode)mode;
+- (NSUInteger) appendPID:(NSUInteger)pid
+				 forMode:(FLScanToolMode)mode
+				 toReply:(uint8_t*)reply
+				capacity:(NSUInteger)capacity;
+- (NSUInteger) addTroubleCodes:(NSArray*)codes
+					   forMode:(FLScanToolMode)mode
+				   canProtocol:(BOOL)canProtocol
+					   toArray:(NSMutableArray*)replies;
+- (NSUInteger) addVehicleInfoReply:(const uint8_t*)reply
+							length:(NSUInteger)length
+						   toArray:(NSMutableArray*)replies;
+@end
+
+
+#pragma mark -
+@implementation FLSimECU
+
+@synthesize address				= _address,
+			canID				= _canID,
+			responseDelay		= _responseDelay,
+			troubleCodes		= _troubleCodes,
+			pendingTroubleCodes	= _pendingTroubleCodes;
+
+
++ (FLSimECU*) ecuWithAddress:(NSUInteger)address canID:(NSUInteger)canID {
+	return [[[FLSimECU alloc] initWithAddress:address canID:canID] autorelease];
+}
+
+
++ (FLSimECU*) engineECU {
+	
+	FLSimECU* ecu	= [FLSimECU ecuWithAddress:0x10 canID:0x7E8];
+	
+	[ecu setValues:g_engineValues count:(sizeof(g_engineValues) / sizeof(g_engineValues[0]))];
+	[ecu setVIN:@"1FUZZYLUKE0000001"];
+	
+	return ecu;
+}
+
+
++ (FLSimECU*) transmissionECU {
+	
+	FLSimECU* ecu	= [FLSimECU ecuWithAddress:0x18 canID:0x7E9];
+	
+	[ecu setValues:g_transmissionValues count:(sizeof(g_transmissionValues) / sizeof(g_transmissionValues[0]))];
+	
+	return ecu;
+}
+
+
+- initWithAddress:(NSUInteger)address canID:(NSUInteger)canID {
+	
+	if(self = [super init]) {
+		_address				= address;
+		_canID					= canID;
+		_values					= [[NSMutableDictionary alloc] init];
+		_troubleCodes			= [[NSMutableArray alloc] init];
+		_pendingTroubleCodes	= [[NSMutableArray alloc] init];
+	}
+	
+	return self;
+}
+
+
+- (void) dealloc {
+	[_values release];
+	[_troubleCodes release];
+	[_pendingTroubleCodes release];
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Values
+
+- (void) setData:(NSData*)data forMode:(FLScanToolMode)mode pid:(NSUInteger)pid {
+	
+	FLPIDSupportSet* set	= [self supportSetForMode:mode];
+	
+	if(set && (pid == 0x00 || pid > 0xFF || !NOT_SEARCH_PID(pid))) {
+		// Support PIDs are answered from the PIDs which have values
+		FLERROR(@"Ignoring value for support PID $%02X", pid)
+		return;
+	}
+	
+	if(data) {
+		[_values setObject:[[data copy] autorelease] forKey:SIM_ECU_VALUE_KEY(mode, pid)];
+	}
+	else {
+		[_values removeObjectForKey:SIM_ECU_VALUE_KEY(mode, pid)];
+	}
+	
+	if(set) {
+		if(data) {
+			set->words[PID_SUPPORT_WORD(pid)]	|= PID_SUPPORT_BIT(pid);
+		}
+		else {
+			set->words[PID_SUPPORT_WORD(pid)]	&= ~PID_SUPPORT_BIT(pid);
+		}
+	}
+}
+
+
+- (void) setBytes:(const uint8_t*)bytes length:(NSUInteger)length forMode:(FLScanToolMode)mode pid:(NSUInteger)pid {
+	[self setData:[NSData dataWithBytes:bytes length:length] forMode:mode pid:pid];
+}
+
+
+- (NSData*) dataForMode:(FLScanToolMode)mode pid:(NSUInteger)pid {
+	return [_values objectForKey:SIM_ECU_VALUE_KEY(mode, pid)];
+}
+
+
+- (void) setVIN:(NSString*)vin {
+	
+	// On CAN the VIN is preceded by the number of data items, always 1
+	NSMutableData* data	= [NSMutableData dataWithCapacity:([vin length] + 1)];
+	uint8_t itemCount	= 1;
+	
+	[data appendBytes:&itemCount length:1];
+	[data appendData:[vin dataUsingEncoding:NSASCIIStringEncoding allowLossyConversion:YES]];
+	
+	[self setData:data forMode:kScanToolModeRequestVehicleInfo pid:0x02];
+}
+
+
+- (void) addTroubleCode:(NSUInteger)code {
+	[_troubleCodes addObject:[NSNumber numberWithUnsignedInteger:(code & 0xFFFF)]];
+}
+
+
+- (void) addPendingTroubleCode:(NSUInteger)code {
+	[_pendingTroubleCodes addObject:[NSNumber numberWithUnsignedInteger:(code & 0xFFFF)]];
+}
+
+
+- (void) clearTroubleCodes {
+	[_troubleCodes removeAllObjects];
+	[_pendingTroubleCodes removeAllObjects];
+}
+
+
+#pragma mark -
+#pragma mark Replies
+
+- (NSUInteger) addRepliesToRequest:(const uint8_t*)request
+							length:(NSUInteger)length
+					   canProtocol:(BOOL)canProtocol
+						   toArray:(NSMutableArray*)replies {
+	
+	uint8_t reply[SIM_ECU_MAX_REPLY_LENGTH];
+	NSUInteger replyLength	= 0;
+	NSData* data			= nil;
+	
+	if(!request || length == 0) {
+		return 0;
+	}
+	
+	FLScanToolMode mode		= request[0];
+	reply[replyLength++]	= (0x40 | mode);
+	
+	switch(mode) {
+		case kScanToolModeRequestCurrentPowertrainDiagnosticData:
+		case kScanToolModeRequestVehicleInfo: {
+			// ISO 15765-4 allows several Mode $01 PIDs per request, the
+			// other protocols only one
+			NSUInteger maxPIDs	= (canProtocol && mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) ? MAX_PIDS_PER_REQUEST : 1;
+			
+			for(NSUInteger i = 1; i < length && i <= maxPIDs; i++) {
+				replyLength		+= [self appendPID:request[i]
+										   forMode:mode
+										   toReply:&reply[replyLength]
+										  capacity:(sizeof(reply) - replyLength)];
+			}
+		}
+			break;
+		
+		case kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes:
+			return [self addTroubleCodes:_troubleCodes forMode:mode canProtocol:canProtocol toArray:replies];
+		
+		case kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodesDetected:
+			return [self addTroubleCodes:_pendingTroubleCodes forMode:mode canProtocol:canProtocol toArray:replies];
+		
+		case kScanToolModeClearResetEmissionRelatedDiagnosticInfo:
+			[self clearTroubleCodes];
+			[replies addObject:[NSData dataWithBytes:reply length:replyLength]];
+			return 1;
+		
+		case kScanToolModeRequestDataByIdentifier:
+			if(length >= 3 && (data = [self dataForMode:mode pid:((request[1] << 8) | request[2])])) {
+				reply[replyLength++]	= request[1];
+				reply[replyLength++]	= request[2];
+			}
+			break;
+		
+		default:
+			// Any other mode with a PID, e.g. Mode $02 whose value holds the
+			// frame number and data
+			if(length >= 2 && (data = [self dataForMode:mode pid:request[1]])) {
+				reply[replyLength++]	= request[1];
+			}
+			break;
+	}
+	
+	if(data) {
+		NSUInteger dataLength	= MIN([data length], (sizeof(reply) - replyLength));
+		memcpy(&reply[replyLength], [data bytes], dataLength);
+		replyLength				+= dataLength;
+	}
+	
+	if(replyLength <= 1) {
+		return 0;
+	}
+	
+	if(!canProtocol && replyLength > SIM_ECU_MAX_MESSAGE_LENGTH) {
+		if(mode == kScanToolModeRequestVehicleInfo) {
+			return [self addVehicleInfoReply:reply length:replyLength toArray:replies];
+		}
+		
+		FLERROR(@"Truncating %d byte reply to a single message", replyLength)
+		replyLength		= SIM_ECU_MAX_MESSAGE_LENGTH;
+	}
+	
+	[replies addObject:[NSData dataWithBytes:reply length:replyLength]];
+	return 1;
+}
+
+
+- (FLPIDSupportSet*) supportSetForMode:(FLScanToolMode)mode {
+	
+	switch(mode) {
+		case kScanToolModeRequestCurrentPowertrainDiagnosticData:
+			return &_service01PIDs;
+		case kScanToolModeRequestVehicleInfo:
+			return &_service09PIDs;
+		default:
+			return NULL;
+	}
+}
+
+
+- (NSUInteger) appendPID:(NSUInteger)pid
+				 forMode:(FLScanToolMode)mode
+				 toReply:(uint8_t*)reply
+				capacity:(NSUInteger)capacity {
+	
+	const FLPIDSupportSet* set	= [self supportSetForMode:mode];
+	
+	if(!NOT_SEARCH_PID(pid)) {
+		// A group is answered if any PID beyond it is supported, and Mode
+		// $01 group $00 always is
+		if(FLPIDSupportSetNext(set, pid) == 0 &&
+		   !(mode == kScanToolModeRequestCurrentPowertrainDiagnosticData && pid == 0x00)) {
+			return 0;
+		}
+		
+		if(capacity < 5) {
+			return 0;
+		}
+		
+		// The low bit of each group is the next group, which is supported
+		// if any PID beyond it is
+		uint32_t word	= set->words[pid >> 5] & ~1U;
+		
+		if(pid < MAX_PID_GROUP && FLPIDSupportSetNext(set, pid + 0x20) != 0) {
+			word		|= 1U;
+		}
+		
+		reply[0]		= pid;
+		reply[1]		= (word >> 24) & 0xFF;
+		reply[2]		= (word >> 16) & 0xFF;
+		reply[3]		= (word >> 8) & 0xFF;
+		reply[4]		= word & 0xFF;
+		
+		return 5;
+	}
+	
+	NSData* data		= [self dataForMode:mode pid:pid];
+	
+	if(!data || capacity < (1 + [data length])) {
+		return 0;
+	}
+	
+	reply[0]			= pid;
+	memcpy(&reply[1], [data bytes], [data length]);
+	
+	return 1 + [data length];
+}
+
+
+- (NSUInteger) addTroubleCodes:(NSArray*)codes
+					   forMode:(FLScanToolMode)mode
+				   canProtocol:(BOOL)canProtocol
+					   toArray:(NSMutableArray*)replies {
+	
+	uint8_t reply[SIM_ECU_MAX_REPLY_LENGTH];
+	NSUInteger replyLength		= 0;
+	NSUInteger codeCount		= [codes count];
+	NSUInteger messageCount		= 0;
+	
+	if(canProtocol) {
+		// ISO 15765-4 replies carry the number of codes, then every code
+		codeCount				= MIN(codeCount, MIN(0xFF, ((sizeof(reply) - 2) / 2)));
+		reply[replyLength++]	= (0x40 | mode);
+		reply[replyLength++]	= codeCount;
+		
+		for(NSUInteger i = 0; i < codeCount; i++) {
+			NSUInteger code			= [[codes objectAtIndex:i] unsignedIntegerValue];
+			reply[replyLength++]	= (code >> 8) & 0xFF;
+			reply[replyLength++]	= code & 0xFF;
+		}
+		
+		[replies addObject:[NSData dataWithBytes:reply length:replyLength]];
+		return 1;
+	}
+	
+	// The other protocols send three codes per message, padded out with
+	// zeros, and a single message of zeros when there are none
+	NSUInteger index			= 0;
+	
+	do {
+		replyLength				= 0;
+		reply[replyLength++]	= (0x40 | mode);
+		
+		for(NSUInteger i = 0; i < SIM_ECU_CODES_PER_MESSAGE; i++, index++) {
+			NSUInteger code			= (index < codeCount) ? [[codes objectAtIndex:index] unsignedIntegerValue] : 0;
+			reply[replyLength++]	= (code >> 8) & 0xFF;
+			reply[replyLength++]	= code & 0xFF;
+		}
+		
+		[replies addObject:[NSData dataWithBytes:reply length:replyLength]];
+		messageCount++;
+	} while(index < codeCount);
+	
+	return messageCount;
+}
+
+
+- (NSUInteger) addVehicleInfoReply:(const uint8_t*)reply
+							length:(NSUInteger)length
+						   toArray:(NSMutableArray*)replies {
+	
+	// Outside CAN, long Mode $09 values (e.g. the VIN) are sent as numbered
+	// messages of 4 bytes each, zero padded at the front, without the CAN
+	// item count
+	const uint8_t* data			= &reply[3];
+	NSUInteger dataLength		= length - 3;
+	NSUInteger padding			= (4 - (dataLength % 4)) % 4;
+	NSUInteger messageCount		= (padding + dataLength) / 4;
+	uint8_t message[SIM_ECU_MAX_MESSAGE_LENGTH];
+	
+	for(NSUInteger i = 0; i < messageCount && i < 0xFF; i++) {
+		message[0]				= reply[0];
+		message[1]				= reply[1];
+		message[2]				= (i + 1);
+		
+		for(NSUInteger j = 0; j < 4; j++) {
+			NSUInteger offset	= (i * 4) + j;
+			message[3 + j]		= (offset < padding) ? 0x00 : data[offset - padding];
+		}
+		
+		[replies addObject:[NSData dataWithBytes:message length:sizeof(message)]];
+	}
+	
+	return messageCount;
+}
+
+
+- (void) setValues:(const FLSimECUValue*)values count:(NSUInteger)count {
+	
+	for(NSUInteger i = 0; i < count; i++) {
+		[self setBytes:values[i].bytes
+				length:values[i].length
+			   forMode:kScanToolModeRequestCurrentPowertrainDiagnosticData
+				   pid:values[i].pid];
+	}
+}
+
+@end
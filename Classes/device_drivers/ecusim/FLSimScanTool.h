@@ -21,8 +21,13 @@
 #import <Foundation/Foundation.h>
 #import "FLScanTool.h"
 
-@interface FLSimScanTool : FLScanTool {
+// Seconds between the simulated responses
+#define SIM_SCAN_TOOL_RESPONSE_PERIOD		0.5
+
 
+@interface FLSimScanTool : FLScanTool {
+	NSTimer*				_responseTimer;
+	NSUInteger				_responseIndex;
 }
 
 @end
@@ -20,6 +20,12 @@
 
 #import "FLSimScanTool.h"
 #import "FLLogging.h"
+#import "FLScanLoop.h"
+
+@interface FLSimScanTool (Private)
+- (void) responseTimerDidFire:(NSTimer*)timer;
+@end
+
 
 @implementation FLSimScanTool
 
@@ -29,87 +35,84 @@
 	FLINFO(@"*** Initializing Simulated ScanTool ***")
 	_state				= STATE_IDLE;
 	
-	_supportedSensorList = [[NSMutableArray alloc] initWithCapacity:2];
-
 	//Add RPM pid
-	[_supportedSensorList addObject:[NSNumber numberWithInt:0x0C]];
+	[self addSupportedPID:0x0C];
 	//Add Speed pid
-	[_supportedSensorList addObject:[NSNumber numberWithInt:0x0D]];
-
+	[self addSupportedPID:0x0D];
+	
 	[self dispatchDelegate:@selector(scanToolDidInitialize:) withObject:nil];
 	[self dispatchDelegate:@selector(scanToolDidConnect:) withObject:nil];
 }
 
 
-- (void) runStreams {
-	NSAutoreleasePool * pool	= [[NSAutoreleasePool alloc] init];
-	FLScanToolResponse* rpmResp		= [[FLScanToolResponse alloc] init];
-	FLScanToolResponse* spdResp		= [[FLScanToolResponse alloc] init];
-	FLScanToolResponse* dtcResp		= [[FLScanToolResponse alloc] init];
-
-	@try {
-		[self initScanTool];
-
-		rpmResp.scanToolName			= @"Simulated";
-		rpmResp.protocol				= kScanToolProtocolCAN29bit500KB;
-		rpmResp.mode					= 0x40 + kScanToolModeRequestCurrentPowertrainDiagnosticData;
-		rpmResp.pid						= 0x0C;
-		rpmResp.data					= [NSData dataWithBytes:"0FFF" length:4];
-		
-		spdResp.scanToolName			= @"Simulated";
-		spdResp.protocol				= kScanToolProtocolCAN29bit500KB;
-		spdResp.mode					= 0x40 + kScanToolModeRequestCurrentPowertrainDiagnosticData;
-		spdResp.pid						= 0x0D;
-		spdResp.data					= [NSData dataWithBytes:"0040" length:4];
-		
-		dtcResp.scanToolName			= @"Simulated";
-		dtcResp.protocol				= kScanToolProtocolCAN29bit500KB;
-		dtcResp.mode					= 0x40 + kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes;
-		dtcResp.pid						= 0x03;
-		dtcResp.data					= [NSData dataWithBytes:"41030200" length:8];
-		
-		
-		int state = 0;
-		//Simulated ScanTool does not need to do anything
-		while (!_streamOperation.isCancelled) {
-			NSMutableArray* responses = [NSMutableArray arrayWithCapacity:0];
-			
-			switch (state) {
-				case 0:
-					[responses addObject:rpmResp];
-					break;
-				case 1:
-					[responses addObject:spdResp];
-					break;
-				case 2:
-					[responses addObject:dtcResp];
-					break;
-				default:
-					break;
-			}
+- (void) beginScan {
+	
+	if(_scanCancelled) {
+		return;
+	}
+	
+	// Responses come from a timer rather than a loop, as the scan loop is
+	// shared with other scan tools
+	_responseIndex		= 0;
+	_responseTimer		= [[NSTimer alloc] initWithFireDate:[NSDate dateWithTimeIntervalSinceNow:SIM_SCAN_TOOL_RESPONSE_PERIOD] 
+												  interval:SIM_SCAN_TOOL_RESPONSE_PERIOD 
+													target:self 
+												  selector:@selector(responseTimerDidFire:) 
+												  userInfo:nil 
+												   repeats:YES];
+	[[NSRunLoop currentRunLoop] addTimer:_responseTimer forMode:NSDefaultRunLoopMode];
+	
+	[self initScanTool];
+}
 
-			if (state < 2) {
-				state++;
-			} else {
-				state = 0;
-			}
 
-			[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:responses];
-			[NSThread sleepForTimeInterval:0.5];
+- (void) endScan {
+	
+	if(!_responseTimer) {
+		[_scanLoop removeScanTool:self];
+		return;
+	}
+	
+	FLINFO(@"*** STREAMS CANCELLED ***")
+	
+	[_responseTimer invalidate];
+	[_responseTimer release];
+	_responseTimer		= nil;
+	
+	[self dispatchDelegate:@selector(scanDidCancel:) withObject:nil];
+	[_scanLoop removeScanTool:self];
+}
 
-		}
 
-		FLINFO(@"*** STREAMS CANCELLED ***")
-	}
-	@catch (NSException * e) {
-		FLEXCEPTION(e)
+- (void) responseTimerDidFire:(NSTimer*)timer {
+	
+	FLScanToolResponse* resp	= [[FLScanToolResponse alloc] init];
+	
+	resp.scanToolName			= @"Simulated";
+	resp.protocol				= kScanToolProtocolCAN29bit500KB;
+	
+	switch (_responseIndex) {
+		case 0:
+			resp.mode			= 0x40 + kScanToolModeRequestCurrentPowertrainDiagnosticData;
+			resp.pid			= 0x0C;
+			resp.data			= [NSData dataWithBytes:"0FFF" length:4];
+			break;
+		case 1:
+			resp.mode			= 0x40 + kScanToolModeRequestCurrentPowertrainDiagnosticData;
+			resp.pid			= 0x0D;
+			resp.data			= [NSData dataWithBytes:"0040" length:4];
+			break;
+		default:
+			resp.mode			= 0x40 + kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes;
+			resp.pid			= 0x03;
+			resp.data			= [NSData dataWithBytes:"41030200" length:8];
+			break;
 	}
-	@finally {
-		[rpmResp release];
-		[spdResp release];
-		[pool release];
-		[self dispatchDelegate:@selector(scanDidCancel:) withObject:nil];
-	}	
+	
+	_responseIndex				= (_responseIndex + 1) % 3;
+	
+	[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:[NSArray arrayWithObject:resp]];
+	[resp release];
 }
 
 
@@ -21,9 +21,12 @@
 #import <Foundation/Foundation.h>
 #import "FLWifiScanTool.h"
 #import "ELM327ResponseParser.h"
+#import "FLRingBuffer.h"
+#import "FLVehicleProfile.h"
 
 
-#define CLEAR_READBUF()				memset(_readBuf, 0x00, sizeof(_readBuf)); _readBufLength = 0;
+// Initial read buffer size; the buffer grows to fit longer responses
+#define ELM327_READBUF_SIZE			512
 #define INIT_COMPLETE(state)		(state == ELM327_INIT_STATE_COMPLETE)
 
 
@@ -31,13 +34,68 @@ typedef enum {
 	ELM327_INIT_STATE_UNKNOWN			= 0x0000,	
 	ELM327_INIT_STATE_RESET				= 0x0001,
 	ELM327_INIT_STATE_ECHO_OFF			= 0x0002,
-	ELM327_INIT_STATE_VERSION			= 0x0004,
-	ELM327_INIT_STATE_PID_SEARCH		= 0x0008,
-	ELM327_INIT_STATE_PROTOCOL			= 0x0010,
-	ELM327_INIT_STATE_COMPLETE			= 0x0020
+	ELM327_INIT_STATE_BAUD_RATE			= 0x0004,
+	ELM327_INIT_STATE_ADAPTIVE_TIMING	= 0x0008,
+	ELM327_INIT_STATE_TIMEOUT			= 0x0010,
+	ELM327_INIT_STATE_VERSION			= 0x0020,
+	ELM327_INIT_STATE_SET_PROTOCOL		= 0x0040,
+	ELM327_INIT_STATE_PROBE				= 0x0080,
+	ELM327_INIT_STATE_PID_SEARCH		= 0x0100,
+	ELM327_INIT_STATE_PROTOCOL			= 0x0200,
+	ELM327_INIT_STATE_HEADERS_ON		= 0x0400,
+	ELM327_INIT_STATE_PID_SEARCH_EXTENDED	= 0x0800,
+	ELM327_INIT_STATE_HEADERS_OFF		= 0x1000,
+	ELM327_INIT_STATE_RECEIVE_ADDRESS	= 0x2000,
+	ELM327_INIT_STATE_REQUEST_HEADER	= 0x4000,
+	ELM327_INIT_STATE_COMPLETE			= 0x8000
 } ELM327InitState;
 
 
+// Init states which older ELM327 clones may reject with '?'.  These are
+// skipped rather than restarting the init sequence.
+#define OPTIONAL_INIT_STATE(state)	(state == ELM327_INIT_STATE_BAUD_RATE || \
+									 state == ELM327_INIT_STATE_ADAPTIVE_TIMING || \
+									 state == ELM327_INIT_STATE_TIMEOUT || \
+									 state == ELM327_INIT_STATE_SET_PROTOCOL || \
+									 state == ELM327_INIT_STATE_RECEIVE_ADDRESS || \
+									 state == ELM327_INIT_STATE_REQUEST_HEADER)
+
+
+typedef enum {
+	kELM327AdaptiveTimingOff			= 0,
+	kELM327AdaptiveTimingNormal			= 1,
+	kELM327AdaptiveTimingAggressive		= 2
+} ELM327AdaptiveTimingMode;
+
+
+// Default maximum time, in msec, the ELM327 waits for an ECU response
+#define ELM327_DEFAULT_RESPONSE_TIMEOUT		200
+
+
+/*
+ AT BRD moves the ELM327 to a new baud rate in steps the host has to
+ follow: the ELM327 answers OK (with no prompt) at the old rate, switches,
+ and prints its ID string at the new rate.  If the host answers with a CR
+ within the ELM327's AT BRT time (75 msec by default) it prints the prompt
+ and stays; otherwise it goes back to the old rate and prints the prompt
+ there.
+ */
+typedef enum {
+	kELM327BaudRateIdle					= 0,
+	kELM327BaudRateRequested,			// AT BRD sent, waiting for OK
+	kELM327BaudRateSwitched,			// At the new rate, waiting for the ID
+	kELM327BaudRateConfirmed,			// CR sent, waiting for the prompt
+	kELM327BaudRateFailed				// Waiting out the adapter's fallback
+} ELM327BaudRatePhase;
+
+// Seconds from switching rate to giving up on it, which must be longer
+// than the adapter's AT BRT time so it has gone back by then
+#define ELM327_BAUD_RATE_TIMEOUT			0.5f
+
+// Longest ID string looked for at the new rate
+#define ELM327_MAX_ID_LENGTH				32
+
+
 /*
  These are the protocol numbers for the ELM327: 
  
@@ -100,10 +158,67 @@ const static int elm_protocol_map[] = {
 	ELM327InitState					_initState;
 	ELM327ResponseParser*			_parser;
 	NSMutableArray*					_initOperations;
-	uint8_t							_readBuf[512];
-	NSUInteger						_readBufLength;
+	FLRingBuffer*					_readBuffer;
+	
+	BOOL							_useResponseCountHints;
+	ELM327AdaptiveTimingMode		_adaptiveTimingMode;
+	NSUInteger						_responseTimeout;
+	
+	BOOL							_useHeaders;
+	BOOL							_headersOn;
+	NSUInteger						_receiveAddressFilter;
+	
+	NSString*						_versionString;
+	NSUInteger						_elmProtocol;
+	FLVehicleProfile*				_vehicleProfile;
+	BOOL							_vehicleProfileVerified;
+	
+	BOOL							_batchPIDSearch;
+	BOOL							_extendedPIDSearch;
+	NSUInteger						_searchECUAddresses[MAX_PID_SEARCH_ECUS];
+	NSUInteger						_searchECUCount;
+	
+	ELM327BaudRatePhase				_baudRatePhase;
+	NSUInteger						_baudRateAttempt;		// 0 when not negotiating
+	NSUInteger						_previousBaudRate;
+	NSUInteger						_negotiatedBaudRate;
+	BOOL							_answeredAtBaudRate;	// Since the last init or rate change
 }
 
 @property (nonatomic, readonly) ELM327InitState initState;
 
+// When enabled, Mode $01 requests carry the number of responses expected
+// from the vehicle, so the ELM327 does not wait out its response timeout
+// listening for additional ECUs.
+@property (nonatomic, assign) BOOL useResponseCountHints;
+
+// Adaptive timing mode (AT AT) and maximum response timeout (AT ST), in
+// msec, configured during initScanTool
+@property (nonatomic, assign) ELM327AdaptiveTimingMode adaptiveTimingMode;
+@property (nonatomic, assign) NSUInteger responseTimeout;
+
+// When enabled on a CAN protocol, headers are turned on (AT H1) after the
+// protocol is detected, and responses carry the priority, target and ECU
+// address of the ECU which sent them.
+@property (nonatomic, assign) BOOL useHeaders;
+
+// CAN ID to accept responses from (AT CRA), e.g. 0x7E8 or 0x18DAF110 for
+// the engine ECU, or 0 to accept all.  For the standard OBD response IDs,
+// requests are also addressed to that ECU alone (AT SH) instead of being
+// broadcast.
+@property (nonatomic, assign) NSUInteger receiveAddressFilter;
+
+// When enabled on a CAN protocol, the PID search beyond group $00 requests
+// every support group in one or two multi-PID requests, rather than one
+// group per request.  Headers are turned on for the duration of the search
+// so each reply can be matched to its ECU.  Other protocols always search
+// one group at a time.  Defaults to YES.
+@property (nonatomic, assign) BOOL batchPIDSearch;
+
+// Rate the adapter was moved to with AT BRD, or 0.  Set only when the
+// transport is an FLSerialTransport whose maxBaudRate is above its rate.
+@property (nonatomic, readonly) NSUInteger negotiatedBaudRate;
+
+- (NSUInteger) expectedResponseCountForPIDs:(NSArray*)pids;
+
 @end
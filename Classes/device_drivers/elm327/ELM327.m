@@ -21,6 +21,7 @@
 #import "ELM327.h"
 #import "ELM327Command.h"
 #import "ELM327ResponseParser.h"
+#import "FLSerialTransport.h"
 #import "FLLogging.h"
 
 @interface ELM327 (Private)
@@ -28,29 +29,73 @@
 - (void) handleInputEvent:(NSStreamEvent)eventCode;
 - (void) handleOutputEvent:(NSStreamEvent)eventCode;
 - (void) readInput;
-- (void) readInitResponse;
-- (void) readVoltageResponse;
+- (void) handleInitResponse:(uint8_t*)bytes length:(NSUInteger)length;
+- (void) continueInit;
+- (void) handleResponse:(uint8_t*)bytes length:(NSUInteger)length;
+- (void) handleVoltageResponse:(uint8_t*)bytes length:(NSUInteger)length;
+- (void) handlePIDSearchResponse:(uint8_t*)bytes length:(NSUInteger)length;
+- (NSUInteger) searchIndexForECUAddress:(NSUInteger)address;
+- (BOOL) shouldSkipInitState:(ELM327InitState)state;
+- (NSUInteger) requestHeaderForReceiveAddress:(NSUInteger)address;
+- (NSString*) vehicleProfileIdentifier;
+- (void) verifyVehicleProfile:(NSArray*)responses;
+- (void) updateVehicleProfile;
+- (FLSerialTransport*) serialTransport;
+- (NSUInteger) baudRateBelow:(NSUInteger)rate above:(NSUInteger)minimum;
+- (BOOL) readBaudRateResponse;
+- (void) baudRateDidTimeout;
 @end
 
 
+// Rates tried with AT BRD, fastest first.  Those below the adapter's
+// default rate are only used to find an adapter which has been left at one.
+static const NSUInteger g_elm327BaudRates[] = { 500000, 230400, 115200, 57600, 38400, 9600 };
+
+
 #pragma mark -
 @implementation ELM327
 
-@synthesize initState	= _initState;
+@synthesize initState				= _initState,
+			useResponseCountHints	= _useResponseCountHints,
+			adaptiveTimingMode		= _adaptiveTimingMode,
+			responseTimeout			= _responseTimeout,
+			useHeaders				= _useHeaders,
+			receiveAddressFilter	= _receiveAddressFilter,
+			batchPIDSearch			= _batchPIDSearch,
+			negotiatedBaudRate		= _negotiatedBaudRate;
 
 
 - (id) init {
 	if (self = [super init]) {
-		_deviceType		= kScanToolDeviceTypeGoLink;
+		_deviceType				= kScanToolDeviceTypeELM327;
+		_adaptiveTimingMode		= kELM327AdaptiveTimingNormal;
+		_responseTimeout		= ELM327_DEFAULT_RESPONSE_TIMEOUT;
+		_batchPIDSearch			= YES;
+		_readBuffer				= [[FLRingBuffer alloc] initWithCapacity:ELM327_READBUF_SIZE];
 	}
 	
 	return self;
 }
 
+- (void) dealloc {
+	[_readBuffer release];
+	[_parser release];
+	[_versionString release];
+	[_vehicleProfile release];
+	[super dealloc];
+}
+
 - (NSString*) scanToolName {
 	return @"ELM327";
 }
 
+- (void) close {
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(baudRateDidTimeout) object:nil];
+	_baudRatePhase	= kELM327BaudRateIdle;
+	_initState		= ELM327_INIT_STATE_UNKNOWN;
+	[super close];
+}
+
 #pragma mark -
 #pragma mark ScanTool Initialization
 
@@ -62,11 +107,23 @@
 		case ELM327_INIT_STATE_RESET:
 			cmd = (FLScanToolCommand*)[ELM327Command commandForReset];
 			break;
-
+		
 		case ELM327_INIT_STATE_ECHO_OFF:
 			cmd = (FLScanToolCommand*)[ELM327Command commandForEchoOff];
 			break;
 			
+		case ELM327_INIT_STATE_BAUD_RATE:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetBaudRate:_baudRateAttempt];
+			break;
+			
+		case ELM327_INIT_STATE_ADAPTIVE_TIMING:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetAdaptiveTiming:_adaptiveTimingMode];
+			break;
+			
+		case ELM327_INIT_STATE_TIMEOUT:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetTimeout:_responseTimeout];
+			break;
+			
 		case ELM327_INIT_STATE_PROTOCOL:
 			cmd = (FLScanToolCommand*)[ELM327Command commandForReadProtocol];
 			break;
@@ -75,11 +132,55 @@
 			cmd = (FLScanToolCommand*)[ELM327Command commandForReadVersionID];
 			break;
 			
+		case ELM327_INIT_STATE_SET_PROTOCOL:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetProtocol:_vehicleProfile.protocolNumber];
+			break;
+			
+		case ELM327_INIT_STATE_PROBE:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForOBD2:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+															  pid:0x00 
+															 data:nil];
+			break;
+			
 		case ELM327_INIT_STATE_PID_SEARCH:
 			cmd = (FLScanToolCommand*)[ELM327Command commandForOBD2:kScanToolModeRequestCurrentPowertrainDiagnosticData 
 															  pid:_currentPIDGroup 
 															 data:nil];
 			break;
+			
+		case ELM327_INIT_STATE_PID_SEARCH_EXTENDED:
+			if(_batchPIDSearch && IS_CAN_PROTOCOL(_protocol)) {
+				NSMutableArray* groups	= [NSMutableArray arrayWithCapacity:MAX_PIDS_PER_REQUEST];
+				
+				for(NSUInteger group = _currentPIDGroup; group <= MAX_PID_GROUP && [groups count] < MAX_PIDS_PER_REQUEST; group += 0x20) {
+					[groups addObject:[NSNumber numberWithUnsignedInteger:group]];
+				}
+				
+				cmd = (FLScanToolCommand*)[ELM327Command commandForOBD2:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+																   pids:groups];
+			}
+			else {
+				cmd = (FLScanToolCommand*)[ELM327Command commandForOBD2:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+																	pid:_currentPIDGroup 
+																   data:nil];
+			}
+			break;
+			
+		case ELM327_INIT_STATE_HEADERS_ON:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForHeadersOn];
+			break;
+			
+		case ELM327_INIT_STATE_HEADERS_OFF:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForHeadersOff];
+			break;
+			
+		case ELM327_INIT_STATE_RECEIVE_ADDRESS:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetReceiveAddress:_receiveAddressFilter];
+			break;
+			
+		case ELM327_INIT_STATE_REQUEST_HEADER:
+			cmd = (FLScanToolCommand*)[ELM327Command commandForSetHeader:[self requestHeaderForReceiveAddress:_receiveAddressFilter]];
+			break;
 		
 		case ELM327_INIT_STATE_UNKNOWN:
 		default:
@@ -90,6 +191,59 @@
 }
 
 
+- (BOOL) shouldSkipInitState:(ELM327InitState)state {
+	
+	switch (state) {
+		case ELM327_INIT_STATE_BAUD_RATE:
+			return (_baudRateAttempt == 0);
+			
+		case ELM327_INIT_STATE_SET_PROTOCOL:
+		case ELM327_INIT_STATE_PROBE:
+			return (_vehicleProfile == nil);
+			
+		case ELM327_INIT_STATE_PID_SEARCH:
+		case ELM327_INIT_STATE_PROTOCOL:
+			return _vehicleProfileVerified;
+			
+		case ELM327_INIT_STATE_HEADERS_ON:
+			return !(IS_CAN_PROTOCOL(_protocol) && (_useHeaders || (_extendedPIDSearch && _batchPIDSearch)));
+			
+		case ELM327_INIT_STATE_PID_SEARCH_EXTENDED:
+			return !_extendedPIDSearch;
+			
+		case ELM327_INIT_STATE_HEADERS_OFF:
+			return !(_headersOn && !_useHeaders);
+			
+		case ELM327_INIT_STATE_RECEIVE_ADDRESS:
+			return !(_receiveAddressFilter != 0 && IS_CAN_PROTOCOL(_protocol));
+			
+		case ELM327_INIT_STATE_REQUEST_HEADER:
+			return !(_receiveAddressFilter != 0 && 
+					 IS_CAN_PROTOCOL(_protocol) && 
+					 [self requestHeaderForReceiveAddress:_receiveAddressFilter] != 0);
+			
+		default:
+			return NO;
+	}
+}
+
+
+- (NSUInteger) requestHeaderForReceiveAddress:(NSUInteger)address {
+	
+	if(address >= 0x7E8 && address <= 0x7EF) {
+		// ECU #n responds on 7E8+n to physical requests sent to 7E0+n
+		return address - 8;
+	}
+	else if((address & 0xFFFFFF00) == 0x18DAF100) {
+		// 18 DA F1 xx responses come from ECU xx to the tester (F1).  The
+		// priority byte (18) is the ELM327 default, so only the remaining
+		// three bytes are set: DA xx F1.
+		return 0xDA00F1 | ((address & 0xFF) << 8);
+	}
+	
+	return 0;
+}
+
 
 
 - (void) initScanTool {
@@ -100,19 +254,50 @@
 	
 	@try {
 		
-		CLEAR_READBUF()
+		FLSerialTransport* serial	= [self serialTransport];
+		
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(baudRateDidTimeout) object:nil];
+		_baudRatePhase		= kELM327BaudRateIdle;
+		
+		if(serial && _initState != ELM327_INIT_STATE_UNKNOWN && !_answeredAtBaudRate) {
+			// Nothing was read at this rate, so the adapter may be at
+			// another: power cycled back to its default, or left at a rate
+			// from an earlier session.  Step down through the rates on each
+			// restart until it answers.  A later step timing out, e.g. the
+			// PID search, keeps the rate; AT WS leaves the adapter's rate
+			// as it is.
+			NSUInteger rate	= [self baudRateBelow:serial.baudRate above:0];
+			
+			if(rate == 0) {
+				rate		= [self baudRateBelow:(MAX(serial.maxBaudRate, SERIAL_TRANSPORT_DEFAULT_BAUD_RATE) + 1) above:0];
+			}
+			
+			FLINFO(@"No answer from ELM327, trying %d baud", rate)
+			[serial switchToBaudRate:rate];
+			_negotiatedBaudRate	= 0;
+		}
+		
+		_baudRateAttempt	= (serial) ? [self baudRateBelow:(serial.maxBaudRate + 1) above:serial.baudRate] : 0;
+		_answeredAtBaudRate	= NO;
+		
+		[_readBuffer reset];
 		_state				= STATE_INIT;
 		_initState			= ELM327_INIT_STATE_RESET;
 		_currentPIDGroup	= 0x00;
+		_headersOn			= NO;
+		[self resetSupportedPIDs];
+		
+		_elmProtocol		= kELMAutomatic;
+		_extendedPIDSearch	= NO;
+		[_vehicleProfile release];
+		_vehicleProfile			= nil;
+		_vehicleProfileVerified	= NO;
 		
 		FLDEBUG(@"_inputStream status = %08X", [_inputStream streamStatus])
 		FLDEBUG(@"_outputStream status = %08X", [_outputStream streamStatus])
 		
-		while ([_inputStream streamStatus] != NSStreamStatusOpen &&
-			   [_outputStream streamStatus] != NSStreamStatusOpen) {
-			;
-		}
-	
+		// No need to wait for the streams to open; the reset is held in the
+		// write cache until the output stream reports space available
 		FLINFO(@"Sending Reset")
 		// 1. connect
 		[self sendCommand:(FLScanToolCommand*)[ELM327Command commandForReset] initCommand:YES];
@@ -125,261 +310,660 @@
 	}	
 }
 
-- (void) readInitResponse {
+- (void) readInput {
 	FLTRACE_ENTRY
 	
 	@try {
-		NSInteger readLength = [_inputStream read:&_readBuf[_readBufLength] maxLength:(sizeof(_readBuf) - (_readBufLength-1))];
+		NSInteger readLength = [_readBuffer readFromStream:_inputStream capture:_capture];
 		FLDEBUG(@"Read %d bytes", readLength)
-		FLDEBUG(@"_readBufLength = %d", _readBufLength)
+		FLDEBUG(@"_readBuffer length = %d", [_readBuffer length])
+		
+		if(readLength < 0) {
+			[_readBuffer reset];
+			return;
+		}
+		
+		if(_baudRatePhase != kELM327BaudRateIdle && ![self readBaudRateResponse]) {
+			return;
+		}
 		
-		if(readLength > 0) {
+		// A single read may complete several responses, and a response may
+		// arrive over several reads, so hand off everything up to each
+		// prompt and leave any partial response in the buffer
+		NSInteger promptIndex;
+		while((promptIndex = [_readBuffer indexOfByte:kResponseFinishedCode]) != -1) {
 			
-			_readBufLength += readLength;		
+			uint8_t* bytes		= [_readBuffer contiguousBytes];
+			NSUInteger length	= (NSUInteger)promptIndex;
+			
+			// Trim the '\r\r' preceding the prompt
+			while(length > 0 && (bytes[length-1] == '\r' || bytes[length-1] == '\n')) {
+				length--;
+			}
+			
+			bytes[length]		= 0x00;
+			
+			if(STATE_INIT()) {
+				[self handleInitResponse:bytes length:length];
+			}
+			else if(STATE_IDLE() || STATE_WAITING()) {
+				if(!_waitingForVoltageCommand) {
+					[self handleResponse:bytes length:length];
+				}
+				else {
+					[self handleVoltageResponse:bytes length:length];
+				}
+			}
+			else {
+				FLERROR(@"Received response in unknown state: %d", _state)
+			}
 			
-			if(ELM_READ_COMPLETE(_readBuf, (_readBufLength-1))) {
+			[_readBuffer consumeBytes:(promptIndex + 1)];
+		}
+		
+		if([_readBuffer length] > 0 && STATE_IDLE()) {
+			_state = STATE_WAITING;
+		}
+	}
+	@catch (NSException* e) {
+		FLEXCEPTION(e)
+		[_readBuffer reset];
+		_state = STATE_INIT;
+	}
+}
+
+- (void) handleInitResponse:(uint8_t*)bytes length:(NSUInteger)length {
+	FLTRACE_ENTRY
+	
+	[self stopDeadline];
+	_answeredAtBaudRate		= YES;
+	
+	char* asciistr			= (char*)bytes;
+	FLDEBUG(@"Data Returned: %s", asciistr)
+	
+	NSString* respString	= [NSString stringWithCString:(const char*)bytes encoding:NSASCIIStringEncoding];
+	
+	if(ELM_ERROR(asciistr) && OPTIONAL_INIT_STATE(_initState)) {
+		FLERROR(@"Optional init command not supported by ELM327 (state=%d): %@", _initState, respString)
+		_initState <<= 1;
+	}
+	else if(ELM_ERROR(asciistr)) {
+		FLERROR(@"Error response from ELM327 (state=%d): %@", _initState, respString)
+		_initState	= ELM327_INIT_STATE_RESET;
+		_state		= STATE_INIT;
+	}
+	else {				
+		switch(_initState) {
+			case ELM327_INIT_STATE_RESET:
+				if(0) {
+					FLERROR(@"Error response from ELM327 during Reset: %@", respString)
+				}
+				else {
+					_headersOn	= NO;
+					_initState <<= 1;
+					[self dispatchDelegate:@selector(scanToolDidConnect:) withObject:nil];
+				}
+				break;
 				
-				_readBuf[(_readBufLength - 3)] = 0x00;
-				_readBufLength			-= 3;
+			case ELM327_INIT_STATE_ECHO_OFF:
+				if(!ELM_OK(asciistr)) {
+					FLERROR(@"Error response from ELM327 during Echo Off: %@", respString)
+				}
+				else {
+					_initState <<= 1;
+				}
+				break;
 				
-				char* asciistr			= (char*)_readBuf;
-				FLDEBUG(@"Data Returned: %s", asciistr)
+			case ELM327_INIT_STATE_BAUD_RATE:
+				if(_baudRatePhase == kELM327BaudRateConfirmed) {
+					[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(baudRateDidTimeout) object:nil];
+					_negotiatedBaudRate	= _baudRateAttempt;
+					FLINFO(@"ELM327 switched to %d baud", _negotiatedBaudRate)
+				}
+				else {
+					FLERROR(@"ELM327 did not switch baud rate: %@", respString)
+				}
+				
+				_baudRatePhase		= kELM327BaudRateIdle;
+				_baudRateAttempt	= 0;
+				_initState <<= 1;
+				break;
 				
-				NSString* respString	= [NSString stringWithCString:(const char*)_readBuf encoding:NSASCIIStringEncoding];
+			case ELM327_INIT_STATE_ADAPTIVE_TIMING:
+			case ELM327_INIT_STATE_TIMEOUT:
+			case ELM327_INIT_STATE_RECEIVE_ADDRESS:
+			case ELM327_INIT_STATE_REQUEST_HEADER:
+				_initState <<= 1;
+				break;
+				
+			case ELM327_INIT_STATE_HEADERS_ON:
+				_headersOn	= YES;
+				_initState <<= 1;
+				break;
 				
-				if(ELM_ERROR(asciistr)) {
-					FLERROR(@"Error response from ELM327 (state=%d): %@", _initState, respString)
-					_initState	= ELM327_INIT_STATE_RESET;
-					_state		= STATE_INIT;
+			case ELM327_INIT_STATE_HEADERS_OFF:
+				_headersOn	= NO;
+				_initState <<= 1;
+				break;
+				
+			case ELM327_INIT_STATE_PROTOCOL:
+				if(*asciistr == 'A' && length > 1) {
+					// The 'A' is for Automatic.  The actual
+					// protocol number is at location 1, so
+					// increment pointer by 1
+					asciistr++;
 				}
-				else {				
-					switch(_initState) {
-						case ELM327_INIT_STATE_RESET:
-							if(0) {
-								FLERROR(@"Error response from ELM327 during Reset: %@", respString)
-							}
-							else {
-								_initState <<= 1;
-								[self dispatchDelegate:@selector(scanToolDidConnect:) withObject:nil];
-							}
-							break;
-							
-						case ELM327_INIT_STATE_ECHO_OFF:
-							if(!ELM_OK(asciistr)) {
-								FLERROR(@"Error response from ELM327 during Echo Off: %@", respString)
-							}
-							else {
-								_initState <<= 1;
-							}
-							break;
-							
-						case ELM327_INIT_STATE_PROTOCOL:
-							if(*asciistr == 'A') {
-								// The 'A' is for Automatic.  The actual
-								// protocol number is at location 1, so
-								// increment pointer by 1
-								asciistr++;
-							}
-							
-							_protocol = GET_PROTOCOL(((int)*asciistr) - 0x30);
-							
-							if(_protocol != kScanToolProtocolNone) {
-								_initState <<= 1;
-							}
-							
-							break;
-							
-						case ELM327_INIT_STATE_VERSION:
-							_initState <<= 1;
-							break;
-							
-						case ELM327_INIT_STATE_PID_SEARCH:	{							
-						
-							if(ELM_ERROR(asciistr)) {
-								FLERROR(@"Error response from ELM327 during PID search (state=%d): %@", _initState, respString)
-								_initState = ELM327_INIT_STATE_RESET;
-							}
-							else {							
-								if(!_parser) {
-									_parser = [[ELM327ResponseParser alloc] initWithBytes:_readBuf length:_readBufLength];
-								}
-								else {
-									[_parser setBytes:_readBuf length:_readBufLength];
-								}
-								
-								NSArray* responses	= [_parser parseResponse:kScanToolProtocolNone];
-								if(responses && [responses count] > 0) {									
-									BOOL extendPIDSearch	= NO;
-									
-									for(FLScanToolResponse* resp in responses) {
-										BOOL morePIDs		= [self buildSupportedSensorList:resp.data forPidGroup:_currentPIDGroup];										
-
-										if (!extendPIDSearch && morePIDs) {
-											extendPIDSearch	= YES;
-										}
-										
-										FLDEBUG(@"More PIDs: %@", (morePIDs) ? @"YES" : @"NO")
-									}
-									
-									if (extendPIDSearch) {
-										_currentPIDGroup		+= (extendPIDSearch) ? 0x20 : 0x00;
-										
-										if (_currentPIDGroup > 0x40) {
-											_initState			<<= 1;
-											_currentPIDGroup	= 0x00;
-										}
-									}
-									else {
-										_initState				<<= 1;
-										_currentPIDGroup		= 0x00;
-									}								
-								}
-							}
-						}
-							break;
-							
-						case ELM327_INIT_STATE_UNKNOWN:
-						default:
-							break;
+				
+				if(isxdigit((int)*asciistr)) {
+					// Protocols A-C are single hex digits
+					_elmProtocol	= (isdigit((int)*asciistr)) ? (*asciistr - '0') : (toupper((int)*asciistr) - 'A' + 10);
+					_protocol		= (_elmProtocol <= kUser2CAN11Bit50) ? GET_PROTOCOL(_elmProtocol) : kScanToolProtocolNone;
+				}
+				
+				if(_protocol != kScanToolProtocolNone) {
+					if(_extendedPIDSearch && _batchPIDSearch && IS_CAN_PROTOCOL(_protocol)) {
+						// The batched search starts over at group $00
+						_currentPIDGroup	= 0x00;
 					}
+					
+					_initState <<= 1;
 				}
 				
-				CLEAR_READBUF()
+				break;
+				
+			case ELM327_INIT_STATE_VERSION:
+				[_versionString release];
+				_versionString		= [respString copy];
 				
-				if(INIT_COMPLETE(_initState)) {
-					FLDEBUG(@"Init Complete", nil)
-					_initState	= ELM327_INIT_STATE_UNKNOWN;
-					_state		= STATE_IDLE;
-					[self dispatchDelegate:@selector(scanToolDidInitialize:) withObject:nil];
+				if(self.useVehicleProfileCache) {
+					_vehicleProfile	= [[FLVehicleProfile profileForIdentifier:[self vehicleProfileIdentifier]] retain];
+					FLDEBUG(@"Cached vehicle profile: %@", (_vehicleProfile) ? @"YES" : @"NO")
+				}
+				
+				_initState <<= 1;
+				break;
+				
+			case ELM327_INIT_STATE_SET_PROTOCOL:
+				_initState <<= 1;
+				break;
+				
+			case ELM327_INIT_STATE_PROBE: {
+				if(!_parser) {
+					_parser = [[ELM327ResponseParser alloc] initWithBytes:bytes length:length];
 				}
 				else {
-					[self sendCommand:[self commandForInitState:_initState] initCommand:YES];
-				}				
-			}			
-		}	
+					[_parser setBytes:bytes length:length];
+				}
+				
+				_parser.headersEnabled	= _headersOn;
+				[self verifyVehicleProfile:[_parser parseResponse:kScanToolProtocolNone]];
+				_initState <<= 1;
+			}
+				break;
+				
+			case ELM327_INIT_STATE_PID_SEARCH:
+			case ELM327_INIT_STATE_PID_SEARCH_EXTENDED:
+				[self handlePIDSearchResponse:bytes length:length];
+				break;
+				
+			case ELM327_INIT_STATE_UNKNOWN:
+			default:
+				break;
+		}
 	}
-	@catch (NSException* e) {
-		FLEXCEPTION(e)
+	
+	[self continueInit];
+}
+
+
+- (void) continueInit {
+	
+	while(!INIT_COMPLETE(_initState) && [self shouldSkipInitState:_initState]) {
+		_initState <<= 1;
 	}
-	@finally {
 	
-	}	
+	if(INIT_COMPLETE(_initState)) {
+		FLDEBUG(@"Init Complete", nil)
+		[self updateVehicleProfile];
+		_initState	= ELM327_INIT_STATE_UNKNOWN;
+		_state		= STATE_IDLE;
+		[self dispatchDelegate:@selector(scanToolDidInitialize:) withObject:nil];
+	}
+	else {
+		if(_initState == ELM327_INIT_STATE_BAUD_RATE) {
+			_baudRatePhase	= kELM327BaudRateRequested;
+		}
+		
+		[self sendCommand:[self commandForInitState:_initState] initCommand:YES];
+	}
 }
 
-- (void) readInput {
-	FLTRACE_ENTRY
-	@try {
-		NSInteger readLength = [_inputStream read:&_readBuf[_readBufLength] maxLength:(sizeof(_readBuf) - _readBufLength)];
-		FLDEBUG(@"Read %d bytes", readLength)
-		FLDEBUG(@"_readBufLength = %d", _readBufLength)
+
+- (void) handlePIDSearchResponse:(uint8_t*)bytes length:(NSUInteger)length {
+	
+	// Group $00 is searched on its own, as the first request to the vehicle
+	// is also what makes the ELM327 detect the protocol.  The remaining
+	// groups are searched in PID_SEARCH_EXTENDED once the protocol is known,
+	// either one group at a time or, on CAN, up to six groups per request.
+	BOOL extended			= (_initState == ELM327_INIT_STATE_PID_SEARCH_EXTENDED);
+	BOOL batch				= (extended && _batchPIDSearch && IS_CAN_PROTOCOL(_protocol));
+	NSUInteger firstGroup	= _currentPIDGroup;
+	NSUInteger lastGroup	= firstGroup;
+	
+	if(batch) {
+		lastGroup			= MIN(firstGroup + ((MAX_PIDS_PER_REQUEST - 1) * 0x20), MAX_PID_GROUP);
+	}
+	
+	if(!_parser) {
+		_parser = [[ELM327ResponseParser alloc] initWithBytes:bytes length:length];
+	}
+	else {
+		[_parser setBytes:bytes length:length];
+	}
+	
+	_parser.headersEnabled	= _headersOn;
+	NSArray* responses		= [_parser parseResponse:(extended) ? _protocol : kScanToolProtocolNone];
+	
+	if(!responses || [responses count] == 0) {
+		if(extended) {
+			// Keep whatever was found in the earlier groups
+			_extendedPIDSearch	= NO;
+			_currentPIDGroup	= 0x00;
+			_initState			<<= 1;
+		}
 		
-		if (readLength != -1) {
-			_readBufLength += readLength;
+		return;
+	}
+	
+	if(batch && firstGroup == 0x00) {
+		// The first batch repeats group $00 with headers on, so the ECUs can
+		// be told apart by address rather than by the order of their replies
+		[self resetSupportedPIDs];
+		_searchECUCount		= 0;
+	}
+	
+	BOOL morePIDs			= NO;
+	NSUInteger ecuIndex		= 0;
+	
+	for(FLScanToolResponse* resp in responses) {
+		NSUInteger group	= (batch) ? resp.pid : firstGroup;
+		
+		if(group < firstGroup || group > lastGroup || NOT_SEARCH_PID(group)) {
+			continue;
 		}
 		
-		if(ELM_READ_COMPLETE(_readBuf, (_readBufLength-1))) {
-			
-			_state			= STATE_PROCESSING;
-			
-			// Trim the ending '\r\r>' characters
-			_readBuf[(_readBufLength - 3)] = 0x00;
-			_readBufLength			-= 3;
-			
-			char* asciistr			= (char*)_readBuf;
-			FLDEBUG(@"Data Returned: %s", asciistr)
-			
-			if(ELM_ERROR(asciistr)) {
-				FLERROR(@"Error response from ELM327 (state=%d): %s", _initState, asciistr)
-				_initState	= ELM327_INIT_STATE_RESET;
-				_state		= STATE_INIT;
+		NSUInteger index	= (batch) ? [self searchIndexForECUAddress:resp.ecuAddress] : ecuIndex++;
+		BOOL more			= [self buildSupportedSensorList:resp.data forPidGroup:group ecuIndex:index];
+		
+		// Only the last group requested decides whether to go on; the
+		// others are answered within this same request
+		if(more && group == lastGroup) {
+			morePIDs		= YES;
+		}
+		
+		FLDEBUG(@"PID group $%02X more PIDs: %@", group, (more) ? @"YES" : @"NO")
+	}
+	
+	if(!extended) {
+		_extendedPIDSearch	= morePIDs;
+		_currentPIDGroup	= 0x20;
+		_initState			<<= 1;
+	}
+	else if(morePIDs && lastGroup < MAX_PID_GROUP) {
+		_currentPIDGroup	= lastGroup + 0x20;
+	}
+	else {
+		_extendedPIDSearch	= NO;
+		_currentPIDGroup	= 0x00;
+		_initState			<<= 1;
+	}
+}
+
+
+- (NSUInteger) searchIndexForECUAddress:(NSUInteger)address {
+	
+	for(NSUInteger i = 0; i < _searchECUCount; i++) {
+		if(_searchECUAddresses[i] == address) {
+			return i;
+		}
+	}
+	
+	if(_searchECUCount >= MAX_PID_SEARCH_ECUS) {
+		// Too many ECUs to track individually; still counted in the union
+		return MAX_PID_SEARCH_ECUS;
+	}
+	
+	_searchECUAddresses[_searchECUCount]	= address;
+	return _searchECUCount++;
+}
+
+
+- (void) handleResponse:(uint8_t*)bytes length:(NSUInteger)length {
+	
+	[self stopDeadline];
+	
+	_state					= STATE_PROCESSING;
+	
+	char* asciistr			= (char*)bytes;
+	FLDEBUG(@"Data Returned: %s", asciistr)
+	
+	if(ELM_ERROR(asciistr)) {
+		FLERROR(@"Error response from ELM327 (state=%d): %s", _initState, asciistr)
+		_initState	= ELM327_INIT_STATE_RESET;
+		_state		= STATE_INIT;
+	}
+	else {
+		if(!_parser) {
+			_parser = [[ELM327ResponseParser alloc] initWithBytes:bytes length:length];
+		}
+		else {
+			[_parser setBytes:bytes length:length];
+		}
+		
+		_parser.headersEnabled	= _headersOn;
+		
+		if([_parser parseRecords:_protocol]) {
+			[self dispatchRecords:_parser.records count:_parser.recordCount];
+		}
+		else {
+			// A reply too long for a record, e.g. a long trouble code list
+			NSArray* responses		= [_parser parseResponse:_protocol];
+			if(responses) {
+				if(self.useLocation) {
+					[responses makeObjectsPerformSelector:@selector(updateLocation:) withObject:self.currentLocation];
+				}					
+				[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:responses];
 			}
 			else {
-				if(!_parser) {
-					_parser = [[ELM327ResponseParser alloc] initWithBytes:_readBuf length:_readBufLength];
-				}
-				else {
-					[_parser setBytes:_readBuf length:_readBufLength];
-				}
-				
-				NSArray* responses	= [_parser parseResponse:_protocol];
-				if(responses) {
-					if(self.useLocation) {
-						[responses makeObjectsPerformSelector:@selector(updateLocation:) withObject:self.currentLocation];
-					}					
-					[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:responses];
-				}
-				else {
-					[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:nil];
-				}
-
-				
-				_state = STATE_IDLE;
-				[self sendCommand:[self dequeueCommand] initCommand:YES];
+				[self dispatchDelegate:@selector(scanTool:didReceiveResponse:) withObject:nil];
 			}
-		}	
-		else {
-			_state = STATE_WAITING;
 		}
+		
+		_state = STATE_IDLE;
+		[self sendCommand:[self dequeueCommand] initCommand:YES];
 	}
-	@catch (NSException * e) {
-		FLEXCEPTION(e)
-		CLEAR_READBUF()
-		_state = STATE_INIT;
+}
+
+
+- (void) handleVoltageResponse:(uint8_t*)bytes length:(NSUInteger)length {
+	
+	[self stopDeadline];
+	
+	_state						= STATE_PROCESSING;
+	_waitingForVoltageCommand	= NO;
+	
+	char* asciistr				= (char*)bytes;
+	FLDEBUG(@"Data Returned: %s", asciistr)
+	
+	if(ELM_ERROR(asciistr)) {
+		FLERROR(@"Error response from ELM327 (state=%d): %s", _initState, asciistr)
+		_initState	= ELM327_INIT_STATE_RESET;
+		_state		= STATE_INIT;
 	}
-	@finally {
-		if(STATE_IDLE() || STATE_INIT()) {
-			CLEAR_READBUF()
+	else {				
+		[self dispatchDelegate:@selector(scanTool:didReceiveVoltage:) withObject:[NSString stringWithCString:asciistr encoding:NSASCIIStringEncoding]];
+		_state		= STATE_IDLE;
+		[self sendCommand:[self dequeueCommand] initCommand:YES];
+	}
+}
+
+- (void) discardPendingResponse {
+	[_readBuffer reset];
+}
+
+
+#pragma mark -
+#pragma mark Baud Rate Negotiation
+
+- (FLSerialTransport*) serialTransport {
+	FLScanToolTransport* transport	= [self activeTransport];
+	return ([transport isKindOfClass:[FLSerialTransport class]]) ? (FLSerialTransport*)transport : nil;
+}
+
+
+- (NSUInteger) baudRateBelow:(NSUInteger)rate above:(NSUInteger)minimum {
+	
+	for(NSUInteger i = 0; i < sizeof(g_elm327BaudRates) / sizeof(g_elm327BaudRates[0]); i++) {
+		if(g_elm327BaudRates[i] < rate && 
+		   g_elm327BaudRates[i] > minimum && 
+		   [FLSerialTransport supportsBaudRate:g_elm327BaudRates[i]]) {
+			return g_elm327BaudRates[i];
 		}
 	}
+	
+	return 0;
 }
 
 
-- (void) readVoltageResponse {
-	FLTRACE_ENTRY
-	@try {
-		NSInteger readLength = [_inputStream read:&_readBuf[_readBufLength] maxLength:(sizeof(_readBuf) - _readBufLength)];
-		FLDEBUG(@"Read %d bytes", readLength)
-		_readBufLength += readLength;
-		
-		if(ELM_READ_COMPLETE(_readBuf, (_readBufLength-1))) {
+- (BOOL) readBaudRateResponse {
+	
+	// Returns YES if what is left in the buffer should go on to the prompt
+	// handling in readInput
+	FLSerialTransport* transport	= [self serialTransport];
+	
+	while([_readBuffer length] > 0 && ([_readBuffer byteAtIndex:0] == '\r' || [_readBuffer byteAtIndex:0] == '\n')) {
+		[_readBuffer consumeBytes:1];
+	}
+	
+	NSInteger lineIndex				= [_readBuffer indexOfByte:'\r'];
+	NSInteger promptIndex			= [_readBuffer indexOfByte:kResponseFinishedCode];
+	const char* line				= (const char*)[_readBuffer contiguousBytes];
+	
+	switch(_baudRatePhase) {
+		case kELM327BaudRateRequested:
+			if(promptIndex != -1 && (lineIndex == -1 || promptIndex < lineIndex || strncasecmp(line, "OK", 2))) {
+				// Refused ('?'), or answered without switching
+				_baudRatePhase		= kELM327BaudRateIdle;
+				_baudRateAttempt	= 0;
+				return YES;
+			}
+			
+			if(lineIndex == -1 || strncasecmp(line, "OK", 2)) {
+				return NO;
+			}
 			
-			_state			= STATE_PROCESSING;
+			// The OK has no prompt after it; the adapter is now switching
+			[_readBuffer consumeBytes:(lineIndex + 1)];
+			[self stopDeadline];
 			
-			// Trim the ending '\r\n>' characters
-			_readBuf[(_readBufLength - 3)] = 0x00;
-			_readBufLength			-= 3;
+			_previousBaudRate		= transport.baudRate;
+			_baudRatePhase			= ([transport switchToBaudRate:_baudRateAttempt]) ? kELM327BaudRateSwitched : kELM327BaudRateFailed;
+			_answeredAtBaudRate		= NO;
+			[self performSelector:@selector(baudRateDidTimeout) withObject:nil afterDelay:ELM327_BAUD_RATE_TIMEOUT];
 			
-			char* asciistr			= (char*)_readBuf;
-			FLDEBUG(@"Data Returned: %s", asciistr)
+			// The ID may have come in the same read, e.g. over a pty
+			return [self readBaudRateResponse];
 			
-			if(ELM_ERROR(asciistr)) {
-				FLERROR(@"Error response from ELM327 (state=%d): %s", _initState, asciistr)
-				_initState	= ELM327_INIT_STATE_RESET;
-				_state		= STATE_INIT;
+		case kELM327BaudRateSwitched:
+			if(lineIndex != -1 && lineIndex >= 3 && !strncasecmp(line, "ELM", 3)) {
+				// The ID string came through at the new rate, so confirm
+				// it; the prompt follows
+				[_readBuffer consumeBytes:(lineIndex + 1)];
+				[_cachedWriteData appendBytes:"\r" length:1];
+				[self writeCachedData];
+				_baudRatePhase		= kELM327BaudRateConfirmed;
+				return YES;
 			}
-			else {				
-				[self dispatchDelegate:@selector(scanTool:didReceiveVoltage:) withObject:[NSString stringWithCString:asciistr encoding:NSASCIIStringEncoding]];
-				_state		= STATE_IDLE;
-				[self sendCommand:[self dequeueCommand] initCommand:YES];
+			
+			if(lineIndex != -1 || promptIndex != -1 || [_readBuffer length] > ELM327_MAX_ID_LENGTH) {
+				// Garbled, so the rate does not work at one end or the
+				// other.  The adapter goes back once its AT BRT time is up.
+				_baudRatePhase		= kELM327BaudRateFailed;
+				[_readBuffer reset];
 			}
-		}	
-		else {
-			_state = STATE_WAITING;
+			
+			return NO;
+			
+		case kELM327BaudRateConfirmed:
+			return YES;
+			
+		case kELM327BaudRateFailed:
+			[_readBuffer reset];
+			return NO;
+			
+		default:
+			return YES;
+	}
+}
+
+
+- (void) baudRateDidTimeout {
+	
+	if(_baudRatePhase == kELM327BaudRateIdle || _baudRatePhase == kELM327BaudRateRequested) {
+		return;
+	}
+	
+	FLSerialTransport* transport	= [self serialTransport];
+	NSUInteger failedRate			= _baudRateAttempt;
+	
+	// The adapter has gone back to the old rate by now, and has printed its
+	// prompt there
+	[transport switchToBaudRate:_previousBaudRate];
+	[_readBuffer reset];
+	_answeredAtBaudRate				= YES;
+	
+	_baudRatePhase					= kELM327BaudRateIdle;
+	_baudRateAttempt				= [self baudRateBelow:failedRate above:transport.baudRate];
+	
+	FLERROR(@"ELM327 did not answer at %d baud, staying at %d", failedRate, transport.baudRate)
+	
+	if(_baudRateAttempt == 0) {
+		_initState <<= 1;
+	}
+	
+	[self continueInit];
+}
+
+
+#pragma mark -
+#pragma mark Vehicle Profile Methods
+
+- (NSString*) vehicleProfileIdentifier {
+	// The same adapter is assumed to stay plugged into the same vehicle; the
+	// probe checks the vehicle's PID support against the profile to catch
+	// the cases where it has not.  Adapters which cannot be told apart, e.g.
+	// over a socket given to the transport or a replay, are not cached.
+	FLScanToolTransport* transport	= [self activeTransport];
+	NSString* adapter				= nil;
+	
+	if(transport) {
+		adapter						= transport.adapterIdentity;
+	}
+	else if(_host) {
+		adapter						= [NSString stringWithFormat:@"%@:%d", _host, _port];
+	}
+	
+	return (adapter) ? [NSString stringWithFormat:@"%@ %@", adapter, _versionString] : nil;
+}
+
+
+- (void) verifyVehicleProfile:(NSArray*)responses {
+	
+	// The probe is the PID search for group $00.  The profile is only used
+	// if the same number of ECUs reply, each with a reply the profile has
+	// seen before.
+	BOOL verified	= (_vehicleProfile && [responses count] > 0 && [responses count] == _vehicleProfile.ecuCount);
+	
+	for(FLScanToolResponse* resp in responses) {
+		if(!verified) {
+			break;
 		}
+		
+		verified	= [_vehicleProfile hasECUWithSupportedPIDs:resp.data forPidGroup:0x00];
 	}
-	@catch (NSException* e) {
-		FLEXCEPTION(e)
-		CLEAR_READBUF()
-		_state = STATE_INIT;
+	
+	if(verified) {
+		FLINFO(@"Vehicle matches cached profile, skipping PID search")
+		[self applyVehicleProfile:_vehicleProfile];
+		_elmProtocol			= _vehicleProfile.protocolNumber;
+		_vehicleProfileVerified	= YES;
 	}
-	@finally {
-		if(STATE_IDLE() || STATE_INIT()) {
-			CLEAR_READBUF()
-			_waitingForVoltageCommand	= NO;
+	else {
+		FLINFO(@"Vehicle does not match cached profile")
+		[_vehicleProfile release];
+		_vehicleProfile			= nil;
+	}
+}
+
+
+- (void) updateVehicleProfile {
+	
+	if(!self.useVehicleProfileCache || 
+	   _protocol == kScanToolProtocolNone || 
+	   _elmProtocol == kELMAutomatic || 
+	   _supportedECUCount == 0) {
+		return;
+	}
+	
+	NSString* identifier		= [self vehicleProfileIdentifier];
+	
+	if(!identifier) {
+		return;
+	}
+	
+	FLVehicleProfile* profile	= [self vehicleProfileWithIdentifier:identifier];
+	profile.protocolNumber		= _elmProtocol;
+	profile.adapterVersion		= _versionString;
+	
+	[FLVehicleProfile storeProfile:profile];
+}
+
+
+#pragma mark -
+#pragma mark Response Count Hints
+
+- (NSUInteger) expectedResponseCountForPIDs:(NSArray*)pids {
+	
+	uint8_t ecuMask			= 0;
+	NSUInteger pidGroup		= NSNotFound;
+	NSInteger replyLength	= 1; // Mode byte
+	
+	for(NSNumber* pidNumber in pids) {
+		NSUInteger pid		= [pidNumber unsignedIntegerValue];
+		NSInteger pidLength	= [FLScanToolResponseParser dataLengthForService01PID:pid];
+		
+		if(pid == 0x00 || pid > 0xFF || pidLength < 0) {
+			return 0;
+		}
+		
+		// ECU ordering is only consistent within a single PID search
+		// response, so we cannot combine masks learned from different groups
+		NSUInteger group	= ((pid - 1) / 0x20) * 0x20;
+		if(pidGroup != NSNotFound && pidGroup != group) {
+			return 0;
 		}
+		
+		pidGroup			= group;
+		
+		for(NSUInteger ecu = 0; ecu < _supportedECUCount; ecu++) {
+			if([self isService01PIDSupported:pid ecuIndex:ecu]) {
+				ecuMask		|= (1 << ecu);
+			}
+		}
+		
+		replyLength			+= 1 + pidLength;
 	}
+	
+	// A reply that does not fit in a single CAN frame is returned as
+	// several lines, which would throw off the response count
+	if(IS_CAN_PROTOCOL(_protocol) && replyLength > 7) {
+		return 0;
+	}
+	
+	NSUInteger count		= 0;
+	for(; ecuMask != 0; ecuMask >>= 1) {
+		count				+= (ecuMask & 0x01);
+	}
+	
+	// With a receive address filter only the one ECU's reply is shown
+	if(_receiveAddressFilter != 0 && IS_CAN_PROTOCOL(_protocol)) {
+		count				= MIN(count, 1);
+	}
+	
+	return count;
 }
 
+
 #pragma mark -
 #pragma mark NSStream Event Handling Methods
 
@@ -414,20 +998,7 @@
 			case NSStreamEventHasBytesAvailable:
 				FLINFO(@"NSStreamEventHasBytesAvailable")
 				
-				if(STATE_INIT()) {
-					[self readInitResponse];
-				}
-				else if(STATE_IDLE() || STATE_WAITING()) {
-					if(!_waitingForVoltageCommand) {
-						[self readInput];
-					}
-					else {
-						[self readVoltageResponse];
-					}					
-				}
-				else {
-					FLERROR(@"Received bytes in unknown state: %d", _state)
-				}
+				[self readInput];
 				
 				break;
 				
@@ -500,7 +1071,32 @@
 #pragma mark ScanToolCommand Generators
 
 - (FLScanToolCommand*) commandForGenericOBD:(FLScanToolMode)mode pid:(unsigned char)pid data:(NSData*)data {	
-	return (FLScanToolCommand*)[ELM327Command commandForOBD2:mode pid:pid data:data];
+	ELM327Command* cmd = [ELM327Command commandForOBD2:mode pid:pid data:data];
+	
+	if(_useResponseCountHints && mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
+		cmd.expectedResponseCount = [self expectedResponseCountForPIDs:[NSArray arrayWithObject:[NSNumber numberWithUnsignedChar:pid]]];
+	}
+	
+	return (FLScanToolCommand*)cmd;
+}
+
+- (FLScanToolCommand*) commandForGenericOBD:(FLScanToolMode)mode pids:(NSArray*)pids {
+	ELM327Command* cmd = [ELM327Command commandForOBD2:mode pids:pids];
+	
+	if(_useResponseCountHints && mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
+		cmd.expectedResponseCount = [self expectedResponseCountForPIDs:pids];
+	}
+	
+	return (FLScanToolCommand*)cmd;
+}
+
+- (FLScanToolCommand*) commandForEnhancedPID:(NSUInteger)pid {
+	return (FLScanToolCommand*)[ELM327Command commandForOBD2:kScanToolModeRequestDataByIdentifier pid:pid data:nil];
+}
+
+- (NSUInteger) maxPIDsPerRequest {
+	// Only ISO 15765-4 (CAN) ECUs are required to accept multi-PID requests
+	return (IS_CAN_PROTOCOL(_protocol)) ? MAX_PIDS_PER_REQUEST : 1;
 }
 
 - (FLScanToolCommand*) commandForReadVersionNumber {
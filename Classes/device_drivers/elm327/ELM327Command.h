@@ -28,6 +28,7 @@ extern NSString *const kCarriageReturn;
 extern NSString *const kELM327Reset;
 extern NSString *const kELM327EchoOff;
 extern NSString *const kELM327HeadersOn;
+extern NSString *const kELM327HeadersOff;
 extern NSString *const kELM327ReadVoltage;
 extern NSString *const kELM327ReadProtocol;
 extern NSString *const kELM327ReadProtocolNumber;
@@ -35,6 +36,18 @@ extern NSString *const kELM327ReadVersionID;
 extern NSString *const kELM327ReadDeviceDescription;
 extern NSString *const kELM327ReadDeviceIdentifier;
 extern NSString *const kELM327SetDeviceIdentifier;
+extern NSString *const kELM327SetAdaptiveTiming;
+extern NSString *const kELM327SetTimeout;
+extern NSString *const kELM327SetHeader;
+extern NSString *const kELM327SetReceiveAddress;
+extern NSString *const kELM327SetProtocol;
+extern NSString *const kELM327SetBaudRateDivisor;
+
+
+// The ELM327 runs at this rate divided by the AT BRD divisor, from 500000
+// baud (divisor $08) down
+#define ELM327_BAUD_RATE_CLOCK			4000000
+#define ELM327_MIN_BAUD_RATE_DIVISOR	0x08
 
 
 typedef enum {
@@ -46,11 +59,17 @@ typedef enum {
 @interface ELM327Command : FLScanToolCommand {
 	ELM327CommandType		_commandType;
 	NSMutableString*		_command;
+	NSUInteger				_expectedResponseCount;
 }
 
 
 @property(nonatomic, retain) NSString* commandString;
 
+// Appends an expected response count (1-15) to an OBD request, so the ELM327
+// returns as soon as that many responses are received instead of waiting out
+// its response timeout.  A value of 0 leaves the command unchanged.
+@property(nonatomic, assign) NSUInteger expectedResponseCount;
+
 
 + (ELM327Command*) commandForReset;
 + (ELM327Command*) commandForEchoOff;
@@ -61,8 +80,18 @@ typedef enum {
 + (ELM327Command*) commandForReadDeviceIdentifier;
 + (ELM327Command*) commandForSetDeviceIdentifier:(NSString*)identifier;
 + (ELM327Command*) commandForHeadersOn;
++ (ELM327Command*) commandForHeadersOff;
++ (ELM327Command*) commandForSetAdaptiveTiming:(NSUInteger)mode;
++ (ELM327Command*) commandForSetTimeout:(NSUInteger)milliseconds;
++ (ELM327Command*) commandForSetHeader:(NSUInteger)header;
++ (ELM327Command*) commandForSetReceiveAddress:(NSUInteger)address;
++ (ELM327Command*) commandForSetProtocol:(NSUInteger)protocol;
+
+// AT BRD, with the divisor nearest baudRate.  See ELM327_BAUD_RATE_CLOCK.
++ (ELM327Command*) commandForSetBaudRate:(NSUInteger)baudRate;
 
 + (ELM327Command*) commandForOBD2:(FLScanToolMode)mode pid:(NSUInteger)pid data:(NSData*)data;
++ (ELM327Command*) commandForOBD2:(FLScanToolMode)mode pids:(NSArray*)pids;
 
 
 - initWithCommandString:(NSString*)command;
@@ -26,6 +26,7 @@ NSString *const kCarriageReturn						= @"\r";
 // Common Commands
 NSString *const kELM327Reset						= @"AT WS";
 NSString *const kELM327HeadersOn					= @"AT H1";
+NSString *const kELM327HeadersOff					= @"AT H0";
 NSString *const kELM327EchoOff						= @"AT E0";
 NSString *const kELM327ReadVoltage					= @"AT RV";
 NSString *const kELM327ReadProtocol					= @"AT DP";
@@ -34,12 +35,19 @@ NSString *const kELM327ReadVersionID				= @"AT I";
 NSString *const kELM327ReadDeviceDescription		= @"AT @1";
 NSString *const kELM327ReadDeviceIdentifier			= @"AT @2";
 NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
+NSString *const kELM327SetAdaptiveTiming			= @"AT AT";
+NSString *const kELM327SetTimeout					= @"AT ST";
+NSString *const kELM327SetHeader					= @"AT SH";
+NSString *const kELM327SetReceiveAddress			= @"AT CRA";
+NSString *const kELM327SetProtocol					= @"AT SP";
+NSString *const kELM327SetBaudRateDivisor			= @"AT BRD";
 
 
 
 @implementation ELM327Command
 
-@synthesize commandString	= _command;
+@synthesize commandString			= _command,
+			expectedResponseCount	= _expectedResponseCount;
 
 
 
@@ -47,13 +55,16 @@ NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
 	
 	ELM327Command* cmd = nil;
 	
-	if (pid >= 0x00 && pid <= 0x4E) {
+	if (MODE_HAS_EXTENDED_PID(mode) && pid <= 0xFFFF) {
+		cmd = [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%02x %04x", (NSUInteger)mode, pid]];	
+	}
+	else if (MODE_HAS_PID(mode) && pid <= 0xFF) {
 		cmd = [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%02x %02x", (NSUInteger)mode, pid]];	
 	}
 	else {
 		cmd = [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%02x", (NSUInteger)mode]];	
 	}
-
+	
 	if(data) {
 		cmd.data = data;
 	}
@@ -62,6 +73,26 @@ NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
 }
 
 
++ (ELM327Command*) commandForOBD2:(FLScanToolMode)mode pids:(NSArray*)pids {
+	
+	NSMutableString* commandString	= [NSMutableString stringWithFormat:@"%02x", (NSUInteger)mode];
+	NSUInteger pidCount				= 0;
+	
+	for(NSNumber* pid in pids) {
+		if(pidCount >= MAX_PIDS_PER_REQUEST) {
+			FLERROR(@"Dropping PIDs beyond the multi-PID request limit (%d)", MAX_PIDS_PER_REQUEST)
+			break;
+		}
+		
+		[commandString appendFormat:@" %02x", [pid unsignedIntegerValue]];
+		pidCount++;
+	}
+	
+	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:commandString];
+	return [cmd autorelease];
+}
+
+
 + (ELM327Command*) commandForReset {
 	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:kELM327Reset];
 	return [cmd autorelease];
@@ -72,6 +103,72 @@ NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
 	return [cmd autorelease];
 }
 
++ (ELM327Command*) commandForHeadersOff {
+	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:kELM327HeadersOff];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetAdaptiveTiming:(NSUInteger)mode {
+	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%@%d", kELM327SetAdaptiveTiming, (mode > 2) ? 2 : mode]];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetTimeout:(NSUInteger)milliseconds {
+	// The ELM327 timeout is set in increments of 4 msec
+	NSUInteger timeout	= milliseconds / 4;
+	
+	if(timeout < 1) {
+		timeout			= 1;
+	}
+	else if(timeout > 0xFF) {
+		timeout			= 0xFF;
+	}
+	
+	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%@ %02X", kELM327SetTimeout, timeout]];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetHeader:(NSUInteger)header {
+	// 11-bit CAN headers are 3 hex digits, all others are 3 bytes
+	NSString* format	= (header <= 0x7FF) ? @"%@ %03X" : @"%@ %06X";
+	ELM327Command* cmd	= [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:format, kELM327SetHeader, header]];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetReceiveAddress:(NSUInteger)address {
+	// 11-bit CAN IDs are 3 hex digits, 29-bit IDs are 8
+	NSString* format	= (address <= 0x7FF) ? @"%@ %03X" : @"%@ %08X";
+	ELM327Command* cmd	= [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:format, kELM327SetReceiveAddress, address]];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetProtocol:(NSUInteger)protocol {
+	// 'A' tries the given protocol first, and falls back to the automatic
+	// search if the vehicle does not respond on it
+	ELM327Command* cmd	= [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%@ A%X", kELM327SetProtocol, (protocol & 0x0F)]];
+	return [cmd autorelease];
+}
+
+
++ (ELM327Command*) commandForSetBaudRate:(NSUInteger)baudRate {
+	NSUInteger divisor	= (baudRate > 0) ? ((ELM327_BAUD_RATE_CLOCK + (baudRate / 2)) / baudRate) : 0xFF;
+	
+	if(divisor < ELM327_MIN_BAUD_RATE_DIVISOR) {
+		divisor			= ELM327_MIN_BAUD_RATE_DIVISOR;
+	}
+	else if(divisor > 0xFF) {
+		divisor			= 0xFF;
+	}
+	
+	ELM327Command* cmd	= [[ELM327Command alloc] initWithCommandString:[NSString stringWithFormat:@"%@ %02X", kELM327SetBaudRateDivisor, divisor]];
+	return [cmd autorelease];
+}
+
 
 + (ELM327Command*) commandForEchoOff {
 	ELM327Command* cmd = [[ELM327Command alloc] initWithCommandString:kELM327EchoOff];
@@ -125,6 +222,15 @@ NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
 }
 
 
+- (void) setExpectedResponseCount:(NSUInteger)count {
+	
+	if(_expectedResponseCount == 0 && count > 0 && count <= 0x0F) {
+		_expectedResponseCount = count;
+		[_command appendFormat:@" %X", count];
+	}
+}
+
+
 - (void) dealloc {
 	[_command release];
 	[super dealloc];
@@ -132,9 +238,10 @@ NSString *const kELM327SetDeviceIdentifier			= @"AT @3";
 
 
 - (NSData*) data {
-	[_command appendString:kCarriageReturn];
-	FLDEBUG(@"Flushing command: %@", _command)
-	return [_command dataUsingEncoding:NSASCIIStringEncoding];
+	// Leave _command untouched, so a command can be resent after a timeout
+	NSString* commandString = [_command stringByAppendingString:kCarriageReturn];
+	FLDEBUG(@"Flushing command: %@", commandString)
+	return [commandString dataUsingEncoding:NSASCIIStringEncoding];
 }
 
 @end
@@ -21,13 +21,15 @@
 #import <Foundation/Foundation.h>
 #import "FLScanToolResponseParser.h"
 
+@class FLResponseBuffer;
+
 extern NSString *const kATError;
 extern NSString *const kResponseFinished;
 extern NSString *const kOK;
 extern NSString *const kNoData;
 
 
-#define CLEAR_DECODE_BUF()						memset(_decodeBuf, 0x00, sizeof(_decodeBuf)); _decodeBufLength = 0;
+#define CLEAR_DECODE_BUF()						_decodeBufLength = 0;
 
 #define kResponseFinishedCode					0x3E
 #define ELM_READ_COMPLETE(buf, end)				(buf[end] == kResponseFinishedCode)
@@ -40,14 +42,43 @@ extern NSString *const kNoData;
 #define ELM_DATA_RESPONSE(str)					isdigit((int)*str) || ELM_SEARCHING(str)
 #define ELM_AT_RESPONSE(str)					isalpha((int)*str)
 
+// ISO 15765-4 multi-frame replies are preceded by a line holding the total
+// byte count (e.g. "00E"), followed by numbered frames (e.g. "0: 41 0C ...")
+#define ELM_CAN_BYTE_COUNT(str, len)			(len == 3 && isxdigit((int)str[0]) && isxdigit((int)str[1]) && isxdigit((int)str[2]))
+#define ELM_CAN_FRAME_INDEX(str, len)			(len >= 2 && isxdigit((int)str[0]) && str[1] == ':')
+
+// Largest Mode $01 PID payload we will split out of a multi-PID reply
+#define ELM_MAX_PID_DATA_LENGTH					8
+
+// With headers on (AT H1), each CAN line starts with either an 11-bit ID
+// (e.g. "7E8 06 41 ...") or a 29-bit ID as 4 bytes (e.g. "18 DA F1 10 06 41 ...")
+#define ELM_CAN_11BIT_HEADER(str, len)			(len > 3 && str[3] == ' ' && isxdigit((int)str[0]) && isxdigit((int)str[1]) && isxdigit((int)str[2]))
+
+// Number of ECUs whose multi-frame replies we can assemble concurrently
+#define ELM_MAX_CAN_MESSAGES					4
+
 
 @interface ELM327ResponseParser : FLScanToolResponseParser {
 	
 	// Buffer to hold the decoded ASCII stream from the ELM
 	uint8_t							_decodeBuf[256];
 	NSInteger						_decodeBufLength;
+	
+	BOOL							_headersEnabled;
+	
+	// Set while parseRecords: is running, so that decoded responses are
+	// added as records rather than objects
+	BOOL							_parsingRecords;
+	
+	// Holds the decoded bytes of every response from one parseResponse:,
+	// which the responses' rawData and data are sliced from
+	FLResponseBuffer*				_responseBuffer;
 }
 
+// Set when the ELM327 is echoing CAN headers (AT H1).  Responses are then
+// tagged with the priority, target and ECU address from the CAN ID.
+@property (nonatomic, assign) BOOL headersEnabled;
+
 - (NSString*) stringForResponse;
 
 @end
@@ -19,6 +19,8 @@
  */
 
 #import "ELM327ResponseParser.h"
+#import "ELM327Command.h"
+#import "FLResponseBuffer.h"
 #import <CoreLocation/CoreLocation.h>
 #import "FLLogging.h"
 
@@ -27,8 +29,91 @@ NSString *const kResponseFinished				= @">";
 NSString *const kOK								= @"OK";
 NSString *const kNoData							= @"NO DATA";
 
+
+// Hex digit lookup table.  Entries hold the digit value + 1, so that 0 marks
+// a character which is not a hex digit.
+static const uint8_t g_hexDigitTable[256] = {
+	['0'] = 0x01, ['1'] = 0x02, ['2'] = 0x03, ['3'] = 0x04, ['4'] = 0x05,
+	['5'] = 0x06, ['6'] = 0x07, ['7'] = 0x08, ['8'] = 0x09, ['9'] = 0x0A,
+	['A'] = 0x0B, ['B'] = 0x0C, ['C'] = 0x0D, ['D'] = 0x0E, ['E'] = 0x0F, ['F'] = 0x10,
+	['a'] = 0x0B, ['b'] = 0x0C, ['c'] = 0x0D, ['d'] = 0x0E, ['e'] = 0x0F, ['f'] = 0x10
+};
+
+#define HEX_DIGIT(c)		g_hexDigitTable[(uint8_t)(c)]
+
+
+/*
+ Decodes a line of ASCII hex (e.g. "41 0C 1A F8") into bytes, stopping at the
+ first character that is neither a hex digit nor a space.  Returns the
+ number of bytes written to out.
+ */
+static inline NSUInteger decodeHexLine(const uint8_t* line, NSUInteger length, uint8_t* out, NSUInteger outLength) {
+	
+	NSUInteger index	= 0;
+	NSUInteger decoded	= 0;
+	
+	while(index < length && decoded < outLength) {
+		uint8_t high	= HEX_DIGIT(line[index]);
+		
+		if(!high) {
+			if(line[index] == ' ') {
+				index++;
+				continue;
+			}
+			
+			break;
+		}
+		
+		uint8_t low		= (index + 1 < length) ? HEX_DIGIT(line[index + 1]) : 0;
+		
+		if(low) {
+			out[decoded++]	= (uint8_t)(((high - 1) << 4) | (low - 1));
+			index			+= 2;
+		}
+		else {
+			out[decoded++]	= (uint8_t)(high - 1);
+			index++;
+		}
+	}
+	
+	return decoded;
+}
+
+
+// A CAN message being reassembled from ISO 15765-2 first and consecutive
+// frames, keyed on the ID of the ECU sending it
+typedef struct elm_can_message_t {
+	uint32_t		canID;
+	NSUInteger		expectedLength;
+	NSUInteger		length;
+	uint8_t			data[256];
+} ELMCANMessage;
+
+
+@interface ELM327ResponseParser (Private)
+- (void) addResponseData:(uint8_t*)data 
+				ofLength:(NSInteger)length 
+			 forProtocol:(FLScanToolProtocol)protocol 
+				 toArray:(NSMutableArray*)responseArray;
+- (void) addResponsesForData:(uint8_t*)data 
+					ofLength:(NSInteger)length 
+					   canID:(uint32_t)canID 
+				 forProtocol:(FLScanToolProtocol)protocol 
+					 toArray:(NSMutableArray*)responseArray;
+- (void) addResponsesForHeaderLine:(const uint8_t*)line 
+							length:(NSUInteger)length 
+						  messages:(ELMCANMessage*)messages 
+					   forProtocol:(FLScanToolProtocol)protocol 
+						   toArray:(NSMutableArray*)responseArray;
+- (BOOL) parseLinesForProtocol:(FLScanToolProtocol)protocol toArray:(NSMutableArray*)responseArray;
+@end
+
+
+#pragma mark -
 @implementation ELM327ResponseParser
 
+@synthesize headersEnabled = _headersEnabled;
+
 
 - (NSString*) stringForResponse {
 	/*
@@ -49,17 +134,26 @@ NSString *const kNoData							= @"NO DATA";
 	FLScanToolResponse* resp	= [[FLScanToolResponse alloc] init];
 	int dataIndex			= 0;
 	
+	// Copy the response into the shared buffer once, and slice rawData
+	// and data from that copy
+	const uint8_t* bytes	= [_responseBuffer appendBytes:data length:length];
+	
 	resp.scanToolName		= @"ELM327";
 	resp.protocol			= protocol;
-	resp.rawData			= [NSData dataWithBytes:data length:length];
+	resp.rawData			= (bytes) ? [_responseBuffer sliceWithBytes:bytes length:length] : [NSData dataWithBytes:data length:length];
 	resp.mode				= data[dataIndex++];
 	
 	if(resp.mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
 		resp.pid			= data[dataIndex++];
 	}	
+	else if(resp.mode == kScanToolModeRequestDataByIdentifier && length > 3) {
+		resp.pid			= (data[1] << 8) | data[2];
+		dataIndex			+= 2;
+	}
 	
-	if(length > 2) {
-		resp.data				= [NSData dataWithBytes:&data[dataIndex] length:(length-dataIndex)];
+	if(length > 2 && length > dataIndex) {
+		resp.data				= (bytes) ? [_responseBuffer sliceWithBytes:&bytes[dataIndex] length:(length-dataIndex)] : 
+										[NSData dataWithBytes:&data[dataIndex] length:(length-dataIndex)];
 	}
 	
 	if(self.resolveLocation) {
@@ -70,23 +164,325 @@ NSString *const kNoData							= @"NO DATA";
 }
 
 
+- (void) addResponseData:(uint8_t*)data 
+				ofLength:(NSInteger)length 
+			 forProtocol:(FLScanToolProtocol)protocol 
+				 toArray:(NSMutableArray*)responseArray {
+	
+	if(!_parsingRecords) {
+		[responseArray addObject:[self decodeResponseData:data ofLength:length forProtocol:protocol]];
+		return;
+	}
+	
+	NSUInteger dataOffset		= 1;
+	uint8_t mode				= (data[0] ^ 0x40);
+	
+	if(mode == kScanToolModeRequestCurrentPowertrainDiagnosticData && length > 2) {
+		dataOffset				= 2;
+	}
+	else if(mode == kScanToolModeRequestDataByIdentifier && length > 3) {
+		dataOffset				= 3;
+	}
+	
+	FLScanToolRecord* record	= [self addRecordForBytes:data 
+											  length:length 
+										  dataOffset:MIN(dataOffset, (NSUInteger)length) 
+											protocol:protocol];
+	
+	if(record) {
+		record->mode			= mode;
+		record->pid				= (dataOffset == 3) ? ((data[1] << 8) | data[2]) : 
+								  (dataOffset == 2) ? data[1] : 0;
+	}
+}
+
+
+- (void) addResponsesForData:(uint8_t*)data 
+					 ofLength:(NSInteger)length 
+				  forProtocol:(FLScanToolProtocol)protocol 
+					  toArray:(NSMutableArray*)responseArray {
+	
+	if(!data || length <= 0) {
+		return;
+	}
+	
+	// Some ELM327s run a multi-ECU response together without a CR between
+	// the ECUs (e.g. 41 00 BF 9F F9 91 41 00 90 18 80 00).  If the line is
+	// an exact multiple of the expected reply length, and every chunk starts
+	// with the same mode and PID, split it into one response per ECU.
+	if(length > 2 && data[0] == (0x40 | kScanToolModeRequestCurrentPowertrainDiagnosticData)) {
+		
+		NSInteger frameLength	= 2 + [FLScanToolResponseParser dataLengthForService01PID:data[1]];
+		
+		if(frameLength > 2 && length > frameLength && (length % frameLength) == 0) {
+			
+			NSInteger offset	= frameLength;
+			
+			while(offset < length && data[offset] == data[0] && data[offset + 1] == data[1]) {
+				offset			+= frameLength;
+			}
+			
+			if(offset == length) {
+				for(offset = 0; offset < length; offset += frameLength) {
+					[self addResponseData:&data[offset] 
+								 ofLength:frameLength 
+							  forProtocol:protocol 
+								  toArray:responseArray];
+				}
+				
+				return;
+			}
+		}
+	}
+	
+	// A Mode $01 reply to a multi-PID request carries several PID/data pairs
+	// after the mode byte (e.g. 41 0C 1A F8 0D 00 05 7B).  Multi-PID requests
+	// are only sent on CAN, so only attempt to split on CAN protocols.
+	if(IS_CAN_PROTOCOL(protocol) && 
+	   length > 2 && 
+	   data[0] == (0x40 | kScanToolModeRequestCurrentPowertrainDiagnosticData)) {
+		
+		NSInteger pidLength	= [FLScanToolResponseParser dataLengthForService01PID:data[1]];
+		
+		if(pidLength > 0 && (2 + pidLength) < length) {
+			
+			// Responses are added as they are split, and taken back out
+			// if the reply turns out not to split cleanly
+			NSUInteger firstIndex			= [responseArray count];
+			NSUInteger firstRecord			= _recordCount;
+			uint8_t pidFrame[2 + ELM_MAX_PID_DATA_LENGTH];
+			NSInteger dataIndex				= 1;
+			
+			pidFrame[0]						= data[0];
+			
+			while(dataIndex < length) {
+				pidLength	= [FLScanToolResponseParser dataLengthForService01PID:data[dataIndex]];
+				
+				if(pidLength <= 0 || 
+				   pidLength > ELM_MAX_PID_DATA_LENGTH || 
+				   (dataIndex + 1 + pidLength) > length) {
+					break;
+				}
+				
+				memcpy(&pidFrame[1], &data[dataIndex], (1 + pidLength));
+				[self addResponseData:pidFrame 
+							 ofLength:(2 + pidLength) 
+						  forProtocol:protocol 
+							  toArray:responseArray];
+				
+				dataIndex	+= 1 + pidLength;
+			}
+			
+			if(dataIndex == length) {
+				return;
+			}
+			
+			[responseArray removeObjectsInRange:NSMakeRange(firstIndex, ([responseArray count] - firstIndex))];
+			_recordCount					= firstRecord;
+			
+			FLERROR(@"Unable to split multi-PID response at offset %d of %d", dataIndex, length)
+		}
+	}
+	
+	[self addResponseData:data ofLength:length forProtocol:protocol toArray:responseArray];
+}
+
+
+- (void) addResponsesForData:(uint8_t*)data 
+					ofLength:(NSInteger)length 
+					   canID:(uint32_t)canID 
+				 forProtocol:(FLScanToolProtocol)protocol 
+					 toArray:(NSMutableArray*)responseArray {
+	
+	NSUInteger firstIndex	= [responseArray count];
+	NSUInteger firstRecord	= _recordCount;
+	uint8_t priority;
+	uint8_t targetAddress	= 0;
+	uint32_t ecuAddress;
+	
+	if(canID > 0x7FF) {
+		// 29-bit: priority, format (0xDA physical / 0xDB functional),
+		// target address, source address
+		priority			= (canID >> 24) & 0xFF;
+		targetAddress		= (canID >> 8) & 0xFF;
+		ecuAddress			= canID & 0xFF;
+	}
+	else {
+		// 11-bit: there is no target address, and the ID itself
+		// (e.g. 0x7E8) identifies the ECU
+		priority			= (canID >> 8) & 0x07;
+		ecuAddress			= canID;
+	}
+	
+	[self addResponsesForData:data ofLength:length forProtocol:protocol toArray:responseArray];
+	
+	for(NSUInteger i = firstIndex; i < [responseArray count]; i++) {
+		FLScanToolResponse* resp	= [responseArray objectAtIndex:i];
+		
+		resp.priority				= priority;
+		resp.targetAddress			= targetAddress;
+		resp.ecuAddress				= ecuAddress;
+	}
+	
+	for(NSUInteger i = firstRecord; i < _recordCount; i++) {
+		_records[i].priority		= priority;
+		_records[i].targetAddress	= targetAddress;
+		_records[i].ecuAddress		= ecuAddress;
+	}
+}
+
+
+- (void) addResponsesForHeaderLine:(const uint8_t*)line 
+							length:(NSUInteger)length 
+						  messages:(ELMCANMessage*)messages 
+					   forProtocol:(FLScanToolProtocol)protocol 
+						   toArray:(NSMutableArray*)responseArray {
+	
+	// 4 header bytes plus the 8 byte CAN frame
+	uint8_t frame[12];
+	uint8_t* frameBytes;
+	NSUInteger frameLength;
+	uint32_t canID;
+	
+	if(ELM_CAN_11BIT_HEADER(line, length)) {
+		canID			= (HEX_DIGIT(line[0]) - 1) << 8 | 
+						  (HEX_DIGIT(line[1]) - 1) << 4 | 
+						  (HEX_DIGIT(line[2]) - 1);
+		frameLength		= decodeHexLine(&line[4], (length - 4), frame, sizeof(frame));
+		frameBytes		= frame;
+	}
+	else {
+		frameLength		= decodeHexLine(line, length, frame, sizeof(frame));
+		
+		if(frameLength < 5) {
+			FLERROR(@"Skipping CAN line without a 29-bit header (%d bytes)", frameLength)
+			return;
+		}
+		
+		canID			= frame[0] << 24 | frame[1] << 16 | frame[2] << 8 | frame[3];
+		frameBytes		= &frame[4];
+		frameLength		-= 4;
+	}
+	
+	if(frameLength < 2) {
+		return;
+	}
+	
+	// The first byte of each frame is the ISO 15765-2 protocol control
+	// information, whose high nibble gives the frame type
+	NSUInteger dataLength	= 0;
+	ELMCANMessage* message	= NULL;
+	
+	switch(frameBytes[0] & 0xF0) {
+		case 0x00:
+			// Single frame, low nibble is the payload length
+			dataLength		= MIN((frameBytes[0] & 0x0F), (frameLength - 1));
+			[self addResponsesForData:&frameBytes[1] 
+							 ofLength:dataLength 
+								canID:canID 
+						  forProtocol:protocol 
+							  toArray:responseArray];
+			break;
+			
+		case 0x10:
+			// First frame, 12-bit payload length across the PCI bytes.
+			// Reuse this ECU's slot, or else take the first idle one.
+			for(NSUInteger i = 0; i < ELM_MAX_CAN_MESSAGES; i++) {
+				if(messages[i].expectedLength > 0 && messages[i].canID == canID) {
+					message	= &messages[i];
+					break;
+				}
+				else if(!message && messages[i].expectedLength == 0) {
+					message	= &messages[i];
+				}
+			}
+			
+			if(!message) {
+				FLERROR(@"Dropping multi-frame response from %X, too many ECUs", canID)
+				break;
+			}
+			
+			message->canID			= canID;
+			message->expectedLength	= MIN((((frameBytes[0] & 0x0F) << 8) | frameBytes[1]), sizeof(message->data));
+			message->length			= MIN((frameLength - 2), message->expectedLength);
+			memcpy(message->data, &frameBytes[2], message->length);
+			break;
+			
+		case 0x20:
+			// Consecutive frame
+			for(NSUInteger i = 0; i < ELM_MAX_CAN_MESSAGES; i++) {
+				if(messages[i].expectedLength > 0 && messages[i].canID == canID) {
+					message	= &messages[i];
+					break;
+				}
+			}
+			
+			if(!message) {
+				FLERROR(@"Dropping consecutive frame from %X without a first frame", canID)
+				break;
+			}
+			
+			dataLength				= MIN((frameLength - 1), (message->expectedLength - message->length));
+			memcpy(&message->data[message->length], &frameBytes[1], dataLength);
+			message->length			+= dataLength;
+			
+			if(message->length >= message->expectedLength) {
+				[self addResponsesForData:message->data 
+								 ofLength:message->length 
+									canID:canID 
+							  forProtocol:protocol 
+								  toArray:responseArray];
+				message->expectedLength	= 0;
+			}
+			break;
+			
+		default:
+			// Flow control frames carry no data
+			break;
+	}
+}
+
+
 - (NSArray*) parseResponse:(FLScanToolProtocol)protocol {
 	
-	NSMutableArray* responseArray		= nil;
+	NSMutableArray* responseArray	= [[NSMutableArray alloc] initWithCapacity:1];
 	
-	/*
-	 TODO:
-	 
-	 41 00 BF 9F F9 91 41 00 90 18 80 00
-	 
-	 Deal with cases where the ELM327 does not properly insert a CR in between
-	 a multi-ECU response packet (real-world example above - Mode $01 PID $00).
-	 
-	 Need to split on modulo 6 boundary and check to ensure total packet length
-	 is a multiple of 6.  If not, we'll have to discard.
-	 
-	 */
+	// Decoded responses are never longer than the ASCII they came from
+	_responseBuffer					= [[FLResponseBuffer alloc] initWithCapacity:_length];
+	
+	BOOL parsed						= [self parseLinesForProtocol:protocol toArray:responseArray];
 	
+	// The responses keep the buffer for as long as they need it
+	[_responseBuffer release];
+	_responseBuffer					= nil;
+	
+	if(!parsed || [responseArray count] == 0) {
+		// Either an error, or only partial multi-frame responses were received
+		[responseArray release];
+		responseArray				= nil;
+	}
+	
+	return (NSArray*)[responseArray autorelease];
+}
+
+
+- (BOOL) parseRecords:(FLScanToolProtocol)protocol {
+	
+	[self resetRecords];
+	
+	_parsingRecords		= YES;
+	[self parseLinesForProtocol:protocol toArray:nil];
+	_parsingRecords		= NO;
+	
+	return !_recordOverflow;
+}
+
+
+- (BOOL) parseLinesForProtocol:(FLScanToolProtocol)protocol toArray:(NSMutableArray*)responseArray {
+	
+	if(!_bytes || _length <= 0) {
+		return NO;
+	}
 	
 	// Chop off the trailing space, if it's there
 	if(_bytes[_length-1] == 0x20) {
@@ -99,49 +495,120 @@ NSString *const kNoData							= @"NO DATA";
 	if(!ELM_ERROR(asciistr) && ELM_DATA_RESPONSE(asciistr)) {
 		
 		// There may be more than one response, if multiple ECUs responded to
-		// a particular query, so split on the '\r' boundary
-		NSArray* responseComponents		= [[self stringForResponse] componentsSeparatedByString:@"\r"];
+		// a particular query, so walk the buffer line by line on the '\r'
+		// boundary.  Lines are decoded in place; nothing is copied out of
+		// the read buffer other than the decoded bytes.
+		uint8_t* lineStart				= _bytes;
+		uint8_t* bufferEnd				= _bytes + _length;
 		
-		for(NSString* resp in responseComponents) {
-			
-			CLEAR_DECODE_BUF()
+		// Expected length of a multi-frame CAN response, or 0 if we are not
+		// currently assembling one
+		NSUInteger multiFrameLength		= 0;
+		
+		// With headers on, multi-frame responses are assembled per ECU
+		BOOL canHeaders					= (_headersEnabled && IS_CAN_PROTOCOL(protocol));
+		ELMCANMessage messages[ELM_MAX_CAN_MESSAGES];
+		
+		if(canHeaders) {
+			for(NSUInteger i = 0; i < ELM_MAX_CAN_MESSAGES; i++) {
+				messages[i].expectedLength	= 0;
+			}
+		}
+		
+		CLEAR_DECODE_BUF()
+		
+		while(lineStart < bufferEnd) {
 			
-			char* respCString		= (char*)[resp cStringUsingEncoding:NSASCIIStringEncoding];
-			NSUInteger respLen		= [resp lengthOfBytesUsingEncoding:NSASCIIStringEncoding];
+			uint8_t* lineEnd		= (uint8_t*)memchr(lineStart, '\r', (bufferEnd - lineStart));
+			if(!lineEnd) {
+				lineEnd				= bufferEnd;
+			}
 			
-			// You'd be surprised
-			respCString[respLen]	= 0x00;
+			char* line				= (char*)lineStart;
+			NSUInteger lineLength	= (lineEnd - lineStart);
+			lineStart				= lineEnd + 1;
 			
 			// Again, trim any trailing spaces
-			if (respCString[respLen-1] == 0x20) {
-				respCString[respLen-1]  = 0x00;
+			while(lineLength > 0 && line[lineLength-1] == 0x20) {
+				lineLength--;
 			}
 			
-			if(ELM_SEARCHING(respCString)) {
+			if(lineLength == 0) {
+				continue;
+			}
+			
+			if(lineLength >= 12 && ELM_SEARCHING(line)) {
 				// A common reply if PID search occuring for the first time
 				// at this drive cycle
 				break;
 			}
 			
-			// For each response data string, decode into an integer array for
+			if(canHeaders) {
+				[self addResponsesForHeaderLine:(const uint8_t*)line 
+										 length:lineLength 
+									   messages:messages 
+									forProtocol:protocol 
+										toArray:responseArray];
+				continue;
+			}
+			
+			if(ELM_CAN_BYTE_COUNT(line, lineLength)) {
+				// Start of a multi-frame response; the numbered frames that
+				// follow are decoded into a single buffer
+				CLEAR_DECODE_BUF()
+				multiFrameLength	= (HEX_DIGIT(line[0]) - 1) << 8 | 
+									  (HEX_DIGIT(line[1]) - 1) << 4 | 
+									  (HEX_DIGIT(line[2]) - 1);
+				continue;
+			}
+			
+			if(ELM_CAN_FRAME_INDEX(line, lineLength)) {
+				// Skip the frame index, e.g. "0:"
+				line				+= 2;
+				lineLength			-= 2;
+			}
+			else {
+				CLEAR_DECODE_BUF()
+				multiFrameLength	= 0;
+			}
+			
+			// For each response data string, decode into a byte array for
 			// easier processing
-			while(*respCString != '\0' && _decodeBufLength < sizeof(_decodeBuf)) {				
-				_decodeBuf[_decodeBufLength++] = (uint8_t)strtoul(respCString, (char**)&respCString, 16);				
-				FLDEBUG(@"_decodeBuf[%d]: %02x", _decodeBufLength, _decodeBuf[_decodeBufLength-1])
+			_decodeBufLength += decodeHexLine((const uint8_t*)line, 
+											  lineLength, 
+											  &_decodeBuf[_decodeBufLength], 
+											  (sizeof(_decodeBuf) - _decodeBufLength));
+			
+			if(_decodeBufLength == 0) {
+				FLERROR(@"Skipping non-data line in response: %s", asciistr)
+				continue;
 			}
 			
-			if(!responseArray) {
-				responseArray = [[NSMutableArray alloc] initWithCapacity:1];
+			if(multiFrameLength > 0) {
+				if(_decodeBufLength < multiFrameLength) {
+					// Wait for the remaining frames
+					continue;
+				}
+				
+				// The final frame is padded out to 8 bytes on the bus
+				_decodeBufLength	= multiFrameLength;
+				multiFrameLength	= 0;
 			}
 			
-			[responseArray addObject:[self decodeResponseData:_decodeBuf ofLength:_decodeBufLength forProtocol:protocol]];
+			[self addResponsesForData:_decodeBuf 
+							 ofLength:_decodeBufLength 
+						  forProtocol:protocol 
+							  toArray:responseArray];
+			
+			CLEAR_DECODE_BUF()
 		}	
 	}
 	else {
 		FLERROR(@"Error in parse string or non-data response: %s", asciistr)
+		return NO;
 	}
 	
-	return (NSArray*)[responseArray autorelease];
+	return YES;
 }
 
 @end
@@ -20,12 +20,16 @@
 
 #import <Foundation/Foundation.h>
 #import "FLEAScanTool.h"
+#import "FLRingBuffer.h"
 
 extern NSString* const kGoLinkProtocolString;
 extern NSString* const kGoLinkScanToolName;
 
+// Initial read buffer size; the buffer grows to fit longer frame runs
 #define GOLINK_READBUF_SIZE		128
-#define CLEAR_GOLINK()			memset(_readBuf, 0x00, sizeof(_readBuf)); _readBufLength = 0;
+
+// The GoLink uses RPM as a heartbeat, so RPM need not be polled as often
+#define GOLINK_RPM_POLL_RATE	1.0
 
 /*
  These are the protocol numbers for the GoLink: 
@@ -177,10 +181,8 @@ typedef struct golink_data_frame_t {
 
 @interface GoLink : FLEAScanTool {
 	GoLinkInitState		_initState;
-	uint8_t				_readBuf[GOLINK_READBUF_SIZE];
-	NSUInteger			_readBufLength;	
+	FLRingBuffer*		_readBuffer;
 	BOOL				_bufferOverrun;
-	BOOL				_sendRPM;
 }
 
 @end
@@ -22,6 +22,7 @@
 #import "GoLinkCommand.h"
 #import "GoLinkResponseParser.h"
 #import "FLEAController.h"
+#import "FLResponseBuffer.h"
 #import "FLLogging.h"
 
 NSString* const kGoLinkProtocolString	= @"com.goPoint.p1";
@@ -46,11 +47,18 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 	if (self = [super init]) {
 		_protocolString		= [kGoLinkProtocolString copy];
 		_deviceType			= kScanToolDeviceTypeGoLink;
+		_readBuffer			= [[FLRingBuffer alloc] initWithCapacity:GOLINK_READBUF_SIZE];
+		[self setPollRate:GOLINK_RPM_POLL_RATE forPID:0x0C];
 	}
 	
 	return self;
 }
 
+- (void) dealloc {
+	[_readBuffer release];
+	[super dealloc];
+}
+
 - (NSString*) scanToolName {
 	return @"GoLink";
 }
@@ -89,7 +97,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 	_initState			= GOLINK_INIT_STATE_PROTOCOL;
 	_currentPIDGroup	= 0x00;
 	
-	CLEAR_GOLINK();
+	[_readBuffer reset];
 	
 	[self sendCommand:[GoLinkCommand commandForReadProtocol] initCommand:YES];
 }
@@ -97,6 +105,24 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 #pragma mark -
 #pragma mark Data Handlers
 
+// Returns the length of the run of complete frames at the start of data
+static inline NSUInteger completeFrameLength(const uint8_t* data, NSUInteger length) {
+	
+	NSUInteger offset		= 0;
+	
+	while ((length - offset) >= sizeof(GoLinkFrameHeader)) {
+		NSUInteger frameLength	= sizeof(GoLinkFrameHeader) + ((GoLinkFrameHeader*)&data[offset])->length;
+		
+		if (frameLength > (length - offset)) {
+			break;
+		}
+		
+		offset				+= frameLength;
+	}
+	
+	return offset;
+}
+
 - (NSArray*) framesForData:(uint8_t*)data length:(NSUInteger)length {
 	FLTRACE_ENTRY
 	NSMutableArray *rawFrames		= [NSMutableArray array];
@@ -106,8 +132,15 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 		return rawFrames;
 	}
 	
+	FLResponseBuffer* buffer		= [FLResponseBuffer bufferWithCapacity:length];
+	const uint8_t* frameBytes		= [buffer appendBytes:data length:length];
+	
+	if (!frameBytes) {
+		return rawFrames;
+	}
+	
 	NSInteger bytesRemaining		= length;
-	GoLinkFrameHeader* frameHeader  = (GoLinkFrameHeader*)data;
+	GoLinkFrameHeader* frameHeader  = (GoLinkFrameHeader*)frameBytes;
 	
 	do {		
 		FLDEBUG(@"bytesRemaining = %d ** dataFrameAddr = %p", bytesRemaining, frameHeader)
@@ -117,7 +150,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 			break;
 		}
 		
-		NSData *frame				= [NSData dataWithBytes:data length:sizeof(GoLinkFrameHeader) + frameHeader->length];
+		NSData *frame				= [buffer sliceWithBytes:(const uint8_t*)frameHeader length:sizeof(GoLinkFrameHeader) + frameHeader->length];
 		[rawFrames addObject:frame];
 		
 		bytesRemaining				-= sizeof(GoLinkFrameHeader) + frameHeader->length;
@@ -133,19 +166,9 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 - (void) handleReadData {
 	FLTRACE_ENTRY
 	
-	while ([[_session inputStream] hasBytesAvailable] && 
-		   _readBufLength < GOLINK_READBUF_SIZE) {
-		// TODO: add timeout for this loop		
-		_readBufLength += [[_session inputStream] read:&_readBuf[_readBufLength] 
-											 maxLength:(GOLINK_READBUF_SIZE - _readBufLength)];
-		
-		FLDEBUG(@"Read %d bytes from EASession inputStream", _readBufLength)		
-		
-		if (_readBufLength >= GOLINK_READBUF_SIZE) {
-			FLERROR(@"Error, overflow into _readBuf ** _readBufLength=%d", _readBufLength)
-			_readBufLength = 0;
-			break;
-		}
+	if ([_readBuffer readFromStream:[self inputStream] capture:_capture] < 0) {
+		[_readBuffer reset];
+		return;
 	}
 
 /*** This was here to debug the problem with multiple pid search responses in a single data frame.
@@ -154,8 +177,6 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 	
 	cnt++;
 	if (cnt==2) {
-		_readBufLength = 27;
-		
 		uint8_t _tmpBuf[27] = {
 			0x00, 0xeb, 0x06, 0x41, 
 			0x00, 0x80, 0x40, 0x00, 
@@ -166,36 +187,41 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 			0x00, 0x00, 0x01
 		};
 		
-		memcpy(_readBuf, _tmpBuf, _readBufLength);
+		[_readBuffer reset];
+		[_readBuffer appendBytes:_tmpBuf length:27];
 	}
 ***/
 	
-	FLDEBUG(@"_readBufLength = %d  ** _readBuf[] = %@", _readBufLength, [[NSData dataWithBytes:_readBuf length:_readBufLength] description])
-	FLDEBUG(@"Frame Type = 0x%04X", GOLINK_FRAME_TYPE(_readBuf))
+	// Only whole frames are handed off.  A trailing partial frame stays in
+	// the buffer until the rest of it arrives on a later read.
+	uint8_t* readBuf			= [_readBuffer contiguousBytes];
+	NSUInteger readBufLength	= completeFrameLength(readBuf, [_readBuffer length]);
 	
-	GoLinkFrameHeader* header = (GoLinkFrameHeader*)_readBuf;
-	FLDEBUG(@"header->length = %d", header->length)
+	FLDEBUG(@"readBufLength = %d  ** readBuf[] = %@", readBufLength, [[NSData dataWithBytes:readBuf length:[_readBuffer length]] description])
 	
-	if (GOLINK_FRAME_COMPLETE(_readBuf, _readBufLength)) {
+	if (readBufLength > 0) {
+		[self stopDeadline];
+		
+		FLDEBUG(@"Frame Type = 0x%04X", GOLINK_FRAME_TYPE(readBuf))
 		FLINFO(@"GOLINK_FRAME_COMPLETE")
 		_state = (STATE_INIT()) ? STATE_INIT : STATE_PROCESSING;
 		
-		switch (GOLINK_FRAME_TYPE(_readBuf)) {
+		switch (GOLINK_FRAME_TYPE(readBuf)) {
 			case kGLFrameTypeError:
 				FLERROR(@"ERROR FRAME", nil)
-				GoLinkErrorFrame* errorFrame	= (GoLinkErrorFrame*)_readBuf;
+				GoLinkErrorFrame* errorFrame	= (GoLinkErrorFrame*)readBuf;
 				[self processErrorFrame:errorFrame];		
 				break;
 				
 			case kGLFrameTypeData: 
 				FLINFO(@"DATA FRAME")
-				[self processDataFrame:_readBuf length:_readBufLength];
+				[self processDataFrame:readBuf length:readBufLength];
 				
 				break;
 				
 			case kGLFrameTypeSystem: 
 				FLINFO(@"SYSTEM FRAME")
-				[self processSystemFrame:(GoLinkSystemFrame*)_readBuf];				
+				[self processSystemFrame:(GoLinkSystemFrame*)readBuf];				
 				break;
 				
 			default:
@@ -203,7 +229,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 				break;
 		}
 		
-		CLEAR_GOLINK()
+		[_readBuffer consumeBytes:readBufLength];
 		
 		if(_initState == GOLINK_INIT_STATE_COMPLETE && STATE_INIT()) {
 			FLDEBUG(@"*** Init Complete ***", nil)
@@ -217,7 +243,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 			[self sendCommand:[self commandForInitState:_initState] initCommand:YES];
 		}
 		else {
-			if (!_streamOperation.isCancelled) {
+			if (!_scanCancelled) {
 				FLINFO(@"*** STATE_IDLE ***")
 				_state = STATE_IDLE;
 				[self sendNextCommand];
@@ -225,13 +251,16 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 		}		
 	}
 	else {
-		FLERROR(@"Incomplete Frame", nil)
-		CLEAR_GOLINK()
-		_state = (STATE_INIT()) ? STATE_INIT : STATE_IDLE;		
+		FLINFO(@"Incomplete Frame")
 	}
 }
 
 
+- (void) discardPendingResponse {
+	[_readBuffer reset];
+}
+
+
 - (void) commandForDTCCount {
 	if(!_priorityCommandQueue) {
 		_priorityCommandQueue = [NSMutableArray arrayWithCapacity:8];
@@ -247,12 +276,6 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 - (void) sendNextCommand {
 	FLScanToolCommand* cmd = [self dequeueCommand];	
 	if(cmd) {
-		if (cmd.pid == 0x0C) {
-			// We do not need to query RPM as often, since the GoLink
-			// uses RPM as a heartbeat
-			cmd			= (_sendRPM) ? cmd : [self dequeueCommand];
-			_sendRPM	= !_sendRPM; 
-		}
 		[self sendCommand:cmd initCommand:NO];
 	}	
 }
@@ -314,6 +337,19 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 	
 	//GoLinkDataFrame* frame			= (GoLinkDataFrame*)data;
 	GoLinkResponseParser* parser	= [[GoLinkResponseParser alloc] initWithBytes:data length:length];
+	
+	// While scanning, frames are delivered as records; the PID search
+	// still works from response objects
+	if(!(STATE_INIT() && _initState == GOLINK_INIT_STATE_PID_SEARCH) && [parser parseRecords:_protocol]) {
+		if(parser.recordCount > 0) {
+			FLDEBUG(@"Received %d records", parser.recordCount)
+			[self dispatchRecords:parser.records count:parser.recordCount];
+		}
+		
+		[parser release];
+		return;
+	}
+	
 	NSArray* responses				= [parser parseResponse:_protocol];
 	
 	@try {
@@ -338,6 +374,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 				
 				BOOL morePIDs = NO;
 				BOOL goodPIDsFound = NO;
+				NSUInteger ecuIndex = 0;
 				for (FLScanToolResponse* resp in responses) {
 					FLDEBUG(@"resp.rawData: %@", resp.rawData)
 					
@@ -347,12 +384,14 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 					uint8_t pid = frame->data[0];
 					
 					FLDEBUG(@"pid: %d", pid)
-					if (pid != 0x00 && pid != 0x20 && pid != 0x40) {
+					if (NOT_SEARCH_PID(pid)) {
 						FLERROR(@"Received erroneous PID during init search ($%02X)", pid)
 						continue;
 					}
 					
-					BOOL tmpMorePIDs = [self buildSupportedSensorList:resp.data forPidGroup:_currentPIDGroup];
+					BOOL tmpMorePIDs = [self buildSupportedSensorList:resp.data 
+														  forPidGroup:_currentPIDGroup 
+															 ecuIndex:ecuIndex++];
 					if (!morePIDs && tmpMorePIDs) {
 						morePIDs = YES;
 					}
@@ -368,7 +407,7 @@ NSString* const kGoLinkScanToolName		= @"GoLink";
 				if (extendPIDSearch) {
 					_currentPIDGroup		+= (extendPIDSearch) ? 0x20 : 0x00;
 					
-					if (_currentPIDGroup > 0x40) {
+					if (_currentPIDGroup > MAX_PID_GROUP) {
 						_initState			<<= 1;
 						_currentPIDGroup	= 0x00;
 					}
@@ -20,6 +20,7 @@
 
 
 #import "GoLinkResponseParser.h"
+#import "FLResponseBuffer.h"
 #import "FLLogging.h"
 
 @implementation GoLinkResponseParser
@@ -65,9 +66,19 @@
 		return nil;
 	}
 	
+	// The frames are copied out of the read buffer once, and each
+	// response's rawData and data are slices of that copy
+	FLResponseBuffer* buffer		= [[FLResponseBuffer alloc] initWithCapacity:_length];
+	const uint8_t* frameBytes		= [buffer appendBytes:_bytes length:_length];
+	
+	if (!frameBytes) {
+		[buffer release];
+		return nil;
+	}
+	
 	NSMutableArray* responseArray	= [[NSMutableArray alloc] initWithCapacity:1];
 	NSInteger bytesRemaining		= _length;
-	GoLinkDataFrame* dataFrame		= (GoLinkDataFrame*)_bytes;	
+	GoLinkDataFrame* dataFrame		= (GoLinkDataFrame*)frameBytes;	
 	
 	do {		
 		FLDEBUG(@"bytesRemaining = %d ** dataFrameAddr = %p", bytesRemaining, dataFrame)
@@ -81,18 +92,18 @@
 		FLScanToolResponse* resp	= [[FLScanToolResponse alloc] init];
 		resp.scanToolName			= kGoLinkScanToolName;
 		resp.protocol				= protocol;		
-		resp.rawData				= [NSData dataWithBytes:dataFrame length:sizeof(GoLinkFrameHeader) + dataFrame->header.length];
+		resp.rawData				= [buffer sliceWithBytes:(const uint8_t*)dataFrame length:sizeof(GoLinkFrameHeader) + dataFrame->header.length];
 		resp.mode					= dataFrame->mode;
 		
 		if(resp.mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
 			resp.pid				= dataFrame->data[0];
 			
 			if(dataFrame->header.length > 2) {
-				resp.data			= [NSData dataWithBytes:&dataFrame->data[1] length:(dataFrame->header.length - 2)];
+				resp.data			= [buffer sliceWithBytes:&dataFrame->data[1] length:(dataFrame->header.length - 2)];
 			}
 		}
 		else if(resp.mode == kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes) {
-			resp.data				= [NSData dataWithBytes:dataFrame->data length:(dataFrame->header.length - 1)];
+			resp.data				= [buffer sliceWithBytes:dataFrame->data length:(dataFrame->header.length - 1)];
 		}
 				
 		[responseArray addObject:resp];
@@ -104,8 +115,68 @@
 		
 	} while(bytesRemaining > 0);
 	
+	[buffer release];
+	
 	return [responseArray autorelease];
 }
 
 
+- (BOOL) parseRecords:(FLScanToolProtocol)protocol {
+	
+	[self resetRecords];
+	
+	if (_length <= sizeof(GoLinkFrameHeader)) {
+		FLERROR(@"Incomplete frame, size = %d", _length)
+		return YES;
+	}
+	
+	NSInteger bytesRemaining		= _length;
+	GoLinkDataFrame* dataFrame		= (GoLinkDataFrame*)_bytes;	
+	
+	do {
+		NSUInteger frameLength		= sizeof(GoLinkFrameHeader) + dataFrame->header.length;
+		
+		if (frameLength > bytesRemaining) {
+			FLERROR(@"Dropping incomplete frame. Expecting %d, bytesRemaining %d", frameLength, bytesRemaining)
+			break;
+		}
+		
+		// Records hold the whole frame, as rawData does, with the data
+		// offset chosen the same way as in parseResponse:
+		uint8_t mode				= (dataFrame->mode ^ 0x40);
+		NSUInteger dataOffset		= frameLength;
+		
+		if(mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
+			if(dataFrame->header.length > 2) {
+				dataOffset			= offsetof(GoLinkDataFrame, data) + 1;
+			}
+		}
+		else if(mode == kScanToolModeRequestEmissionRelatedDiagnosticTroubleCodes) {
+			dataOffset				= offsetof(GoLinkDataFrame, data);
+		}
+		
+		FLScanToolRecord* record	= [self addRecordForBytes:(const uint8_t*)dataFrame 
+												  length:frameLength 
+											  dataOffset:dataOffset 
+												protocol:protocol];
+		
+		if(!record) {
+			return NO;
+		}
+		
+		record->mode				= mode;
+		
+		if(mode == kScanToolModeRequestCurrentPowertrainDiagnosticData) {
+			record->pid				= dataFrame->data[0];
+		}
+		
+		bytesRemaining				-= frameLength;
+		dataFrame					= (GoLinkDataFrame*)((uint8_t*)dataFrame + frameLength);
+		
+	} while(bytesRemaining > 0);
+	
+	return YES;
+}
+
+
 @end
@@ -0,0 +1,162 @@
+/*
+ *  Base64ExtensionsTests.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <SenTestingKit/SenTestingKit.h>
+#import "Base64Extensions.h"
+#import "FLScanToolResponse.h"
+
+
+// Payloads of every length up to this are round tripped
+#define BASE64_TEST_MAX_LENGTH			100
+
+// Characters per line in the line broken encodings tested, 0 being none
+static const int g_lineLengths[] = { 0, 4, 16, 64, 76 };
+
+#define NUM_LINE_LENGTHS				(sizeof(g_lineLengths) / sizeof(g_lineLengths[0]))
+
+// Payload sizes timed, each encoded and decoded about 64MB worth
+static const size_t g_benchmarkLengths[] = { 8, 64, 4096, 1048576 };
+
+#define NUM_BENCHMARK_LENGTHS			(sizeof(g_benchmarkLengths) / sizeof(g_benchmarkLengths[0]))
+#define BASE64_BENCHMARK_BYTES			(64 * 1048576)
+
+
+/*
+ Checks the vector paths of FLBase64Encode and FLBase64Decode, which are
+ compiled in for SSSE3 and AVX2 targets such as the simulator, against
+ the table-driven loop.  On other targets both sides run the loop.
+ */
+@interface Base64ExtensionsTests : SenTestCase {
+}
+@end
+
+
+@implementation Base64ExtensionsTests
+
+- (NSData*) payloadWithLength:(NSUInteger)length {
+	NSMutableData* data	= [NSMutableData dataWithLength:length];
+	uint8_t* bytes		= (uint8_t*)[data mutableBytes];
+	
+	for(NSUInteger i = 0; i < length; i++) {
+		bytes[i]		= (uint8_t)random();
+	}
+	
+	return data;
+}
+
+
+- (void) testRoundTripMatchesScalar {
+	srandom(20110207);
+	
+	for(NSUInteger length = 0; length <= BASE64_TEST_MAX_LENGTH; length++) {
+		NSData* payload			= [self payloadWithLength:length];
+		char scalar[FL_BASE64_ENCODED_LENGTH(BASE64_TEST_MAX_LENGTH)];
+		char vector[FL_BASE64_ENCODED_LENGTH(BASE64_TEST_MAX_LENGTH)];
+		size_t scalarLength		= FLBase64EncodeScalar([payload bytes], length, scalar);
+		size_t vectorLength		= FLBase64Encode([payload bytes], length, vector);
+		
+		STAssertEquals(vectorLength, (size_t)FL_BASE64_ENCODED_LENGTH(length), @"Length %u encoded length", length);
+		STAssertEquals(vectorLength, scalarLength, @"Length %u encoded length differs from scalar", length);
+		STAssertTrue(memcmp(vector, scalar, scalarLength) == 0, @"Length %u encoding differs from scalar", length);
+		
+		for(NSUInteger l = 0; l < NUM_LINE_LENGTHS; l++) {
+			NSString* string	= [NSString base64StringFromData:payload length:g_lineLengths[l]];
+			const char* chars	= [string UTF8String];
+			size_t charCount	= strlen(chars);
+			size_t unbroken		= 0;
+			
+			// Without its line breaks, the string is the scalar encoding
+			for(size_t c = 0; c < charCount; c++) {
+				if(chars[c] != '\n') {
+					STAssertTrue(unbroken < scalarLength && chars[c] == scalar[unbroken], 
+								 @"Length %u line length %d character %u", length, g_lineLengths[l], c);
+					unbroken++;
+				}
+			}
+			
+			STAssertEquals(unbroken, scalarLength, @"Length %u line length %d", length, g_lineLengths[l]);
+			
+			uint8_t scalarDecoded[FL_BASE64_DECODED_LENGTH(2 * FL_BASE64_ENCODED_LENGTH(BASE64_TEST_MAX_LENGTH))];
+			uint8_t vectorDecoded[FL_BASE64_DECODED_LENGTH(2 * FL_BASE64_ENCODED_LENGTH(BASE64_TEST_MAX_LENGTH))];
+			size_t scalarDecodedLength	= FLBase64DecodeScalar(chars, charCount, scalarDecoded);
+			size_t vectorDecodedLength	= FLBase64Decode(chars, charCount, vectorDecoded);
+			
+			STAssertEquals(scalarDecodedLength, (size_t)length, @"Length %u line length %d scalar decoded length", length, g_lineLengths[l]);
+			STAssertEquals(vectorDecodedLength, (size_t)length, @"Length %u line length %d decoded length", length, g_lineLengths[l]);
+			STAssertTrue(memcmp(scalarDecoded, [payload bytes], length) == 0, @"Length %u line length %d scalar round trip", length, g_lineLengths[l]);
+			STAssertTrue(memcmp(vectorDecoded, [payload bytes], length) == 0, @"Length %u line length %d round trip", length, g_lineLengths[l]);
+			STAssertEqualObjects([NSData base64DataFromString:string], payload, @"Length %u line length %d", length, g_lineLengths[l]);
+		}
+	}
+}
+
+
+- (void) testThroughput {
+	srandom(20110207);
+	
+	for(NSUInteger n = 0; n < NUM_BENCHMARK_LENGTHS; n++) {
+		size_t length			= g_benchmarkLengths[n];
+		NSUInteger iterations	= MAX(BASE64_BENCHMARK_BYTES / length, (NSUInteger)1);
+		NSData* payload			= [self payloadWithLength:length];
+		char* encoded			= (char*)malloc(FL_BASE64_ENCODED_LENGTH(length));
+		uint8_t* decoded		= (uint8_t*)malloc(FL_BASE64_DECODED_LENGTH(FL_BASE64_ENCODED_LENGTH(length)));
+		size_t encodedLength	= FLBase64EncodeScalar([payload bytes], length, encoded);
+		double times[4];
+		double start;
+		
+		start					= FLMonotonicTime();
+		for(NSUInteger i = 0; i < iterations; i++) {
+			FLBase64EncodeScalar([payload bytes], length, encoded);
+		}
+		times[0]				= FLMonotonicTime() - start;
+		
+		start					= FLMonotonicTime();
+		for(NSUInteger i = 0; i < iterations; i++) {
+			FLBase64Encode([payload bytes], length, encoded);
+		}
+		times[1]				= FLMonotonicTime() - start;
+		
+		start					= FLMonotonicTime();
+		for(NSUInteger i = 0; i < iterations; i++) {
+			FLBase64DecodeScalar(encoded, encodedLength, decoded);
+		}
+		times[2]				= FLMonotonicTime() - start;
+		
+		start					= FLMonotonicTime();
+		for(NSUInteger i = 0; i < iterations; i++) {
+			FLBase64Decode(encoded, encodedLength, decoded);
+		}
+		times[3]				= FLMonotonicTime() - start;
+		
+		STAssertTrue(memcmp(decoded, [payload bytes], length) == 0, @"Length %u round trip", length);
+		
+		NSLog(@"Base64 %u bytes: encode scalar %.0f ns, vector %.0f ns; decode scalar %.0f ns, vector %.0f ns", 
+			  length, 
+			  (times[0] * 1.0e9) / iterations, 
+			  (times[1] * 1.0e9) / iterations, 
+			  (times[2] * 1.0e9) / iterations, 
+			  (times[3] * 1.0e9) / iterations);
+		
+		free(encoded);
+		free(decoded);
+	}
+}
+
+@end
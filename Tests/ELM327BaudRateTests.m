@@ -0,0 +1,143 @@
+/*
+ *  ELM327BaudRateTests.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#import "FLScanToolTestCase.h"
+#import "FLSerialTransport.h"
+#import "FLSimECU.h"
+#import "ELM327.h"
+
+
+// Responses to wait for once the scan is past init
+#define BAUD_RATE_TEST_RESPONSE_COUNT	10
+
+
+@interface ELM327BaudRateTests : FLScanToolTestCase {
+	FLELM327Emulator*	_emulator;
+	ELM327*				_scanTool;
+	FLSerialTransport*	_transport;
+}
+
+- (void) connectWithMaxBaudRate:(NSUInteger)maxBaudRate;
+- (void) scanUntilInitialized;
+
+@end
+
+
+@implementation ELM327BaudRateTests
+
+- (void) setUp {
+	self.sensorScanTargets = [NSArray arrayWithObjects:
+							  [NSNumber numberWithInt:0x0C],
+							  [NSNumber numberWithInt:0x0D],
+							  nil];
+	
+	_emulator			= [[FLELM327Emulator alloc] init];
+	_emulator.ecus		= [NSArray arrayWithObjects:[FLSimECU engineECU], [FLSimECU transmissionECU], nil];
+	_emulator.protocol	= kISO15765CAN11Bit500;
+}
+
+
+- (void) tearDown {
+	if(_scanTool) {
+		STAssertTrue([self cancelScan:_scanTool], @"Scan did not cancel");
+		_scanTool.delegate	= nil;
+	}
+	
+	[_emulator stop];
+	
+	[_scanTool release];
+	_scanTool			= nil;
+	[_transport release];
+	_transport			= nil;
+	[_emulator release];
+	_emulator			= nil;
+}
+
+
+// The emulator serves the pty's master, and the scan tool opens the slave
+// as a serial port, so it has a rate to negotiate.  A pty runs at any rate.
+- (void) connectWithMaxBaudRate:(NSUInteger)maxBaudRate {
+	NSString* slavePath				= nil;
+	FLScanToolTransport* master		= [FLFileDescriptorTransport ptyTransportWithSlavePath:&slavePath];
+	
+	STAssertNotNil(master, @"Unable to create a pty");
+	STAssertTrue([_emulator startWithTransport:master], @"Emulator did not start on the pty");
+	
+	_transport						= [[FLSerialTransport alloc] initWithPath:slavePath baudRate:SERIAL_TRANSPORT_DEFAULT_BAUD_RATE];
+	_transport.maxBaudRate			= maxBaudRate;
+	
+	_scanTool						= (ELM327*)[[FLScanTool scanToolForDeviceType:kScanToolDeviceTypeELM327] retain];
+	_scanTool.transport				= _transport;
+	_scanTool.useVehicleProfileCache	= NO;
+	_scanTool.delegate				= self;
+	_scanTool.delegateThread		= [NSThread currentThread];
+}
+
+
+- (void) scanUntilInitialized {
+	[self startScan:_scanTool];
+	STAssertTrue([self runUntil:&_initialized timeout:SCAN_TOOL_TEST_TIMEOUT], @"Scan did not initialize");
+	STAssertFalse(_failedToInitialize, @"Scan failed to initialize");
+}
+
+
+// The adapter takes AT BRD and sends its ID at the new rate, which the
+// driver confirms and then stays at
+- (void) testNegotiatesMaxBaudRate {
+	[self connectWithMaxBaudRate:115200];
+	[self scanUntilInitialized];
+	
+	STAssertEquals(_scanTool.negotiatedBaudRate, (NSUInteger)115200, @"Negotiated the wrong rate");
+	STAssertEquals(_transport.baudRate, (NSUInteger)115200, @"Port was left at the wrong rate");
+	STAssertTrue([self runUntilResponseCount:BAUD_RATE_TEST_RESPONSE_COUNT timeout:SCAN_TOOL_TEST_TIMEOUT], 
+				 @"Only %u responses at the new rate", _responseCount);
+}
+
+
+// An adapter without AT BRD answers '?', and init goes on at the old rate
+- (void) testRefusedBaudRateKeepsRate {
+	_emulator.refusesBaudRateChange	= YES;
+	[self connectWithMaxBaudRate:115200];
+	[self scanUntilInitialized];
+	
+	STAssertEquals(_scanTool.negotiatedBaudRate, (NSUInteger)0, @"Negotiated a rate the adapter refused");
+	STAssertEquals(_transport.baudRate, (NSUInteger)SERIAL_TRANSPORT_DEFAULT_BAUD_RATE, @"Port left the default rate");
+	STAssertTrue([self runUntilResponseCount:BAUD_RATE_TEST_RESPONSE_COUNT timeout:SCAN_TOOL_TEST_TIMEOUT], 
+				 @"Only %u responses after the refusal", _responseCount);
+}
+
+
+// The adapter takes AT BRD but its ID never arrives at the new rate.  Each
+// lower rate is tried in turn, then the driver goes back to the old rate,
+// where the adapter must still answer.
+- (void) testTimedOutBaudRateFallsBack {
+	_emulator.failsBaudRateChange	= YES;
+	[self connectWithMaxBaudRate:115200];
+	[self scanUntilInitialized];
+	
+	STAssertEquals(_scanTool.negotiatedBaudRate, (NSUInteger)0, @"Negotiated a rate the adapter never answered at");
+	STAssertEquals(_transport.baudRate, (NSUInteger)SERIAL_TRANSPORT_DEFAULT_BAUD_RATE, @"Port was not put back at the default rate");
+	STAssertTrue([self runUntilResponseCount:BAUD_RATE_TEST_RESPONSE_COUNT timeout:SCAN_TOOL_TEST_TIMEOUT], 
+				 @"Only %u responses after falling back", _responseCount);
+	STAssertEquals(_transport.baudRate, (NSUInteger)SERIAL_TRANSPORT_DEFAULT_BAUD_RATE, @"Port rate changed during the scan");
+}
+
+@end
@@ -0,0 +1,111 @@
+/*
+ *  ELM327InitBenchmark.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolTestCase.h"
+#import "FLScanToolResponse.h"
+#import "FLSimECU.h"
+#import "ELM327.h"
+
+
+// Scans timed with each PID search, the mean being reported
+#define INIT_BENCHMARK_RUNS				3
+
+// Seconds the emulator takes to answer each OBD request, as a vehicle might
+#define INIT_BENCHMARK_RESPONSE_DELAY	0.05
+
+
+/*
+ Times ELM327 init, from startScan to scanToolDidInitialize:, against the
+ emulator with the supported-PID search batched on CAN and with the
+ serial walk it replaced.  The engine ECU is given a PID in group $A0 so
+ that the walk has six support groups to request.
+ */
+@interface ELM327InitBenchmark : FLScanToolTestCase {
+	FLELM327Emulator*	_emulator;
+	NSUInteger			_initRequestCount;		// Emulator requests up to scanToolDidInitialize:
+}
+@end
+
+
+@implementation ELM327InitBenchmark
+
+- (void)scanToolDidInitialize:(FLScanTool*)scanTool {
+	_initRequestCount = _emulator.requestCount;
+	[super scanToolDidInitialize:scanTool];
+}
+
+
+// Mean seconds to initialize over INIT_BENCHMARK_RUNS scans, and the
+// requests the last scan sent to get there
+- (double) initTimeWithBatchPIDSearch:(BOOL)batchPIDSearch requestCount:(NSUInteger*)requestCount {
+	static const uint8_t odometer[]	= { 0x00, 0x01, 0xE2, 0x40 };
+	double total					= 0;
+	
+	for(NSUInteger run = 0; run < INIT_BENCHMARK_RUNS; run++) {
+		FLSimECU* engine			= [FLSimECU engineECU];
+		
+		[engine setBytes:odometer 
+				  length:sizeof(odometer) 
+				 forMode:kScanToolModeRequestCurrentPowertrainDiagnosticData 
+					 pid:0xA6];
+		
+		_emulator					= [FLELM327Emulator emulator];
+		_emulator.ecus				= [NSArray arrayWithObjects:engine, [FLSimECU transmissionECU], nil];
+		_emulator.protocol			= kISO15765CAN11Bit500;
+		_emulator.responseDelay		= INIT_BENCHMARK_RESPONSE_DELAY;
+		STAssertTrue([_emulator startOnPort:0], @"Emulator did not start");
+		
+		ELM327* scanTool			= (ELM327*)[self scanToolForEmulator:_emulator];
+		scanTool.batchPIDSearch		= batchPIDSearch;
+		scanTool.useVehicleProfileCache	= NO;
+		
+		[self startScan:scanTool];
+		STAssertTrue([self runUntil:&_initialized timeout:SCAN_TOOL_TEST_TIMEOUT], @"Scan did not initialize");
+		STAssertTrue([scanTool isService01PIDSupported:0xA6], @"PID $A6 not found by the search");
+		STAssertTrue([self cancelScan:scanTool], @"Scan did not cancel");
+		scanTool.delegate			= nil;
+		[_emulator stop];
+		_emulator					= nil;
+		
+		total						+= _initializeTime;
+		*requestCount				= _initRequestCount;
+	}
+	
+	return total / INIT_BENCHMARK_RUNS;
+}
+
+
+- (void) testInitTime {
+	NSUInteger batchedRequests;
+	NSUInteger serialRequests;
+	double batched	= [self initTimeWithBatchPIDSearch:YES requestCount:&batchedRequests];
+	double serial	= [self initTimeWithBatchPIDSearch:NO requestCount:&serialRequests];
+	
+	STAssertTrue(batchedRequests < serialRequests, 
+				 @"Batched search sent %u requests, the serial walk %u", batchedRequests, serialRequests);
+	
+	NSLog(@"ELM327 init: serial walk %.3f sec in %u requests, batched %.3f sec in %u requests", 
+		  serial, 
+		  serialRequests, 
+		  batched, 
+		  batchedRequests);
+}
+
+@end
@@ -0,0 +1,186 @@
+/*
+ *  ELM327ResponseParserBenchmark.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolTestCase.h"
+#import "FLScanToolCapture.h"
+#import "FLScanToolResponse.h"
+#import "ELM327ResponseParser.h"
+
+
+// Responses captured from the emulator to parse
+#define PARSER_BENCHMARK_RESPONSE_COUNT		200
+
+// Times each captured response is parsed
+#define PARSER_BENCHMARK_PASSES				500
+
+// Longest response parsed; longer ones are left out
+#define PARSER_BENCHMARK_MAX_LENGTH			1024
+
+
+/*
+ Measures ELM327ResponseParser over the responses from a captured scan of
+ the emulator, cut up at each prompt as ELM327 hands them to its parser.
+ Both the record path the driver takes for sensor replies and the
+ FLScanToolResponse path are measured, and reported in bytes and
+ responses per second.
+ */
+@interface ELM327ResponseParserBenchmark : FLScanToolTestCase {
+	NSMutableArray*		_responses;			// NSData of each response, without the prompt
+	NSMutableArray*		_headersEnabled;	// NSNumber of AT H1 being set for each
+}
+@end
+
+
+@implementation ELM327ResponseParserBenchmark
+
+- (void) setUp {
+	self.sensorScanTargets	= [NSArray arrayWithObjects:
+							   [NSNumber numberWithInt:0x0C],
+							   [NSNumber numberWithInt:0x0D],
+							   [NSNumber numberWithInt:0x05],
+							   [NSNumber numberWithInt:0x10],
+							   [NSNumber numberWithInt:0x11],
+							   nil];
+	
+	_responses				= [[NSMutableArray alloc] init];
+	_headersEnabled			= [[NSMutableArray alloc] init];
+	
+	NSString* path			= [self captureScanWithResponseCount:PARSER_BENCHMARK_RESPONSE_COUNT];
+	NSData* capture			= [NSData dataWithContentsOfFile:path];
+	NSMutableData* pending	= [NSMutableData data];
+	BOOL headersOn			= NO;
+	
+	STAssertTrue([capture length] >= sizeof(FLScanToolCaptureHeader), @"No capture at %@", path);
+	
+	const uint8_t* bytes	= (const uint8_t*)[capture bytes];
+	NSUInteger offset		= ((const FLScanToolCaptureHeader*)bytes)->headerLength;
+	
+	while(offset + sizeof(FLScanToolCaptureChunk) <= [capture length]) {
+		const FLScanToolCaptureChunk* chunk	= (const FLScanToolCaptureChunk*)&bytes[offset];
+		const uint8_t* chunkBytes			= &bytes[offset + sizeof(FLScanToolCaptureChunk)];
+		
+		if(offset + SCAN_TOOL_CAPTURE_CHUNK_SIZE(chunk->length) > [capture length]) {
+			break;
+		}
+		
+		if(chunk->direction == kScanToolCaptureWrite) {
+			if(chunk->length >= 4 && !strncasecmp((const char*)chunkBytes, "ATH1", 4)) {
+				headersOn = YES;
+			}
+			else if(chunk->length >= 4 && !strncasecmp((const char*)chunkBytes, "ATH0", 4)) {
+				headersOn = NO;
+			}
+		}
+		else {
+			[pending appendBytes:chunkBytes length:chunk->length];
+			
+			const uint8_t* prompt;
+			while((prompt = memchr([pending bytes], kResponseFinishedCode, [pending length])) != NULL) {
+				const uint8_t* response	= (const uint8_t*)[pending bytes];
+				NSUInteger length		= (NSUInteger)(prompt - response);
+				NSUInteger consumed		= length + 1;
+				
+				while(length > 0 && (response[length-1] == '\r' || response[length-1] == '\n')) {
+					length--;
+				}
+				
+				// Sensor replies; AT replies go to the driver's init code
+				if(length > 0 && length < PARSER_BENCHMARK_MAX_LENGTH && isdigit((int)response[0])) {
+					[_responses addObject:[NSData dataWithBytes:response length:length]];
+					[_headersEnabled addObject:[NSNumber numberWithBool:headersOn]];
+				}
+				
+				[pending replaceBytesInRange:NSMakeRange(0, consumed) withBytes:NULL length:0];
+			}
+		}
+		
+		offset += SCAN_TOOL_CAPTURE_CHUNK_SIZE(chunk->length);
+	}
+	
+	[[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+	STAssertTrue([_responses count] > 0, @"No sensor responses in the capture");
+}
+
+
+- (void) tearDown {
+	[_responses release];
+	_responses		= nil;
+	[_headersEnabled release];
+	_headersEnabled	= nil;
+}
+
+
+- (void) measureParsingRecords:(BOOL)records {
+	uint8_t buffer[PARSER_BENCHMARK_MAX_LENGTH];
+	ELM327ResponseParser* parser	= [[ELM327ResponseParser alloc] initWithBytes:buffer length:0];
+	NSUInteger byteCount			= 0;
+	NSUInteger parsedCount			= 0;
+	double start					= FLMonotonicTime();
+	
+	for(NSUInteger pass = 0; pass < PARSER_BENCHMARK_PASSES; pass++) {
+		NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+		
+		for(NSUInteger i = 0; i < [_responses count]; i++) {
+			NSData* response		= [_responses objectAtIndex:i];
+			NSUInteger length		= [response length];
+			
+			// The driver parses in place from its read buffer, NUL terminated
+			memcpy(buffer, [response bytes], length);
+			buffer[length]			= 0x00;
+			[parser setBytes:buffer length:length];
+			parser.headersEnabled	= [[_headersEnabled objectAtIndex:i] boolValue];
+			
+			if(records && [parser parseRecords:kScanToolProtocolCAN11bit500KB]) {
+				parsedCount			+= parser.recordCount;
+			}
+			else {
+				parsedCount			+= [[parser parseResponse:kScanToolProtocolCAN11bit500KB] count];
+			}
+			
+			byteCount				+= length;
+		}
+		
+		[pool release];
+	}
+	
+	double elapsed					= FLMonotonicTime() - start;
+	[parser release];
+	
+	STAssertTrue(parsedCount > 0, @"Nothing parsed");
+	NSLog(@"ELM327ResponseParser %@: %u bytes, %u responses in %.3f sec: %.0f bytes/sec, %.0f responses/sec",
+		  (records ? @"parseRecords:" : @"parseResponse:"),
+		  byteCount,
+		  parsedCount,
+		  elapsed,
+		  byteCount / elapsed,
+		  parsedCount / elapsed);
+}
+
+
+- (void) testParseRecordsThroughput {
+	[self measureParsingRecords:YES];
+}
+
+
+- (void) testParseResponseThroughput {
+	[self measureParsingRecords:NO];
+}
+
+@end
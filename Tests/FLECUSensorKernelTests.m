@@ -0,0 +1,210 @@
+/*
+ *  FLECUSensorKernelTests.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <SenTestingKit/SenTestingKit.h>
+#import "FLECUSensor.h"
+#import "FLScanToolResponse.h"
+
+
+// Passes over every payload when timing the batch and scalar paths
+#define KERNEL_BENCHMARK_PASSES			50
+
+
+/*
+ A sensor whose measurement is decoded by one of the linear kernels, with
+ the calculation and conversion functions the kernel stands in for, and
+ the payload length the sensor's PID returns.
+ */
+typedef struct kernel_test_t {
+	NSUInteger				pid;
+	NSUInteger				measurement;
+	pfCalculateValueFunc	calcFunction;
+	pfConvertFunc			convertFunction;
+	NSUInteger				length;
+	BOOL					exact;			// Integer division, so no rounding
+} FLKernelTest;
+
+static const FLKernelTest g_kernelTests[] = {
+	{ 0x04,		1,	&calcPercentage,			NULL,				1,	NO },
+	{ 0x05,		1,	&calcTemp,					&convertTemp,		1,	NO },
+	{ 0x06,		1,	&calcFuelTrimPercentage,	NULL,				1,	NO },
+	{ 0x0B,		1,	&calcInt,					&convertPressure,	1,	NO },
+	{ 0x0C,		1,	&calcEngineRPM,				NULL,				2,	YES },
+	{ 0x0D,		1,	&calcInt,					&convertSpeed,		1,	NO },
+	{ 0x0E,		1,	&calcTimingAdvance,			NULL,				1,	NO },
+	{ 0x10,		1,	&calcMassAirFlow,			&convertAir,		2,	NO },
+	{ 0x14,		1,	&calcOxygenSensorVoltage,	NULL,				2,	NO },
+	{ 0x14,		2,	&calcFuelTrimPercentage2,	NULL,				2,	NO },
+	{ 0x1F,		1,	&calcTime,					NULL,				2,	NO },
+	{ 0x21,		1,	&calcDistance,				&convertDistance,	2,	NO },
+	{ 0x22,		1,	&calcPressure,				&convertPressure,	2,	NO },
+	{ 0x23,		1,	&calcPressureDiesel,		&convertPressure,	2,	NO },
+	{ 0x24,		1,	&calcEquivalenceRatio,		NULL,				4,	NO },
+	{ 0x24,		2,	&calcEquivalenceVoltage,	NULL,				4,	NO },
+	{ 0x2D,		1,	&calcEGRError,				NULL,				1,	NO },
+	{ 0x32,		1,	&calcVaporPressure,			&convertPressure2,	2,	NO },
+	{ 0x34,		2,	&calcEquivalenceCurrent,	NULL,				4,	NO },
+	{ 0x3C,		1,	&calcCatalystTemp,			&convertTemp,		2,	NO },
+	{ 0x42,		1,	&calcControlModuleVoltage,	NULL,				2,	YES },
+	{ 0x43,		1,	&calcAbsoluteLoadValue,		NULL,				2,	NO }
+};
+
+#define NUM_KERNEL_TESTS	(sizeof(g_kernelTests) / sizeof(g_kernelTests[0]))
+
+
+// The kernels fold constants (e.g. * 9 / 5 becomes * 1.8) and compute in
+// float, so they may differ from the scalar functions in the last bits
+static inline BOOL kernelValueMatches(float value, float expected, BOOL exact) {
+	if(exact) {
+		return (value == expected);
+	}
+	
+	return (fabsf(value - expected) <= 1.0e-4f + (1.0e-5f * fabsf(expected)));
+}
+
+
+@interface FLECUSensorKernelTests : SenTestCase {
+}
+@end
+
+
+@implementation FLECUSensorKernelTests
+
+// Payloads covering every value of the bytes the kernel reads: each byte
+// pair of payload i is i's high and low byte, and a one byte payload is
+// each value of that byte
+- (NSData*) payloadsForTest:(const FLKernelTest*)test count:(NSUInteger*)count {
+	*count					= (test->length == 1) ? 256 : 65536;
+	NSMutableData* data		= [NSMutableData dataWithLength:(*count * test->length)];
+	uint8_t* payloads		= (uint8_t*)[data mutableBytes];
+	
+	for(NSUInteger i = 0; i < *count; i++) {
+		for(NSUInteger b = 0; b < test->length; b++) {
+			payloads[(i * test->length) + b] = (test->length == 1) ? 
+												(uint8_t)i : 
+												(uint8_t)((b & 1) ? (i & 0xFF) : (i >> 8));
+		}
+	}
+	
+	return data;
+}
+
+
+- (void) testKernelsMatchScalarFunctions {
+	
+	for(NSUInteger t = 0; t < NUM_KERNEL_TESTS; t++) {
+		const FLKernelTest* test	= &g_kernelTests[t];
+		FLECUSensor* sensor			= [FLECUSensor sensorForPID:test->pid];
+		NSUInteger count;
+		NSData* data				= [self payloadsForTest:test count:&count];
+		const uint8_t* payloads		= (const uint8_t*)[data bytes];
+		float* metricValues			= (float*)malloc(count * sizeof(float));
+		float* imperialValues		= (float*)malloc(count * sizeof(float));
+		NSUInteger mismatches		= 0;
+		
+		STAssertTrue([sensor decodeMeasurement:test->measurement 
+									  payloads:payloads 
+										stride:test->length 
+										length:test->length 
+										 count:count 
+								  metricValues:metricValues 
+								imperialValues:imperialValues], 
+					 @"PID %02X measurement %u not decoded", test->pid, test->measurement);
+		
+		for(NSUInteger i = 0; i < count; i++) {
+			const uint8_t* payload	= &payloads[i * test->length];
+			float metric			= test->calcFunction(payload, test->length);
+			float imperial			= (test->convertFunction) ? test->convertFunction(metric) : metric;
+			
+			if(!kernelValueMatches(metricValues[i], metric, test->exact) || 
+			   !kernelValueMatches(imperialValues[i], imperial, test->exact)) {
+				if(mismatches++ == 0) {
+					STFail(@"PID %02X measurement %u payload %u: %f/%f, expected %f/%f", 
+						   test->pid, test->measurement, i, 
+						   metricValues[i], imperialValues[i], metric, imperial);
+				}
+			}
+		}
+		
+		STAssertEquals(mismatches, (NSUInteger)0, @"PID %02X measurement %u", test->pid, test->measurement);
+		
+		free(metricValues);
+		free(imperialValues);
+	}
+}
+
+
+// Times decodeMeasurement: against the per payload calculation and
+// conversion function calls, as valueForMeasurement1: makes them, for
+// each kernel over its full range of payloads
+- (void) testKernelThroughput {
+	
+	for(NSUInteger t = 0; t < NUM_KERNEL_TESTS; t++) {
+		const FLKernelTest* test	= &g_kernelTests[t];
+		FLECUSensor* sensor			= [FLECUSensor sensorForPID:test->pid];
+		NSUInteger count;
+		NSData* data				= [self payloadsForTest:test count:&count];
+		const uint8_t* payloads		= (const uint8_t*)[data bytes];
+		float* metricValues			= (float*)malloc(count * sizeof(float));
+		float* imperialValues		= (float*)malloc(count * sizeof(float));
+		
+		// Called through volatile pointers so the compiler cannot inline
+		// them, as it cannot through the sensor table
+		pfCalculateValueFunc volatile calcFunction	= test->calcFunction;
+		pfConvertFunc volatile convertFunction		= test->convertFunction;
+		
+		double start				= FLMonotonicTime();
+		
+		for(NSUInteger pass = 0; pass < KERNEL_BENCHMARK_PASSES; pass++) {
+			[sensor decodeMeasurement:test->measurement 
+							 payloads:payloads 
+							   stride:test->length 
+							   length:test->length 
+								count:count 
+						 metricValues:metricValues 
+					   imperialValues:imperialValues];
+		}
+		
+		double batch				= FLMonotonicTime() - start;
+		start						= FLMonotonicTime();
+		
+		for(NSUInteger pass = 0; pass < KERNEL_BENCHMARK_PASSES; pass++) {
+			for(NSUInteger i = 0; i < count; i++) {
+				metricValues[i]		= calcFunction(&payloads[i * test->length], test->length);
+				imperialValues[i]	= (convertFunction) ? convertFunction(metricValues[i]) : metricValues[i];
+			}
+		}
+		
+		double scalar				= FLMonotonicTime() - start;
+		double values				= (double)count * KERNEL_BENCHMARK_PASSES;
+		
+		NSLog(@"PID %02X measurement %u: scalar %.2f ns/value, batch %.2f ns/value (%.1fx)", 
+			  test->pid, 
+			  test->measurement, 
+			  (scalar * 1.0e9) / values, 
+			  (batch * 1.0e9) / values, 
+			  scalar / batch);
+		
+		free(metricValues);
+		free(imperialValues);
+	}
+}
+
+@end
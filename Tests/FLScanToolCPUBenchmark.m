@@ -0,0 +1,154 @@
+/*
+ *  FLScanToolCPUBenchmark.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <mach/mach.h>
+#import <sys/resource.h>
+#import "FLScanToolTestCase.h"
+#import "FLScanToolResponse.h"
+#import "FLScanLoop.h"
+
+
+// Commands timed once the scan has initialized
+#define CPU_BENCHMARK_COMMANDS			1000
+
+// Seconds allowed for the commands
+#define CPU_BENCHMARK_TIMEOUT			60.0
+
+
+static inline double timeValueSeconds(time_value_t time) {
+	return time.seconds + (time.microseconds / 1.0e6);
+}
+
+
+// User and system time of the calling thread
+static double threadCPUTime(void) {
+	thread_basic_info_data_t info;
+	mach_msg_type_number_t count	= THREAD_BASIC_INFO_COUNT;
+	mach_port_t thread				= mach_thread_self();
+	kern_return_t result			= thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+	
+	mach_port_deallocate(mach_task_self(), thread);
+	
+	if(result != KERN_SUCCESS) {
+		return 0;
+	}
+	
+	return timeValueSeconds(info.user_time) + timeValueSeconds(info.system_time);
+}
+
+
+// User and system time of the whole process, including the emulator
+static double processCPUTime(void) {
+	struct rusage usage;
+	
+	getrusage(RUSAGE_SELF, &usage);
+	
+	return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec / 1.0e6) + 
+		   usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec / 1.0e6);
+}
+
+
+/*
+ Measures the CPU time an ELM327 scan takes per 1,000 commands, polling
+ the emulator as fast as it answers.  The scan loop thread, where the
+ driver, its streams and its write path run, is measured on its own, and
+ the process as a whole (the emulator and the delegate calls included)
+ alongside it.
+ */
+@interface FLScanToolCPUBenchmark : FLScanToolTestCase {
+	double		_loopThreadTime;
+}
+@end
+
+
+@implementation FLScanToolCPUBenchmark
+
+- (void) setUp {
+	self.sensorScanTargets = [NSArray arrayWithObjects:
+							  [NSNumber numberWithInt:0x0C],
+							  [NSNumber numberWithInt:0x0D],
+							  [NSNumber numberWithInt:0x05],
+							  [NSNumber numberWithInt:0x10],
+							  [NSNumber numberWithInt:0x11],
+							  nil];
+}
+
+
+- (void) sampleLoopThreadTime {
+	_loopThreadTime = threadCPUTime();
+}
+
+
+- (double) loopThreadTime:(FLScanLoop*)loop {
+	[self performSelector:@selector(sampleLoopThreadTime) 
+				 onThread:loop.thread 
+			   withObject:nil 
+			waitUntilDone:YES];
+	return _loopThreadTime;
+}
+
+
+- (void) testCPUPerThousandCommands {
+	
+	// With a pool of one, every scan runs on the same loop
+	[FLScanLoop setPoolSize:1];
+	
+	FLELM327Emulator* emulator	= [self startedEmulator];
+	FLScanTool* scanTool		= [self scanToolForEmulator:emulator];
+	
+	[self startScan:scanTool];
+	STAssertTrue([self runUntil:&_initialized timeout:SCAN_TOOL_TEST_TIMEOUT], @"Scan did not initialize");
+	
+	FLScanLoop* loop			= [FLScanLoop leastLoadedLoop];
+	NSUInteger firstRequest		= emulator.requestCount;
+	double loopStart			= [self loopThreadTime:loop];
+	double processStart			= processCPUTime();
+	double start				= FLMonotonicTime();
+	NSDate* deadline			= [NSDate dateWithTimeIntervalSinceNow:CPU_BENCHMARK_TIMEOUT];
+	
+	while((emulator.requestCount - firstRequest) < CPU_BENCHMARK_COMMANDS && 
+		  !_cancelled && 
+		  [deadline timeIntervalSinceNow] > 0) {
+		NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+		[[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode 
+								 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+		[pool release];
+	}
+	
+	NSUInteger commands			= emulator.requestCount - firstRequest;
+	double elapsed				= FLMonotonicTime() - start;
+	double loopTime				= [self loopThreadTime:loop] - loopStart;
+	double processTime			= processCPUTime() - processStart;
+	
+	STAssertTrue([self cancelScan:scanTool], @"Scan did not cancel");
+	scanTool.delegate			= nil;
+	[emulator stop];
+	
+	STAssertTrue(commands >= CPU_BENCHMARK_COMMANDS, @"Only %u commands answered", commands);
+	STAssertEquals(_timeoutCount, (NSUInteger)0, @"Commands timed out");
+	
+	NSLog(@"%u commands in %.3f sec: scan loop thread %.1f ms CPU, process %.1f ms CPU per 1,000 commands", 
+		  commands, 
+		  elapsed, 
+		  (loopTime * 1.0e6) / commands, 
+		  (processTime * 1.0e6) / commands);
+}
+
+@end
@@ -0,0 +1,88 @@
+/*
+ *  FLScanToolReplayTests.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolTestCase.h"
+#import "FLScanToolCapture.h"
+#import "FLScanToolReplay.h"
+#import "ELM327.h"
+
+
+// Responses captured from the emulator before the scan is cancelled
+#define REPLAY_TEST_RESPONSE_COUNT		50
+
+
+@interface FLScanToolReplayTests : FLScanToolTestCase {
+}
+@end
+
+
+@implementation FLScanToolReplayTests
+
+- (void) setUp {
+	self.sensorScanTargets = [NSArray arrayWithObjects:
+							  [NSNumber numberWithInt:0x0C],
+							  [NSNumber numberWithInt:0x0D],
+							  [NSNumber numberWithInt:0x05],
+							  nil];
+}
+
+
+// Captures a scan of the emulator and replays it, which must bring up the
+// driver that was captured and take it through init and the same polling.
+- (void) testELM327CaptureRoundTrip {
+	NSString* path				= [NSTemporaryDirectory() stringByAppendingPathComponent:
+								   [@"FLScanToolReplayTests" stringByAppendingPathExtension:SCAN_TOOL_CAPTURE_EXTENSION]];
+	FLELM327Emulator* emulator	= [self startedEmulator];
+	FLScanTool* scanTool		= [self scanToolForEmulator:emulator];
+	
+	STAssertEquals(scanTool.scanToolDeviceType, kScanToolDeviceTypeELM327, @"ELM327 reports the wrong device type");
+	scanTool.capture			= [FLScanToolCapture captureWithPath:path deviceType:scanTool.scanToolDeviceType];
+	
+	[self startScan:scanTool];
+	STAssertTrue([self runUntilResponseCount:REPLAY_TEST_RESPONSE_COUNT timeout:SCAN_TOOL_TEST_TIMEOUT], 
+				 @"Only %u responses from the emulator", _responseCount);
+	STAssertTrue([self cancelScan:scanTool], @"Capture scan did not cancel");
+	STAssertTrue(_initialized, @"Capture scan did not initialize");
+	scanTool.delegate			= nil;
+	[emulator stop];
+	
+	FLScanToolReplay* replay	= [FLScanToolReplay replayWithPath:path speed:SCAN_TOOL_REPLAY_AS_FAST_AS_POSSIBLE];
+	STAssertNotNil(replay, @"Capture at %@ could not be read back", path);
+	STAssertEquals(replay.deviceType, kScanToolDeviceTypeELM327, @"Capture recorded the wrong device type");
+	
+	FLScanTool* replayTool		= [FLScanTool scanToolForReplay:replay];
+	STAssertTrue([replayTool isKindOfClass:[ELM327 class]], @"Replay drove %@ instead of ELM327", [replayTool class]);
+	replayTool.delegate			= self;
+	replayTool.delegateThread	= [NSThread currentThread];
+	
+	[self startScan:replayTool];
+	STAssertTrue([self runUntil:&_cancelled timeout:SCAN_TOOL_TEST_TIMEOUT], @"Replay did not finish");
+	replayTool.delegate			= nil;
+	
+	STAssertTrue(replay.finished, @"Replay stopped before the end of the capture");
+	STAssertTrue(_initialized, @"Replay did not initialize");
+	STAssertFalse(_failedToInitialize, @"Replay failed to initialize");
+	STAssertTrue(_responseCount > 0, @"Replay produced no responses");
+	STAssertTrue(replay.bytesRead > 0 && replay.bytesWritten > 0, @"Replay moved no bytes");
+	
+	[[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+@end
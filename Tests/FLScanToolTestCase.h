@@ -0,0 +1,74 @@
+/*
+ *  FLScanToolTestCase.h
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import <SenTestingKit/SenTestingKit.h>
+#import "FLScanTool.h"
+#import "FLELM327Emulator.h"
+
+
+// Seconds a test waits for a scan to reach the state it is waiting on
+#define SCAN_TOOL_TEST_TIMEOUT			10.0
+
+
+/*
+ Base for tests that run a scan tool.  The test case is the scan tool's
+ delegate, counting what it is sent, and the delegate calls are delivered
+ on the test's thread while it waits in one of the runUntil methods.
+ sensorScanTargets, when set, are given to the scan tool as it
+ initializes, since startScan clears them.
+ */
+@interface FLScanToolTestCase : SenTestCase <FLScanToolDelegate> {
+	NSArray*		_sensorScanTargets;
+	
+	BOOL			_initialized;
+	BOOL			_failedToInitialize;
+	BOOL			_cancelled;
+	NSUInteger		_responseCount;
+	NSUInteger		_timeoutCount;
+	double			_startTime;
+	double			_initializeTime;		// Seconds from startScan to scanToolDidInitialize:
+}
+
+@property (nonatomic, retain) NSArray* sensorScanTargets;
+
+// The engine and transmission ECUs on CAN, listening on a free loopback port
+- (FLELM327Emulator*) startedEmulator;
+
+// An ELM327 scan tool connected to emulator, with the test case as delegate
+- (FLScanTool*) scanToolForEmulator:(FLELM327Emulator*)emulator;
+
+// Scans a new emulator until count responses have been received, capturing
+// the scan to a temporary file.  Returns the capture's path.
+- (NSString*) captureScanWithResponseCount:(NSUInteger)count;
+
+// Clears the counts and starts the scan
+- (void) startScan:(FLScanTool*)scanTool;
+
+// Cancels the scan and waits for scanDidCancel:.  Returns NO on timeout.
+- (BOOL) cancelScan:(FLScanTool*)scanTool;
+
+// Runs the run loop until *flag is set or timeout passes.  Returns *flag.
+- (BOOL) runUntil:(BOOL*)flag timeout:(NSTimeInterval)timeout;
+
+// Runs the run loop until count responses have been received or timeout
+// passes.  Returns NO on timeout.
+- (BOOL) runUntilResponseCount:(NSUInteger)count timeout:(NSTimeInterval)timeout;
+
+@end
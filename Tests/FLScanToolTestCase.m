@@ -0,0 +1,156 @@
+/*
+ *  FLScanToolTestCase.m
+ *  OBD2Kit
+ *
+ *  Copyright (c) 2009-2011 FuzzyLuke Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#import "FLScanToolTestCase.h"
+#import "FLScanToolResponse.h"
+#import "FLSimECU.h"
+#import "FLScanToolCapture.h"
+
+
+@implementation FLScanToolTestCase
+
+@synthesize sensorScanTargets=_sensorScanTargets;
+
+
+- (void) dealloc {
+	[_sensorScanTargets release];
+	[super dealloc];
+}
+
+
+- (FLELM327Emulator*) startedEmulator {
+	FLELM327Emulator* emulator	= [FLELM327Emulator emulator];
+	emulator.ecus				= [NSArray arrayWithObjects:[FLSimECU engineECU], [FLSimECU transmissionECU], nil];
+	emulator.protocol			= kISO15765CAN11Bit500;
+	
+	STAssertTrue([emulator startOnPort:0], @"Emulator did not start");
+	return emulator;
+}
+
+
+- (FLScanTool*) scanToolForEmulator:(FLELM327Emulator*)emulator {
+	FLScanTool* scanTool	= [FLScanTool scanToolForDeviceType:kScanToolDeviceTypeELM327];
+	scanTool.host			= emulator.host;
+	scanTool.port			= emulator.port;
+	scanTool.delegate		= self;
+	scanTool.delegateThread	= [NSThread currentThread];
+	return scanTool;
+}
+
+
+- (NSString*) captureScanWithResponseCount:(NSUInteger)count {
+	NSString* path				= [NSTemporaryDirectory() stringByAppendingPathComponent:
+								   [NSStringFromClass([self class]) stringByAppendingPathExtension:SCAN_TOOL_CAPTURE_EXTENSION]];
+	FLELM327Emulator* emulator	= [self startedEmulator];
+	FLScanTool* scanTool		= [self scanToolForEmulator:emulator];
+	
+	scanTool.capture			= [FLScanToolCapture captureWithPath:path deviceType:scanTool.scanToolDeviceType];
+	
+	[self startScan:scanTool];
+	STAssertTrue([self runUntilResponseCount:count timeout:SCAN_TOOL_TEST_TIMEOUT], 
+				 @"Only %u responses from the emulator", _responseCount);
+	STAssertTrue([self cancelScan:scanTool], @"Capture scan did not cancel");
+	scanTool.delegate			= nil;
+	[emulator stop];
+	
+	return path;
+}
+
+
+- (void) startScan:(FLScanTool*)scanTool {
+	_initialized		= NO;
+	_failedToInitialize	= NO;
+	_cancelled			= NO;
+	_responseCount		= 0;
+	_timeoutCount		= 0;
+	_initializeTime		= 0;
+	_startTime			= FLMonotonicTime();
+	
+	[scanTool startScan];
+}
+
+
+- (BOOL) cancelScan:(FLScanTool*)scanTool {
+	[scanTool cancelScan];
+	return [self runUntil:&_cancelled timeout:SCAN_TOOL_TEST_TIMEOUT];
+}
+
+
+- (BOOL) runUntil:(BOOL*)flag timeout:(NSTimeInterval)timeout {
+	NSDate* deadline	= [NSDate dateWithTimeIntervalSinceNow:timeout];
+	
+	while(!*flag && [deadline timeIntervalSinceNow] > 0) {
+		NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+		[[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode 
+								 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+		[pool release];
+	}
+	
+	return *flag;
+}
+
+
+- (BOOL) runUntilResponseCount:(NSUInteger)count timeout:(NSTimeInterval)timeout {
+	NSDate* deadline	= [NSDate dateWithTimeIntervalSinceNow:timeout];
+	
+	while(_responseCount < count && !_cancelled && [deadline timeIntervalSinceNow] > 0) {
+		NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+		[[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode 
+								 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+		[pool release];
+	}
+	
+	return (_responseCount >= count);
+}
+
+
+#pragma mark -
+#pragma mark FLScanToolDelegate Methods
+
+- (void)scanToolDidInitialize:(FLScanTool*)scanTool {
+	_initialized	= YES;
+	_initializeTime	= FLMonotonicTime() - _startTime;
+	
+	if(_sensorScanTargets) {
+		scanTool.sensorScanTargets = _sensorScanTargets;
+	}
+}
+
+
+- (void)scanToolDidFailToInitialize:(FLScanTool*)scanTool {
+	_failedToInitialize = YES;
+}
+
+
+- (void)scanDidCancel:(FLScanTool*)scanTool {
+	_cancelled = YES;
+}
+
+
+- (void)scanTool:(FLScanTool*)scanTool didReceiveResponse:(NSArray*)responses {
+	_responseCount += [responses count];
+}
+
+
+- (void)scanTool:(FLScanTool*)scanTool didTimeoutOnCommand:(FLScanToolCommand*)command {
+	_timeoutCount++;
+}
+
+@end